@@ -0,0 +1,207 @@
+﻿// Copyright (c) 2015, Johan Sköld
+// License: https://opensource.org/licenses/ISC
+
+#include "stdafx.h"
+#include "cache.h"
+
+#include "hooks.h"
+#include "util.h"
+
+#include <unordered_map>
+
+namespace cache {
+
+    ///
+    // Statics
+    ///
+
+    const uint32_t MAGIC = 0x43435257; // "WRCC"
+    const uint32_t VERSION = 1;
+    const uint32_t MAX_ENTRIES = 1024;
+
+    struct Header {
+        uint32_t magic;
+        uint32_t version;
+        uint32_t timeDateStamp;
+        uint32_t sizeOfImage;
+        uint64_t textHash;
+        uint32_t count;
+        uint32_t reserved;
+    };
+
+    struct Entry {
+        uint64_t id;
+        uint32_t rva;
+        uint32_t reserved;
+    };
+
+    static std::unordered_map<uint64_t, uint32_t> s_entries;
+
+
+    ///
+    // Locals
+    ///
+
+    static uint64_t Fnv1a (const void* data, size_t size)
+    {
+        auto bytes = (const uint8_t*)data;
+        uint64_t hash = 0xcbf29ce484222325ull;
+
+        for (size_t i = 0; i < size; ++i) {
+            hash = (hash ^ bytes[i]) * 0x100000001b3ull;
+        }
+
+        return hash;
+    }
+
+    // Identifies the running executable. The .text header is included since it's the section we
+    // actually resolve addresses in, and it changes with pretty much any patch.
+    static bool BuildHeader (Header* header)
+    {
+        auto imageBase = GetModuleHandleA(nullptr);
+        auto dosHeader = (const IMAGE_DOS_HEADER*)imageBase;
+        auto ntHeaders = (const IMAGE_NT_HEADERS*)((uintptr_t)imageBase + dosHeader->e_lfanew);
+        auto text = hooks::FindSection(".text");
+
+        if (!text) {
+            return false;
+        }
+
+        memset(header, 0, sizeof(*header));
+        header->magic = MAGIC;
+        header->version = VERSION;
+        header->timeDateStamp = ntHeaders->FileHeader.TimeDateStamp;
+        header->sizeOfImage = ntHeaders->OptionalHeader.SizeOfImage;
+        header->textHash = Fnv1a(text, sizeof(*text));
+        return true;
+    }
+
+
+    ///
+    // Exports
+    ///
+
+    bool Load (const wchar_t filename[])
+    {
+        s_entries.clear();
+
+        Header expected;
+        if (!BuildHeader(&expected)) {
+            return false;
+        }
+
+        auto file = CreateFileW(filename,
+                                GENERIC_READ,
+                                FILE_SHARE_READ,
+                                nullptr,
+                                OPEN_EXISTING,
+                                FILE_ATTRIBUTE_NORMAL,
+                                nullptr);
+
+        if (file == INVALID_HANDLE_VALUE) {
+            return false;
+        }
+
+        Header header;
+        DWORD read = 0;
+        auto valid = ReadFile(file, &header, sizeof(header), &read, nullptr)
+                     && read == sizeof(header)
+                     && header.magic == expected.magic
+                     && header.version == expected.version
+                     && header.timeDateStamp == expected.timeDateStamp
+                     && header.sizeOfImage == expected.sizeOfImage
+                     && header.textHash == expected.textHash
+                     && header.count <= MAX_ENTRIES;
+
+        if (valid && header.count) {
+            std::vector<Entry> entries(header.count);
+            const auto size = (DWORD)(entries.size() * sizeof(Entry));
+
+            valid = ReadFile(file, entries.data(), size, &read, nullptr) && read == size;
+
+            if (valid) {
+                for (const auto& entry : entries) {
+                    s_entries[entry.id] = entry.rva;
+                }
+            }
+        }
+
+        CloseHandle(file);
+
+        if (!valid) {
+            LOG("Signature cache is missing or was written for another executable");
+            s_entries.clear();
+        }
+
+        return valid;
+    }
+
+    bool Save (const wchar_t filename[])
+    {
+        Header header;
+        if (!BuildHeader(&header)) {
+            return false;
+        }
+
+        std::vector<Entry> entries;
+        for (const auto& kvp : s_entries) {
+            entries.push_back({ kvp.first, kvp.second, 0 });
+        }
+
+        header.count = (uint32_t)(std::min)(entries.size(), (size_t)MAX_ENTRIES);
+        entries.resize(header.count);
+
+        auto file = CreateFileW(filename,
+                                GENERIC_WRITE,
+                                0,
+                                nullptr,
+                                CREATE_ALWAYS,
+                                FILE_ATTRIBUTE_NORMAL,
+                                nullptr);
+
+        if (file == INVALID_HANDLE_VALUE) {
+            ERR("Could not open signature cache for writing (%lu)", GetLastError());
+            return false;
+        }
+
+        const auto size = (DWORD)(entries.size() * sizeof(Entry));
+        DWORD written = 0;
+        auto result = WriteFile(file, &header, sizeof(header), &written, nullptr) && written == sizeof(header);
+        result = result && (!size || (WriteFile(file, entries.data(), size, &written, nullptr) && written == size));
+
+        CloseHandle(file);
+
+        if (!result) {
+            ERR("Failed to write signature cache (%lu)", GetLastError());
+        }
+
+        return result;
+    }
+
+    bool Get (uint64_t id, uint32_t* rva)
+    {
+        auto result = s_entries.find(id);
+        if (result == s_entries.end()) {
+            return false;
+        }
+
+        *rva = result->second;
+        return true;
+    }
+
+    void Set (uint64_t id, uint32_t rva)
+    {
+        s_entries[id] = rva;
+    }
+
+    void Erase (uint64_t id)
+    {
+        s_entries.erase(id);
+    }
+
+    void Clear ()
+    {
+        s_entries.clear();
+    }
+
+} // namespace cache
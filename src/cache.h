@@ -0,0 +1,23 @@
+﻿// Copyright (c) 2015, Johan Sköld
+// License: https://opensource.org/licenses/ISC
+
+#pragma once
+
+#include <cstdint>
+
+namespace cache {
+
+    // Persistent storage for resolved signature addresses. Entries are stored as RVAs keyed by
+    // a hash of the signature, and the whole file is only considered valid for the exact
+    // executable it was written for.
+
+    bool Load (const wchar_t filename[]);
+    bool Save (const wchar_t filename[]);
+    bool Get (uint64_t id, uint32_t* rva);
+    void Set (uint64_t id, uint32_t rva);
+
+    // Forgets an entry that turned out to be stale, so the next save doesn't write it back.
+    void Erase (uint64_t id);
+    void Clear ();
+
+} // namespace cache
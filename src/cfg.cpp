@@ -0,0 +1,392 @@
+﻿// Copyright (c) 2015, Johan Sköld
+// License: https://opensource.org/licenses/ISC
+
+#include "stdafx.h"
+#include "cfg.h"
+
+#include "pdata.h"
+#include "pe.h"
+#include "util.h"
+
+namespace cfg {
+
+    ///
+    // Statics
+    ///
+
+    // Leaf functions have no .pdata range to bound them, but are nowhere near this big.
+    const uint32_t MAX_UNBOUNDED_SIZE = 64 * 1024;
+
+    const uint32_t MAX_TABLE_ENTRIES = 4096;
+
+    // How far back from an indirect jump to look for the instructions that set up a jump table.
+    const size_t HISTORY_SIZE = 16;
+
+    struct Recent {
+        uint32_t rva;
+        uint32_t length;
+        ud_mnemonic_code mnemonic;
+        ud_operand ops[2];
+    };
+
+    // The last few instructions along the current path, oldest first overwritten.
+    struct History {
+        Recent entries[HISTORY_SIZE];
+        size_t count = 0;
+
+        Recent& Push ()
+        {
+            return entries[count++ % HISTORY_SIZE];
+        }
+
+        // The `i`th most recent instruction.
+        const Recent& Back (size_t i) const
+        {
+            return entries[(count - 1 - i) % HISTORY_SIZE];
+        }
+
+        size_t Size () const
+        {
+            return (std::min)(count, HISTORY_SIZE);
+        }
+    };
+
+
+    ///
+    // Locals
+    ///
+
+    // The 64-bit register that a 16 or 32-bit one is the lower part of.
+    static ud_type Wide (ud_type reg)
+    {
+        if (reg >= UD_R_AX && reg <= UD_R_R15W) {
+            return (ud_type)(reg - UD_R_AX + UD_R_RAX);
+        }
+
+        if (reg >= UD_R_EAX && reg <= UD_R_R15D) {
+            return (ud_type)(reg - UD_R_EAX + UD_R_RAX);
+        }
+
+        return reg;
+    }
+
+    static bool IsRegister (const ud_operand& op, ud_type reg)
+    {
+        return op.type == UD_OP_REG && Wide(op.base) == reg;
+    }
+
+    static int64_t Value (const ud_operand& op, uint8_t size)
+    {
+        switch (size) {
+            case 8:     return op.lval.sbyte;
+            case 16:    return op.lval.sword;
+            case 32:    return op.lval.sdword;
+            default:    return op.lval.sqword;
+        }
+    }
+
+    static bool IsConditional (ud_mnemonic_code mnemonic)
+    {
+        return (mnemonic >= UD_Ija && mnemonic <= UD_Ijz && mnemonic != UD_Ijmp)
+            || mnemonic == UD_Iloop || mnemonic == UD_Iloope || mnemonic == UD_Iloopne;
+    }
+
+    static bool IsTerminator (ud_mnemonic_code mnemonic)
+    {
+        switch (mnemonic) {
+            case UD_Iret:
+            case UD_Iretf:
+            case UD_Iiretq:
+            case UD_Iint3:
+            case UD_Ihlt:
+            case UD_Iud2:   return true;
+            default:        return false;
+        }
+    }
+
+    // Number of cases of a jump table indexed by `index`, from the `cmp index, n; ja default`
+    // guarding it, or the mask applied to the index. Sparse switches index the table through a
+    // byte table, which is guarded instead, and the largest entry of that is then the last case.
+    static uint32_t CaseCount (const pe::Image& image, const History& history, size_t from, ud_type index)
+    {
+        for (size_t i = from; i < history.Size(); ++i) {
+            const auto& insn = history.Back(i);
+            const auto& mem = insn.ops[1];
+
+            if (!IsRegister(insn.ops[0], index)) {
+                continue;
+            }
+
+            if ((insn.mnemonic == UD_Icmp || insn.mnemonic == UD_Iand) && mem.type == UD_OP_IMM) {
+                const auto last = Value(mem, (uint8_t)mem.size);
+                return last >= 0 && last < MAX_TABLE_ENTRIES ? (uint32_t)last + 1 : 0;
+            }
+
+            // The index is usually widened after it's been checked.
+            const auto copy = (insn.mnemonic == UD_Imov || insn.mnemonic == UD_Imovsxd || insn.mnemonic == UD_Imovzx)
+                           && mem.type == UD_OP_REG;
+
+            if (copy) {
+                index = Wide(mem.base);
+                continue;
+            }
+
+            const auto byteTable = insn.mnemonic == UD_Imovzx && mem.type == UD_OP_MEM && mem.size == 8
+                                && mem.index != UD_NONE && mem.scale <= 1;
+
+            if (byteTable) {
+                const auto count = CaseCount(image, history, i + 1, Wide(mem.index));
+                const auto bytes = count ? image.FromRva((uint32_t)Value(mem, mem.offset), count) : nullptr;
+                return bytes ? 1u + *std::max_element(bytes, bytes + count) : 0;
+            }
+        }
+
+        return 0;
+    }
+
+    // MSVC's jump tables hold RVAs, and the code using them looks like
+    //
+    //     lea  base, [__ImageBase]
+    //     mov  entry32, [base + index*4 + table]
+    //     add  entry, base
+    //     jmp  entry
+    //
+    // where the sum may also end up in `base` instead. The bounds check on the index is somewhere
+    // before it.
+    static bool FindJumpTable (const pe::Image& image, const History& history, ud_type target, uint32_t* table, uint32_t* count)
+    {
+        auto other = UD_NONE;
+
+        // The most recent one is the jump itself.
+        for (size_t i = 1; i < history.Size(); ++i) {
+            const auto& insn = history.Back(i);
+            const auto& mem = insn.ops[1];
+
+            if (other == UD_NONE) {
+                if (insn.mnemonic == UD_Iadd && IsRegister(insn.ops[0], target) && mem.type == UD_OP_REG) {
+                    other = Wide(mem.base);
+                }
+
+                continue;
+            }
+
+            // Either of the two added registers may be the one holding the entry.
+            const auto entry = IsRegister(insn.ops[0], target) ? target : IsRegister(insn.ops[0], other) ? other : UD_NONE;
+            const auto load = (insn.mnemonic == UD_Imov || insn.mnemonic == UD_Imovsxd) && entry != UD_NONE
+                           && mem.type == UD_OP_MEM && Wide(mem.base) == (entry == target ? other : target)
+                           && mem.index != UD_NONE && mem.scale == 4;
+
+            if (load) {
+                *table = (uint32_t)Value(mem, mem.offset);
+                *count = CaseCount(image, history, i + 1, Wide(mem.index));
+                return *count != 0;
+            }
+        }
+
+        return false;
+    }
+
+
+    ///
+    // Graph
+    ///
+
+    void Graph::AddBranch (uint32_t site, uint32_t target, EdgeKind kind)
+    {
+        m_branches.push_back({ site, target, kind });
+
+        if (target - m_begin < m_end - m_begin) {
+            m_targets.push_back(target);
+
+            if (!m_visited[target - m_begin]) {
+                m_work.push_back(target);
+            }
+        }
+    }
+
+    void Graph::Discover (const pe::Image& image, const uint8_t* code)
+    {
+        ud_t ud;
+        ud_init(&ud);
+        ud_set_mode(&ud, 64);
+        ud_set_syntax(&ud, nullptr);
+
+        History history;
+
+        while (!m_work.empty()) {
+            auto rva = m_work.back();
+            m_work.pop_back();
+            history.count = 0;
+
+            while (rva - m_begin < m_end - m_begin && !m_visited[rva - m_begin]) {
+                m_visited[rva - m_begin] = 1;
+
+                ud_set_input_buffer(&ud, code + (rva - m_begin), m_end - rva);
+                const auto len = ud_disassemble(&ud);
+                const auto mnemonic = ud_insn_mnemonic(&ud);
+
+                if (!len || mnemonic == UD_Iinvalid) {
+                    break;
+                }
+
+                auto& recent = history.Push();
+                recent.rva = rva;
+                recent.length = len;
+                recent.mnemonic = mnemonic;
+
+                for (unsigned i = 0; i < ArraySize(recent.ops); ++i) {
+                    const auto op = ud_insn_opr(&ud, i);
+                    recent.ops[i] = op ? *op : ud_operand{};
+                }
+
+                const auto& op = recent.ops[0];
+                const auto next = rva + len;
+                auto ends = false;
+                auto falls = true;
+
+                if (op.type == UD_OP_JIMM && (mnemonic == UD_Ijmp || IsConditional(mnemonic))) {
+                    const auto target = (uint32_t)(next + Value(op, (uint8_t)op.size));
+                    const auto jump = mnemonic == UD_Ijmp;
+
+                    AddBranch(rva, target, jump ? EdgeKind::Jump : EdgeKind::Conditional);
+                    ends = true;
+                    falls = !jump;
+                } else if (mnemonic == UD_Ijmp) {
+                    uint32_t table, count;
+
+                    if (op.type == UD_OP_REG && FindJumpTable(image, history, Wide(op.base), &table, &count)) {
+                        // A table with entries outside of the function isn't one we understood.
+                        const auto entries = (const uint32_t*)image.FromRva(table, count * sizeof(uint32_t));
+                        const auto valid = entries && std::all_of(entries, entries + count, [this] (uint32_t entry) {
+                            return entry - m_begin < m_end - m_begin;
+                        });
+
+                        if (valid) {
+                            for (uint32_t i = 0; i < count; ++i) {
+                                AddBranch(rva, entries[i], EdgeKind::Table);
+                            }
+
+                            ++m_tables;
+                        }
+                    }
+
+                    ends = true;
+                    falls = false;
+                } else if (IsTerminator(mnemonic)) {
+                    ends = true;
+                    falls = false;
+                }
+
+                m_instructions.push_back({ rva, (uint8_t)len, ends, falls });
+
+                if (!falls) {
+                    break;
+                }
+
+                rva = next;
+            }
+        }
+    }
+
+    void Graph::Link ()
+    {
+        std::sort(m_instructions.begin(), m_instructions.end(), [] (const Instruction& a, const Instruction& b) {
+            return a.rva < b.rva;
+        });
+
+        std::stable_sort(m_branches.begin(), m_branches.end(), [] (const Branch& a, const Branch& b) {
+            return a.site < b.site;
+        });
+
+        std::sort(m_targets.begin(), m_targets.end());
+        m_targets.erase(std::unique(m_targets.begin(), m_targets.end()), m_targets.end());
+
+        size_t branch = 0;
+
+        for (size_t i = 0; i < m_instructions.size(); ++i) {
+            const auto& insn = m_instructions[i];
+            const auto prev = i ? &m_instructions[i - 1] : nullptr;
+            const auto contiguous = prev && prev->rva + prev->length == insn.rva;
+            const auto leader = !contiguous || prev->ends || std::binary_search(m_targets.begin(), m_targets.end(), insn.rva);
+
+            if (leader) {
+                if (contiguous && prev->falls) {
+                    m_edges.push_back({ (uint32_t)m_blocks.size() - 1, insn.rva, EdgeKind::FallThrough });
+                    m_blocks.back().edgeCount += 1;
+                }
+
+                m_blocks.push_back({ insn.rva, insn.rva, (uint32_t)m_edges.size(), 0 });
+            }
+
+            auto& block = m_blocks.back();
+            block.end = insn.rva + insn.length;
+
+            for (; branch < m_branches.size() && m_branches[branch].site == insn.rva; ++branch) {
+                m_edges.push_back({ (uint32_t)m_blocks.size() - 1, m_branches[branch].target, m_branches[branch].kind });
+                block.edgeCount += 1;
+            }
+        }
+    }
+
+    bool Graph::Build (const pe::Image& image, const pdata::Index& functions, uint32_t entry)
+    {
+        m_tables = 0;
+        m_blocks.clear();
+        m_edges.clear();
+        m_targets.clear();
+        m_instructions.clear();
+        m_branches.clear();
+        m_work.clear();
+
+        if (auto function = functions.Find(entry)) {
+            m_begin = function->begin;
+            m_end = function->end;
+        } else {
+            const uint8_t* start;
+            const uint8_t* end;
+            const auto section = image.SectionFromRva(entry);
+
+            if (!image.SectionRange(section, &start, &end)) {
+                return false;
+            }
+
+            const auto sectionEnd = section->VirtualAddress + (uint32_t)(end - start);
+            m_begin = entry;
+            m_end = (std::min)(sectionEnd, entry + MAX_UNBOUNDED_SIZE);
+        }
+
+        const auto code = image.FromRva(m_begin, m_end - m_begin);
+        if (!code || entry >= m_end) {
+            return false;
+        }
+
+        m_visited.assign(m_end - m_begin, 0);
+        m_work.push_back(entry);
+
+        Discover(image, code);
+        Link();
+        return !m_blocks.empty();
+    }
+
+    const std::vector<Block>& Graph::Blocks () const
+    {
+        return m_blocks;
+    }
+
+    const std::vector<Edge>& Graph::Edges () const
+    {
+        return m_edges;
+    }
+
+    size_t Graph::JumpTableCount () const
+    {
+        return m_tables;
+    }
+
+    bool Graph::IsBranchedInto (uint32_t start, uint32_t end) const
+    {
+        auto it = std::upper_bound(m_targets.begin(), m_targets.end(), start);
+        return it != m_targets.end() && *it < end;
+    }
+
+} // namespace cfg
@@ -0,0 +1,82 @@
+﻿// Copyright (c) 2015, Johan Sköld
+// License: https://opensource.org/licenses/ISC
+
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+namespace pe { class Image; }
+namespace pdata { class Index; }
+
+namespace cfg {
+
+    enum class EdgeKind : uint8_t {
+        FallThrough,
+        Jump,
+        Conditional,    // Taken side of a conditional branch
+        Table,          // Jump table entry
+    };
+
+    struct Edge {
+        uint32_t from;          // Index of the block it leaves
+        uint32_t to;            // RVA it goes to, which may be outside of the function
+        EdgeKind kind;
+    };
+
+    struct Block {
+        uint32_t begin;
+        uint32_t end;
+        uint32_t firstEdge;
+        uint32_t edgeCount;
+    };
+
+    // Basic blocks of a single function, found by following its branches from the entry point,
+    // including through MSVC's jump tables. The function's .pdata range bounds the walk, and
+    // branches out of it (mostly tail calls) are edges to blocks that aren't part of the graph.
+    // All buffers are kept between builds, so analysing many functions in a row hardly allocates.
+    class Graph
+    {
+        struct Instruction {
+            uint32_t rva;
+            uint8_t length;
+            bool ends;          // Whether a new block starts after it
+            bool falls;         // Whether execution may continue after it
+        };
+
+        struct Branch {
+            uint32_t site;
+            uint32_t target;
+            EdgeKind kind;
+        };
+
+        uint32_t m_begin = 0;
+        uint32_t m_end = 0;
+        size_t m_tables = 0;
+        std::vector<Block> m_blocks;
+        std::vector<Edge> m_edges;
+        std::vector<uint32_t> m_targets;
+        std::vector<Instruction> m_instructions;
+        std::vector<Branch> m_branches;
+        std::vector<uint32_t> m_work;
+        std::vector<uint8_t> m_visited;
+
+        void AddBranch (uint32_t site, uint32_t target, EdgeKind kind);
+        void Discover (const pe::Image& image, const uint8_t* code);
+        void Link ();
+
+        public:
+            // Analyses the function with its entry point at `entry`. Leaf functions have no .pdata
+            // range, so they're only bounded by the section and a sanity limit.
+            bool Build (const pe::Image& image, const pdata::Index& functions, uint32_t entry);
+
+            const std::vector<Block>& Blocks () const;
+            const std::vector<Edge>& Edges () const;
+            size_t JumpTableCount () const;
+
+            // Whether any branch in the function lands in (start, end), so that the instructions
+            // in [start, end) can't be replaced without breaking it.
+            bool IsBranchedInto (uint32_t start, uint32_t end) const;
+    };
+
+} // namespace cfg
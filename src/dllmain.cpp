@@ -3,12 +3,212 @@
 
 #include "stdafx.h"
 
+#include "cache.h"
 #include "config.h"
 #include "dx.h"
 #include "hooks.h"
+#include "pattern.h"
+#include "pdata.h"
+#include "pe.h"
+#include "rtti.h"
 #include "util.h"
 
 
+///
+// Signatures
+///
+
+// Features register their signatures during init, and they are all resolved together the first
+// time any of them is looked up. Resolved addresses are cached on disk per executable, so only
+// signatures that are new or no longer match need to go through a (single) scan of .text.
+namespace signatures {
+
+    static std::vector<hooks::Pattern> s_patterns;
+    static std::vector<const char*> s_names;
+    static std::vector<uintptr_t> s_addresses;
+    static std::vector<size_t> s_counts;
+    static wchar_t s_cachePath[MAX_PATH];
+    static bool s_resolved;
+
+    static void Init (const wchar_t cachePath[])
+    {
+        wcscpy_s(s_cachePath, cachePath);
+    }
+
+    static size_t Add (const char name[], const hooks::Pattern& pattern)
+    {
+        s_patterns.emplace_back(pattern);
+        s_names.emplace_back(name);
+        return s_patterns.size() - 1;
+    }
+
+    // Signatures are taken from the code of a single function, so a match that runs past the end
+    // of the function it starts in is a coincidence.
+    static bool IsInOneFunction (const pdata::Index& functions, uintptr_t imageBase, uintptr_t address, size_t size)
+    {
+        const auto rva = (uint32_t)(address - imageBase);
+        const auto function = functions.Find(rva);
+        return !function || size <= function->end - rva;
+    }
+
+    static void Resolve ()
+    {
+        ScopedTimer timer(__FUNCTION__, "Resolved signatures in %u.%u ms");
+
+        s_addresses.assign(s_patterns.size(), 0);
+        s_counts.assign(s_patterns.size(), 0);
+
+        const auto imageBase = (uintptr_t)GetModuleHandleA(nullptr);
+        const auto text = hooks::FindSection(".text");
+
+        if (!text) {
+            ERR("No .text segment");
+            return;
+        }
+
+        const auto textStart = imageBase + text->VirtualAddress;
+        const auto textEnd = textStart + text->SizeOfRawData;
+        const auto cached = *s_cachePath && cache::Load(s_cachePath);
+        const auto& functions = pdata::ForModule((const void*)imageBase);
+
+        // Trust cached addresses only if the signature still matches at them. Only signatures
+        // that had a single match make it into the cache, so they needn't be counted again.
+        hooks::PatternBatch batch;
+        std::vector<size_t> pending;
+
+        for (size_t i = 0; i < s_patterns.size(); ++i) {
+            const auto& pattern = s_patterns[i];
+            uint32_t rva;
+
+            if (cached && cache::Get(pattern.Hash(), &rva)) {
+                const auto address = imageBase + rva;
+
+                const auto valid = address >= textStart && textEnd - address >= pattern.Size()
+                                && pattern.Matches((const uint8_t*)address, (const uint8_t*)textEnd)
+                                && IsInOneFunction(functions, imageBase, address, pattern.Size());
+
+                if (valid) {
+                    s_addresses[i] = address;
+                    s_counts[i] = 1;
+                    continue;
+                }
+
+                LOG("Cached address for signature %s no longer matches", s_names[i]);
+                cache::Erase(pattern.Hash());
+            }
+
+            batch.Add(pattern);
+            pending.emplace_back(i);
+        }
+
+        if (pending.empty()) {
+            LOG("Resolved all %zu signatures from cache", s_patterns.size());
+            return;
+        }
+
+        // The batch reports every match rather than the first, which costs next to nothing as
+        // it has to look at all of .text anyway.
+        {
+            ScopedTimer scanTimer(__FUNCTION__, "Scanned .text in %u.%u ms");
+            batch.Scan(textStart, textEnd, WorkerCount());
+        }
+
+        LOG("Scanned %zu KB for %zu of %zu signatures", (size_t)(textEnd - textStart) / 1024, pending.size(), s_patterns.size());
+
+        for (size_t i = 0; i < pending.size(); ++i) {
+            const auto id = pending[i];
+            const auto& stats = batch.Stats(i);
+
+            std::vector<uintptr_t> matches;
+            for (auto match : batch.Matches(i)) {
+                if (IsInOneFunction(functions, imageBase, match, s_patterns[id].Size())) {
+                    matches.push_back(match);
+                }
+            }
+
+            LOG("Signature %s: %zu matches, %zu candidates verified in %llu cycles",
+                s_names[id], matches.size(), stats.candidates, stats.cycles);
+
+            s_counts[id] = matches.size();
+
+            if (!matches.empty()) {
+                s_addresses[id] = matches.front();
+            }
+
+            if (matches.size() == 1) {
+                cache::Set(s_patterns[id].Hash(), (uint32_t)(matches.front() - imageBase));
+            }
+        }
+
+        if (*s_cachePath) {
+            cache::Save(s_cachePath);
+        }
+    }
+
+    static uintptr_t Find (size_t id)
+    {
+        // The executable is still encrypted by Steam while we're being loaded, so resolving is
+        // deferred until the first time a feature actually asks for a result.
+        if (!s_resolved) {
+            s_resolved = true;
+            Resolve();
+        }
+
+        return id < s_addresses.size() ? s_addresses[id] : 0;
+    }
+
+    // Like `Find`, but refuses signatures that didn't match exactly once. A signature that has
+    // become ambiguous after a game update is likely to point at the wrong code.
+    static uintptr_t FindUnique (size_t id)
+    {
+        const auto address = Find(id);
+
+        if (address && s_counts[id] != 1) {
+            ERR("Signature %s is ambiguous with %zu matches", s_names[id], s_counts[id]);
+            return 0;
+        }
+
+        return address;
+    }
+
+} // namespace signatures
+
+
+///
+// Classes
+///
+
+// Looks up the game's vftables by class name, through an index built from the RTTI the first time
+// it's needed. Unlike signatures, this keeps working when the code using a class changes.
+namespace classes {
+
+    static rtti::Index s_index;
+    static bool s_indexed;
+
+    static void** FindVfTable (const char name[])
+    {
+        // Same as with signatures, Steam needs to have decrypted the executable first.
+        const auto imageBase = GetModuleHandleA(nullptr);
+
+        if (!s_indexed) {
+            ScopedTimer timer(__FUNCTION__, "Indexed RTTI in %u.%u ms");
+            s_indexed = true;
+            s_index.Build(pe::Image(imageBase));
+            LOG("Found %zu vftables", s_index.Count());
+        }
+
+        const auto rva = s_index.Find(name);
+        if (!rva) {
+            LOG("No vftable found for %s", name);
+            return nullptr;
+        }
+
+        return (void**)((uintptr_t)imageBase + rva);
+    }
+
+} // namespace classes
+
+
 ///
 // UI movie scale
 ///
@@ -45,6 +245,18 @@ namespace uiscale {
     ///
 
     static Movie::SetViewScaleMode::Fn* s_movieSetViewScaleMode;
+    static size_t s_movieCtorSignature;
+
+    // Scaleform's Movie constructor, which we use to find its vftable if the RTTI can't.
+    static constexpr auto s_movieCtor = hooks::MakeSignature(
+        "48 83 EC 20 "              // sub   rsp, 20h
+        "33 ED "                    // xor   ebp, ebp
+        "48 8D 05 ?? ?? ?? ?? "     // lea   rax, [rip+????]
+        "4C 8D 35 ?? ?? ?? ?? "     // lea   r14, [rip+????]
+        "4C 89 31 "                 // mov   [rcx], r14
+        "C7 41 ?? ?? ?? ?? ?? "     // mov   dword ptr [rcx+8], 1
+        "48 89 69 18 "              // mov   [rcx+18h], rbp
+        "48 89 01");                // mov   [rcx], rax
 
     static const char* s_names[] = { "NoScale",
                                      "ShowAll",
@@ -77,8 +289,7 @@ namespace uiscale {
 
     static const char* MovieFilename (const Movie& movie)
     {
-        hooks::VfTable table(movie.movieDef->vftable);
-        return table.Invoke<MovieDef::GetFilename>(*movie.movieDef);
+        return hooks::BoundVirtual<MovieDef::GetFilename>::Call(*movie.movieDef);
     }
 
 
@@ -109,38 +320,25 @@ namespace uiscale {
 
     static void OnDeviceCreate (ID3D11DeviceContext*, ID3D11Device*, IDXGISwapChain*)
     {
-        const auto imageBase = (uintptr_t)GetModuleHandleA(nullptr);
-        const auto text = hooks::FindSection(".text");
+        auto vtable = classes::FindVfTable(".?AVMovie@GFx@Scaleform@@");
 
-        if (text) {
-            const auto textStart = imageBase + text->VirtualAddress;
-            const auto textEnd = textStart + text->SizeOfRawData;
-
-            // Find Scaleform's Movie constructor, and inject our own functions into its vftable.
-            const auto mask = "xxxxxxxxx????xxx????xxxxx?????xxxxxxx";
-            const auto pattern = "\x48\x83\xEC\x20"             // sub   rsp, 20h
-                                 "\x33\xED"                     // xor   ebp, ebp
-                                 "\x48\x8D\x05\x00\x00\x00\x00" // lea   rax, [rip+????]
-                                 "\x4C\x8D\x35\x00\x00\x00\x00" // lea   r14, [rip+????]
-                                 "\x4C\x89\x31"                 // mov   [rcx], r14
-                                 "\xC7\x41\x00\x00\x00\x00\x00" // mov   dword ptr [rcx+8], 1
-                                 "\x48\x89\x69\x18"             // mov   [rcx+18h], rbp
-                                 "\x48\x89\x01";                // mov   [rcx], rax
-            const auto ctor = hooks::FindPattern(textStart, textEnd, pattern, mask);
-
-            if (ctor) {
-                auto offset = *(const int32_t*)(ctor + 9);
+        // Fall back on the constructor's code in case the RTTI is ever stripped. The lea it loads
+        // the vftable with is at +6, with its displacement at +9.
+        if (!vtable) {
+            if (auto ctor = signatures::FindUnique(s_movieCtorSignature)) {
                 auto rip = ctor + 13;
-                auto vtable = (void**)(rip + offset);
-
-                hooks::VfTable vftable(vtable);
-                vftable.Inject<Movie::SetViewScaleMode>(MovieSetViewScaleMode, &s_movieSetViewScaleMode);
-            } else {
-                ERR("Could not locate the Movie constructor");
+                auto offset = *(const int32_t*)(ctor + 9);
+                vtable = (void**)(rip + offset);
             }
-        } else {
-            ERR("No .text segment");
         }
+
+        if (!vtable) {
+            ERR("Unable to find the Movie vftable");
+            return;
+        }
+
+        hooks::VfTable vftable(vtable);
+        vftable.Inject<Movie::SetViewScaleMode>(MovieSetViewScaleMode, &s_movieSetViewScaleMode);
     }
 
 
@@ -154,6 +352,8 @@ namespace uiscale {
             return;
         }
 
+        s_movieCtorSignature = signatures::Add("Movie::Movie", s_movieCtor);
+
         // We can't apply the hooks until later. At the point this is called, Steam still has the
         // executable encrypted, so we can't scan for instructions.
         dx::Callbacks callbacks;
@@ -217,6 +417,17 @@ namespace backdrop {
 
     static BSTriShape::Parse_t::Fn* s_origTriShapeParse;
     static float s_scale = 1.0f;
+    static size_t s_triShapeCtorSignature;
+
+    // Code constructing a BSTriShape, which we use to find its vftable.
+    static constexpr auto s_triShapeCtor = hooks::MakeSignature(
+        "E8 ?? ?? ?? ?? "           // call ????????
+        "48 8D 05 ?? ?? ?? ?? "     // lea  rax, ????????
+        "C6 87 58 01 00 00 03 "     // mov  byte ptr [rdi+158h], 3
+        "48 89 07 "                 // mov  [rdi], rax
+        "33 C0 "                    // xor  eax, eax
+        "89 87 60 01 00 00 "        // mov  [rdi+160h], eax
+        "66 89 87 64 01 00 00");    // mov  [rdi+164h], ax
 
 
     ///
@@ -256,37 +467,23 @@ namespace backdrop {
 
     static void OnDeviceCreate (ID3D11DeviceContext*, ID3D11Device*, IDXGISwapChain*)
     {
-        auto imageBase = GetModuleHandleA(nullptr);
-        auto segment = hooks::FindSection(".text");
-
-        if (!segment) {
-            ERR("No .text segment found?");
-            return;
+        auto vftable = classes::FindVfTable(".?AVBSTriShape@@");
+
+        // Fall back on the constructor's code in case the RTTI is ever stripped.
+        if (!vftable) {
+            if (auto location = signatures::FindUnique(s_triShapeCtorSignature)) {
+                auto rip = location + 12;
+                auto rva = *(int32_t*)(location + 8);
+                vftable = (void**)(rip + rva);
+            }
         }
 
-        auto pattern = "\xE8\x00\x00\x00\x00"            // call ????????
-                       "\x48\x8D\x05\x00\x00\x00\x00"    // lea  rax, ????????
-                       "\xC6\x87\x58\x01\x00\x00\x03"    // mov  byte ptr [rdi+158h], 3
-                       "\x48\x89\x07"                    // mov  [rdi], rax
-                       "\x33\xC0"                        // xor  eax, eax
-                       "\x89\x87\x60\x01\x00\x00"        // mov  [rdi+160h], eax
-                       "\x66\x89\x87\x64\x01\x00\x00";   // mov  [rdi+164h], ax
-
-        auto mask = "x????xxx????xxxxxxxxxxxxxxxxxxxxxxxxx";
-
-        auto location = hooks::FindPattern((uintptr_t)imageBase + segment->VirtualAddress,
-                                           (uintptr_t)imageBase + segment->VirtualAddress + segment->SizeOfRawData,
-                                           pattern,
-                                           mask);
-
-        if (!location) {
+        if (!vftable) {
             ERR("Unable to find the BSTriShape vftable.");
             return;
         }
 
-        auto rip = location + 12;
-        auto rva = *(int32_t*)(location + 8);
-        hooks::VfTable vtable = (void**)(rip + rva);
+        hooks::VfTable vtable = vftable;
         vtable.Inject<BSTriShape::Parse_t>(BSTriShapeParse, &s_origTriShapeParse);
     }
 
@@ -301,6 +498,8 @@ namespace backdrop {
             return;
         }
 
+        s_triShapeCtorSignature = signatures::Add("BSTriShape::BSTriShape", s_triShapeCtor);
+
         // Steam still has the .text section encrypted at this point, so we're delay hooking until
         // we've got a DX device.
         dx::Callbacks callbacks;
@@ -381,6 +580,15 @@ static void InitConfig ()
     LogConfig();
 }
 
+static void InitSignatures ()
+{
+    wchar_t path[MAX_PATH];
+    auto len = BuildPath(L"Wrench.cache", path);
+    if (len && len < ArraySize(path)) {
+        signatures::Init(path);
+    }
+}
+
 static void InitLog ()
 {
     wchar_t logPath[MAX_PATH];
@@ -401,6 +609,7 @@ BOOL APIENTRY DllMain (HMODULE hModule,
             ScopedTimer timer(__FUNCTION__, "Started in %u.%u ms");
             InitLog();
             InitConfig();
+            InitSignatures();
 
             uiscale::Init();
             backdrop::Init();
@@ -412,6 +621,12 @@ BOOL APIENTRY DllMain (HMODULE hModule,
         }
 
         case DLL_PROCESS_DETACH:
+            // The hooks are destroyed by static destructors after this. A non-null lpReserved
+            // means the process is exiting, rather than the DLL being unloaded.
+            if (lpReserved) {
+                hooks::OnProcessExit();
+            }
+
             logging::Close();
             break;
 
@@ -6,6 +6,7 @@
 #include "dx.h"
 #include "util.h"
 #include "hooks.h"
+#include "imports.h"
 
 namespace dx {
 
@@ -15,101 +16,124 @@ namespace dx {
     using IDXGISwapChain_ResizeBuffers_t = hooks::Function<13, HRESULT(IDXGISwapChain*, UINT, UINT, UINT, DXGI_FORMAT, UINT)>;
 
 
+    using DeviceContextMap = hooks::Multiplexer<ID3D11DeviceContext_Map_t::Fn, ID3D11DeviceContext_Map_t>;
+    using DeviceContextUnmap = hooks::Multiplexer<ID3D11DeviceContext_Unmap_t::Fn, ID3D11DeviceContext_Unmap_t>;
+    using DeviceContextVsSetConstantBuffers = hooks::Multiplexer<ID3D11DeviceContext_VSSetConstantBuffers_t::Fn, ID3D11DeviceContext_VSSetConstantBuffers_t>;
+    using SwapChainResizeBuffers = hooks::Multiplexer<IDXGISwapChain_ResizeBuffers_t::Fn, IDXGISwapChain_ResizeBuffers_t>;
+
+
     ///
     // Data
     ///
 
     static std::vector<OnDeviceCreate_t*> s_afterDeviceCreate;
-    static std::vector<OnResourceMap_t*> s_afterResourceMap;
-    static std::vector<OnResourceUnmap_t*> s_beforeResourceUnmap;
-    static std::vector<OnViewportResize_t*> s_afterViewportResize;
-    static std::vector<OnVsSetConstantBuffers_t*> s_afterVsSetConstantBuffers;
 
     static UnsafePtr<IDXGISwapChain> s_swapChain;
 
     static decltype(D3D11CreateDeviceAndSwapChain) * s_createDevice;
-    static ID3D11DeviceContext_VSSetConstantBuffers_t::Fn* s_deviceContextVsSetConstantBuffers;
-    static ID3D11DeviceContext_Map_t::Fn* s_deviceContextMap;
-    static ID3D11DeviceContext_Unmap_t::Fn* s_deviceContextUnmap;
-    static IDXGISwapChain_ResizeBuffers_t::Fn* s_swapChainResizeBuffers;
+
+    // The device context's table, once a device has been created. Guarded by `s_hookMutex`, as
+    // callbacks may be registered from any thread.
+    static hooks::VfTable* s_dcVftable;
+    static std::mutex s_hookMutex;
 
 
     ///
-    // Hooks
+    // Subscribers
     ///
 
-    static HRESULT DeviceContextMap (ID3D11DeviceContext*      context,
-                                     ID3D11Resource*           resource,
-                                     UINT                      subResource,
-                                     D3D11_MAP                 mapType,
-                                     UINT                      mapFlags,
-                                     D3D11_MAPPED_SUBRESOURCE* mappedResource)
+    // Every registered callback is subscribed to its multiplexer through one of these, with the
+    // callback itself as the user pointer.
+
+    static void AfterResourceMap (void*                     user,
+                                  HRESULT                   result,
+                                  ID3D11DeviceContext*      context,
+                                  ID3D11Resource*           resource,
+                                  UINT                      /*subResource*/,
+                                  D3D11_MAP                 /*mapType*/,
+                                  UINT                      /*mapFlags*/,
+                                  D3D11_MAPPED_SUBRESOURCE* mappedResource)
     {
-        auto result = s_deviceContextMap(context, resource, subResource, mapType, mapFlags, mappedResource);
-
         if (SUCCEEDED(result)) {
-            for (auto cb : s_afterResourceMap) {
-                cb(context, resource, mappedResource);
-            }
+            ((OnResourceMap_t*)user)(context, resource, mappedResource);
         }
-
-        return result;
     }
 
-    static void DeviceContextUnmap (ID3D11DeviceContext* context,
-                                    ID3D11Resource*      resource,
-                                    UINT                 subResource)
+    static void BeforeResourceUnmap (void*                user,
+                                     ID3D11DeviceContext* context,
+                                     ID3D11Resource*      resource,
+                                     UINT                 /*subResource*/)
     {
-        for (auto cb : s_beforeResourceUnmap) {
-            cb(context, resource);
-        }
-
-        return s_deviceContextUnmap(context, resource, subResource);
+        ((OnResourceUnmap_t*)user)(context, resource);
     }
 
-    static HRESULT SwapChainResizeBuffers (IDXGISwapChain* swapChain,
-                                           UINT            BufferCount,
-                                           UINT            Width,
-                                           UINT            Height,
-                                           DXGI_FORMAT     NewFormat,
-                                           UINT            SwapChainFlags)
+    static void AfterViewportResize (void*           user,
+                                     HRESULT         result,
+                                     IDXGISwapChain* swapChain,
+                                     UINT            /*BufferCount*/,
+                                     UINT            Width,
+                                     UINT            Height,
+                                     DXGI_FORMAT     /*NewFormat*/,
+                                     UINT            /*SwapChainFlags*/)
     {
-        auto result = s_swapChainResizeBuffers(swapChain, BufferCount, Width, Height, NewFormat, SwapChainFlags);
-
-        if (SUCCEEDED(result) && s_swapChain == swapChain) {
-            if (!Width || !Height) {
-                DXGI_SWAP_CHAIN_DESC desc;
-
-                if (SUCCEEDED(swapChain->GetDesc(&desc))) {
-                    Width = desc.BufferDesc.Width;
-                    Height = desc.BufferDesc.Height;
-                } else {
-                    ERR("Could not get swap chain description");
-                }
-            }
+        if (FAILED(result) || s_swapChain != swapChain) {
+            return;
+        }
 
-            if (Width && Height) {
-                for (auto cb : s_afterViewportResize) {
-                    cb(Width, Height);
-                }
+        if (!Width || !Height) {
+            DXGI_SWAP_CHAIN_DESC desc;
+
+            if (SUCCEEDED(swapChain->GetDesc(&desc))) {
+                Width = desc.BufferDesc.Width;
+                Height = desc.BufferDesc.Height;
+            } else {
+                ERR("Could not get swap chain description");
             }
         }
 
-        return result;
+        if (Width && Height) {
+            ((OnViewportResize_t*)user)(Width, Height);
+        }
     }
 
-    static void DeviceContextVsSetConstantBuffers (ID3D11DeviceContext* context,
-                                                   UINT                 slotStart,
-                                                   UINT                 numBuffers,
-                                                   ID3D11Buffer* const* buffers)
+    static void AfterVsSetConstantBuffers (void*                user,
+                                           ID3D11DeviceContext* context,
+                                           UINT                 slotStart,
+                                           UINT                 numBuffers,
+                                           ID3D11Buffer* const* buffers)
     {
-        s_deviceContextVsSetConstantBuffers(context, slotStart, numBuffers, buffers);
+        ((OnVsSetConstantBuffers_t*)user)(context, slotStart, numBuffers, buffers);
+    }
+
+
+    ///
+    // Device context
+    ///
 
-        for (auto cb : s_afterVsSetConstantBuffers) {
-            cb(context, slotStart, numBuffers, buffers);
+    // Detours a device context function once its multiplexer has a subscriber, so that functions
+    // nothing listens to are called without going through a dispatch at all. The trampoline is
+    // only set once the function has been detoured.
+    template <class F, class M>
+    static void DetourSubscribed (hooks::Transaction* transaction)
+    {
+        if (!M::IsEmpty() && !*M::Original()) {
+            s_dcVftable->Detour<F>(M::Dispatch, M::Original(), transaction);
         }
     }
 
+    // Must be called with `s_hookMutex` held, after the device context's table has been saved.
+    static void DetourDeviceContext (hooks::Transaction* transaction)
+    {
+        DetourSubscribed<ID3D11DeviceContext_Map_t, DeviceContextMap>(transaction);
+        DetourSubscribed<ID3D11DeviceContext_Unmap_t, DeviceContextUnmap>(transaction);
+        DetourSubscribed<ID3D11DeviceContext_VSSetConstantBuffers_t, DeviceContextVsSetConstantBuffers>(transaction);
+    }
+
+
+    ///
+    // Hooks
+    ///
+
     static HRESULT WINAPI CreateDeviceAndSwapChain (IDXGIAdapter*               pAdapter,
                                                     D3D_DRIVER_TYPE             DriverType,
                                                     HMODULE                     Software,
@@ -148,58 +172,63 @@ namespace dx {
         }
 
         // These VfTables needs to be static so we keep the trampoline memory valid even after
-        // leaving this function. It is *not* safe to use after leaving this function however
-        // (the pointed to virtual table has been deallocated), and as such should not be
-        // globally accessible.
-        static hooks::VfTable s_dcVftable;
+        // leaving this function. The tables themselves live in d3d11's image rather than in the
+        // interfaces, so the device context's is kept to detour functions whose callbacks are
+        // registered later on. Nothing is ever called through them. Being constructed this late,
+        // they're also destroyed before anything in the hook engine they depend on.
+        static hooks::VfTable s_dcTable;
         static hooks::VfTable s_scVftable;
 
         s_swapChain = swapChain;
 
-        // The `IsValid()` calls below are really lies. The vftables may be freed already. In these
-        // cases, we really only using them to determine whether we've already detoured the
-        // functions or not. We still should not make any calls using the tables!
-        if (context) {
-            if (!s_dcVftable.IsValid()) {
-                s_dcVftable = *(void***)context;
-
-                if (s_afterResourceMap.size()) {
-                    s_dcVftable.Detour<ID3D11DeviceContext_Map_t>(DeviceContextMap, &s_deviceContextMap);
-                }
+        // The lock is let go of before any callbacks run, since they may register more.
+        std::unique_lock<std::mutex> lock(s_hookMutex);
 
-                if (s_beforeResourceUnmap.size()) {
-                    s_dcVftable.Detour<ID3D11DeviceContext_Unmap_t>(DeviceContextUnmap, &s_deviceContextUnmap);
-                }
+        // All hooks go in at once, rather than one at a time while the render thread may
+        // already be calling through the tables.
+        hooks::Transaction transaction;
 
-                if (s_afterVsSetConstantBuffers.size()) {
-                    s_dcVftable.Detour<ID3D11DeviceContext_VSSetConstantBuffers_t>(DeviceContextVsSetConstantBuffers, &s_deviceContextVsSetConstantBuffers);
-                }
+        // The `IsValid()` calls below only tell whether a table has been saved, and so whether
+        // the functions have been looked at already.
+        //
+        // Device context functions are detoured only once something has been registered for
+        // them, since some of them are called thousands of times per frame. Those registered for
+        // later on are detoured by `Register`. The swap chain is resized rarely enough that it's
+        // always detoured.
+        if (context) {
+            if (!s_dcTable.IsValid()) {
+                s_dcTable = *(void***)context;
+                s_dcVftable = &s_dcTable;
+                DetourDeviceContext(&transaction);
             }
-        } else if (!s_dcVftable.IsValid()) {
+        } else if (!s_dcTable.IsValid()) {
             ERR("No device context");
         }
 
         if (swapChain) {
             if (!s_scVftable.IsValid()) {
                 s_scVftable = *(void***)swapChain;
-
-                if (s_afterViewportResize.size()) {
-                    s_scVftable.Detour<IDXGISwapChain_ResizeBuffers_t>(SwapChainResizeBuffers, &s_swapChainResizeBuffers);
-                }
+                s_scVftable.Detour<IDXGISwapChain_ResizeBuffers_t>(SwapChainResizeBuffers::Dispatch, SwapChainResizeBuffers::Original(), &transaction);
             }
         } else if (!s_scVftable.IsValid()) {
             ERR("No swap chain");
         }
 
+        if (!transaction.Commit()) {
+            ERR("Failed to apply the device hooks");
+        }
+
+        lock.unlock();
+
         // Invoke DeviceCreate and Resize callbacks, in that order.
         for (auto cb : s_afterDeviceCreate) {
             cb(context, device, swapChain);
         }
 
+        // The swap chain was created with its buffers, which makes for the first resize.
         if (swapChain) {
-            for (auto cb : s_afterViewportResize) {
-                cb(pSwapChainDesc->BufferDesc.Width, pSwapChainDesc->BufferDesc.Height);
-            }
+            const auto& mode = pSwapChainDesc->BufferDesc;
+            SwapChainResizeBuffers::Notify(S_OK, swapChain, pSwapChainDesc->BufferCount, mode.Width, mode.Height, mode.Format, pSwapChainDesc->Flags);
         } else {
             ERR("Can't determine initial buffer sizes, no swap chain desc passed");
         }
@@ -237,17 +266,40 @@ namespace dx {
             s_afterDeviceCreate.emplace_back(callbacks.afterDeviceCreate);
         }
         if (callbacks.afterResourceMap) {
-            s_afterResourceMap.emplace_back(callbacks.afterResourceMap);
+            DeviceContextMap::AddPost(AfterResourceMap, (void*)callbacks.afterResourceMap);
         }
         if (callbacks.beforeResourceUnmap) {
-            s_beforeResourceUnmap.emplace_back(callbacks.beforeResourceUnmap);
+            DeviceContextUnmap::AddPre(BeforeResourceUnmap, (void*)callbacks.beforeResourceUnmap);
         }
         if (callbacks.afterViewportResize) {
-            s_afterViewportResize.emplace_back(callbacks.afterViewportResize);
+            SwapChainResizeBuffers::AddPost(AfterViewportResize, (void*)callbacks.afterViewportResize);
         }
         if (callbacks.afterVsSetConstantBuffers) {
-            s_afterVsSetConstantBuffers.emplace_back(callbacks.afterVsSetConstantBuffers);
+            DeviceContextVsSetConstantBuffers::AddPost(AfterVsSetConstantBuffers, (void*)callbacks.afterVsSetConstantBuffers);
         }
+
+        // Functions that got their first subscriber after the device was created are detoured
+        // now. Without a device yet, that's left to `CreateDeviceAndSwapChain`.
+        std::lock_guard<std::mutex> lock(s_hookMutex);
+
+        if (s_dcVftable) {
+            hooks::Transaction transaction;
+            DetourDeviceContext(&transaction);
+
+            if (!transaction.Commit()) {
+                ERR("Failed to apply the device context hooks");
+            }
+        }
+    }
+
+    void Unregister (const Callbacks& callbacks)
+    {
+        s_afterDeviceCreate.erase(std::remove(s_afterDeviceCreate.begin(), s_afterDeviceCreate.end(), callbacks.afterDeviceCreate), s_afterDeviceCreate.end());
+
+        DeviceContextMap::RemovePost(AfterResourceMap, (void*)callbacks.afterResourceMap);
+        DeviceContextUnmap::RemovePre(BeforeResourceUnmap, (void*)callbacks.beforeResourceUnmap);
+        SwapChainResizeBuffers::RemovePost(AfterViewportResize, (void*)callbacks.afterViewportResize);
+        DeviceContextVsSetConstantBuffers::RemovePost(AfterVsSetConstantBuffers, (void*)callbacks.afterVsSetConstantBuffers);
     }
 
     void Init ()
@@ -264,6 +316,21 @@ namespace dx {
             return;
         }
 
+        // Patching the game's import of the function costs nothing per call, and leaves d3d11's
+        // code alone. It's only used if the loader has already pointed the import at the function
+        // we found, which it hasn't while Steam's stub is still to fill in the real import table.
+        // The slot is checked before anything is written, so an import table that isn't ready
+        // yet is left alone. Otherwise, the function itself is detoured.
+        const auto module = GetModuleHandleA(nullptr);
+        const auto rva = imports::ForModule(module).Find("d3d11.dll", "D3D11CreateDeviceAndSwapChain");
+
+        if (rva && *(void**)((uintptr_t)module + rva) == (void*)proc) {
+            static auto s_import = hooks::HookImport(module, "d3d11.dll", "D3D11CreateDeviceAndSwapChain", &CreateDeviceAndSwapChain, &s_createDevice);
+            if (s_import.IsValid()) {
+                return;
+            }
+        }
+
         static auto s_detour = hooks::Detour(proc, &CreateDeviceAndSwapChain, &s_createDevice);
     }
 
@@ -36,7 +36,11 @@ namespace dx {
         OnVsSetConstantBuffers_t* afterVsSetConstantBuffers = nullptr;
     };
 
+    // Callbacks can be registered and unregistered at any time, even while the render thread is
+    // calling them, apart from `afterDeviceCreate` which must not change during device creation.
+    // A thread that was already dispatching may still call an unregistered callback one last time.
     void Register (const Callbacks& callbacks);
+    void Unregister (const Callbacks& callbacks);
     void Init ();
 
 } // namespace dx
@@ -4,6 +4,13 @@
 #include "stdafx.h"
 #include "hooks.h"
 
+#include "cfg.h"
+#include "imports.h"
+#include "lde.h"
+#include "pdata.h"
+#include "pe.h"
+#include "platform.h"
+#include "trampoline.h"
 #include "util.h"
 
 
@@ -11,113 +18,588 @@
 // Local helpers
 ///
 
-static size_t AsmLength (void* addr, size_t minSize)
+// How many bytes from `addr` on can be read without running off the end of its region.
+static size_t ReadableSize (const void* addr)
 {
-    // TODO: I should probably set this up in a way so that it doesn't potentially dig into
-    // unassigned memory. Specifically, `ud_set_input_buffer` should get a more reasonable
-    // second parameter...
-    //
-    // Also, ideally this function should also somehow (magically) detect the end of a function
-    // so we don't overwrite whatever is after it for functions smaller than `minSize`.
-
-    ud_t ud;
-    ud_init(&ud);
-    ud_set_input_buffer(&ud, (const uint8_t*)addr, minSize + 16);
-    ud_set_mode(&ud, 64);
-    ud_set_syntax(&ud, nullptr);
-
-    while (ud_insn_off(&ud) < minSize) {
-        if (!ud_disassemble(&ud)) {
+    platform::Region region;
+    if (!platform::Query((uintptr_t)addr, &region) || region.free) {
+        return 0;
+    }
+
+    return region.base + region.size - (uintptr_t)addr;
+}
+
+// How many bytes of the code at `addr` a patch may cover. That's up to the end of its function
+// when the module's .pdata knows where that is, which keeps detours of tiny functions from
+// spilling into the next one. Leaf functions have no .pdata entries, and get no such guarantee.
+static size_t PatchableSize (const void* addr)
+{
+    auto size = ReadableSize(addr);
+
+    if (auto module = platform::ModuleFromAddress(addr)) {
+        const auto rva = (uint32_t)((uintptr_t)addr - (uintptr_t)module);
+        if (auto function = pdata::ForModule(module).Find(rva)) {
+            size = (std::min)(size, (size_t)(function->end - rva));
+        }
+    }
+
+    return size;
+}
+
+// Whether any branch in the function at `addr` lands inside its first `length` bytes, which a
+// patch covering them would break. Only code in PE modules can be analysed this way.
+static bool IsBranchedInto (const void* addr, size_t length)
+{
+    auto module = platform::ModuleFromAddress(addr);
+    if (!module) {
+        return false;
+    }
+
+    const pe::Image image(module);
+    const auto& functions = pdata::ForModule(module);
+    const auto rva = (uint32_t)((uintptr_t)addr - (uintptr_t)module);
+    const auto function = functions.Find(rva);
+
+    // Hooks are mostly placed in bulk at startup, and the graph keeps its buffers between builds.
+    thread_local cfg::Graph s_graph;
+    if (!s_graph.Build(image, functions, function ? function->begin : rva)) {
+        return false;
+    }
+
+    return s_graph.IsBranchedInto(rva, rva + (uint32_t)length);
+}
+
+// Whether `addr` is inside a PE module, but not inside any of its .pdata ranges. The code there is
+// part of a leaf function, whose entry point isn't known, so the branches into it can't be found.
+static bool IsInLeafFunction (const void* addr)
+{
+    auto module = platform::ModuleFromAddress(addr);
+    if (!module) {
+        return false;
+    }
+
+    const auto rva = (uint32_t)((uintptr_t)addr - (uintptr_t)module);
+    return !pdata::ForModule(module).Find(rva);
+}
+
+// Length of the whole instructions covering at least `minSize` bytes, or less if the code runs
+// out before `limit`.
+static size_t AsmLength (const uint8_t* addr, size_t minSize, size_t limit)
+{
+    size_t length = 0;
+
+    while (length < minSize) {
+        lde::Instruction insn;
+        const auto len = lde::Decode(addr + length, limit - length, &insn);
+        if (!len) {
             break;
         }
+
+        length += len;
     }
 
-    return ud_insn_off(&ud);
+    return length;
 }
 
-static void* FollowJumps (void* addr)
+// A rel32 jump is used whenever the target is in reach. Unlike the push/ret sequences often used
+// for this it's also a plain jump to the CPU, and doesn't throw off its return stack predictor.
+const size_t JMP_REL32_SIZE = 5;
+const size_t JMP_ABS64_SIZE = 14;
+const size_t CALL_ABS64_SIZE = 16;
+const size_t JCC_ABS64_SIZE = 2 + JMP_ABS64_SIZE;
+
+static bool IsInRel32Reach (uintptr_t next, uintptr_t target)
 {
-    ud_t ud;
-    ud_init(&ud);
-    ud_set_mode(&ud, 64);
-    ud_set_syntax(&ud, nullptr);
+    const auto disp = (intptr_t)(target - next);
+    return disp >= INT32_MIN && disp <= INT32_MAX;
+}
 
-    while (true) {
-        ud_set_input_buffer(&ud, (const uint8_t*)addr, 16);
-        if (!ud_disassemble(&ud)) {
-            ERR("Could not disassemble instruction at %p", addr);
-            return addr;
+static size_t EmitAbsJump (uint8_t* out, uintptr_t target)
+{
+    // jmp [rip+0], followed by the target
+    out[0] = 0xff;
+    out[1] = 0x25;
+    *(int32_t*)(out + 2) = 0;
+    *(uintptr_t*)(out + 6) = target;
+    return JMP_ABS64_SIZE;
+}
+
+// Writes the shortest jump to `target` into `out`, for when the jump is placed at `at`, and
+// returns its size.
+static size_t EmitJump (uint8_t* out, uintptr_t at, uintptr_t target)
+{
+    if (IsInRel32Reach(at + JMP_REL32_SIZE, target)) {
+        // jmp rel32
+        out[0] = 0xe9;
+        *(int32_t*)(out + 1) = (int32_t)(target - (at + JMP_REL32_SIZE));
+        return JMP_REL32_SIZE;
+    }
+
+    return EmitAbsJump(out, target);
+}
+
+static size_t EmitCall (uint8_t* out, uintptr_t at, uintptr_t target)
+{
+    if (IsInRel32Reach(at + 5, target)) {
+        // call rel32
+        out[0] = 0xe8;
+        *(int32_t*)(out + 1) = (int32_t)(target - (at + 5));
+        return 5;
+    }
+
+    // call [rip+2]; jmp +8, followed by the target
+    const uint8_t call[] = { 0xff, 0x15, 0x02, 0x00, 0x00, 0x00, 0xeb, 0x08 };
+    memcpy(out, call, ArraySize(call));
+    *(uintptr_t*)(out + ArraySize(call)) = target;
+    return CALL_ABS64_SIZE;
+}
+
+// `condition` is the low nibble of the jcc opcode.
+static size_t EmitConditionalJump (uint8_t* out, uintptr_t at, uint8_t condition, uintptr_t target)
+{
+    if (IsInRel32Reach(at + 6, target)) {
+        // jcc rel32
+        out[0] = 0x0f;
+        out[1] = (uint8_t)(0x80 | condition);
+        *(int32_t*)(out + 2) = (int32_t)(target - (at + 6));
+        return 6;
+    }
+
+    // Inverted jcc rel8 past an absolute jump
+    out[0] = (uint8_t)(0x70 | (condition ^ 1));
+    out[1] = (uint8_t)JMP_ABS64_SIZE;
+    return 2 + EmitAbsJump(out + 2, target);
+}
+
+// Copies the instructions in the `length` bytes at `src` to `out`, adjusting everything that is
+// relative to the instruction pointer so it still refers to the same address. Short branches are
+// widened, and branches out of rel32 reach are turned into absolute ones. With `out` set to null,
+// this only returns the largest size the relocated code may need. Returns 0 for code that can't
+// be relocated. `calls` is set if any of the instructions is a call.
+static size_t Relocate (const uint8_t* src, size_t length, uint8_t* out, bool* calls = nullptr)
+{
+    size_t size = 0;
+
+    for (size_t len = 0, offset = 0; offset < length; offset += len) {
+        const auto insn = src + offset;
+        lde::Instruction decoded;
+        len = lde::Decode(insn, length - offset, &decoded);
+
+        if (!len) {
+            ERR("Could not disassemble instruction at %p", insn);
+            return 0;
         }
 
-        const auto instruction = ud_insn_mnemonic(&ud);
-        if (instruction != UD_Ijmp) {
-            return addr;
+        const auto next = (uintptr_t)insn + len;
+        const auto at = (uintptr_t)out + size;
+
+        if (decoded.relOffset) {
+            if (decoded.relSize == 2) {
+                ERR("Can't relocate 16-bit branch at %p", insn);
+                return 0;
+            }
+
+            const auto target = (uintptr_t)lde::BranchTarget(insn, decoded);
+
+            // Whatever is there has been replaced by the detour.
+            if (target - (uintptr_t)src < length) {
+                ERR("Branch at %p into the relocated code", insn);
+                return 0;
+            }
+
+            if (decoded.branch == lde::Branch::Jump) {
+                size += out ? EmitJump(out + size, at, target) : JMP_ABS64_SIZE;
+            } else if (decoded.branch == lde::Branch::Call) {
+                size += out ? EmitCall(out + size, at, target) : CALL_ABS64_SIZE;
+                if (calls) {
+                    *calls = true;
+                }
+            } else if (decoded.branch == lde::Branch::Conditional) {
+                // The condition is in the last opcode byte, right before the displacement.
+                const auto condition = (uint8_t)(insn[decoded.relOffset - 1] & 0x0f);
+                size += out ? EmitConditionalJump(out + size, at, condition, target) : JCC_ABS64_SIZE;
+            } else {
+                // loop and jrcxz have no rel32 form.
+                ERR("Can't relocate the short branch at %p", insn);
+                return 0;
+            }
+
+            continue;
         }
 
-        const auto param = ud_insn_opr(&ud, 0);
-        if (param->type != UD_OP_JIMM) {
-            ERR("Invalid operand for jump: %u", param->type);
-            return addr;
+        if (out) {
+            memcpy(out + size, insn, len);
+        }
+
+        if (decoded.ripOffset) {
+            const auto target = (uintptr_t)((intptr_t)next + *(const int32_t*)(insn + decoded.ripOffset));
+
+            if (out) {
+                if (!IsInRel32Reach(at + len, target)) {
+                    ERR("%p is out of reach of the relocated instruction at %p", (void*)target, insn);
+                    return 0;
+                }
+
+                *(int32_t*)(out + size + decoded.ripOffset) = (int32_t)(target - (at + len));
+            }
         }
 
-        const auto rip = (intptr_t)addr + (intptr_t)ud_insn_len(&ud);
-        addr = (void*)(rip + param->lval.sdword);
+        size += len;
     }
+
+    return size;
 }
 
-static bool DataCompare (const uint8_t* buffer,
-                         const uint8_t* data,
-                         const uint8_t* sMask)
+static void* FollowJumps (void* addr)
 {
-    for (; *sMask; ++sMask, ++buffer, ++data) {
-        if (*sMask == 'x' && *buffer != *data) {
-            return false;
+    while (true) {
+        lde::Instruction insn;
+        if (!lde::Decode((const uint8_t*)addr, ReadableSize(addr), &insn)) {
+            ERR("Could not disassemble instruction at %p", addr);
+            return addr;
+        }
+
+        // Jumps through memory, such as to imports, are left for the caller to detour.
+        if (insn.branch != lde::Branch::Jump) {
+            return addr;
         }
+
+        addr = (void*)lde::BranchTarget((const uint8_t*)addr, insn);
     }
-    return true;
 }
 
 
+///
+// Transaction
+///
+
+namespace hooks {
+
+    void Transaction::Write (void* address, const void* data, size_t size)
+    {
+        auto bytes = (const uint8_t*)data;
+        m_patches.push_back({ (uint8_t*)address, std::vector<uint8_t>(bytes, bytes + size) });
+    }
+
+    void Transaction::WritePointer (void** slot, void* value)
+    {
+        Write(slot, &value, sizeof(value));
+    }
+
+    size_t Transaction::Count () const
+    {
+        return m_patches.size();
+    }
+
+    bool Transaction::Commit ()
+    {
+        if (m_patches.empty()) {
+            return true;
+        }
+
+        std::sort(m_patches.begin(), m_patches.end(), [] (const Patch& a, const Patch& b) {
+            return a.address < b.address;
+        });
+
+        struct Page {
+            uintptr_t base;
+            platform::Access access;
+        };
+
+        const auto pageSize = (uintptr_t)platform::PageSize();
+        std::vector<Page> pages;
+
+        for (const auto& patch : m_patches) {
+            const auto end = (uintptr_t)patch.address + patch.bytes.size();
+
+            for (auto page = (uintptr_t)patch.address & ~(pageSize - 1); page < end; page += pageSize) {
+                if (pages.empty() || pages.back().base < page) {
+                    pages.push_back({ page, platform::Access::None });
+                }
+            }
+        }
+
+        // Each page is done on its own, since a single call only reports the protection of the
+        // first page it covers.
+        auto result = true;
+        size_t unlocked = 0;
+
+        for (; unlocked < pages.size(); ++unlocked) {
+            auto& page = pages[unlocked];
+            if (!platform::Protect((void*)page.base, pageSize, platform::Access::ReadWriteExecute, &page.access)) {
+                result = false;
+                break;
+            }
+        }
+
+        // Nothing may be logged while the threads are suspended, since one of them may hold the
+        // lock of the log file. A failure is noted, and reported once they're running again.
+        const uint8_t* executing = nullptr;
+
+        if (result) {
+            auto isAtomic = [] (const Patch& patch) {
+                return patch.bytes.size() == sizeof(uint64_t) && (uintptr_t)patch.address % sizeof(uint64_t) == 0;
+            };
+
+            platform::ThreadFreeze threads;
+
+            // A thread stopped partway into the replaced bytes would resume in the middle of
+            // whatever instruction ends up there. That's checked for atomic writes too: they keep
+            // pointers from being torn, but can still replace code a thread is in the middle of.
+            for (const auto& patch : m_patches) {
+                const auto address = (uintptr_t)patch.address;
+                if (threads.IsExecuting(address + 1, address + patch.bytes.size())) {
+                    executing = patch.address;
+                    break;
+                }
+            }
+
+            for (size_t i = 0; !executing && i < m_patches.size(); ++i) {
+                const auto& patch = m_patches[i];
+                if (isAtomic(patch)) {
+                    ((std::atomic<uint64_t>*)patch.address)->exchange(*(const uint64_t*)patch.bytes.data());
+                } else {
+                    memcpy(patch.address, patch.bytes.data(), patch.bytes.size());
+                }
+            }
+        }
+
+        if (executing) {
+            ERR("A thread is executing the code at %p", executing);
+            result = false;
+        }
+
+        for (size_t i = 0; i < unlocked; ++i) {
+            platform::Protect((void*)pages[i].base, pageSize, pages[i].access, nullptr);
+        }
+
+        if (result) {
+            const auto start = m_patches.front().address;
+            const auto end = m_patches.back().address + m_patches.back().bytes.size();
+            platform::FlushInstructionCache(start, (size_t)(end - start));
+        }
+
+        m_patches.clear();
+        return result;
+    }
+
+} // namespace hooks
+
+
 ///
 // Detour
 ///
 
 namespace hooks {
 
+    struct RetiredTrampoline {
+        const uint8_t* buffer;
+        size_t size;
+        std::chrono::steady_clock::time_point time;
+    };
+
+    // A thread may be on its way through a trampoline even after the jump to it is gone, so
+    // they're only freed once they've been out of use for a while and no thread is stopped in
+    // one of them.
+    const auto RETIRE_DELAY = std::chrono::seconds(1);
+
+    struct RetiredList {
+        std::mutex mutex;
+        std::vector<RetiredTrampoline> trampolines;
+    };
+
+    // Set once the process is exiting, when the other threads are gone and the code is about to
+    // be unmapped anyway.
+    static std::atomic<bool> s_processExiting(false);
+
+    // Never destroyed, since detours may be released by static destructors in any order.
+    static RetiredList& Retired ()
+    {
+        static auto s_retired = new RetiredList();
+        return *s_retired;
+    }
+
+    static void FreeRetiredTrampolines ()
+    {
+        auto& retired = Retired();
+        std::vector<RetiredTrampoline> due;
+
+        {
+            std::lock_guard<std::mutex> lock(retired.mutex);
+
+            const auto now = std::chrono::steady_clock::now();
+            const auto first = std::partition(retired.trampolines.begin(), retired.trampolines.end(), [now] (const RetiredTrampoline& trampoline) {
+                return now - trampoline.time < RETIRE_DELAY;
+            });
+
+            due.assign(first, retired.trampolines.end());
+            retired.trampolines.erase(first, retired.trampolines.end());
+        }
+
+        if (due.empty()) {
+            return;
+        }
+
+        // The lock isn't held while the threads are suspended, so none of them can be left
+        // waiting for it, and nothing is allocated until they're running again.
+        std::vector<const uint8_t*> unused;
+        unused.reserve(due.size());
+
+        {
+            platform::ThreadFreeze threads;
+
+            for (auto& trampoline : due) {
+                const auto start = (uintptr_t)trampoline.buffer;
+                if (!threads.IsExecuting(start, start + trampoline.size)) {
+                    unused.push_back(trampoline.buffer);
+                    trampoline.buffer = nullptr;
+                }
+            }
+        }
+
+        // Whatever was still in use is tried again next time.
+        if (unused.size() < due.size()) {
+            std::lock_guard<std::mutex> lock(retired.mutex);
+
+            for (const auto& trampoline : due) {
+                if (trampoline.buffer) {
+                    retired.trampolines.push_back(trampoline);
+                }
+            }
+        }
+
+        for (auto buffer : unused) {
+            trampoline::Free((void*)buffer);
+        }
+    }
+
+    static void RetireTrampoline (const uint8_t* buffer, size_t size)
+    {
+        auto& retired = Retired();
+
+        {
+            std::lock_guard<std::mutex> lock(retired.mutex);
+            retired.trampolines.push_back({ buffer, size, std::chrono::steady_clock::now() });
+        }
+
+        FreeRetiredTrampolines();
+    }
+
+    static bool ApplyPatch (void* address, const void* data, size_t size, Transaction* transaction)
+    {
+        if (transaction) {
+            transaction->Write(address, data, size);
+            return true;
+        }
+
+        Transaction patch;
+        patch.Write(address, data, size);
+        return patch.Commit();
+    }
+
     DetourBuffer::DetourBuffer (const uint8_t* data)
         : m_buffer(data) {}
 
+    DetourBuffer::DetourBuffer (const uint8_t* buffer, size_t size, void* target, const uint8_t patch[], bool pinned)
+        : m_buffer(buffer)
+        , m_size(size)
+        , m_target((uint8_t*)target)
+        , m_pinned(pinned)
+    {
+        memcpy(m_original, target, ArraySize(m_original));
+        memcpy(m_patch, patch, ArraySize(m_patch));
+    }
+
     DetourBuffer::DetourBuffer (DetourBuffer&& source)
-        : m_buffer(source.m_buffer)
+        : m_buffer(nullptr)
     {
-        source.m_buffer = nullptr;
+        *this = std::move(source);
     }
 
     DetourBuffer::~DetourBuffer ()
     {
-        // TODO: This should also remove the detour
-
-        if (m_buffer) {
-            VirtualFree((void*)m_buffer, 0, MEM_RELEASE);
-        }
+        Release();
     }
 
     DetourBuffer& DetourBuffer::operator= (DetourBuffer&& source)
     {
-        m_buffer = source.m_buffer;
-        source.m_buffer = nullptr;
+        if (this != &source) {
+            Release();
+
+            m_buffer = source.m_buffer;
+            m_size = source.m_size;
+            m_target = source.m_target;
+            memcpy(m_original, source.m_original, ArraySize(m_original));
+            memcpy(m_patch, source.m_patch, ArraySize(m_patch));
+            m_enabled = source.m_enabled;
+            m_pinned = source.m_pinned;
+
+            source.m_buffer = nullptr;
+        }
+
         return *this;
     }
 
+    void DetourBuffer::Release ()
+    {
+        if (!m_buffer) {
+            return;
+        }
+
+        if (s_processExiting) {
+            // Restoring the code would mean suspending threads under the loader lock, for code
+            // that's about to go away anyway.
+            m_buffer = nullptr;
+            return;
+        }
+
+        if (m_enabled && !Disable()) {
+            ERR("Leaking the trampoline for %p, which is still jumped to", m_target);
+        } else if (m_pinned) {
+            // A call made from the relocated code returns into the trampoline, so it may be on
+            // the stack of some thread for any amount of time.
+            LOG("Keeping the trampoline for %p", m_target);
+        } else {
+            RetireTrampoline(m_buffer, m_size);
+        }
+
+        m_buffer = nullptr;
+    }
+
     bool DetourBuffer::IsValid () const
     {
         return m_buffer != nullptr;
     }
 
+    bool DetourBuffer::IsEnabled () const
+    {
+        return m_enabled;
+    }
+
+    bool DetourBuffer::Enable (Transaction* transaction)
+    {
+        if (m_buffer && !m_enabled) {
+            m_enabled = ApplyPatch(m_target, m_patch, ArraySize(m_patch), transaction);
+        }
+
+        return m_enabled;
+    }
+
+    bool DetourBuffer::Disable (Transaction* transaction)
+    {
+        if (m_buffer && m_enabled) {
+            m_enabled = !ApplyPatch(m_target, m_original, ArraySize(m_original), transaction);
+        }
+
+        return !m_enabled;
+    }
+
 } // namespace hooks
 
-// This must be global for the forward declare in hooks::Detour<F>
-hooks::DetourBuffer DetourImpl (void* src, void* dst, void** prev)
+hooks::DetourBuffer hooks::DetourImpl (void*               src,
+                                       void*               dst,
+                                       void**              prev,
+                                       hooks::Transaction* transaction)
 {
     // Based on http://www.unknowncheats.me/forum/c-and-c/134871-64-bit-detour-function.html
 
@@ -130,140 +612,848 @@ hooks::DetourBuffer DetourImpl (void* src, void* dst, void** prev)
     // instruction is a jump, we therefore follow them and detour the final function.
     src = FollowJumps(src);
 
-    // Allocate trampoline memory
-    const size_t allocSize = 0x1000;
+    const auto length = AsmLength((const uint8_t*)src, JMP_REL32_SIZE, PatchableSize(src));
+    if (length < JMP_REL32_SIZE) {
+        ERR("Function at %p is too short to detour", src);
+        return hooks::DetourBuffer(nullptr);
+    }
 
-    MEMORY_BASIC_INFORMATION mbi;
-    for (auto addr = (uintptr_t)src; addr > (uintptr_t)src - 0x80000000; addr = (uintptr_t)mbi.BaseAddress - 1) {
-        if (!VirtualQuery((void*)addr, &mbi, sizeof(mbi))) {
-            break;
-        }
+    if (IsBranchedInto(src, length)) {
+        ERR("The code at %p is branched into, and can't be detoured", src);
+        return hooks::DetourBuffer(nullptr);
+    }
 
-        if (mbi.State != MEM_FREE) {
-            continue;
-        }
+    // Now's a good time to give back the memory of removed detours.
+    hooks::FreeRetiredTrampolines();
 
-        // TODO: Fix bug where this may generate a bad jump if the current block is too big
-        buffer = (uint8_t*)VirtualAlloc(mbi.BaseAddress, allocSize, MEM_RESERVE | MEM_COMMIT, PAGE_EXECUTE_READWRITE);
-        if (buffer) {
-            break;
-        }
+    const auto relocatedSize = Relocate((const uint8_t*)src, length, nullptr);
+    if (!relocatedSize) {
+        return hooks::DetourBuffer(nullptr);
     }
 
+    // The trampoline holds the relocated original code followed by a jump back to the rest of
+    // it, and a relay to `dst` for when that's too far away for the jump at the source.
+    const size_t allocSize = relocatedSize + 2 * JMP_ABS64_SIZE;
+    buffer = (uint8_t*)trampoline::Allocate(src, allocSize);
     if (!buffer) {
         return hooks::DetourBuffer(nullptr);
     }
 
-    // Save the original code, and apply the detour:
-    //   push   rax
-    //   movabs rax, 0xcccccccccccccccc
-    //   xchg   rax, [rsp]
-    //   ret
-    uint8_t detour[] = { 0x50, 0x48, 0xb8, 0xcc, 0xcc, 0xcc, 0xcc, 0xcc, 0xcc, 0xcc, 0xcc, 0x48, 0x87, 0x04, 0x24, 0xC3 };
-    const auto length = AsmLength(src, 16);
-    if (length < 16) {
-        VirtualFree(buffer, 0, MEM_RELEASE);
+    auto calls = false;
+    auto size = Relocate((const uint8_t*)src, length, buffer, &calls);
+    if (!size) {
+        trampoline::Free(buffer);
         return hooks::DetourBuffer(nullptr);
     }
 
-    memcpy_s(buffer, allocSize, src, length);
-    memcpy_s(buffer + length, allocSize - length, detour, ArraySize(detour));
-    *(uintptr_t*)(buffer + length + 3) = (uintptr_t)src + length;
+    size += EmitJump(buffer + size, (uintptr_t)buffer + size, (uintptr_t)src + length);
 
-    // Build a far jump to the destination
-    uint8_t farJump[6];
-    farJump[0] = 0xff;
-    farJump[1] = 0x25;
-    *(int32_t*)(farJump + 2) = (int32_t)((intptr_t)(buffer + length + 16) - (intptr_t)src - 6);
-    *(uintptr_t*)(buffer + length + 16) = (uintptr_t)dst;
+    auto target = (uintptr_t)dst;
+    if (!IsInRel32Reach((uintptr_t)src + JMP_REL32_SIZE, target)) {
+        target = (uintptr_t)buffer + size;
+        EmitJump(buffer + size, target, (uintptr_t)dst);
+    }
 
-    // Patch the source
-    DWORD protection = 0;
-    VirtualProtect(src, 6, PAGE_EXECUTE_READWRITE, &protection);
-    memcpy(src, farJump, ArraySize(farJump));
-    memset((uint8_t*)src + 6, 0x90, length - 6);
-    VirtualProtect(src, 6, protection, &protection);
-    FlushInstructionCache(GetCurrentProcess(), src, length);
+    // Patch the source. The trampoline is always in reach, so this only ever needs a rel32 jump,
+    // and the remaining bytes of the last overwritten instruction are left alone.
+    uint8_t jump[JMP_ABS64_SIZE];
+    if (EmitJump(jump, (uintptr_t)src, target) != JMP_REL32_SIZE) {
+        trampoline::Free(buffer);
+        return hooks::DetourBuffer(nullptr);
+    }
 
+    // The trampoline has to be usable before anything can get to it.
     *prev = buffer;
-    return hooks::DetourBuffer(buffer);
+
+    hooks::DetourBuffer result(buffer, allocSize, src, jump, calls);
+    if (!result.Enable(transaction)) {
+        *prev = nullptr;
+        return hooks::DetourBuffer(nullptr);
+    }
+
+    return result;
 }
 
 
 ///
-// VfTable
+// Mid-function hooks
 ///
 
 namespace hooks {
 
-    VfTable::VfTable ()
-        : m_vftable(nullptr) { }
+    // The stub keeps the context above the home area of the callback, on a stack aligned for it.
+    const int32_t CONTEXT_OFFSET = 32;
+    const int32_t FRAME_SIZE = CONTEXT_OFFSET + (int32_t)sizeof(Context) + 15;
 
-    VfTable::VfTable (void** vftable)
-        : m_vftable(vftable) { }
+    const unsigned REG_RAX = 0;
+    const unsigned REG_RSP = 4;
+    const unsigned REG_RBP = 5;
 
-    bool VfTable::IsValid () const
+    static_assert(offsetof(Context, r15) == offsetof(Context, rax) + 15 * sizeof(uint64_t), "registers must be in encoding order");
+    static_assert(offsetof(Context, xmm) % 16 == 0, "xmm registers must be aligned");
+
+    static int32_t ContextOffset (size_t member)
     {
-        return m_vftable != nullptr;
+        return CONTEXT_OFFSET + (int32_t)member;
     }
 
-    VfTable& VfTable::operator= (void** vftable)
+    static int32_t RegisterOffset (unsigned reg)
     {
-        m_vftable = vftable;
-        return *this;
+        return ContextOffset(offsetof(Context, rax) + reg * sizeof(uint64_t));
     }
 
-    void VfTable::Detour (size_t index, void* replacement, void** prev)
+    static int32_t XmmOffset (unsigned reg)
     {
-        auto buffer = DetourImpl(m_vftable[index], replacement, prev);
-        m_detours.emplace_back(std::move(buffer));
+        return ContextOffset(offsetof(Context, xmm) + reg * sizeof(Xmm));
     }
 
-    void VfTable::Inject (size_t index, void* replacement, void** prev)
+    static void Emit (std::vector<uint8_t>* code, std::initializer_list<uint8_t> bytes)
     {
-        const auto addr = m_vftable + index;
-        DWORD prevProtection;
+        code->insert(code->end(), bytes);
+    }
 
-        if (!VirtualProtect(addr, sizeof(*addr), PAGE_READWRITE, &prevProtection)) {
-            LOG("Failed to make %p read/writable (%lu)", addr, GetLastError());
-            return;
-        }
+    static void EmitDisp32 (std::vector<uint8_t>* code, int32_t disp)
+    {
+        const auto bytes = (const uint8_t*)&disp;
+        code->insert(code->end(), bytes, bytes + sizeof(disp));
+    }
 
-        _InterlockedExchange64((LONG64*)prev, (LONG64)*addr);
-        _InterlockedExchange64((LONG64*)addr, (LONG64)replacement);
+    // mov [rsp+disp32], reg (0x89) or mov reg, [rsp+disp32] (0x8b)
+    static void EmitMov (std::vector<uint8_t>* code, uint8_t opcode, unsigned reg, int32_t disp)
+    {
+        Emit(code, { (uint8_t)(0x48 | (reg >> 3) << 2), opcode, (uint8_t)(0x84 | (reg & 7) << 3), 0x24 });
+        EmitDisp32(code, disp);
+    }
 
-        if (!VirtualProtect(addr, sizeof(addr), prevProtection, &prevProtection)) {
-            LOG("Failed to restore protection flags for %p (%lu)", addr, GetLastError());
+    // movups [rsp+disp32], xmm (0x11) or movups xmm, [rsp+disp32] (0x10)
+    static void EmitMovups (std::vector<uint8_t>* code, uint8_t opcode, unsigned reg, int32_t disp)
+    {
+        if (reg >= 8) {
+            Emit(code, { 0x44 });
         }
+
+        Emit(code, { 0x0f, opcode, (uint8_t)(0x84 | (reg & 7) << 3), 0x24 });
+        EmitDisp32(code, disp);
     }
 
-} // namespace hooks
+    // Saves the registers into a context on the stack, calls the callback with it, and loads the
+    // registers back. The flags are kept with lahf/sahf and seto, since pushfq and especially
+    // popfq cost more than everything else here together. rbp points to where the flags, rax and
+    // rbp were pushed throughout, as rsp is moved to align the stack.
+    static std::vector<uint8_t> MakeMidHookStub (MidHookFn* callback, uint32_t registers)
+    {
+        auto isSaved = [registers] (unsigned reg) {
+            return reg != REG_RAX && reg != REG_RSP && reg != REG_RBP && (registers & (1u << reg));
+        };
 
+        std::vector<uint8_t> code;
 
-///
-// Functions
-///
+        Emit(&code, { 0x55 });                          // push rbp
+        Emit(&code, { 0x50 });                          // push rax
+        Emit(&code, { 0x9f });                          // lahf
+        Emit(&code, { 0x0f, 0x90, 0xc0 });              // seto al
+        Emit(&code, { 0x50 });                          // push rax
+        Emit(&code, { 0x48, 0x89, 0xe5 });              // mov rbp, rsp
+        Emit(&code, { 0x48, 0x8d, 0xa4, 0x24 });        // lea rsp, [rsp-FRAME_SIZE]
+        EmitDisp32(&code, -FRAME_SIZE);
+        Emit(&code, { 0x48, 0x83, 0xe4, 0xf0 });        // and rsp, -16
 
-namespace hooks {
+        for (unsigned reg = 0; reg < 16; ++reg) {
+            if (isSaved(reg)) {
+                EmitMov(&code, 0x89, reg, RegisterOffset(reg));
+            }
+        }
 
-    uintptr_t FindPattern (uintptr_t   address,
-                           uintptr_t   term,
-                           const char* data,
-                           const char* sMask)
-    {
-        auto start = (const uint8_t*)address;
-        auto end = (const uint8_t*)term;
-        for (auto ptr = start; ptr < end; ++ptr) {
-            if (DataCompare(ptr, (const uint8_t*)data, (const uint8_t*)sMask)) {
-                return (uintptr_t)ptr;
+        for (unsigned reg = 0; reg < 16; ++reg) {
+            if (registers & (1u << (16 + reg))) {
+                EmitMovups(&code, 0x11, reg, XmmOffset(reg));
             }
         }
-        return 0;
-    }
 
-    struct _IMAGE_SECTION_HEADER* FindSection (const char* name)
+        // rax and rcx are saved by now, and free to carry the pushed values over.
+        Emit(&code, { 0x48, 0x8b, 0x45, 0x08 });        // mov rax, [rbp+8]
+        EmitMov(&code, 0x89, REG_RAX, RegisterOffset(REG_RAX));
+        Emit(&code, { 0x48, 0x8b, 0x45, 0x10 });        // mov rax, [rbp+16]
+        EmitMov(&code, 0x89, REG_RAX, RegisterOffset(REG_RBP));
+        Emit(&code, { 0x48, 0x8d, 0x45, 0x18 });        // lea rax, [rbp+24]
+        EmitMov(&code, 0x89, REG_RAX, RegisterOffset(REG_RSP));
+        Emit(&code, { 0x0f, 0xb6, 0x45, 0x01 });        // movzx eax, byte [rbp+1]
+        Emit(&code, { 0x0f, 0xb6, 0x4d, 0x00 });        // movzx ecx, byte [rbp]
+        Emit(&code, { 0xc1, 0xe1, 0x0b });              // shl ecx, 11
+        Emit(&code, { 0x09, 0xc8 });                    // or eax, ecx
+        EmitMov(&code, 0x89, REG_RAX, ContextOffset(offsetof(Context, rflags)));
+
+        Emit(&code, { 0x48, 0x8d, 0x4c, 0x24, (uint8_t)CONTEXT_OFFSET });     // lea rcx, [rsp+CONTEXT_OFFSET]
+        Emit(&code, { 0x48, 0xb8 });                    // mov rax, callback
+        const auto target = (uintptr_t)callback;
+        code.insert(code.end(), (const uint8_t*)&target, (const uint8_t*)&target + sizeof(target));
+        Emit(&code, { 0xff, 0xd0 });                    // call rax
+
+        // Written back whole, as the pop reading it would stall on smaller stores.
+        EmitMov(&code, 0x8b, REG_RAX, ContextOffset(offsetof(Context, rflags)));
+        Emit(&code, { 0x89, 0xc1 });                    // mov ecx, eax
+        Emit(&code, { 0xc1, 0xe9, 0x0b });              // shr ecx, 11
+        Emit(&code, { 0x83, 0xe1, 0x01 });              // and ecx, 1
+        Emit(&code, { 0xc1, 0xe0, 0x08 });              // shl eax, 8
+        Emit(&code, { 0x09, 0xc8 });                    // or eax, ecx
+        Emit(&code, { 0x48, 0x89, 0x45, 0x00 });        // mov [rbp], rax
+        EmitMov(&code, 0x8b, REG_RAX, RegisterOffset(REG_RAX));
+        Emit(&code, { 0x48, 0x89, 0x45, 0x08 });        // mov [rbp+8], rax
+        EmitMov(&code, 0x8b, REG_RAX, RegisterOffset(REG_RBP));
+        Emit(&code, { 0x48, 0x89, 0x45, 0x10 });        // mov [rbp+16], rax
+
+        for (unsigned reg = 0; reg < 16; ++reg) {
+            if (registers & (1u << (16 + reg))) {
+                EmitMovups(&code, 0x10, reg, XmmOffset(reg));
+            }
+        }
+
+        for (unsigned reg = 0; reg < 16; ++reg) {
+            if (isSaved(reg)) {
+                EmitMov(&code, 0x8b, reg, RegisterOffset(reg));
+            }
+        }
+
+        Emit(&code, { 0x48, 0x89, 0xec });              // mov rsp, rbp
+        Emit(&code, { 0x58 });                          // pop rax
+        Emit(&code, { 0x04, 0x7f });                    // add al, 0x7f, which overflows if OF was set
+        Emit(&code, { 0x9e });                          // sahf
+        Emit(&code, { 0x58 });                          // pop rax
+        Emit(&code, { 0x5d });                          // pop rbp
+
+        return code;
+    }
+
+    DetourBuffer MidHook (void* address, MidHookFn* callback, uint32_t registers, Transaction* transaction)
+    {
+        const auto src = (const uint8_t*)address;
+
+        const auto length = AsmLength(src, JMP_REL32_SIZE, PatchableSize(src));
+        if (length < JMP_REL32_SIZE) {
+            ERR("The code at %p is too short to hook", address);
+            return DetourBuffer(nullptr);
+        }
+
+        // Only the entry of a function can be hooked without knowing where it starts.
+        if (IsInLeafFunction(src)) {
+            ERR("The code at %p is in a function without .pdata, and can't be hooked", address);
+            return DetourBuffer(nullptr);
+        }
+
+        if (IsBranchedInto(src, length)) {
+            ERR("The code at %p is branched into, and can't be hooked", address);
+            return DetourBuffer(nullptr);
+        }
+
+        FreeRetiredTrampolines();
+
+        const auto relocatedSize = Relocate(src, length, nullptr);
+        if (!relocatedSize) {
+            return DetourBuffer(nullptr);
+        }
+
+        // The stub, followed by the relocated instructions and a jump back to the rest of them.
+        const auto stub = MakeMidHookStub(callback, registers | Context::VOLATILE);
+        const auto allocSize = stub.size() + relocatedSize + JMP_ABS64_SIZE;
+
+        const auto buffer = (uint8_t*)trampoline::Allocate(address, allocSize);
+        if (!buffer) {
+            return DetourBuffer(nullptr);
+        }
+
+        memcpy(buffer, stub.data(), stub.size());
+
+        auto size = stub.size();
+        const auto relocated = Relocate(src, length, buffer + size);
+        if (!relocated) {
+            trampoline::Free(buffer);
+            return DetourBuffer(nullptr);
+        }
+
+        size += relocated;
+        EmitJump(buffer + size, (uintptr_t)buffer + size, (uintptr_t)src + length);
+
+        uint8_t jump[JMP_ABS64_SIZE];
+        if (EmitJump(jump, (uintptr_t)src, (uintptr_t)buffer) != JMP_REL32_SIZE) {
+            trampoline::Free(buffer);
+            return DetourBuffer(nullptr);
+        }
+
+        // Threads return into the stub from the callback, so it may always be on a stack.
+        DetourBuffer result(buffer, allocSize, address, jump, true);
+        if (!result.Enable(transaction)) {
+            return DetourBuffer(nullptr);
+        }
+
+        return result;
+    }
+
+} // namespace hooks
+
+
+///
+// VfTable
+///
+
+namespace hooks {
+
+    struct SlotWrite {
+        void** slot;
+        void* value;
+    };
+
+    // Vftable slots are only ever read as whole pointers, so unlike code they can be written while
+    // other threads are running. Each page holding slots is unprotected once however many it
+    // holds, and the pages between them are left alone.
+    static bool WriteSlots (const SlotWrite writes[], size_t count)
+    {
+        struct Page {
+            uintptr_t base;
+            platform::Access access;
+        };
+
+        const auto pageSize = (uintptr_t)platform::PageSize();
+        std::vector<Page> pages;
+        pages.reserve(count);
+
+        for (size_t i = 0; i < count; ++i) {
+            pages.push_back({ (uintptr_t)writes[i].slot & ~(pageSize - 1), platform::Access::None });
+        }
+
+        std::sort(pages.begin(), pages.end(), [] (const Page& a, const Page& b) {
+            return a.base < b.base;
+        });
+
+        pages.erase(std::unique(pages.begin(), pages.end(), [] (const Page& a, const Page& b) {
+            return a.base == b.base;
+        }), pages.end());
+
+        auto result = true;
+        size_t unlocked = 0;
+
+        for (; unlocked < pages.size(); ++unlocked) {
+            auto& page = pages[unlocked];
+            if (!platform::Protect((void*)page.base, pageSize, platform::Access::ReadWrite, &page.access)) {
+                result = false;
+                break;
+            }
+        }
+
+        if (result) {
+            for (size_t i = 0; i < count; ++i) {
+                ((std::atomic<void*>*)writes[i].slot)->store(writes[i].value, std::memory_order_release);
+            }
+        }
+
+        for (size_t i = 0; i < unlocked; ++i) {
+            platform::Protect((void*)pages[i].base, pageSize, pages[i].access, nullptr);
+        }
+
+        return result;
+    }
+
+    VfTable::VfTable ()
+        : m_vftable(nullptr) { }
+
+    VfTable::VfTable (void** vftable)
+        : m_vftable(vftable) { }
+
+    bool VfTable::IsValid () const
+    {
+        return m_vftable != nullptr;
+    }
+
+    VfTable& VfTable::operator= (void** vftable)
+    {
+        m_vftable = vftable;
+        return *this;
+    }
+
+    void VfTable::Detour (size_t index, void* replacement, void** prev, Transaction* transaction)
+    {
+        auto buffer = DetourImpl(m_vftable[index], replacement, prev, transaction);
+        m_hooks.push_back({ index, nullptr, replacement, std::move(buffer) });
+    }
+
+    bool VfTable::Inject (size_t index, void* replacement, void** prev, Transaction* transaction)
+    {
+        return Inject({ { index, replacement, prev } }, transaction);
+    }
+
+    bool VfTable::Inject (std::initializer_list<Injection> injections, Transaction* transaction)
+    {
+        std::vector<SlotWrite> writes;
+        writes.reserve(injections.size());
+
+        for (const auto& injection : injections) {
+            const auto slot = m_vftable + injection.index;
+            const auto original = *slot;
+            ((std::atomic<void*>*)injection.prev)->store(original, std::memory_order_release);
+
+            m_hooks.push_back({ injection.index, original, injection.replacement, DetourBuffer(nullptr) });
+
+            if (transaction) {
+                transaction->WritePointer(slot, injection.replacement);
+            } else {
+                writes.push_back({ slot, injection.replacement });
+            }
+        }
+
+        return WriteSlots(writes.data(), writes.size());
+    }
+
+    bool VfTable::SetEnabled (size_t index, bool enabled, Transaction* transaction)
+    {
+        for (auto& hook : m_hooks) {
+            if (hook.index != index) {
+                continue;
+            }
+
+            if (hook.detour.IsValid()) {
+                return enabled ? hook.detour.Enable(transaction) : hook.detour.Disable(transaction);
+            }
+
+            if (hook.original) {
+                const SlotWrite write = { m_vftable + index, enabled ? hook.replacement : hook.original };
+
+                if (transaction) {
+                    transaction->WritePointer(write.slot, write.value);
+                    return true;
+                }
+
+                return WriteSlots(&write, 1);
+            }
+        }
+
+        ERR("No hook for function %zu of %p", index, m_vftable);
+        return false;
+    }
+
+} // namespace hooks
+
+
+///
+// ShadowVfTable
+///
+
+namespace hooks {
+
+    static bool IsCodeInModule (const pe::Image& image, const void* address)
+    {
+        uint32_t rva;
+        if (!image.RvaFromAddress((uint64_t)address, &rva)) {
+            return false;
+        }
+
+        const auto section = image.SectionFromRva(rva);
+        return section && (section->Characteristics & IMAGE_SCN_MEM_EXECUTE) != 0;
+    }
+
+    // A vftable is followed by either the complete object locator of the next one, or other data,
+    // neither of which points to code.
+    static size_t VfTableSize (void** vftable)
+    {
+        const auto module = platform::ModuleFromAddress(vftable);
+        if (!module) {
+            return 0;
+        }
+
+        const pe::Image image(module);
+        uint32_t rva;
+        if (!image.RvaFromAddress((uint64_t)vftable, &rva)) {
+            return 0;
+        }
+
+        const auto section = image.SectionFromRva(rva);
+        if (!section) {
+            return 0;
+        }
+
+        const auto end = (uintptr_t)image.ImageBase() + section->VirtualAddress + section->Misc.VirtualSize;
+
+        size_t count = 0;
+        while ((uintptr_t)(vftable + count + 1) <= end && IsCodeInModule(image, vftable[count])) {
+            ++count;
+        }
+
+        return count;
+    }
+
+    ShadowVfTable::ShadowVfTable (void** vftable, size_t count)
+    {
+        if (!count) {
+            count = VfTableSize(vftable);
+        }
+
+        if (!count) {
+            ERR("Could not determine the size of vftable %p", vftable);
+            return;
+        }
+
+        m_original = vftable;
+        m_count = count;
+        m_slots = new void*[count + 1];
+        memcpy(m_slots, vftable - 1, (count + 1) * sizeof(void*));
+    }
+
+    ShadowVfTable::ShadowVfTable (ShadowVfTable&& source)
+        : m_original(source.m_original)
+        , m_slots(source.m_slots)
+        , m_count(source.m_count)
+    {
+        source.m_original = nullptr;
+        source.m_slots = nullptr;
+        source.m_count = 0;
+    }
+
+    ShadowVfTable::~ShadowVfTable ()
+    {
+        delete[] m_slots;
+    }
+
+    ShadowVfTable& ShadowVfTable::operator= (ShadowVfTable&& source)
+    {
+        if (this != &source) {
+            delete[] m_slots;
+
+            m_original = source.m_original;
+            m_slots = source.m_slots;
+            m_count = source.m_count;
+
+            source.m_original = nullptr;
+            source.m_slots = nullptr;
+            source.m_count = 0;
+        }
+
+        return *this;
+    }
+
+    bool ShadowVfTable::IsValid () const
+    {
+        return m_slots != nullptr;
+    }
+
+    size_t ShadowVfTable::Count () const
+    {
+        return m_count;
+    }
+
+    void** ShadowVfTable::Original () const
+    {
+        return m_original;
+    }
+
+    void** ShadowVfTable::Table () const
+    {
+        return m_slots ? m_slots + 1 : nullptr;
+    }
+
+    bool ShadowVfTable::Replace (size_t index, void* replacement, void** prev)
+    {
+        if (index >= m_count) {
+            ERR("Function %zu is outside of the %zu in vftable %p", index, m_count, m_original);
+            return false;
+        }
+
+        // Attached objects may be calling through the slot already.
+        ((std::atomic<void*>*)prev)->exchange(m_original[index]);
+        ((std::atomic<void*>*)(Table() + index))->store(replacement, std::memory_order_release);
+        return true;
+    }
+
+    bool ShadowVfTable::Attach (void* object) const
+    {
+        auto expected = m_original;
+        return m_slots && ((std::atomic<void**>*)object)->compare_exchange_strong(expected, Table());
+    }
+
+    bool ShadowVfTable::Detach (void* object) const
+    {
+        auto expected = Table();
+        return m_slots && ((std::atomic<void**>*)object)->compare_exchange_strong(expected, m_original);
+    }
+
+    bool ShadowVfTable::IsAttached (const void* object) const
+    {
+        return m_slots && *(void** const*)object == Table();
+    }
+
+} // namespace hooks
+
+
+///
+// ImportHook
+///
+
+namespace hooks {
+
+    ImportHook::ImportHook (void** slot, void* replacement)
+        : m_slot(slot)
+        , m_original(*slot)
+        , m_replacement(replacement) { }
+
+    ImportHook::ImportHook (ImportHook&& source)
+    {
+        *this = std::move(source);
+    }
+
+    ImportHook::~ImportHook ()
+    {
+        if (!s_processExiting) {
+            Disable();
+        }
+    }
+
+    ImportHook& ImportHook::operator= (ImportHook&& source)
+    {
+        if (this != &source) {
+            Disable();
+
+            m_slot = source.m_slot;
+            m_original = source.m_original;
+            m_replacement = source.m_replacement;
+            m_enabled = source.m_enabled;
+
+            source.m_slot = nullptr;
+            source.m_enabled = false;
+        }
+
+        return *this;
+    }
+
+    bool ImportHook::IsValid () const
+    {
+        return m_slot != nullptr;
+    }
+
+    bool ImportHook::IsEnabled () const
+    {
+        return m_enabled;
+    }
+
+    bool ImportHook::Enable (Transaction* transaction)
+    {
+        if (!m_slot || m_enabled) {
+            return m_enabled;
+        }
+
+        if (transaction) {
+            transaction->WritePointer(m_slot, m_replacement);
+            m_enabled = true;
+        } else {
+            const SlotWrite write = { m_slot, m_replacement };
+            m_enabled = WriteSlots(&write, 1);
+        }
+
+        return m_enabled;
+    }
+
+    bool ImportHook::Disable (Transaction* transaction)
+    {
+        if (!m_slot || !m_enabled) {
+            return true;
+        }
+
+        if (transaction) {
+            transaction->WritePointer(m_slot, m_original);
+            m_enabled = false;
+        } else {
+            const SlotWrite write = { m_slot, m_original };
+            m_enabled = !WriteSlots(&write, 1);
+        }
+
+        return !m_enabled;
+    }
+
+    static ImportHook HookImportSlot (const void* module, uint32_t rva, void* replacement, void** prev, Transaction* transaction)
+    {
+        if (!rva) {
+            return ImportHook();
+        }
+
+        const auto slot = (void**)((uintptr_t)module + rva);
+
+        // Calls through `prev` go straight to the imported function.
+        ((std::atomic<void*>*)prev)->store(*slot, std::memory_order_release);
+
+        ImportHook hook(slot, replacement);
+        if (!hook.Enable(transaction)) {
+            *prev = nullptr;
+            return ImportHook();
+        }
+
+        return hook;
+    }
+
+    ImportHook HookImportImpl (const void* module, const char dll[], const char function[], void* replacement, void** prev, Transaction* transaction)
+    {
+        *prev = nullptr;
+
+        const auto rva = imports::ForModule(module).Find(dll, function);
+        if (!rva) {
+            LOG("%p doesn't import %s!%s", module, dll, function);
+        }
+
+        return HookImportSlot(module, rva, replacement, prev, transaction);
+    }
+
+    ImportHook HookImportImpl (const void* module, const char dll[], uint16_t ordinal, void* replacement, void** prev, Transaction* transaction)
+    {
+        *prev = nullptr;
+
+        const auto rva = imports::ForModule(module).Find(dll, ordinal);
+        if (!rva) {
+            LOG("%p doesn't import %s#%u", module, dll, ordinal);
+        }
+
+        return HookImportSlot(module, rva, replacement, prev, transaction);
+    }
+
+} // namespace hooks
+
+
+///
+// Multiplexer
+///
+
+namespace hooks {
+
+    Subscribers::Subscribers ()
+        : m_list(nullptr)
+        , m_epoch(0)
+    {
+        m_readers[0] = 0;
+        m_readers[1] = 0;
+    }
+
+    Subscribers::~Subscribers ()
+    {
+        delete m_list.load();
+
+        for (const auto& retired : m_retired) {
+            delete retired.list;
+        }
+    }
+
+    // Must be called with the mutex held, right after `list` was replaced.
+    void Subscribers::Retire (const List* list)
+    {
+        if (list) {
+            m_retired.push_back({ list, m_epoch.load() });
+        }
+
+        // Without readers, two steps are enough to free the list that was just retired.
+        for (auto step = 0; step < 2 && !m_retired.empty(); ++step) {
+            const auto epoch = m_epoch.load();
+            if (m_readers[(epoch - 1) & 1].load() != 0) {
+                break;
+            }
+
+            size_t kept = 0;
+            for (const auto& retired : m_retired) {
+                if (retired.epoch < epoch) {
+                    delete retired.list;
+                } else {
+                    m_retired[kept++] = retired;
+                }
+            }
+
+            m_retired.resize(kept);
+            m_epoch.store(epoch + 1);
+        }
+    }
+
+    bool Subscribers::Add (bool post, void* fn, void* user, int order)
+    {
+        if (!fn) {
+            return false;
+        }
+
+        std::lock_guard<std::mutex> lock(m_mutex);
+
+        auto list = new List();
+        if (const auto current = m_list.load(std::memory_order_relaxed)) {
+            *list = *current;
+        } else {
+            list->preCount = 0;
+        }
+
+        const auto begin = list->entries.begin() + (post ? (ptrdiff_t)list->preCount : 0);
+        const auto end = post ? list->entries.end() : list->entries.begin() + (ptrdiff_t)list->preCount;
+        const auto at = std::upper_bound(begin, end, order, [] (int value, const Entry& entry) {
+            return value < entry.order;
+        });
+
+        list->entries.insert(at, { fn, user, order });
+        list->preCount += post ? 0 : 1;
+
+        Retire(m_list.exchange(list));
+        return true;
+    }
+
+    bool Subscribers::Remove (bool post, void* fn, void* user)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+
+        const auto current = m_list.load(std::memory_order_relaxed);
+        if (!current) {
+            return false;
+        }
+
+        auto list = new List();
+        list->preCount = 0;
+
+        for (size_t i = 0; i < current->entries.size(); ++i) {
+            const auto& entry = current->entries[i];
+            const auto isPost = i >= current->preCount;
+
+            if (isPost == post && entry.fn == fn && entry.user == user) {
+                continue;
+            }
+
+            list->entries.push_back(entry);
+            list->preCount += isPost ? 0 : 1;
+        }
+
+        if (list->entries.size() == current->entries.size()) {
+            delete list;
+            return false;
+        }
+
+        // An empty list is published as nullptr, which is what lets dispatching skip straight to
+        // the original function.
+        if (list->entries.empty()) {
+            delete list;
+            list = nullptr;
+        }
+
+        Retire(m_list.exchange(list));
+        return true;
+    }
+
+} // namespace hooks
+
+
+///
+// Functions
+///
+
+namespace hooks {
+
+    void OnProcessExit ()
+    {
+        s_processExiting = true;
+    }
+
+#ifdef _WIN32
+    struct _IMAGE_SECTION_HEADER* FindSection (const char* name)
+    {
+        return FindSection(GetModuleHandleA(nullptr), name);
+    }
+#endif
+
+    struct _IMAGE_SECTION_HEADER* FindSection (const void* imageBase, const char* name)
     {
-        auto imageBase = GetModuleHandleA(nullptr);
         auto dosHeader = (const IMAGE_DOS_HEADER*)imageBase;
         if (dosHeader->e_magic != IMAGE_DOS_SIGNATURE) {
             ERR("Invalid DOS magic: %#hx", dosHeader->e_magic);
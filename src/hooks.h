@@ -3,20 +3,67 @@
 
 #pragma once
 
+#include <atomic>
+#include <initializer_list>
+#include <mutex>
 #include <vector>
 
 namespace hooks {
 
+    ///
+    // Transaction
+    ///
+
+    // Collects writes to code and vftables, and applies them all at once. Every page is made
+    // writable once no matter how many patches it holds, and the instruction cache is flushed once
+    // at the end, which keeps the window during which the hooks are half applied short. Other
+    // threads are suspended while writing, and the commit fails if any of them is stopped in the
+    // middle of the bytes being replaced.
+    class Transaction
+    {
+        struct Patch {
+            uint8_t* address;
+            std::vector<uint8_t> bytes;
+        };
+
+        std::vector<Patch> m_patches;
+
+        public:
+            void Write (void* address, const void* data, size_t size);
+
+            // Aligned pointers are swapped atomically, so threads calling through the slot see
+            // either the old or the new value.
+            void WritePointer (void** slot, void* value);
+
+            size_t Count () const;
+            bool Commit ();
+    };
+
+
     ///
     // Detour
     ///
 
+    // Owns the trampoline of a detour. Destroying it restores the original code, and frees the
+    // trampoline after it's been out of use for a second, once no suspended thread is stopped in
+    // it. That doesn't rule out a return address into it: a thread interrupted in the trampoline
+    // by a signal or exception handler that runs for longer than that resumes in freed memory.
+    // Trampolines whose relocated code makes calls, which return into them, are never freed.
     class DetourBuffer
     {
         const uint8_t* m_buffer;
+        size_t m_size = 0;
+        uint8_t* m_target = nullptr;
+        uint8_t m_original[5];          // Bytes replaced by the rel32 jmp
+        uint8_t m_patch[5];
+        bool m_enabled = false;
+        bool m_pinned = false;          // The trampoline calls out, so it may be on a stack
+
+        void Release ();
 
         public:
             DetourBuffer (const uint8_t* data);
+            DetourBuffer (const uint8_t* buffer, size_t size, void* target, const uint8_t patch[], bool pinned);
             DetourBuffer (const DetourBuffer&) = delete;
             DetourBuffer (DetourBuffer&& source);
             ~DetourBuffer ();
@@ -25,16 +72,74 @@ namespace hooks {
             DetourBuffer& operator= (DetourBuffer&& source);
 
             bool IsValid () const;
+            bool IsEnabled () const;
+
+            // Writes the jump into the target, or restores its original bytes. The trampoline
+            // stays around either way, so a detour can be toggled any number of times.
+            bool Enable (Transaction* transaction = nullptr);
+            bool Disable (Transaction* transaction = nullptr);
     };
 
+    DetourBuffer DetourImpl (void* src, void* dst, void** prev, Transaction* transaction);
+
+    // Without a transaction, the detour is applied right away.
     template <class F>
-    DetourBuffer Detour (F* src, F* dst, F** prev)
+    DetourBuffer Detour (F* src, F* dst, F** prev, Transaction* transaction = nullptr)
     {
-        DetourBuffer DetourImpl(void*, void*, void**);
-        return DetourImpl((void*)src, (void*)dst, (void**)prev);
+        return DetourImpl((void*)src, (void*)dst, (void**)prev, transaction);
     }
 
 
+    ///
+    // Mid-function hooks
+    ///
+
+    union Xmm {
+        float f32[4];
+        double f64[2];
+        uint32_t u32[4];
+        uint64_t u64[2];
+    };
+
+    // The registers at a hooked instruction. Changes the callback makes to them are in effect once
+    // the code carries on, except for `rsp`, which is only there to be read. Of the flags, only
+    // the status flags are kept. The direction flag is expected to be clear, as the ABI has it
+    // everywhere outside of string instructions.
+    struct alignas(16) Context {
+        // The registers a call may change are always saved, along with rsp, rbp and the flags.
+        // The others are only saved when asked for, as the callback leaves them alone anyway.
+        enum : uint32_t {
+            RAX = 1u << 0,  RCX = 1u << 1,  RDX = 1u << 2,  RBX = 1u << 3,
+            RSP = 1u << 4,  RBP = 1u << 5,  RSI = 1u << 6,  RDI = 1u << 7,
+            R8 = 1u << 8,   R9 = 1u << 9,   R10 = 1u << 10, R11 = 1u << 11,
+            R12 = 1u << 12, R13 = 1u << 13, R14 = 1u << 14, R15 = 1u << 15,
+
+            XMM0 = 1u << 16,  XMM1 = 1u << 17,  XMM2 = 1u << 18,  XMM3 = 1u << 19,
+            XMM4 = 1u << 20,  XMM5 = 1u << 21,  XMM6 = 1u << 22,  XMM7 = 1u << 23,
+            XMM8 = 1u << 24,  XMM9 = 1u << 25,  XMM10 = 1u << 26, XMM11 = 1u << 27,
+            XMM12 = 1u << 28, XMM13 = 1u << 29, XMM14 = 1u << 30, XMM15 = 1u << 31,
+
+            VOLATILE = RAX | RCX | RDX | RSP | RBP | R8 | R9 | R10 | R11 | XMM0 | XMM1 | XMM2 | XMM3 | XMM4 | XMM5,
+            ALL = 0xffffffffu,
+        };
+
+        uint64_t rax, rcx, rdx, rbx, rsp, rbp, rsi, rdi;    // In encoding order
+        uint64_t r8, r9, r10, r11, r12, r13, r14, r15;
+        uint64_t rflags;
+        uint64_t reserved;
+        Xmm xmm[16];
+    };
+
+    using MidHookFn = void(Context* context);
+
+    // Calls `callback` every time the instruction at `address` is about to run. The address must
+    // be the start of an instruction, and the callback must not throw, since nothing can unwind
+    // through the stub calling it. Addresses in a module's leaf functions, which have no .pdata
+    // entry to tell where they start, are refused. Without a transaction, the hook is applied
+    // right away.
+    DetourBuffer MidHook (void* address, MidHookFn* callback, uint32_t registers = 0, Transaction* transaction = nullptr);
+
+
     ///
     // Function
     ///
@@ -54,13 +159,30 @@ namespace hooks {
     // VfTable
     ///
 
+    // Detours made through the table are removed along with it, while injected slots stay.
     class VfTable
     {
-        void** m_vftable;
-        std::vector<DetourBuffer> m_detours;
+        public:
+            struct Injection {
+                size_t index;
+                void* replacement;
+                void** prev;
+            };
+
+        private:
+            struct Hook {
+                size_t index;
+                void* original;             // Injected hooks only
+                void* replacement;
+                DetourBuffer detour;        // Detoured hooks only
+            };
 
-        void Detour (size_t index, void* replacement, void** prev);
-        void Inject (size_t index, void* replacement, void** prev);
+            void** m_vftable;
+            std::vector<Hook> m_hooks;
+
+            void Detour (size_t index, void* replacement, void** prev, Transaction* transaction);
+            bool Inject (size_t index, void* replacement, void** prev, Transaction* transaction);
+            bool SetEnabled (size_t index, bool enabled, Transaction* transaction);
 
         public:
             VfTable ();
@@ -69,15 +191,41 @@ namespace hooks {
             VfTable& operator= (void** vftable);
 
             template <class F>
-            void Detour (typename F::Fn* replacement, typename F::Fn** prev)
+            void Detour (typename F::Fn* replacement, typename F::Fn** prev, Transaction* transaction = nullptr)
+            {
+                Detour(F::INDEX, (void*)replacement, (void**)prev, transaction);
+            }
+
+            // False if the slot couldn't be written. With a transaction, that's up to its commit.
+            template <class F>
+            bool Inject (typename F::Fn* replacement, typename F::Fn** prev, Transaction* transaction = nullptr)
+            {
+                return Inject(F::INDEX, (void*)replacement, (void**)prev, transaction);
+            }
+
+            // Injects a set of slots, made with `Slot`, at once. Without a transaction, each page
+            // of the table holding any of them is unprotected once for all of them, and since
+            // they hold nothing but pointers, no threads need to be stopped.
+            bool Inject (std::initializer_list<Injection> injections, Transaction* transaction = nullptr);
+
+            template <class F>
+            static Injection Slot (typename F::Fn* replacement, typename F::Fn** prev)
+            {
+                return { F::INDEX, (void*)replacement, (void**)prev };
+            }
+
+            // Turns hooks previously added through this table off and on again. Injected slots get
+            // their original function back, and detoured functions their original code.
+            template <class F>
+            bool Enable (Transaction* transaction = nullptr)
             {
-                Detour(F::INDEX, (void*)replacement, (void**)prev);
+                return SetEnabled(F::INDEX, true, transaction);
             }
 
             template <class F>
-            void Inject (typename F::Fn* replacement, typename F::Fn** prev)
+            bool Disable (Transaction* transaction = nullptr)
             {
-                Inject(F::INDEX, (void*)replacement, (void**)prev);
+                return SetEnabled(F::INDEX, false, transaction);
             }
 
             template <class F, class... Args>
@@ -89,11 +237,438 @@ namespace hooks {
     };
 
 
+    ///
+    // BoundVirtual
+    ///
+
+    // Calls function `F` of an object's vftable. The function is looked up once and cached along
+    // with the vftable it came from, and looked up again whenever an object turns up with another
+    // vftable. The pair is guarded by a sequence lock, so a thread reading it while another
+    // replaces it never gets a function from the wrong table.
+    template <class F>
+    class BoundVirtual
+    {
+        static std::atomic<uint32_t> s_sequence;    // Odd while the cache is being replaced
+        static std::atomic<void**> s_vftable;
+        static std::atomic<void*> s_function;
+
+        static void* Resolve (void** vftable)
+        {
+            const auto function = vftable[F::INDEX];
+
+            // Only one thread replaces the cache at a time. Any other just calls what it found.
+            auto sequence = s_sequence.load(std::memory_order_relaxed);
+            if ((sequence & 1) == 0 && s_sequence.compare_exchange_strong(sequence, sequence + 1, std::memory_order_relaxed)) {
+                std::atomic_thread_fence(std::memory_order_release);
+                s_vftable.store(vftable, std::memory_order_relaxed);
+                s_function.store(function, std::memory_order_relaxed);
+                s_sequence.store(sequence + 2, std::memory_order_release);
+            }
+
+            return function;
+        }
+
+        static void* Lookup (void** vftable)
+        {
+            const auto sequence = s_sequence.load(std::memory_order_acquire);
+            const auto cached = s_vftable.load(std::memory_order_relaxed);
+            const auto function = s_function.load(std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_acquire);
+
+            if (cached == vftable && (sequence & 1) == 0 && s_sequence.load(std::memory_order_relaxed) == sequence) {
+                return function;
+            }
+
+            return Resolve(vftable);
+        }
+
+        public:
+            // `object` is passed on as the first argument of the function.
+            template <class T, class... Args>
+            static typename F::Ret Call (T& object, Args&& ... args)
+            {
+                const auto function = (typename F::Fn*)Lookup(*(void** const*)&object);
+                return function(object, std::forward<Args>(args) ...);
+            }
+    };
+
+    template <class F>
+    std::atomic<uint32_t> BoundVirtual<F>::s_sequence(0);
+
+    template <class F>
+    std::atomic<void**> BoundVirtual<F>::s_vftable(nullptr);
+
+    template <class F>
+    std::atomic<void*> BoundVirtual<F>::s_function(nullptr);
+
+
+    ///
+    // ShadowVfTable
+    ///
+
+    // A copy of a class's vftable in our own memory, with some of its functions replaced. Objects
+    // are hooked one at a time by pointing them at the copy, which needs no page protection
+    // changes, and leaves every other object of the class running the game's code as is. The
+    // slot before the functions is copied too, so RTTI still works on the hooked objects.
+    //
+    // The copy must outlive every object attached to it.
+    class ShadowVfTable
+    {
+        void** m_original = nullptr;
+        void** m_slots = nullptr;       // The complete object locator, then the functions
+        size_t m_count = 0;
+
+        bool Replace (size_t index, void* replacement, void** prev);
+
+        public:
+            ShadowVfTable () = default;
+
+            // Without a count, the table ends at the first slot that doesn't point to code in the
+            // module holding the table.
+            explicit ShadowVfTable (void** vftable, size_t count = 0);
+            ShadowVfTable (const ShadowVfTable&) = delete;
+            ShadowVfTable (ShadowVfTable&& source);
+            ~ShadowVfTable ();
+
+            ShadowVfTable& operator= (const ShadowVfTable&) = delete;
+            ShadowVfTable& operator= (ShadowVfTable&& source);
+
+            bool IsValid () const;
+            size_t Count () const;
+            void** Original () const;
+            void** Table () const;
+
+            // `prev` gets the class's own function, which the original table still points to.
+            // Functions can be replaced while objects are attached.
+            template <class F>
+            bool Replace (typename F::Fn* replacement, typename F::Fn** prev)
+            {
+                return Replace(F::INDEX, (void*)replacement, (void**)prev);
+            }
+
+            // These only swap the vptr of an object using the table it's swapped from, so objects
+            // of other classes, or already attached ones, are left alone.
+            bool Attach (void* object) const;
+            bool Detach (void* object) const;
+            bool IsAttached (const void* object) const;
+    };
+
+
+    ///
+    // ImportHook
+    ///
+
+    // Points a slot of a module's import address table somewhere else. Calls through the import
+    // cost nothing extra and no code is touched, but only the calls that module makes itself are
+    // hooked, and not those from other modules or through GetProcAddress. Destroying it puts the
+    // original function back.
+    class ImportHook
+    {
+        void** m_slot = nullptr;
+        void* m_original = nullptr;
+        void* m_replacement = nullptr;
+        bool m_enabled = false;
+
+        public:
+            ImportHook () = default;
+            ImportHook (void** slot, void* replacement);
+            ImportHook (const ImportHook&) = delete;
+            ImportHook (ImportHook&& source);
+            ~ImportHook ();
+
+            ImportHook& operator= (const ImportHook&) = delete;
+            ImportHook& operator= (ImportHook&& source);
+
+            bool IsValid () const;
+            bool IsEnabled () const;
+            bool Enable (Transaction* transaction = nullptr);
+            bool Disable (Transaction* transaction = nullptr);
+    };
+
+    ImportHook HookImportImpl (const void* module, const char dll[], const char function[], void* replacement, void** prev, Transaction* transaction);
+    ImportHook HookImportImpl (const void* module, const char dll[], uint16_t ordinal, void* replacement, void** prev, Transaction* transaction);
+
+    // `function` is either the name or the ordinal of the function in `dll`. The hook is invalid
+    // if `module` doesn't import it. Without a transaction, the hook is applied right away.
+    template <class F, class Function>
+    ImportHook HookImport (const void* module, const char dll[], Function function, F* replacement, F** prev, Transaction* transaction = nullptr)
+    {
+        return HookImportImpl(module, dll, function, (void*)replacement, (void**)prev, transaction);
+    }
+
+
+    ///
+    // Multiplexer
+    ///
+
+    // The ordered functions subscribed to a multiplexed target. Every change makes a new list and
+    // publishes it in one store, so dispatching never takes a lock or sees a change half made.
+    //
+    // A replaced list may still be walked by a thread that was dispatching, so it's retired rather
+    // than freed. Threads count themselves in one of two reader counts while they hold a list, the
+    // one picked by the parity of the epoch. Once the count of the previous epoch has drained,
+    // nobody can hold a list retired before the current one, so those are freed and the epoch
+    // moves on. This is done on every change, which never waits for readers, so lists pile up only
+    // for as long as some thread keeps dispatching in the previous epoch.
+    class Subscribers
+    {
+        public:
+            struct Entry {
+                void* fn;
+                void* user;
+                int order;
+            };
+
+            struct List {
+                size_t preCount;                // Pre subscribers come first, post after them
+                std::vector<Entry> entries;
+            };
+
+        private:
+            struct Retired {
+                const List* list;
+                size_t epoch;                   // When it was replaced
+            };
+
+            std::atomic<const List*> m_list;    // nullptr while there are no subscribers
+            std::atomic<size_t> m_epoch;
+            std::atomic<size_t> m_readers[2];
+            std::mutex m_mutex;
+            std::vector<Retired> m_retired;
+
+            void Retire (const List* list);
+
+        public:
+            // Holds on to the current list, if there is one, so that it isn't freed while in use.
+            // While there are no subscribers, this is a single load.
+            class Reader
+            {
+                Subscribers& m_subscribers;
+                const List* m_list = nullptr;
+                size_t m_parity = 0;
+
+                public:
+                    explicit Reader (Subscribers& subscribers)
+                        : m_subscribers(subscribers)
+                    {
+                        if (!subscribers.m_list.load(std::memory_order_relaxed)) {
+                            return;
+                        }
+
+                        // The epoch is checked again once counted, since a count made in an epoch
+                        // that has already ended wouldn't be waited for.
+                        for (;;) {
+                            const auto epoch = subscribers.m_epoch.load();
+                            m_parity = epoch & 1;
+                            subscribers.m_readers[m_parity].fetch_add(1);
+
+                            if (subscribers.m_epoch.load() == epoch) {
+                                break;
+                            }
+
+                            subscribers.m_readers[m_parity].fetch_sub(1);
+                        }
+
+                        m_list = subscribers.m_list.load();
+                        if (!m_list) {
+                            subscribers.m_readers[m_parity].fetch_sub(1);
+                        }
+                    }
+
+                    Reader (const Reader&) = delete;
+
+                    ~Reader ()
+                    {
+                        if (m_list) {
+                            m_subscribers.m_readers[m_parity].fetch_sub(1, std::memory_order_release);
+                        }
+                    }
+
+                    Reader& operator= (const Reader&) = delete;
+
+                    const List* Get () const
+                    {
+                        return m_list;
+                    }
+            };
+
+            Subscribers ();
+            Subscribers (const Subscribers&) = delete;
+            ~Subscribers ();
+
+            Subscribers& operator= (const Subscribers&) = delete;
+
+            bool IsEmpty () const
+            {
+                return m_list.load(std::memory_order_acquire) == nullptr;
+            }
+
+            // Subscribers run by ascending `order`, and in the order they were added for equal
+            // ones. Removing takes out every entry with the same function and user pointer.
+            bool Add (bool post, void* fn, void* user, int order);
+            bool Remove (bool post, void* fn, void* user);
+    };
+
+    namespace detail {
+
+        template <class R, class... A>
+        struct Dispatcher {
+            using Pre = void(void* user, A... args);
+            using Post = void(void* user, R result, A... args);
+
+            static void Notify (const Subscribers::List& list, R result, A... args)
+            {
+                for (auto i = list.preCount; i < list.entries.size(); ++i) {
+                    const auto& entry = list.entries[i];
+                    ((Post*)entry.fn)(entry.user, result, args...);
+                }
+            }
+
+            static R Run (const Subscribers::List& list, R (*original)(A...), A... args)
+            {
+                for (size_t i = 0; i < list.preCount; ++i) {
+                    const auto& entry = list.entries[i];
+                    ((Pre*)entry.fn)(entry.user, args...);
+                }
+
+                auto result = original(args...);
+                Notify(list, result, args...);
+                return result;
+            }
+        };
+
+        template <class... A>
+        struct Dispatcher<void, A...> {
+            using Pre = void(void* user, A... args);
+            using Post = void(void* user, A... args);
+
+            static void Notify (const Subscribers::List& list, A... args)
+            {
+                for (auto i = list.preCount; i < list.entries.size(); ++i) {
+                    const auto& entry = list.entries[i];
+                    ((Post*)entry.fn)(entry.user, args...);
+                }
+            }
+
+            static void Run (const Subscribers::List& list, void (*original)(A...), A... args)
+            {
+                for (size_t i = 0; i < list.preCount; ++i) {
+                    const auto& entry = list.entries[i];
+                    ((Pre*)entry.fn)(entry.user, args...);
+                }
+
+                original(args...);
+                Notify(list, args...);
+            }
+        };
+
+    } // namespace detail
+
+    // Detours a target once and fans every call out to the subscribers, which run before and
+    // after the original function. Pre subscribers get the arguments, and post subscribers the
+    // result followed by the arguments, both after the `user` pointer they were added with.
+    // Subscribers come and go without touching the code again, and while there are none the
+    // original is called straight away. A removed subscriber may still be called by a thread that
+    // was already dispatching.
+    //
+    // All state is static, so every target needs a type of its own. `Tag` tells apart targets
+    // that share a signature.
+    template <class F, class Tag = F>
+    class Multiplexer;
+
+    template <class R, class... A, class Tag>
+    class Multiplexer<R(A...), Tag>
+    {
+        public:
+            using Fn = R(A...);
+            using Pre = typename detail::Dispatcher<R, A...>::Pre;
+            using Post = typename detail::Dispatcher<R, A...>::Post;
+
+        private:
+            static Fn* s_original;
+            static Subscribers s_subscribers;
+
+        public:
+            static R Dispatch (A... args)
+            {
+                const Subscribers::Reader reader(s_subscribers);
+                if (!reader.Get()) {
+                    return s_original(args...);
+                }
+
+                return detail::Dispatcher<R, A...>::Run(*reader.Get(), s_original, args...);
+            }
+
+            // Where the trampoline goes. Passing this and `Dispatch` to `VfTable::Detour` installs
+            // the multiplexer through a vftable instead of `Install`.
+            static Fn** Original ()
+            {
+                return &s_original;
+            }
+
+            // Must only be done once, since there's only one trampoline to call.
+            static DetourBuffer Install (Fn* target, Transaction* transaction = nullptr)
+            {
+                return Detour(target, &Dispatch, &s_original, transaction);
+            }
+
+            static bool IsEmpty ()
+            {
+                return s_subscribers.IsEmpty();
+            }
+
+            static bool AddPre (Pre* fn, void* user = nullptr, int order = 0)
+            {
+                return s_subscribers.Add(false, (void*)fn, user, order);
+            }
+
+            static bool AddPost (Post* fn, void* user = nullptr, int order = 0)
+            {
+                return s_subscribers.Add(true, (void*)fn, user, order);
+            }
+
+            static bool RemovePre (Pre* fn, void* user = nullptr)
+            {
+                return s_subscribers.Remove(false, (void*)fn, user);
+            }
+
+            static bool RemovePost (Post* fn, void* user = nullptr)
+            {
+                return s_subscribers.Remove(true, (void*)fn, user);
+            }
+
+            // Runs only the post subscribers, as if the target had been called. For when something
+            // else did the target's work, and the subscribers should still hear about it.
+            template <class... Args>
+            static void Notify (Args&& ... args)
+            {
+                const Subscribers::Reader reader(s_subscribers);
+                if (reader.Get()) {
+                    detail::Dispatcher<R, A...>::Notify(*reader.Get(), std::forward<Args>(args) ...);
+                }
+            }
+    };
+
+    template <class R, class... A, class Tag>
+    R (*Multiplexer<R(A...), Tag>::s_original)(A...) = nullptr;
+
+    template <class R, class... A, class Tag>
+    Subscribers Multiplexer<R(A...), Tag>::s_subscribers;
+
+
     ///
     // Functions
     ///
 
-    uintptr_t FindPattern (uintptr_t address, uintptr_t term, const char* data, const char* sMask);
+    // Leaves every hook in place from here on, rather than restoring what it replaced. Call it
+    // when the process is exiting: the other threads are gone by then, and everything would be
+    // unmapped anyway, while restoring code means suspending threads under the loader lock.
+    void OnProcessExit ();
+
+#ifdef _WIN32
+    // Looks in the executable of the process, which is only a PE image on Windows.
     struct _IMAGE_SECTION_HEADER* FindSection (const char* name);
+#endif
+    struct _IMAGE_SECTION_HEADER* FindSection (const void* imageBase, const char* name);
 
 } // namespace hooks
@@ -0,0 +1,169 @@
+﻿// Copyright (c) 2015, Johan Sköld
+// License: https://opensource.org/licenses/ISC
+
+#include "stdafx.h"
+#include "imports.h"
+
+#include "pe.h"
+#include "util.h"
+
+namespace imports {
+
+    ///
+    // Statics
+    ///
+
+    const size_t MAX_NAME_LENGTH = 0x200;
+
+
+    ///
+    // Locals
+    ///
+
+    // The null terminated string at `rva`, if all of it is inside the image.
+    static const char* String (const pe::Image& image, uint32_t rva)
+    {
+        auto str = (const char*)image.FromRva(rva);
+        if (!str) {
+            return nullptr;
+        }
+
+        for (size_t i = 0; i < MAX_NAME_LENGTH; ++i) {
+            if (!image.FromRva(rva + (uint32_t)i, 1)) {
+                return nullptr;
+            }
+
+            if (!str[i]) {
+                return str;
+            }
+        }
+
+        return nullptr;
+    }
+
+    // Lower case, and without a ".dll" extension.
+    static std::string DllKey (const char dll[])
+    {
+        std::string key(dll);
+
+        for (auto& c : key) {
+            c = (char)tolower((unsigned char)c);
+        }
+
+        if (key.size() > 4 && key.compare(key.size() - 4, 4, ".dll") == 0) {
+            key.resize(key.size() - 4);
+        }
+
+        return key;
+    }
+
+    static std::string NameKey (const std::string& dll, const char function[])
+    {
+        return dll + '!' + function;
+    }
+
+    static std::string OrdinalKey (const std::string& dll, uint16_t ordinal)
+    {
+        return dll + '#' + std::to_string(ordinal);
+    }
+
+
+    ///
+    // Index
+    ///
+
+    void Index::Build (const pe::Image& image)
+    {
+        m_slots.clear();
+
+        size_t size;
+        const auto directory = image.Directory(IMAGE_DIRECTORY_ENTRY_IMPORT, &size);
+        if (!directory) {
+            return;
+        }
+
+        const auto count = size / sizeof(IMAGE_IMPORT_DESCRIPTOR);
+        const auto descriptors = (const IMAGE_IMPORT_DESCRIPTOR*)directory;
+
+        for (size_t i = 0; i < count && descriptors[i].Name; ++i) {
+            const auto& descriptor = descriptors[i];
+
+            const auto dll = String(image, descriptor.Name);
+            if (!dll) {
+                continue;
+            }
+
+            // The names are in the lookup table, since the loader replaces the ones in the
+            // address table with the addresses. Old linkers left the lookup table out, in which
+            // case the names are only there in files.
+            auto lookup = descriptor.OriginalFirstThunk;
+            if (!lookup) {
+                if (image.IsMapped()) {
+                    continue;
+                }
+
+                lookup = descriptor.FirstThunk;
+            }
+
+            const auto key = DllKey(dll);
+
+            for (uint32_t j = 0; ; ++j) {
+                const auto offset = j * (uint32_t)sizeof(IMAGE_THUNK_DATA64);
+                const auto thunk = (const IMAGE_THUNK_DATA64*)image.FromRva(lookup + offset, sizeof(IMAGE_THUNK_DATA64));
+                if (!thunk || !thunk->u1.AddressOfData) {
+                    break;
+                }
+
+                const auto slot = descriptor.FirstThunk + offset;
+
+                if (IMAGE_SNAP_BY_ORDINAL64(thunk->u1.Ordinal)) {
+                    m_slots.emplace(OrdinalKey(key, (uint16_t)IMAGE_ORDINAL64(thunk->u1.Ordinal)), slot);
+                } else if (thunk->u1.AddressOfData <= UINT32_MAX) {
+                    const auto rva = (uint32_t)thunk->u1.AddressOfData + (uint32_t)offsetof(IMAGE_IMPORT_BY_NAME, Name);
+                    if (auto name = String(image, rva)) {
+                        m_slots.emplace(NameKey(key, name), slot);
+                    }
+                }
+            }
+        }
+    }
+
+    size_t Index::Count () const
+    {
+        return m_slots.size();
+    }
+
+    uint32_t Index::Find (const char dll[], const char function[]) const
+    {
+        auto it = m_slots.find(NameKey(DllKey(dll), function));
+        return it != m_slots.end() ? it->second : 0;
+    }
+
+    uint32_t Index::Find (const char dll[], uint16_t ordinal) const
+    {
+        auto it = m_slots.find(OrdinalKey(DllKey(dll), ordinal));
+        return it != m_slots.end() ? it->second : 0;
+    }
+
+
+    ///
+    // Functions
+    ///
+
+    const Index& ForModule (const void* module)
+    {
+        static std::mutex s_mutex;
+        static std::map<const void*, Index> s_indices;
+
+        std::lock_guard<std::mutex> lock(s_mutex);
+        auto it = s_indices.find(module);
+
+        if (it == s_indices.end()) {
+            it = s_indices.emplace(module, Index()).first;
+            it->second.Build(pe::Image(module));
+        }
+
+        return it->second;
+    }
+
+} // namespace imports
@@ -0,0 +1,35 @@
+﻿// Copyright (c) 2015, Johan Sköld
+// License: https://opensource.org/licenses/ISC
+
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+
+namespace pe { class Image; }
+
+namespace imports {
+
+    // Where an image keeps the addresses of the functions it imports, by DLL and function name or
+    // ordinal. The import directory is walked once, after which finding the import address table
+    // slot of a function is a single lookup. DLL names are matched without regard to case, and
+    // with or without their ".dll" extension. Everything is in RVAs, so the index works the same
+    // for loaded images and files on disk.
+    class Index
+    {
+        std::unordered_map<std::string, uint32_t> m_slots;
+
+        public:
+            void Build (const pe::Image& image);
+            size_t Count () const;
+
+            // RVA of the slot the function's address is written to, or 0 if it isn't imported.
+            uint32_t Find (const char dll[], const char function[]) const;
+            uint32_t Find (const char dll[], uint16_t ordinal) const;
+    };
+
+    // The index of a loaded module, built the first time it is asked for.
+    const Index& ForModule (const void* module);
+
+} // namespace imports
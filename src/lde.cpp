@@ -0,0 +1,337 @@
+﻿// Copyright (c) 2015, Johan Sköld
+// License: https://opensource.org/licenses/ISC
+
+#include "stdafx.h"
+#include "lde.h"
+
+namespace lde {
+
+    ///
+    // Tables
+    ///
+
+    // The longest encoding the CPU accepts.
+    const size_t MAX_LENGTH = 15;
+
+    // What follows an opcode. The opcodes that don't fit any of these are handled in `Decode`.
+    enum Class : uint8_t {
+        X,      // Invalid in 64-bit mode
+        N,      // Nothing
+        M,      // ModRM
+        MB,     // ModRM, imm8
+        MZ,     // ModRM, imm16/32
+        B,      // imm8
+        W,      // imm16
+        Z,      // imm16/32
+        V,      // imm16/32/64, for mov r, imm
+        GB,     // ModRM, imm8 for /0 and /1 only (test)
+        GZ,     // ModRM, imm16/32 for /0 and /1 only (test)
+        MI,     // ModRM, indirect branch for /2 to /5
+        JC,     // jcc rel8
+        JCZ,    // jcc rel32
+        JB,     // jmp rel8
+        JZ,     // jmp rel32
+        CZ,     // call rel32
+        LB,     // loop rel8
+        R,      // ret
+        RW,     // ret imm16
+        P,      // Prefix
+        S,      // Special
+    };
+
+    struct ClassInfo {
+        bool modrm;
+        uint8_t imm[3];     // Immediate size with no operand size override, 66 and REX.W
+        Branch branch;
+    };
+
+    static const ClassInfo CLASSES[] = {
+        { false, { 0, 0, 0 }, Branch::None },           // X
+        { false, { 0, 0, 0 }, Branch::None },           // N
+        { true,  { 0, 0, 0 }, Branch::None },           // M
+        { true,  { 1, 1, 1 }, Branch::None },           // MB
+        { true,  { 4, 2, 4 }, Branch::None },           // MZ
+        { false, { 1, 1, 1 }, Branch::None },           // B
+        { false, { 2, 2, 2 }, Branch::None },           // W
+        { false, { 4, 2, 4 }, Branch::None },           // Z
+        { false, { 4, 2, 8 }, Branch::None },           // V
+        { true,  { 1, 1, 1 }, Branch::None },           // GB
+        { true,  { 4, 2, 4 }, Branch::None },           // GZ
+        { true,  { 0, 0, 0 }, Branch::Indirect },       // MI
+        { false, { 1, 1, 1 }, Branch::Conditional },    // JC
+        { false, { 4, 2, 4 }, Branch::Conditional },    // JCZ
+        { false, { 1, 1, 1 }, Branch::Jump },           // JB
+        { false, { 4, 2, 4 }, Branch::Jump },           // JZ
+        { false, { 4, 2, 4 }, Branch::Call },           // CZ
+        { false, { 1, 1, 1 }, Branch::Loop },           // LB
+        { false, { 0, 0, 0 }, Branch::Return },         // R
+        { false, { 2, 2, 2 }, Branch::Return },         // RW
+        { false, { 0, 0, 0 }, Branch::None },           // P
+        { false, { 0, 0, 0 }, Branch::None },           // S
+    };
+
+    static const uint8_t ONE_BYTE[256] = {
+    //  0   1   2   3   4   5   6   7   8   9   a   b   c   d   e   f
+        M,  M,  M,  M,  B,  Z,  X,  X,  M,  M,  M,  M,  B,  Z,  X,  S,  // 0
+        M,  M,  M,  M,  B,  Z,  X,  X,  M,  M,  M,  M,  B,  Z,  X,  X,  // 1
+        M,  M,  M,  M,  B,  Z,  P,  X,  M,  M,  M,  M,  B,  Z,  P,  X,  // 2
+        M,  M,  M,  M,  B,  Z,  P,  X,  M,  M,  M,  M,  B,  Z,  P,  X,  // 3
+        P,  P,  P,  P,  P,  P,  P,  P,  P,  P,  P,  P,  P,  P,  P,  P,  // 4
+        N,  N,  N,  N,  N,  N,  N,  N,  N,  N,  N,  N,  N,  N,  N,  N,  // 5
+        X,  X,  S,  M,  P,  P,  P,  P,  Z,  MZ, B,  MB, N,  N,  N,  N,  // 6
+        JC, JC, JC, JC, JC, JC, JC, JC, JC, JC, JC, JC, JC, JC, JC, JC, // 7
+        MB, MZ, X,  MB, M,  M,  M,  M,  M,  M,  M,  M,  M,  M,  M,  S,  // 8
+        N,  N,  N,  N,  N,  N,  N,  N,  N,  N,  X,  N,  N,  N,  N,  N,  // 9
+        S,  S,  S,  S,  N,  N,  N,  N,  B,  Z,  N,  N,  N,  N,  N,  N,  // a
+        B,  B,  B,  B,  B,  B,  B,  B,  V,  V,  V,  V,  V,  V,  V,  V,  // b
+        MB, MB, RW, R,  S,  S,  MB, MZ, S,  N,  RW, R,  N,  B,  X,  N,  // c
+        M,  M,  M,  M,  X,  X,  X,  N,  M,  M,  M,  M,  M,  M,  M,  M,  // d
+        LB, LB, LB, LB, B,  B,  B,  B,  CZ, JZ, X,  JB, N,  N,  N,  N,  // e
+        P,  N,  P,  P,  N,  N,  GB, GZ, N,  N,  N,  N,  N,  N,  M,  MI, // f
+    };
+
+    // 0f xx. The 0f 38 and 0f 3a maps are regular enough not to need tables of their own.
+    static const uint8_t TWO_BYTE[256] = {
+    //  0   1   2   3   4   5   6   7   8   9   a   b   c   d   e   f
+        M,  M,  M,  M,  X,  N,  N,  N,  N,  N,  X,  N,  X,  M,  N,  MB, // 0
+        M,  M,  M,  M,  M,  M,  M,  M,  M,  M,  M,  M,  M,  M,  M,  M,  // 1
+        M,  M,  M,  M,  X,  X,  X,  X,  M,  M,  M,  M,  M,  M,  M,  M,  // 2
+        N,  N,  N,  N,  N,  N,  X,  N,  S,  X,  S,  X,  X,  X,  X,  X,  // 3
+        M,  M,  M,  M,  M,  M,  M,  M,  M,  M,  M,  M,  M,  M,  M,  M,  // 4
+        M,  M,  M,  M,  M,  M,  M,  M,  M,  M,  M,  M,  M,  M,  M,  M,  // 5
+        M,  M,  M,  M,  M,  M,  M,  M,  M,  M,  M,  M,  M,  M,  M,  M,  // 6
+        MB, MB, MB, MB, M,  M,  M,  N,  M,  M,  X,  X,  M,  M,  M,  M,  // 7
+        JCZ,JCZ,JCZ,JCZ,JCZ,JCZ,JCZ,JCZ,JCZ,JCZ,JCZ,JCZ,JCZ,JCZ,JCZ,JCZ,// 8
+        M,  M,  M,  M,  M,  M,  M,  M,  M,  M,  M,  M,  M,  M,  M,  M,  // 9
+        N,  N,  N,  M,  MB, M,  M,  M,  N,  N,  N,  M,  MB, M,  M,  M,  // a
+        M,  M,  M,  M,  M,  M,  M,  M,  M,  M,  MB, M,  M,  M,  M,  M,  // b
+        M,  M,  MB, M,  MB, MB, MB, M,  N,  N,  N,  N,  N,  N,  N,  N,  // c
+        M,  M,  M,  M,  M,  M,  M,  M,  M,  M,  M,  M,  M,  M,  M,  M,  // d
+        M,  M,  M,  M,  M,  M,  M,  M,  M,  M,  M,  M,  M,  M,  M,  M,  // e
+        M,  M,  M,  M,  M,  M,  M,  M,  M,  M,  M,  M,  M,  M,  M,  M,  // f
+    };
+
+    // Opcode maps, as selected by VEX, EVEX and XOP prefixes.
+    enum Map : uint8_t {
+        MAP_ONE_BYTE,
+        MAP_0F,
+        MAP_0F38,
+        MAP_0F3A,
+        MAP_XOP8 = 8,
+        MAP_XOP9,
+        MAP_XOPA,
+    };
+
+    // Displacement size for each ModRM mod.
+    static const uint8_t DISP_SIZE[4] = { 0, 1, 4, 0 };
+
+
+    ///
+    // Locals
+    ///
+
+    static int32_t ReadSigned (const uint8_t* data, size_t size)
+    {
+        switch (size) {
+            case 1:     return *(const int8_t*)data;
+            case 2:     return *(const int16_t*)data;
+            default:    return *(const int32_t*)data;
+        }
+    }
+
+    // Everything that has more than a single opcode byte, or an operand size that the class
+    // table can't tell. Leaves `i` at the byte after the opcode.
+    static bool DecodeSpecial (const uint8_t* code,
+                               size_t         limit,
+                               bool           addrsize,
+                               size_t*        i,
+                               uint8_t*       opcode,
+                               uint8_t*       type,
+                               size_t*        imm,
+                               bool*          rexW)
+    {
+        auto at = *i;
+
+        // mov with a moffs operand, which is as wide as an address
+        if (*opcode >= 0xa0 && *opcode <= 0xa3) {
+            *type = N;
+            *imm = addrsize ? 4 : 8;
+            return true;
+        }
+
+        // enter imm16, imm8
+        if (*opcode == 0xc8) {
+            *type = N;
+            *imm = 3;
+            return true;
+        }
+
+        if (*opcode == 0x0f) {
+            if (at >= limit) {
+                return false;
+            }
+
+            *opcode = code[at++];
+            *type = TWO_BYTE[*opcode];
+
+            if (*opcode == 0x38 || *opcode == 0x3a) {
+                if (at >= limit) {
+                    return false;
+                }
+
+                *type = *opcode == 0x38 ? M : MB;
+                *opcode = code[at++];
+            }
+
+            *i = at;
+            return true;
+        }
+
+        // pop r/m shares its opcode with XOP, which always has a non-zero reg field there.
+        if (*opcode == 0x8f && (at >= limit || (code[at] & 0x38) == 0)) {
+            *type = M;
+            return true;
+        }
+
+        // VEX, EVEX and XOP put the rest of the prefixes and the opcode map in a payload.
+        const size_t payload = *opcode == 0xc5 ? 1 : *opcode == 0x62 ? 3 : 2;
+        if (at + payload >= limit) {
+            return false;
+        }
+
+        Map map;
+        if (*opcode == 0xc5) {
+            map = MAP_0F;
+        } else if (*opcode == 0x62) {
+            map = (Map)(code[at] & 0x07);
+            *rexW = (code[at + 1] & 0x80) != 0;
+        } else {
+            map = (Map)(code[at] & 0x1f);
+            *rexW = (code[at + 1] & 0x80) != 0;
+        }
+
+        at += payload;
+        *opcode = code[at++];
+
+        switch (map) {
+            case MAP_ONE_BYTE:  return false;
+            case MAP_0F:        *type = TWO_BYTE[*opcode]; break;
+            case MAP_0F3A:
+            case MAP_XOP8:      *type = MB; break;
+            case MAP_XOPA:      *type = M; *imm = 4; break;
+            default:            *type = M; break;
+        }
+
+        // Only the legacy encodings of the two-byte map have branches.
+        if (*type == JCZ) {
+            return false;
+        }
+
+        *i = at;
+        return true;
+    }
+
+
+    ///
+    // Decoding
+    ///
+
+    size_t Decode (const uint8_t* code, size_t limit, Instruction* insn)
+    {
+        *insn = {};
+        limit = (std::min)(limit, MAX_LENGTH);
+
+        auto opsize = false;
+        auto addrsize = false;
+        auto rexW = false;
+        size_t i = 0;
+
+        // Legacy prefixes may come in any order, but REX only counts right before the opcode.
+        for (;; ++i) {
+            if (i >= limit) {
+                return 0;
+            }
+
+            const auto prefix = code[i];
+            if (ONE_BYTE[prefix] != P) {
+                break;
+            }
+
+            if ((prefix & 0xf0) == 0x40) {
+                rexW = (prefix & 0x08) != 0;
+                continue;
+            }
+
+            opsize |= prefix == 0x66;
+            addrsize |= prefix == 0x67;
+            rexW = false;
+        }
+
+        auto opcode = code[i++];
+        auto type = ONE_BYTE[opcode];
+        size_t imm = 0;
+
+        if (type == S && !DecodeSpecial(code, limit, addrsize, &i, &opcode, &type, &imm, &rexW)) {
+            return 0;
+        }
+
+        if (type == X) {
+            return 0;
+        }
+
+        const auto& info = CLASSES[type];
+        auto branch = info.branch;
+        imm += info.imm[rexW ? 2 : opsize ? 1 : 0];
+
+        if (info.modrm) {
+            if (i >= limit) {
+                return 0;
+            }
+
+            const auto modrm = code[i];
+            const auto mod = modrm >> 6;
+            const auto rm = modrm & 7;
+            const auto reg = (modrm >> 3) & 7;
+            const auto sib = mod != 3 && rm == 4;
+
+            if (sib && i + 1 >= limit) {
+                return 0;
+            }
+
+            // No base means a disp32, which for a missing SIB byte is relative to RIP.
+            const auto rip = mod == 0 && rm == 5;
+            const auto noBase = sib && mod == 0 && (code[i + 1] & 7) == 5;
+
+            if (rip) {
+                insn->ripOffset = (uint8_t)(i + 1);
+            }
+
+            i += 1 + sib + DISP_SIZE[mod] + (rip || noBase ? 4 : 0);
+
+            if ((type == GB || type == GZ) && reg >= 2) {
+                imm = 0;
+            }
+
+            if (type == MI && (reg < 2 || reg > 5)) {
+                branch = Branch::None;
+            }
+        }
+
+        if (i + imm > limit) {
+            insn->ripOffset = 0;
+            return 0;
+        }
+
+        insn->length = (uint8_t)(i + imm);
+        insn->branch = branch;
+
+        if (branch != Branch::None && branch != Branch::Indirect && branch != Branch::Return) {
+            insn->relOffset = (uint8_t)i;
+            insn->relSize = (uint8_t)imm;
+            insn->rel = ReadSigned(code + i, imm);
+        }
+
+        return insn->length;
+    }
+
+} // namespace lde
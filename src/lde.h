@@ -0,0 +1,43 @@
+﻿// Copyright (c) 2015, Johan Sköld
+// License: https://opensource.org/licenses/ISC
+
+#pragma once
+
+#include <cstdint>
+
+// Length decoder for x64 code. It only looks at as much of each instruction as it takes to find
+// where it ends, which branch it is, and where its RIP-relative displacement is, using a couple
+// of small opcode tables. That is all the hook engine needs to know to copy code around, and it
+// gets there far quicker than a full disassembler. Nothing is allocated.
+namespace lde {
+
+    enum class Branch : uint8_t {
+        None,
+        Jump,           // jmp rel8/rel32
+        Conditional,    // jcc rel8/rel32
+        Call,           // call rel32
+        Loop,           // loop, loope, loopne and jrcxz, which only have a rel8 form
+        Indirect,       // jmp/call through a register or memory
+        Return,
+    };
+
+    struct Instruction {
+        uint8_t length;
+        Branch branch;
+        uint8_t relOffset;      // Offset of the displacement of a relative branch, or 0
+        uint8_t relSize;        // Size of that displacement: 1, 2 or 4
+        uint8_t ripOffset;      // Offset of the disp32 of a [rip+disp32] operand, or 0
+        int32_t rel;            // The branch displacement, sign extended
+    };
+
+    // Decodes the instruction at `code` without reading more than `limit` bytes. Returns its
+    // length, or 0 if the bytes aren't a valid instruction or it doesn't fit within `limit`.
+    size_t Decode (const uint8_t* code, size_t limit, Instruction* insn);
+
+    // Where a relative branch decoded from `code` goes.
+    inline const uint8_t* BranchTarget (const uint8_t* code, const Instruction& insn)
+    {
+        return code + insn.length + insn.rel;
+    }
+
+} // namespace lde
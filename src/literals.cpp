@@ -0,0 +1,158 @@
+﻿// Copyright (c) 2015, Johan Sköld
+// License: https://opensource.org/licenses/ISC
+
+#include "stdafx.h"
+#include "literals.h"
+
+#include "pe.h"
+#include "util.h"
+#include "xref.h"
+
+namespace literals {
+
+    ///
+    // Statics
+    ///
+
+    // Shorter runs are mostly other data that just happens to be printable.
+    const size_t MIN_LENGTH = 4;
+
+
+    ///
+    // Locals
+    ///
+
+    static bool IsText (uint32_t c)
+    {
+        return (c >= 0x20 && c < 0x7f) || c == '\t' || c == '\r' || c == '\n';
+    }
+
+    template <class Map, class Key>
+    static std::vector<uint32_t> FindAll (const Map& map, const Key& key)
+    {
+        std::vector<uint32_t> result;
+        auto range = map.equal_range(key);
+
+        for (auto it = range.first; it != range.second; ++it) {
+            result.push_back(it->second);
+        }
+
+        return result;
+    }
+
+
+    ///
+    // Index
+    ///
+
+    void Index::Build (const pe::Image& image, const xref::Index& code)
+    {
+        m_ascii.clear();
+        m_wide.clear();
+        m_code = &code;
+
+        const uint8_t* start;
+        const uint8_t* end;
+        uint32_t rva;
+
+        if (!image.SectionRange(image.Section(".rdata"), &start, &end) || !image.RvaFromPointer(start, &rva)) {
+            ERR("No .rdata section");
+            return;
+        }
+
+        // Both kinds of strings are tracked in the same pass. UTF-16 strings are only looked for at
+        // even offsets, since the compiler always aligns them.
+        const uint8_t* ascii = nullptr;
+        const uint8_t* wide = nullptr;
+
+        for (auto ptr = start; ptr < end; ++ptr) {
+            if (IsText(*ptr)) {
+                ascii = ascii ? ascii : ptr;
+            } else {
+                if (!*ptr && ascii && (size_t)(ptr - ascii) >= MIN_LENGTH) {
+                    m_ascii.emplace(std::string((const char*)ascii, (size_t)(ptr - ascii)), rva + (uint32_t)(ascii - start));
+                }
+
+                ascii = nullptr;
+            }
+
+            if ((ptr - start) % 2 || end - ptr < 2) {
+                continue;
+            }
+
+            const auto unit = (uint32_t)ptr[0] | ((uint32_t)ptr[1] << 8);
+
+            if (IsText(unit)) {
+                wide = wide ? wide : ptr;
+            } else {
+                if (!unit && wide && (size_t)(ptr - wide) / 2 >= MIN_LENGTH) {
+                    std::wstring str;
+                    for (auto c = wide; c < ptr; c += 2) {
+                        str.push_back((wchar_t)*c);
+                    }
+
+                    m_wide.emplace(std::move(str), rva + (uint32_t)(wide - start));
+                }
+
+                wide = nullptr;
+            }
+        }
+    }
+
+    size_t Index::Count () const
+    {
+        return m_ascii.size() + m_wide.size();
+    }
+
+    std::vector<uint32_t> Index::Find (const char str[]) const
+    {
+        return FindAll(m_ascii, std::string(str));
+    }
+
+    std::vector<uint32_t> Index::Find (const wchar_t str[]) const
+    {
+        return FindAll(m_wide, std::wstring(str));
+    }
+
+    std::vector<uint32_t> Index::Functions (const std::vector<uint32_t>& strings) const
+    {
+        std::vector<uint32_t> functions;
+
+        if (!m_code) {
+            return functions;
+        }
+
+        for (auto rva : strings) {
+            for (auto site : m_code->ReferencesTo(rva, xref::RefKind::Data)) {
+                if (auto function = m_code->FunctionContaining(site)) {
+                    functions.push_back(function);
+                }
+            }
+        }
+
+        std::sort(functions.begin(), functions.end());
+        functions.erase(std::unique(functions.begin(), functions.end()), functions.end());
+        return functions;
+    }
+
+    uint32_t Index::FindFunctionReferencing (const char str[]) const
+    {
+        const auto functions = Functions(Find(str));
+        if (functions.size() > 1) {
+            LOG("\"%s\" is referenced by %zu functions", str, functions.size());
+        }
+
+        return functions.size() == 1 ? functions.front() : 0;
+    }
+
+    uint32_t Index::FindFunctionReferencing (const wchar_t str[]) const
+    {
+        const auto functions = Functions(Find(str));
+        if (functions.size() > 1) {
+            LOG("\"%ls\" is referenced by %zu functions", str, functions.size());
+        }
+
+        return functions.size() == 1 ? functions.front() : 0;
+    }
+
+} // namespace literals
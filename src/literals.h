@@ -0,0 +1,43 @@
+﻿// Copyright (c) 2015, Johan Sköld
+// License: https://opensource.org/licenses/ISC
+
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace pe { class Image; }
+namespace xref { class Index; }
+
+namespace literals {
+
+    // Every null terminated ASCII and UTF-16 string in .rdata, by contents. Together with the
+    // cross-reference index this finds the functions that load a given string literal, which
+    // tends to survive game updates much better than the bytes of those functions do.
+    class Index
+    {
+        std::unordered_multimap<std::string, uint32_t> m_ascii;
+        std::unordered_multimap<std::wstring, uint32_t> m_wide;
+        const xref::Index* m_code = nullptr;    // Borrowed from Build
+
+        std::vector<uint32_t> Functions (const std::vector<uint32_t>& strings) const;
+
+        public:
+            // `code` is kept to answer FindFunctionReferencing with, so it must outlive this index,
+            // or at least the last call to that. The strings themselves are copied.
+            void Build (const pe::Image& image, const xref::Index& code);
+            size_t Count () const;
+
+            // RVAs of all copies of the string.
+            std::vector<uint32_t> Find (const char str[]) const;
+            std::vector<uint32_t> Find (const wchar_t str[]) const;
+
+            // Start of the single function that loads the string, or 0 if there's none or more
+            // than one.
+            uint32_t FindFunctionReferencing (const char str[]) const;
+            uint32_t FindFunctionReferencing (const wchar_t str[]) const;
+    };
+
+} // namespace literals
@@ -0,0 +1,649 @@
+﻿// Copyright (c) 2015, Johan Sköld
+// License: https://opensource.org/licenses/ISC
+
+#include "stdafx.h"
+#include "pattern.h"
+
+#include "util.h"
+
+
+///
+// Local helpers
+///
+
+static bool HasAvx2 ()
+{
+    static const bool s_hasAvx2 = [] {
+        int info[4];
+        __cpuid(info, 0);
+        if (info[0] < 7) {
+            return false;
+        }
+
+        // The OS must have enabled saving of the YMM registers, or we'll fault on AVX code.
+        __cpuid(info, 1);
+        const auto osxsave = (info[2] & (1 << 27)) != 0;
+        const auto avx = (info[2] & (1 << 28)) != 0;
+        if (!osxsave || !avx || (_xgetbv(0) & 6) != 6) {
+            return false;
+        }
+
+        __cpuidex(info, 7, 0);
+        return (info[1] & (1 << 5)) != 0;
+    }();
+
+    return s_hasAvx2;
+}
+
+// Ranges are split into chunks of this size when scanned by multiple threads, which keeps each
+// chunk's working set within a typical L2 cache.
+static const size_t CHUNK_SIZE = 256 * 1024;
+
+static bool HasSsse3 ()
+{
+    static const bool s_hasSsse3 = [] {
+        int info[4];
+        __cpuid(info, 1);
+        return (info[2] & (1 << 9)) != 0;
+    }();
+
+    return s_hasSsse3;
+}
+
+static size_t AlignSize (size_t size)
+{
+    return (size + 15) & ~(size_t)15;
+}
+
+
+///
+// Pattern
+///
+
+namespace hooks {
+
+    Pattern::Pattern (const char* data, const char* sMask)
+        : m_size(strlen(sMask))
+        , m_wildcard(true)
+    {
+        // The buffers are padded with wildcards up to a whole vector, so the verification step
+        // never has to deal with partial vectors.
+        m_bytes.resize(AlignSize(m_size));
+        m_mask.resize(AlignSize(m_size));
+        m_anchors[0] = 0;
+        m_anchors[1] = 0;
+
+        for (size_t i = 0; i < m_size; ++i) {
+            if (sMask[i] != 'x') {
+                continue;
+            }
+
+            m_bytes[i] = (uint8_t)data[i];
+            m_mask[i] = 0xff;
+
+            // Keep the two rarest bytes as anchors, with the rarest one first.
+            const auto frequency = detail::BYTE_FREQUENCY[m_bytes[i]];
+
+            if (m_wildcard) {
+                m_anchors[0] = i;
+                m_anchors[1] = i;
+                m_wildcard = false;
+            } else if (frequency < detail::BYTE_FREQUENCY[m_bytes[m_anchors[0]]]) {
+                m_anchors[1] = m_anchors[0];
+                m_anchors[0] = i;
+            } else if (m_anchors[1] == m_anchors[0] || frequency < detail::BYTE_FREQUENCY[m_bytes[m_anchors[1]]]) {
+                m_anchors[1] = i;
+            }
+        }
+
+        // Same shifts as `detail::SignatureSkip`, computed by walking forward so that the last
+        // byte that can match wins.
+        memset(m_skip, (int)(std::min)(m_size, (size_t)255), sizeof(m_skip));
+
+        for (size_t i = 0; i + 1 < m_size; ++i) {
+            const auto shift = (uint8_t)(std::min)(m_size - 1 - i, (size_t)255);
+
+            if (m_mask[i]) {
+                m_skip[m_bytes[i]] = shift;
+            } else {
+                memset(m_skip, shift, sizeof(m_skip));
+            }
+        }
+    }
+
+    Pattern::Pattern (const uint8_t* bytes,
+                      const uint8_t* mask,
+                      size_t         size,
+                      const size_t*  anchors,
+                      const uint8_t* skip)
+        : m_bytes(AlignSize(size))
+        , m_mask(AlignSize(size))
+        , m_size(size)
+        , m_wildcard(false)
+    {
+        // Everything has already been worked out by the compiler.
+        memcpy(m_bytes.data(), bytes, size);
+        memcpy(m_mask.data(), mask, size);
+        memcpy(m_skip, skip, sizeof(m_skip));
+        m_anchors[0] = anchors[0];
+        m_anchors[1] = anchors[1];
+    }
+
+    size_t Pattern::Size () const
+    {
+        return m_size;
+    }
+
+    uint64_t Pattern::Hash () const
+    {
+        // FNV-1a over the concrete bytes and the mask, so any change to a signature gets a
+        // new hash.
+        uint64_t hash = 0xcbf29ce484222325ull;
+
+        for (size_t i = 0; i < m_size; ++i) {
+            hash = (hash ^ (m_bytes[i] & m_mask[i])) * 0x100000001b3ull;
+            hash = (hash ^ m_mask[i]) * 0x100000001b3ull;
+        }
+
+        return hash;
+    }
+
+    bool Pattern::Matches (const uint8_t* buffer, const uint8_t* end) const
+    {
+        const auto padded = m_bytes.size();
+
+        if ((size_t)(end - buffer) >= padded) {
+            const auto zero = _mm_setzero_si128();
+
+            for (size_t i = 0; i < padded; i += 16) {
+                const auto value = _mm_loadu_si128((const __m128i*)(buffer + i));
+                const auto bytes = _mm_loadu_si128((const __m128i*)(m_bytes.data() + i));
+                const auto mask = _mm_loadu_si128((const __m128i*)(m_mask.data() + i));
+                const auto diff = _mm_and_si128(_mm_xor_si128(value, bytes), mask);
+
+                if (_mm_movemask_epi8(_mm_cmpeq_epi8(diff, zero)) != 0xffff) {
+                    return false;
+                }
+            }
+
+            return true;
+        }
+
+        for (size_t i = 0; i < m_size; ++i) {
+            if ((buffer[i] ^ m_bytes[i]) & m_mask[i]) {
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    const uint8_t* Pattern::FindScalar (const uint8_t* ptr,
+                                        const uint8_t* last,
+                                        const uint8_t* end) const
+    {
+        // Boyer-Moore-Horspool, shifting on the byte under the last byte of the pattern.
+        while (ptr <= last) {
+            if (Matches(ptr, end)) {
+                return ptr;
+            }
+
+            const auto shift = m_skip[ptr[m_size - 1]];
+            if ((size_t)(last - ptr) < shift) {
+                break;
+            }
+
+            ptr += shift;
+        }
+
+        return nullptr;
+    }
+
+    const uint8_t* Pattern::FindSse2 (const uint8_t** ptr,
+                                      const uint8_t*  last,
+                                      const uint8_t*  end) const
+    {
+        const auto first = _mm_set1_epi8((char)m_bytes[m_anchors[0]]);
+        const auto second = _mm_set1_epi8((char)m_bytes[m_anchors[1]]);
+        auto curr = *ptr;
+
+        // Every offset tested by a block must be a valid start of the full pattern, which also
+        // keeps both anchor loads inside the buffer.
+        for (; last - curr >= 15; curr += 16) {
+            const auto a = _mm_loadu_si128((const __m128i*)(curr + m_anchors[0]));
+            const auto b = _mm_loadu_si128((const __m128i*)(curr + m_anchors[1]));
+            auto bits = (uint32_t)_mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, first),
+                                                                  _mm_cmpeq_epi8(b, second)));
+
+            while (bits) {
+                unsigned long bit;
+                _BitScanForward(&bit, bits);
+
+                if (Matches(curr + bit, end)) {
+                    *ptr = curr;
+                    return curr + bit;
+                }
+
+                bits &= bits - 1;
+            }
+        }
+
+        *ptr = curr;
+        return nullptr;
+    }
+
+    TARGET("avx2")
+    const uint8_t* Pattern::FindAvx2 (const uint8_t** ptr,
+                                      const uint8_t*  last,
+                                      const uint8_t*  end) const
+    {
+        const auto first = _mm256_set1_epi8((char)m_bytes[m_anchors[0]]);
+        const auto second = _mm256_set1_epi8((char)m_bytes[m_anchors[1]]);
+        const uint8_t* result = nullptr;
+        auto curr = *ptr;
+
+        for (; !result && last - curr >= 31; curr += 32) {
+            const auto a = _mm256_loadu_si256((const __m256i*)(curr + m_anchors[0]));
+            const auto b = _mm256_loadu_si256((const __m256i*)(curr + m_anchors[1]));
+            auto bits = (uint32_t)_mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(a, first),
+                                                                        _mm256_cmpeq_epi8(b, second)));
+
+            while (bits) {
+                unsigned long bit;
+                _BitScanForward(&bit, bits);
+
+                if (Matches(curr + bit, end)) {
+                    result = curr + bit;
+                    break;
+                }
+
+                bits &= bits - 1;
+            }
+        }
+
+        // Avoid AVX->SSE transition penalties in whatever runs after us.
+        _mm256_zeroupper();
+
+        *ptr = curr;
+        return result;
+    }
+
+    const uint8_t* Pattern::Find (const uint8_t* start, const uint8_t* end) const
+    {
+        if (end < start || (size_t)(end - start) < m_size) {
+            return nullptr;
+        }
+
+        if (m_wildcard) {
+            return start;
+        }
+
+        // Last offset where the whole pattern still fits within the range.
+        const auto last = end - m_size;
+        auto ptr = start;
+        const uint8_t* result = nullptr;
+
+        if (HasAvx2()) {
+            result = FindAvx2(&ptr, last, end);
+        }
+
+        if (!result) {
+            result = FindSse2(&ptr, last, end);
+        }
+
+        return result ? result : FindScalar(ptr, last, end);
+    }
+
+    const uint8_t* Pattern::Find (const uint8_t* start, const uint8_t* end, size_t threads) const
+    {
+        if (threads <= 1 || end <= start || (size_t)(end - start) <= CHUNK_SIZE) {
+            return Find(start, end);
+        }
+
+        // Every chunk is extended by the pattern size minus one, so it finds all matches that
+        // *start* inside of it. Once a chunk has found a match, the chunks after it can be
+        // skipped, as the lowest address must be in that chunk or an earlier one.
+        const auto size = (size_t)(end - start);
+        const auto numChunks = (size + CHUNK_SIZE - 1) / CHUNK_SIZE;
+        std::vector<const uint8_t*> results(numChunks, nullptr);
+        std::atomic<size_t> first(numChunks);
+
+        ParallelFor(numChunks, threads, [&] (size_t i) {
+            if (i > first.load()) {
+                return;
+            }
+
+            const auto chunk = start + i * CHUNK_SIZE;
+            const auto length = (std::min)(CHUNK_SIZE + (std::max)(m_size, (size_t)1) - 1, (size_t)(end - chunk));
+            results[i] = Find(chunk, chunk + length);
+
+            if (results[i]) {
+                auto prev = first.load();
+                while (i < prev && !first.compare_exchange_weak(prev, i)) { }
+            }
+        });
+
+        for (auto result : results) {
+            if (result) {
+                return result;
+            }
+        }
+
+        return nullptr;
+    }
+
+    std::vector<const uint8_t*> Pattern::FindAll (const uint8_t* start, const uint8_t* end, size_t threads) const
+    {
+        std::vector<const uint8_t*> matches;
+        if (end < start || (size_t)(end - start) < m_size) {
+            return matches;
+        }
+
+        // Same chunking as `Find`, except that no chunk can be skipped. Each chunk only reports
+        // the matches that start inside of it, so none are reported twice.
+        const auto size = (size_t)(end - start);
+        const auto numChunks = (size + CHUNK_SIZE - 1) / CHUNK_SIZE;
+        std::vector<std::vector<const uint8_t*> > results(numChunks);
+
+        ParallelFor(numChunks, threads, [&] (size_t i) {
+            const auto chunk = start + i * CHUNK_SIZE;
+            const auto chunkEnd = chunk + (std::min)(CHUNK_SIZE, (size_t)(end - chunk));
+            const auto term = chunk + (std::min)(CHUNK_SIZE + (std::max)(m_size, (size_t)1) - 1, (size_t)(end - chunk));
+            auto ptr = chunk;
+
+            while (ptr < chunkEnd) {
+                const auto match = Find(ptr, term);
+                if (!match || match >= chunkEnd) {
+                    break;
+                }
+
+                results[i].emplace_back(match);
+                ptr = match + 1;
+            }
+        });
+
+        for (const auto& result : results) {
+            matches.insert(matches.end(), result.begin(), result.end());
+        }
+
+        return matches;
+    }
+
+} // namespace hooks
+
+
+///
+// PatternBatch
+///
+
+namespace hooks {
+
+    size_t PatternBatch::Add (const Pattern& pattern)
+    {
+        m_patterns.emplace_back(pattern);
+        m_results.emplace_back();
+        m_filter.clear();
+        return m_patterns.size() - 1;
+    }
+
+    size_t PatternBatch::Add (const char* data, const char* sMask)
+    {
+        return Add(Pattern(data, sMask));
+    }
+
+    size_t PatternBatch::Count () const
+    {
+        return m_patterns.size();
+    }
+
+    void PatternBatch::Build ()
+    {
+        const size_t numKeys = 0x10000;
+
+        m_filter.assign(numKeys / 64, 0);
+        m_buckets.assign(numKeys + 1, 0);
+        m_entries.clear();
+        m_unkeyed.clear();
+        m_maxOffset = 0;
+        memset(m_nibbles, 0, sizeof(m_nibbles));
+
+        // Pick the rarest pair of adjacent concrete bytes in every pattern as its key. The key
+        // is read as a little endian 16-bit value, so it matches an unaligned load at the key's
+        // offset.
+        std::vector<uint32_t> keys(m_patterns.size());
+
+        for (size_t i = 0; i < m_patterns.size(); ++i) {
+            const auto& pattern = m_patterns[i];
+            auto best = (size_t)-1;
+            auto bestFrequency = 0u;
+
+            for (size_t j = 0; j + 1 < pattern.m_size; ++j) {
+                if (!pattern.m_mask[j] || !pattern.m_mask[j + 1]) {
+                    continue;
+                }
+
+                const auto frequency = (unsigned)detail::BYTE_FREQUENCY[pattern.m_bytes[j]] + detail::BYTE_FREQUENCY[pattern.m_bytes[j + 1]];
+                if (best == (size_t)-1 || frequency < bestFrequency) {
+                    best = j;
+                    bestFrequency = frequency;
+                }
+            }
+
+            if (best == (size_t)-1) {
+                m_unkeyed.emplace_back((uint32_t)i);
+                keys[i] = (uint32_t)numKeys;
+                continue;
+            }
+
+            const auto key = (uint32_t)pattern.m_bytes[best] | ((uint32_t)pattern.m_bytes[best + 1] << 8);
+            m_filter[key / 64] |= 1ull << (key % 64);
+
+            // Nibble masks for the vector prefilter. Patterns are spread over eight groups, and
+            // a position is only probed if both key bytes can belong to the same group.
+            const auto group = (uint8_t)(1 << (i % 8));
+            m_nibbles[0][pattern.m_bytes[best] & 0xf] |= group;
+            m_nibbles[1][pattern.m_bytes[best] >> 4] |= group;
+            m_nibbles[2][pattern.m_bytes[best + 1] & 0xf] |= group;
+            m_nibbles[3][pattern.m_bytes[best + 1] >> 4] |= group;
+            ++m_buckets[key + 1];
+            keys[i] = key;
+            m_entries.push_back({ (uint32_t)i, (uint32_t)best });
+        }
+
+        // Turn the counts into offsets, and sort the entries into their buckets.
+        for (size_t key = 0; key < numKeys; ++key) {
+            m_buckets[key + 1] += m_buckets[key];
+        }
+
+        std::vector<Entry> sorted(m_entries.size());
+        std::vector<uint32_t> next(m_buckets.begin(), m_buckets.end() - 1);
+
+        for (const auto& entry : m_entries) {
+            sorted[next[keys[entry.pattern]]++] = entry;
+            m_maxOffset = (std::max)(m_maxOffset, (size_t)entry.offset);
+        }
+
+        m_entries = std::move(sorted);
+    }
+
+    void PatternBatch::Probe (const uint8_t* ptr,
+                              const uint8_t* chunk,
+                              const uint8_t* chunkEnd,
+                              const uint8_t* end,
+                              ResultList&    results) const
+    {
+        const auto key = *(const uint16_t*)ptr;
+        if (!(m_filter[key / 64] & (1ull << (key % 64)))) {
+            return;
+        }
+
+        for (auto i = m_buckets[key]; i < m_buckets[key + 1]; ++i) {
+            const auto& entry = m_entries[i];
+            const auto& pattern = m_patterns[entry.pattern];
+
+            if ((size_t)(ptr - chunk) < entry.offset) {
+                continue;
+            }
+
+            const auto candidate = ptr - entry.offset;
+            if (candidate >= chunkEnd || (size_t)(end - candidate) < pattern.m_size) {
+                continue;
+            }
+
+            auto& result = results[entry.pattern];
+            const auto begin = __rdtsc();
+
+            if (pattern.Matches(candidate, end)) {
+                result.matches.emplace_back((uintptr_t)candidate);
+            }
+
+            result.stats.candidates += 1;
+            result.stats.cycles += __rdtsc() - begin;
+        }
+    }
+
+    TARGET("ssse3")
+    void PatternBatch::ScanChunk (const uint8_t* chunk,
+                                  const uint8_t* chunkEnd,
+                                  const uint8_t* end,
+                                  ResultList&    results) const
+    {
+        // Only matches starting inside the chunk are reported, but their keys may lie up to the
+        // largest key offset past the end of it.
+        const auto keyEnd = (size_t)(end - chunkEnd) > m_maxOffset ? chunkEnd + m_maxOffset + 1 : end;
+        auto ptr = chunk;
+
+        if (HasSsse3()) {
+            // Look up the low and high nibble of both key bytes with `pshufb`, and only probe the
+            // positions where all four agree on at least one group.
+            const auto lowBits = _mm_set1_epi8(0x0f);
+            const auto lo0 = _mm_loadu_si128((const __m128i*)m_nibbles[0]);
+            const auto hi0 = _mm_loadu_si128((const __m128i*)m_nibbles[1]);
+            const auto lo1 = _mm_loadu_si128((const __m128i*)m_nibbles[2]);
+            const auto hi1 = _mm_loadu_si128((const __m128i*)m_nibbles[3]);
+            const auto zero = _mm_setzero_si128();
+
+            for (; keyEnd - ptr >= 17; ptr += 16) {
+                const auto first = _mm_loadu_si128((const __m128i*)ptr);
+                const auto second = _mm_loadu_si128((const __m128i*)(ptr + 1));
+
+                const auto groups0 = _mm_and_si128(_mm_shuffle_epi8(lo0, _mm_and_si128(first, lowBits)),
+                                                   _mm_shuffle_epi8(hi0, _mm_and_si128(_mm_srli_epi16(first, 4), lowBits)));
+                const auto groups1 = _mm_and_si128(_mm_shuffle_epi8(lo1, _mm_and_si128(second, lowBits)),
+                                                   _mm_shuffle_epi8(hi1, _mm_and_si128(_mm_srli_epi16(second, 4), lowBits)));
+
+                auto bits = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(groups0, groups1), zero)) ^ 0xffff;
+
+                while (bits) {
+                    unsigned long bit;
+                    _BitScanForward(&bit, bits);
+                    Probe(ptr + bit, chunk, chunkEnd, end, results);
+                    bits &= bits - 1;
+                }
+            }
+        }
+
+        for (; ptr + 1 < keyEnd; ++ptr) {
+            Probe(ptr, chunk, chunkEnd, end, results);
+        }
+
+        // Patterns without two adjacent concrete bytes are rare enough that they don't get
+        // their own pass through the filter.
+        for (auto index : m_unkeyed) {
+            const auto& pattern = m_patterns[index];
+            const auto overlap = (std::max)(pattern.m_size, (size_t)1) - 1;
+            const auto term = (size_t)(end - chunkEnd) > overlap ? chunkEnd + overlap : end;
+            auto& result = results[index];
+            const auto begin = __rdtsc();
+            auto ptr = chunk;
+
+            while (auto match = pattern.Find(ptr, term)) {
+                // Matches starting in the overlap belong to the next chunk.
+                if (match >= chunkEnd) {
+                    break;
+                }
+
+                result.matches.emplace_back((uintptr_t)match);
+                result.stats.candidates += 1;
+                ptr = match + 1;
+            }
+
+            result.stats.cycles += __rdtsc() - begin;
+        }
+    }
+
+    void PatternBatch::Scan (uintptr_t address, uintptr_t term, size_t threads)
+    {
+        if (m_filter.empty()) {
+            Build();
+        }
+
+        for (auto& result : m_results) {
+            result = Result();
+        }
+
+        const auto start = (const uint8_t*)address;
+        const auto end = (const uint8_t*)term;
+
+        if (end <= start) {
+            return;
+        }
+
+        const auto size = (size_t)(end - start);
+
+        if (threads <= 1 || size <= CHUNK_SIZE) {
+            ScanChunk(start, end, end, m_results);
+            return;
+        }
+
+        // Chunks are merged back in order, which keeps the matches of every pattern sorted by
+        // address exactly like a serial scan would.
+        const auto numChunks = (size + CHUNK_SIZE - 1) / CHUNK_SIZE;
+        std::vector<ResultList> results(numChunks, ResultList(m_patterns.size()));
+
+        ParallelFor(numChunks, threads, [&] (size_t i) {
+            const auto chunk = start + i * CHUNK_SIZE;
+            const auto chunkEnd = chunk + (std::min)(CHUNK_SIZE, (size_t)(end - chunk));
+            ScanChunk(chunk, chunkEnd, end, results[i]);
+        });
+
+        for (const auto& chunkResults : results) {
+            for (size_t i = 0; i < chunkResults.size(); ++i) {
+                const auto& result = chunkResults[i];
+                m_results[i].matches.insert(m_results[i].matches.end(), result.matches.begin(), result.matches.end());
+                m_results[i].stats.candidates += result.stats.candidates;
+                m_results[i].stats.cycles += result.stats.cycles;
+            }
+        }
+    }
+
+    const std::vector<uintptr_t>& PatternBatch::Matches (size_t id) const
+    {
+        return m_results[id].matches;
+    }
+
+    const PatternStats& PatternBatch::Stats (size_t id) const
+    {
+        return m_results[id].stats;
+    }
+
+} // namespace hooks
+
+
+///
+// Functions
+///
+
+namespace hooks {
+
+    uintptr_t FindPattern (uintptr_t   address,
+                           uintptr_t   term,
+                           const char* data,
+                           const char* sMask,
+                           size_t      threads)
+    {
+        const Pattern pattern(data, sMask);
+        return (uintptr_t)pattern.Find((const uint8_t*)address, (const uint8_t*)term, threads);
+    }
+
+} // namespace hooks
@@ -0,0 +1,245 @@
+﻿// Copyright (c) 2015, Johan Sköld
+// License: https://opensource.org/licenses/ISC
+
+#pragma once
+
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+namespace hooks {
+
+    ///
+    // Signature helpers
+    ///
+
+    namespace detail {
+
+        // Approximate frequency of each byte value in optimized x64 code, on a logarithmic 0-255
+        // scale. Only the relative order matters; it is used to pick the bytes of a signature that
+        // are least likely to show up by chance.
+        constexpr uint8_t BYTE_FREQUENCY[256] = {
+            255, 175, 119,  96, 124, 101,  66,  74, 148,  44,  37,  29,  56,  61,  45, 193,
+            137,  84,  30,  30,  51,  47,  24,  23, 109,  30,  19,  18,  32,  28,  11, 127,
+            117,  23,  11,  11, 193,  52,   8,  10,  97,  88,  15,  39,  28,  28,  56,  12,
+            101, 111,   4,  16,  41,  63,  12,  10,  80, 131,  16,  51,  73,  78,  19,  34,
+            123, 148,  40,  84, 151, 104,  49,  60, 237, 144,  23,  28, 169, 101,  18,  23,
+             97,  17,  20,  75,  93,  85,  49,  46,  70,  14,  10,  76,  80,  88,  48,  46,
+             82,   0,   3,  37,  58,  20, 129,  11,  69,  10,  23,  28,  64,  27,  42,  62,
+            110,   9,  26,  45, 139, 106,  42,  30,  65,  16,  15,  54,  97,  58,  37,  65,
+            107,  64,  28, 148, 165, 163,  33,  41,  71, 206,   5, 200,  39, 157,  19,  22,
+            101,   7,  25,  16,  55,  39,  18,   9,  48,  60,   7,  14,  35,  35,  10,   4,
+             61,   2,   1,  14,  26,  16,  24,   7,  45,  11,  25,  12,  44,  15,   5,  26,
+             59,   6,   2,  13,  45,  40,  70,  74,  83,  53,  83,  33,  77,  70,  91,  84,
+            142,  85,  68, 112,  78,  72, 101, 128,  61,  53,  29,  16, 210,  23,  30,  37,
+             84,  37,  81,  43,  30,  33,  32,  30,  62,  25,  41,  54,  24,  34,  56,  92,
+             78,  33,  52,  28,  47,  32,  55,  70, 177, 137,  54,  81,  66,  64,  68,  96,
+             79,  37,  53,  63,  39,  47,  94,  78,  94,  61,  79,  77,  81,  97, 118, 228,
+        };
+
+        // These are all evaluated by the compiler. Anything that isn't a valid signature ends up
+        // evaluating a `throw`, which turns the signature's definition into a compile error.
+
+        constexpr uint8_t SignatureNibble (char c)
+        {
+            return (c >= '0' && c <= '9') ? (uint8_t)(c - '0')
+                 : (c >= 'A' && c <= 'F') ? (uint8_t)(c - 'A' + 10)
+                 : (c >= 'a' && c <= 'f') ? (uint8_t)(c - 'a' + 10)
+                 : throw "signature contains an invalid hex digit";
+        }
+
+        constexpr bool SignatureWildcard (const char* str, size_t i)
+        {
+            return (str[i * 3 + 2] != ' ' && str[i * 3 + 2] != '\0') ? throw "signature bytes must be separated by single spaces"
+                 : (str[i * 3] == '?' && str[i * 3 + 1] == '?') ? true
+                 : (str[i * 3] == '?' || str[i * 3 + 1] == '?') ? throw "signature wildcards must be written as ??"
+                 : false;
+        }
+
+        constexpr uint8_t SignatureByte (const char* str, size_t i)
+        {
+            return SignatureWildcard(str, i)
+                   ? (uint8_t)0
+                   : (uint8_t)((SignatureNibble(str[i * 3]) << 4) | SignatureNibble(str[i * 3 + 1]));
+        }
+
+        constexpr uint8_t SignatureMask (const char* str, size_t i)
+        {
+            return SignatureWildcard(str, i) ? (uint8_t)0x00 : (uint8_t)0xff;
+        }
+
+        constexpr bool SignatureRarer (const char* str, size_t i, size_t best)
+        {
+            return best == (size_t)-1 || BYTE_FREQUENCY[SignatureByte(str, i)] < BYTE_FREQUENCY[SignatureByte(str, best)];
+        }
+
+        // Index of the rarest concrete byte in [i, n), ignoring `exclude`, or -1 if there is none.
+        constexpr size_t SignatureRarest (const char* str, size_t n, size_t exclude, size_t i = 0, size_t best = (size_t)-1)
+        {
+            return i == n
+                   ? best
+                   : SignatureRarest(str, n, exclude, i + 1, (i != exclude && !SignatureWildcard(str, i) && SignatureRarer(str, i, best)) ? i : best);
+        }
+
+        constexpr size_t SignatureAnchor (const char* str, size_t n)
+        {
+            return SignatureRarest(str, n, (size_t)-1) != (size_t)-1
+                   ? SignatureRarest(str, n, (size_t)-1)
+                   : throw "signature must contain at least one concrete byte";
+        }
+
+        constexpr size_t SignatureSecondAnchor (const char* str, size_t n)
+        {
+            return SignatureRarest(str, n, SignatureAnchor(str, n)) != (size_t)-1
+                   ? SignatureRarest(str, n, SignatureAnchor(str, n))
+                   : SignatureAnchor(str, n);
+        }
+
+        // One past the index of the last byte in [0, i) that can match `c`, or 0 if none can.
+        constexpr size_t SignatureLastMatch (const char* str, size_t i, uint8_t c)
+        {
+            return i == 0
+                   ? 0
+                   : (SignatureWildcard(str, i - 1) || SignatureByte(str, i - 1) == c) ? i : SignatureLastMatch(str, i - 1, c);
+        }
+
+        // Boyer-Moore-Horspool shift for when `c` is seen under the last byte of the signature.
+        constexpr uint8_t SignatureSkip (const char* str, size_t n, uint8_t c)
+        {
+            return (n - SignatureLastMatch(str, n - 1, c)) > 255
+                   ? (uint8_t)255
+                   : (uint8_t)(n - SignatureLastMatch(str, n - 1, c));
+        }
+
+    } // namespace detail
+
+
+    ///
+    // Signature
+    ///
+
+    // A signature compiled from an IDA style string, such as "48 8D 05 ?? ?? ?? ??". Use it
+    // through `MakeSignature` in a constexpr context, so malformed signatures fail to compile and
+    // nothing is parsed at run time.
+    template <size_t N>
+    struct Signature {
+        uint8_t bytes[N];
+        uint8_t mask[N];
+        size_t anchors[2];
+        uint8_t skip[256];
+
+        template <size_t L, size_t... I, size_t... C>
+        constexpr Signature (const char (&str)[L], std::index_sequence<I...>, std::index_sequence<C...>)
+            : bytes{ detail::SignatureByte(str, I)... }
+            , mask{ detail::SignatureMask(str, I)... }
+            , anchors{ detail::SignatureAnchor(str, N), detail::SignatureSecondAnchor(str, N) }
+            , skip{ detail::SignatureSkip(str, N, (uint8_t)C)... } { }
+    };
+
+    template <size_t L>
+    constexpr Signature<L / 3> MakeSignature (const char (&str)[L])
+    {
+        static_assert(L >= 3 && L % 3 == 0, "signature bytes must be two characters separated by single spaces");
+        return Signature<L / 3>(str, std::make_index_sequence<L / 3>(), std::make_index_sequence<256>());
+    }
+
+
+    ///
+    // Pattern
+    ///
+
+    // A byte signature with wildcards, compiled into a form that can be searched for quickly.
+    // Candidates are located by comparing the two rarest concrete bytes of the signature across a
+    // full vector of offsets at a time, and are then verified with masked vector compares.
+    class Pattern
+    {
+        std::vector<uint8_t> m_bytes;
+        std::vector<uint8_t> m_mask;
+        size_t m_size;
+        size_t m_anchors[2];
+        uint8_t m_skip[256];
+        bool m_wildcard;
+
+        friend class PatternBatch;
+
+        Pattern (const uint8_t* bytes, const uint8_t* mask, size_t size, const size_t* anchors, const uint8_t* skip);
+
+        const uint8_t* FindScalar (const uint8_t* ptr, const uint8_t* last, const uint8_t* end) const;
+        const uint8_t* FindSse2 (const uint8_t** ptr, const uint8_t* last, const uint8_t* end) const;
+        const uint8_t* FindAvx2 (const uint8_t** ptr, const uint8_t* last, const uint8_t* end) const;
+
+        public:
+            Pattern (const char* data, const char* sMask);
+
+            template <size_t N>
+            Pattern (const Signature<N>& signature)
+                : Pattern(signature.bytes, signature.mask, N, signature.anchors, signature.skip) { }
+
+            size_t Size () const;
+            uint64_t Hash () const;
+            bool Matches (const uint8_t* buffer, const uint8_t* end) const;
+            const uint8_t* Find (const uint8_t* start, const uint8_t* end) const;
+            const uint8_t* Find (const uint8_t* start, const uint8_t* end, size_t threads) const;
+            std::vector<const uint8_t*> FindAll (const uint8_t* start, const uint8_t* end, size_t threads = 1) const;
+    };
+
+
+    ///
+    // PatternBatch
+    ///
+
+    // Time spent verifying the candidate positions of a pattern during a scan. Patterns with many
+    // candidates per match are the ones that slow a scan down.
+    struct PatternStats {
+        size_t candidates = 0;
+        uint64_t cycles = 0;
+    };
+
+    // Searches for any number of patterns in a single pass over the data. Each pattern is keyed
+    // by its rarest pair of adjacent concrete bytes. Positions are first filtered 16 at a time
+    // by nibble lookups on the key bytes, and the survivors are probed in a 64k-bit filter before
+    // any pattern is compared, so the cost of a pass hardly depends on the number of patterns.
+    class PatternBatch
+    {
+        struct Entry {
+            uint32_t pattern;
+            uint32_t offset;
+        };
+
+        struct Result {
+            std::vector<uintptr_t> matches;
+            PatternStats stats;
+        };
+
+        using ResultList = std::vector<Result>;
+
+        std::vector<Pattern> m_patterns;
+        ResultList m_results;
+        std::vector<uint64_t> m_filter;
+        std::vector<uint32_t> m_buckets;
+        std::vector<Entry> m_entries;
+        std::vector<uint32_t> m_unkeyed;
+        size_t m_maxOffset = 0;
+        uint8_t m_nibbles[4][16];
+
+        void Build ();
+        void Probe (const uint8_t* ptr, const uint8_t* chunk, const uint8_t* chunkEnd, const uint8_t* end, ResultList& results) const;
+        void ScanChunk (const uint8_t* chunk, const uint8_t* chunkEnd, const uint8_t* end, ResultList& results) const;
+
+        public:
+            size_t Add (const Pattern& pattern);
+            size_t Add (const char* data, const char* sMask);
+            size_t Count () const;
+            void Scan (uintptr_t address, uintptr_t term, size_t threads = 1);
+            const std::vector<uintptr_t>& Matches (size_t id) const;
+            const PatternStats& Stats (size_t id) const;
+    };
+
+
+    ///
+    // Functions
+    ///
+
+    uintptr_t FindPattern (uintptr_t address, uintptr_t term, const char* data, const char* sMask, size_t threads = 1);
+
+} // namespace hooks
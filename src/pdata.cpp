@@ -0,0 +1,152 @@
+﻿// Copyright (c) 2015, Johan Sköld
+// License: https://opensource.org/licenses/ISC
+
+#include "stdafx.h"
+#include "pdata.h"
+
+#include "pe.h"
+#include "util.h"
+
+namespace pdata {
+
+    ///
+    // Statics
+    ///
+
+    // winnt.h only has the flags of the unwind info that RUNTIME_FUNCTION entries point at.
+    struct UnwindInfo {
+        uint8_t versionAndFlags;
+        uint8_t prologSize;
+        uint8_t codeCount;
+        uint8_t frame;
+    };
+
+    // Chains are normally only a link or two long, so anything longer is a broken image.
+    const size_t MAX_CHAIN_LENGTH = 32;
+
+
+    ///
+    // Locals
+    ///
+
+    // The entry chained to by `entry`, or null if it isn't chained.
+    static const RUNTIME_FUNCTION* Parent (const pe::Image& image, const RUNTIME_FUNCTION& entry)
+    {
+        // With the low bit set, the unwind data is another entry rather than unwind info.
+        if (entry.UnwindData & 1) {
+            return (const RUNTIME_FUNCTION*)image.FromRva(entry.UnwindData & ~1u, sizeof(RUNTIME_FUNCTION));
+        }
+
+        auto info = (const UnwindInfo*)image.FromRva(entry.UnwindData, sizeof(UnwindInfo));
+        if (!info || !((info->versionAndFlags >> 3) & UNW_FLAG_CHAININFO)) {
+            return nullptr;
+        }
+
+        // The chained entry follows the unwind codes, which are padded to an even count.
+        const auto codes = (info->codeCount + 1u) & ~1u;
+        const auto offset = sizeof(UnwindInfo) + codes * sizeof(uint16_t);
+        return (const RUNTIME_FUNCTION*)image.FromRva(entry.UnwindData + (uint32_t)offset, sizeof(RUNTIME_FUNCTION));
+    }
+
+    static uint32_t Primary (const pe::Image& image, const RUNTIME_FUNCTION& entry)
+    {
+        auto primary = &entry;
+
+        for (size_t i = 0; i < MAX_CHAIN_LENGTH; ++i) {
+            auto parent = Parent(image, *primary);
+            if (!parent) {
+                return primary->BeginAddress;
+            }
+
+            primary = parent;
+        }
+
+        return entry.BeginAddress;
+    }
+
+
+    ///
+    // Index
+    ///
+
+    void Index::Build (const pe::Image& image)
+    {
+        m_functions.clear();
+
+        size_t size = 0;
+        auto entries = (const RUNTIME_FUNCTION*)image.Directory(IMAGE_DIRECTORY_ENTRY_EXCEPTION, &size);
+
+        if (!entries) {
+            return;
+        }
+
+        std::vector<Function> functions;
+        functions.reserve(size / sizeof(RUNTIME_FUNCTION));
+
+        for (size_t i = 0; i < size / sizeof(RUNTIME_FUNCTION); ++i) {
+            const auto& entry = entries[i];
+            if (entry.EndAddress > entry.BeginAddress) {
+                functions.push_back({ entry.BeginAddress, entry.EndAddress, Primary(image, entry) });
+            }
+        }
+
+        // The linker emits them sorted, but nothing requires it to.
+        std::sort(functions.begin(), functions.end(), [] (const Function& a, const Function& b) {
+            return a.begin < b.begin;
+        });
+
+        for (const auto& function : functions) {
+            if (!m_functions.empty() && m_functions.back().end == function.begin && m_functions.back().primary == function.primary) {
+                m_functions.back().end = function.end;
+            } else {
+                m_functions.push_back(function);
+            }
+        }
+    }
+
+    size_t Index::Count () const
+    {
+        return m_functions.size();
+    }
+
+    const std::vector<Function>& Index::Functions () const
+    {
+        return m_functions;
+    }
+
+    const Function* Index::Find (uint32_t rva) const
+    {
+        auto next = std::upper_bound(m_functions.begin(), m_functions.end(), rva, [] (uint32_t value, const Function& function) {
+            return value < function.begin;
+        });
+
+        if (next == m_functions.begin()) {
+            return nullptr;
+        }
+
+        const auto& function = *(next - 1);
+        return rva < function.end ? &function : nullptr;
+    }
+
+
+    ///
+    // Functions
+    ///
+
+    const Index& ForModule (const void* module)
+    {
+        static std::mutex s_mutex;
+        static std::map<const void*, Index> s_indices;
+
+        std::lock_guard<std::mutex> lock(s_mutex);
+        auto it = s_indices.find(module);
+
+        if (it == s_indices.end()) {
+            it = s_indices.emplace(module, Index()).first;
+            it->second.Build(pe::Image(module));
+        }
+
+        return it->second;
+    }
+
+} // namespace pdata
@@ -0,0 +1,40 @@
+﻿// Copyright (c) 2015, Johan Sköld
+// License: https://opensource.org/licenses/ISC
+
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+namespace pe { class Image; }
+
+namespace pdata {
+
+    struct Function {
+        uint32_t begin;
+        uint32_t end;
+        uint32_t primary;       // Start of the function this is part of, which differs from
+                                // `begin` for code the compiler split off into its own range
+    };
+
+    // Function ranges from the exception directory of an x64 image. Every function that isn't a
+    // leaf has an entry there, so this is where to find out where most functions end. Ranges
+    // chained to another one are traced back to the function they belong to, and adjacent parts
+    // of the same function are merged. Lookups are binary searches over the sorted ranges.
+    class Index
+    {
+        std::vector<Function> m_functions;
+
+        public:
+            void Build (const pe::Image& image);
+            size_t Count () const;
+            const std::vector<Function>& Functions () const;
+
+            // The range containing `rva`, or null if there's none, such as for leaf functions.
+            const Function* Find (uint32_t rva) const;
+    };
+
+    // The index of a loaded module, built the first time it is asked for.
+    const Index& ForModule (const void* module);
+
+} // namespace pdata
@@ -0,0 +1,219 @@
+﻿// Copyright (c) 2015, Johan Sköld
+// License: https://opensource.org/licenses/ISC
+
+#include "stdafx.h"
+#include "pe.h"
+
+#include "util.h"
+
+namespace pe {
+
+    ///
+    // Image
+    ///
+
+    Image::Image (const void* module)
+        : m_data((const uint8_t*)module)
+        , m_mapped(true)
+    {
+        // The loader has already validated the headers, so they can be read before we know the
+        // size of the image.
+        auto dosHeader = (const IMAGE_DOS_HEADER*)module;
+        if (module && dosHeader->e_magic == IMAGE_DOS_SIGNATURE) {
+            auto ntHeaders = (const IMAGE_NT_HEADERS64*)(m_data + dosHeader->e_lfanew);
+            m_size = ntHeaders->OptionalHeader.SizeOfImage;
+        }
+
+        if (!Init()) {
+            ERR("Invalid image at %p", module);
+        }
+    }
+
+    Image::Image (const uint8_t* file, size_t size)
+        : m_data(file)
+        , m_size(size)
+        , m_mapped(false)
+    {
+        Init();
+    }
+
+    bool Image::Init ()
+    {
+        m_ntHeaders = nullptr;
+
+        auto dosHeader = (const IMAGE_DOS_HEADER*)m_data;
+        if (!m_data || m_size < sizeof(*dosHeader) || dosHeader->e_magic != IMAGE_DOS_SIGNATURE) {
+            return false;
+        }
+
+        if (dosHeader->e_lfanew < 0 || (size_t)dosHeader->e_lfanew + sizeof(IMAGE_NT_HEADERS64) > m_size) {
+            return false;
+        }
+
+        auto ntHeaders = (const IMAGE_NT_HEADERS64*)(m_data + dosHeader->e_lfanew);
+        if (ntHeaders->Signature != IMAGE_NT_SIGNATURE || ntHeaders->OptionalHeader.Magic != IMAGE_NT_OPTIONAL_HDR64_MAGIC) {
+            return false;
+        }
+
+        auto sections = (const uint8_t*)IMAGE_FIRST_SECTION(ntHeaders);
+        auto sectionsSize = ntHeaders->FileHeader.NumberOfSections * sizeof(IMAGE_SECTION_HEADER);
+        if (sections < m_data || (size_t)(sections - m_data) + sectionsSize > m_size) {
+            return false;
+        }
+
+        m_ntHeaders = ntHeaders;
+        m_imageBase = m_mapped ? (uint64_t)m_data : ntHeaders->OptionalHeader.ImageBase;
+        return true;
+    }
+
+    bool Image::IsValid () const
+    {
+        return m_ntHeaders != nullptr;
+    }
+
+    bool Image::IsMapped () const
+    {
+        return m_mapped;
+    }
+
+    const IMAGE_NT_HEADERS64* Image::NtHeaders () const
+    {
+        return m_ntHeaders;
+    }
+
+    uint64_t Image::ImageBase () const
+    {
+        return m_imageBase;
+    }
+
+    const uint8_t* Image::Directory (size_t index, size_t* size) const
+    {
+        if (!m_ntHeaders || index >= (std::min)((size_t)m_ntHeaders->OptionalHeader.NumberOfRvaAndSizes, (size_t)IMAGE_NUMBEROF_DIRECTORY_ENTRIES)) {
+            return nullptr;
+        }
+
+        const auto& directory = m_ntHeaders->OptionalHeader.DataDirectory[index];
+        const auto data = directory.Size ? FromRva(directory.VirtualAddress, directory.Size) : nullptr;
+
+        if (data) {
+            *size = directory.Size;
+        }
+
+        return data;
+    }
+
+    const IMAGE_SECTION_HEADER* Image::Section (const char name[]) const
+    {
+        if (!m_ntHeaders) {
+            return nullptr;
+        }
+
+        auto section = IMAGE_FIRST_SECTION(m_ntHeaders);
+
+        for (unsigned i = 0; i < m_ntHeaders->FileHeader.NumberOfSections; ++section, ++i) {
+            if (strncmp(name, (const char*)section->Name, ArraySize(section->Name)) == 0) {
+                return section;
+            }
+        }
+
+        return nullptr;
+    }
+
+    const IMAGE_SECTION_HEADER* Image::SectionFromRva (uint32_t rva) const
+    {
+        if (!m_ntHeaders) {
+            return nullptr;
+        }
+
+        auto section = IMAGE_FIRST_SECTION(m_ntHeaders);
+
+        for (unsigned i = 0; i < m_ntHeaders->FileHeader.NumberOfSections; ++section, ++i) {
+            const auto size = (std::max)(section->Misc.VirtualSize, section->SizeOfRawData);
+            if (rva >= section->VirtualAddress && rva - section->VirtualAddress < size) {
+                return section;
+            }
+        }
+
+        return nullptr;
+    }
+
+    bool Image::SectionRange (const IMAGE_SECTION_HEADER* section, const uint8_t** start, const uint8_t** end) const
+    {
+        if (!section) {
+            return false;
+        }
+
+        // Only the initialized part of a section is present in a file, while a mapped section
+        // is zero filled up to its virtual size.
+        const auto size = m_mapped ? (std::max)(section->Misc.VirtualSize, section->SizeOfRawData) : section->SizeOfRawData;
+        const auto data = FromRva(section->VirtualAddress, size);
+
+        if (!data) {
+            return false;
+        }
+
+        *start = data;
+        *end = data + size;
+        return true;
+    }
+
+    const uint8_t* Image::FromRva (uint32_t rva, size_t size) const
+    {
+        if (!m_ntHeaders) {
+            return nullptr;
+        }
+
+        size_t offset = rva;
+
+        if (!m_mapped && rva >= m_ntHeaders->OptionalHeader.SizeOfHeaders) {
+            auto section = SectionFromRva(rva);
+            if (!section || rva - section->VirtualAddress >= section->SizeOfRawData) {
+                return nullptr;
+            }
+
+            offset = section->PointerToRawData + (size_t)(rva - section->VirtualAddress);
+
+            if (size > section->SizeOfRawData - (rva - section->VirtualAddress)) {
+                return nullptr;
+            }
+        }
+
+        return (offset <= m_size && size <= m_size - offset) ? m_data + offset : nullptr;
+    }
+
+    bool Image::RvaFromPointer (const uint8_t* ptr, uint32_t* rva) const
+    {
+        if (!m_ntHeaders || ptr < m_data || (size_t)(ptr - m_data) >= m_size) {
+            return false;
+        }
+
+        const auto offset = (size_t)(ptr - m_data);
+
+        if (m_mapped || offset < m_ntHeaders->OptionalHeader.SizeOfHeaders) {
+            *rva = (uint32_t)offset;
+            return true;
+        }
+
+        auto section = IMAGE_FIRST_SECTION(m_ntHeaders);
+
+        for (unsigned i = 0; i < m_ntHeaders->FileHeader.NumberOfSections; ++section, ++i) {
+            if (offset >= section->PointerToRawData && offset - section->PointerToRawData < section->SizeOfRawData) {
+                *rva = section->VirtualAddress + (uint32_t)(offset - section->PointerToRawData);
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    bool Image::RvaFromAddress (uint64_t address, uint32_t* rva) const
+    {
+        if (!m_ntHeaders || address < m_imageBase || address - m_imageBase >= m_ntHeaders->OptionalHeader.SizeOfImage) {
+            return false;
+        }
+
+        *rva = (uint32_t)(address - m_imageBase);
+        return true;
+    }
+
+} // namespace pe
@@ -0,0 +1,61 @@
+﻿// Copyright (c) 2015, Johan Sköld
+// License: https://opensource.org/licenses/ISC
+
+#pragma once
+
+#include <cstdint>
+
+///
+// Forward declares
+///
+
+struct _IMAGE_NT_HEADERS64;
+struct _IMAGE_SECTION_HEADER;
+
+
+///
+// Pe
+///
+
+namespace pe {
+
+    // Read-only view of a PE image, either as laid out in memory by the loader or as read from
+    // disk. Everything inside is addressed by RVA, and bounds checked against the view, so a
+    // truncated or bogus file can't make us read outside of it.
+    class Image
+    {
+        const uint8_t* m_data = nullptr;
+        size_t m_size = 0;
+        bool m_mapped = false;
+        uint64_t m_imageBase = 0;
+        const _IMAGE_NT_HEADERS64* m_ntHeaders = nullptr;
+
+        bool Init ();
+
+        public:
+            Image () = default;
+            Image (const void* module);
+            Image (const uint8_t* file, size_t size);
+
+            bool IsValid () const;
+            bool IsMapped () const;
+            const _IMAGE_NT_HEADERS64* NtHeaders () const;
+
+            // Address that absolute pointers stored in the image are based on. This is where the
+            // image is loaded for mapped images, and the preferred base for files.
+            uint64_t ImageBase () const;
+
+            // Contents of one of the data directories, such as IMAGE_DIRECTORY_ENTRY_EXCEPTION.
+            const uint8_t* Directory (size_t index, size_t* size) const;
+
+            const _IMAGE_SECTION_HEADER* Section (const char name[]) const;
+            const _IMAGE_SECTION_HEADER* SectionFromRva (uint32_t rva) const;
+            bool SectionRange (const _IMAGE_SECTION_HEADER* section, const uint8_t** start, const uint8_t** end) const;
+
+            // Returns null unless all `size` bytes at `rva` are inside the image.
+            const uint8_t* FromRva (uint32_t rva, size_t size = 1) const;
+            bool RvaFromPointer (const uint8_t* ptr, uint32_t* rva) const;
+            bool RvaFromAddress (uint64_t address, uint32_t* rva) const;
+    };
+
+} // namespace pe
@@ -0,0 +1,506 @@
+﻿// Copyright (c) 2015, Johan Sköld
+// License: https://opensource.org/licenses/ISC
+
+#include "stdafx.h"
+#include "platform.h"
+
+#include "util.h"
+
+#ifndef _WIN32
+#   include <cerrno>
+#   include <cstdio>
+#   include <dirent.h>
+#   include <signal.h>
+#   include <sched.h>
+#   include <sys/mman.h>
+#   include <sys/syscall.h>
+#   include <ucontext.h>
+#   include <unistd.h>
+#endif
+
+namespace platform {
+
+#ifdef _WIN32
+
+    ///
+    // Windows
+    ///
+
+    static DWORD ToProtection (Access access)
+    {
+        switch (access) {
+            case Access::Read:              return PAGE_READONLY;
+            case Access::ReadWrite:         return PAGE_READWRITE;
+            case Access::ReadExecute:       return PAGE_EXECUTE_READ;
+            case Access::ReadWriteExecute:  return PAGE_EXECUTE_READWRITE;
+            default:                        return PAGE_NOACCESS;
+        }
+    }
+
+    static Access FromProtection (DWORD protection)
+    {
+        switch (protection & 0xff) {
+            case PAGE_READONLY:             return Access::Read;
+            case PAGE_READWRITE:
+            case PAGE_WRITECOPY:            return Access::ReadWrite;
+            case PAGE_EXECUTE:
+            case PAGE_EXECUTE_READ:         return Access::ReadExecute;
+            case PAGE_EXECUTE_READWRITE:
+            case PAGE_EXECUTE_WRITECOPY:    return Access::ReadWriteExecute;
+            default:                        return Access::None;
+        }
+    }
+
+    size_t PageSize ()
+    {
+        SYSTEM_INFO info;
+        GetSystemInfo(&info);
+        return info.dwPageSize;
+    }
+
+    size_t AllocationGranularity ()
+    {
+        SYSTEM_INFO info;
+        GetSystemInfo(&info);
+        return info.dwAllocationGranularity;
+    }
+
+    bool Query (uintptr_t address, Region* region)
+    {
+        MEMORY_BASIC_INFORMATION mbi;
+        if (!VirtualQuery((void*)address, &mbi, sizeof(mbi))) {
+            return false;
+        }
+
+        region->base = (uintptr_t)mbi.BaseAddress;
+        region->size = mbi.RegionSize;
+        region->free = mbi.State == MEM_FREE;
+        return true;
+    }
+
+    void* Reserve (uintptr_t address, size_t size, Access access)
+    {
+        return VirtualAlloc((void*)address, size, MEM_RESERVE | MEM_COMMIT, ToProtection(access));
+    }
+
+    void Release (void* block, size_t)
+    {
+        VirtualFree(block, 0, MEM_RELEASE);
+    }
+
+    bool Protect (void* address, size_t size, Access access, Access* previous)
+    {
+        DWORD protection;
+        if (!VirtualProtect(address, size, ToProtection(access), &protection)) {
+            ERR("Failed to change the protection of %p (%lu)", address, GetLastError());
+            return false;
+        }
+
+        if (previous) {
+            *previous = FromProtection(protection);
+        }
+
+        return true;
+    }
+
+    void FlushInstructionCache (const void* address, size_t size)
+    {
+        ::FlushInstructionCache(GetCurrentProcess(), address, size);
+    }
+
+    const void* ModuleFromAddress (const void* address)
+    {
+        const auto flags = GET_MODULE_HANDLE_EX_FLAG_FROM_ADDRESS | GET_MODULE_HANDLE_EX_FLAG_UNCHANGED_REFCOUNT;
+        HMODULE module;
+        return GetModuleHandleExW(flags, (LPCWSTR)address, &module) ? module : nullptr;
+    }
+
+    ThreadFreeze::ThreadFreeze ()
+    {
+        auto snapshot = CreateToolhelp32Snapshot(TH32CS_SNAPTHREAD, 0);
+        if (snapshot == INVALID_HANDLE_VALUE) {
+            ERR("Could not enumerate threads (%lu)", GetLastError());
+            return;
+        }
+
+        std::vector<DWORD> ids;
+        THREADENTRY32 entry;
+        entry.dwSize = sizeof(entry);
+
+        for (auto more = Thread32First(snapshot, &entry); more; more = Thread32Next(snapshot, &entry)) {
+            if (entry.th32OwnerProcessID == GetCurrentProcessId() && entry.th32ThreadID != GetCurrentThreadId()) {
+                ids.push_back(entry.th32ThreadID);
+            }
+        }
+
+        CloseHandle(snapshot);
+        m_threads.reserve(ids.size());
+
+        for (auto id : ids) {
+            // Threads may have exited since the snapshot was taken.
+            auto thread = OpenThread(THREAD_SUSPEND_RESUME | THREAD_GET_CONTEXT, FALSE, id);
+            if (!thread) {
+                continue;
+            }
+
+            if (SuspendThread(thread) == (DWORD)-1) {
+                CloseHandle(thread);
+                continue;
+            }
+
+            m_threads.push_back(thread);
+        }
+    }
+
+    ThreadFreeze::~ThreadFreeze ()
+    {
+        for (auto thread : m_threads) {
+            ResumeThread(thread);
+            CloseHandle(thread);
+        }
+    }
+
+    bool ThreadFreeze::IsExecuting (uintptr_t start, uintptr_t end) const
+    {
+        for (auto thread : m_threads) {
+            CONTEXT context;
+            context.ContextFlags = CONTEXT_CONTROL;
+
+            if (GetThreadContext(thread, &context) && context.Rip - start < end - start) {
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+#else
+
+    ///
+    // POSIX
+    ///
+
+    struct Mapping {
+        uintptr_t start;
+        uintptr_t end;
+        Access access;
+    };
+
+    static int ToProtection (Access access)
+    {
+        switch (access) {
+            case Access::Read:              return PROT_READ;
+            case Access::ReadWrite:         return PROT_READ | PROT_WRITE;
+            case Access::ReadExecute:       return PROT_READ | PROT_EXEC;
+            case Access::ReadWriteExecute:  return PROT_READ | PROT_WRITE | PROT_EXEC;
+            default:                        return PROT_NONE;
+        }
+    }
+
+    // The mapping containing `address`, or the first one after it. There's no call to ask for
+    // this directly, so it's looked up in /proc/self/maps.
+    static bool FindMapping (uintptr_t address, Mapping* mapping, uintptr_t* previousEnd)
+    {
+        auto file = fopen("/proc/self/maps", "r");
+        if (!file) {
+            return false;
+        }
+
+        char line[0x200];
+        auto found = false;
+        *previousEnd = 0;
+
+        while (!found && fgets(line, sizeof(line), file)) {
+            unsigned long long start, end;
+            char perms[5];
+
+            if (sscanf(line, "%llx-%llx %4s", &start, &end, perms) != 3) {
+                continue;
+            }
+
+            if (address < end) {
+                const auto write = perms[1] == 'w';
+                const auto exec = perms[2] == 'x';
+
+                mapping->start = (uintptr_t)start;
+                mapping->end = (uintptr_t)end;
+                mapping->access = perms[0] != 'r' ? Access::None
+                                : exec ? (write ? Access::ReadWriteExecute : Access::ReadExecute)
+                                : (write ? Access::ReadWrite : Access::Read);
+                found = true;
+            } else {
+                *previousEnd = (uintptr_t)end;
+            }
+        }
+
+        fclose(file);
+
+        if (!found) {
+            mapping->start = UINTPTR_MAX;
+            mapping->end = UINTPTR_MAX;
+            mapping->access = Access::None;
+        }
+
+        return true;
+    }
+
+    size_t PageSize ()
+    {
+        return (size_t)sysconf(_SC_PAGESIZE);
+    }
+
+    size_t AllocationGranularity ()
+    {
+        return PageSize();
+    }
+
+    bool Query (uintptr_t address, Region* region)
+    {
+        Mapping mapping;
+        uintptr_t previousEnd;
+
+        if (!FindMapping(address, &mapping, &previousEnd)) {
+            return false;
+        }
+
+        region->free = address < mapping.start;
+        region->base = region->free ? previousEnd : mapping.start;
+        region->size = (region->free ? mapping.start : mapping.end) - region->base;
+        return true;
+    }
+
+    void* Reserve (uintptr_t address, size_t size, Access access)
+    {
+        auto block = mmap((void*)address, size, ToProtection(access), MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE, -1, 0);
+        if (block == MAP_FAILED) {
+            return nullptr;
+        }
+
+        // Kernels without MAP_FIXED_NOREPLACE treat the address as a hint.
+        if ((uintptr_t)block != address) {
+            munmap(block, size);
+            return nullptr;
+        }
+
+        return block;
+    }
+
+    void Release (void* block, size_t size)
+    {
+        munmap(block, size);
+    }
+
+    bool Protect (void* address, size_t size, Access access, Access* previous)
+    {
+        const auto page = (uintptr_t)PageSize();
+        const auto start = (uintptr_t)address - (uintptr_t)address % page;
+
+        Mapping mapping;
+        uintptr_t previousEnd;
+
+        if (previous) {
+            *previous = FindMapping(start, &mapping, &previousEnd) && mapping.start <= start ? mapping.access : Access::None;
+        }
+
+        if (mprotect((void*)start, (uintptr_t)address + size - start, ToProtection(access)) != 0) {
+            ERR("Failed to change the protection of %p", address);
+            return false;
+        }
+
+        return true;
+    }
+
+    void FlushInstructionCache (const void*, size_t)
+    {
+        // x64 keeps its instruction cache coherent with data writes.
+    }
+
+    // Whether `base` holds the headers of a PE image that `address` is inside of. Only the first
+    // page is looked at, which is all the caller knows to be readable.
+    static bool IsImageAt (uintptr_t base, uintptr_t address)
+    {
+        const auto dosHeader = (const IMAGE_DOS_HEADER*)base;
+        if (dosHeader->e_magic != IMAGE_DOS_SIGNATURE || dosHeader->e_lfanew < 0) {
+            return false;
+        }
+
+        if ((size_t)dosHeader->e_lfanew + sizeof(IMAGE_NT_HEADERS64) > PageSize()) {
+            return false;
+        }
+
+        const auto ntHeaders = (const IMAGE_NT_HEADERS64*)(base + (uintptr_t)dosHeader->e_lfanew);
+        return ntHeaders->Signature == IMAGE_NT_SIGNATURE && address - base < ntHeaders->OptionalHeader.SizeOfImage;
+    }
+
+    const void* ModuleFromAddress (const void* address)
+    {
+        // The loader here only maps ELF files, so any PE image was mapped by hand, and the only
+        // way to find it is to walk down from the address to its headers. The walk ends at the
+        // first page that isn't mapped and readable.
+        const auto page = (uintptr_t)PageSize();
+        auto base = (uintptr_t)address & ~(page - 1);
+
+        Mapping mapping;
+        uintptr_t previousEnd;
+
+        while (FindMapping(base, &mapping, &previousEnd) && mapping.start <= base && mapping.access != Access::None) {
+            for (;; base -= page) {
+                if (IsImageAt(base, (uintptr_t)address)) {
+                    return (const void*)base;
+                }
+
+                if (base == mapping.start) {
+                    break;
+                }
+            }
+
+            if (previousEnd != mapping.start || base < page) {
+                break;
+            }
+
+            base -= page;
+        }
+
+        return nullptr;
+    }
+
+    // Threads are frozen by sending each of them a signal, whose handler notes where the thread
+    // was interrupted and then waits for the freeze to end. The signal carries the number of the
+    // freeze it's for, so one that's delivered late can't be taken as part of a later freeze.
+    // Only one freeze is done at a time.
+    static const auto FREEZE_TIMEOUT = std::chrono::seconds(1);
+
+    static std::mutex s_freezeMutex;
+    static std::atomic<int> s_freeze(0);
+    static std::atomic<bool> s_frozen(false);
+    static std::atomic<size_t> s_slots(0);
+    static std::atomic<size_t> s_arrived(0);
+    static std::atomic<size_t> s_departed(0);
+    static std::atomic<void**> s_stopped(nullptr);
+    static size_t s_capacity;
+
+    static int FreezeSignal ()
+    {
+        return SIGRTMIN;
+    }
+
+    static void OnFreeze (int, siginfo_t* info, void* context)
+    {
+        if (info->si_code != SI_QUEUE || info->si_value.sival_int != s_freeze.load()) {
+            return;
+        }
+
+        const auto saved = errno;
+        const auto rip = (void*)((const ucontext_t*)context)->uc_mcontext.gregs[REG_RIP];
+
+        // Each stopped thread takes its own slot in the list.
+        const auto slot = s_slots.fetch_add(1);
+        if (slot < s_capacity) {
+            s_stopped.load()[slot] = rip;
+        }
+
+        s_arrived.fetch_add(1, std::memory_order_release);
+
+        while (s_frozen.load(std::memory_order_acquire)) {
+            sched_yield();
+        }
+
+        s_departed.fetch_add(1);
+        errno = saved;
+    }
+
+    ThreadFreeze::ThreadFreeze ()
+    {
+        static std::once_flag s_install;
+        std::call_once(s_install, [] {
+            struct sigaction action = {};
+            action.sa_sigaction = OnFreeze;
+            action.sa_flags = SA_SIGINFO | SA_RESTART;
+            sigfillset(&action.sa_mask);
+            sigaction(FreezeSignal(), &action, nullptr);
+        });
+
+        std::vector<pid_t> ids;
+
+        if (auto tasks = opendir("/proc/self/task")) {
+            const auto self = (pid_t)syscall(SYS_gettid);
+
+            while (auto entry = readdir(tasks)) {
+                const auto id = (pid_t)atoi(entry->d_name);
+                if (id > 0 && id != self) {
+                    ids.push_back(id);
+                }
+            }
+
+            closedir(tasks);
+        } else {
+            ERR("Could not enumerate threads (%d)", errno);
+            return;
+        }
+
+        s_freezeMutex.lock();
+
+        // Where each thread stopped is written straight into the list of threads.
+        m_threads.assign(ids.size(), nullptr);
+        s_capacity = m_threads.size();
+        s_stopped.store(m_threads.data());
+        s_slots.store(0);
+        s_arrived.store(0);
+        s_departed.store(0);
+        s_frozen.store(true);
+        const auto freeze = s_freeze.fetch_add(1) + 1;
+
+        siginfo_t info = {};
+        info.si_signo = FreezeSignal();
+        info.si_code = SI_QUEUE;
+        info.si_pid = getpid();
+        info.si_uid = getuid();
+        info.si_value.sival_int = freeze;
+
+        // Threads may have exited since they were listed.
+        size_t signalled = 0;
+        for (auto id : ids) {
+            if (syscall(SYS_rt_tgsigqueueinfo, getpid(), id, FreezeSignal(), &info) == 0) {
+                ++signalled;
+            }
+        }
+
+        // Threads blocking the signal never stop, and are left running after a while, much like
+        // the Windows version leaves threads it can't open.
+        const auto deadline = std::chrono::steady_clock::now() + FREEZE_TIMEOUT;
+        while (s_arrived.load() < signalled && std::chrono::steady_clock::now() < deadline) {
+            sched_yield();
+        }
+    }
+
+    ThreadFreeze::~ThreadFreeze ()
+    {
+        if (!s_frozen.load()) {
+            return;
+        }
+
+        // Any thread still on its way into the handler will leave it right away.
+        s_freeze.fetch_add(1);
+        s_frozen.store(false, std::memory_order_release);
+
+        while (s_departed.load() < s_arrived.load()) {
+            sched_yield();
+        }
+
+        s_freezeMutex.unlock();
+    }
+
+    bool ThreadFreeze::IsExecuting (uintptr_t start, uintptr_t end) const
+    {
+        for (auto rip : m_threads) {
+            if (rip && (uintptr_t)rip - start < end - start) {
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+#endif
+
+} // namespace platform
@@ -0,0 +1,72 @@
+﻿// Copyright (c) 2015, Johan Sköld
+// License: https://opensource.org/licenses/ISC
+
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+// The little the hook engine needs from the OS: querying, reserving and protecting memory, and
+// stopping other threads while code is being rewritten. Everything is implemented for Windows,
+// and for Linux so the engine can be built and tested outside of the game (see CMakeLists.txt).
+namespace platform {
+
+    enum class Access : uint8_t {
+        None,
+        Read,
+        ReadWrite,
+        ReadExecute,
+        ReadWriteExecute,
+    };
+
+    struct Region {
+        uintptr_t base;
+        size_t size;
+        bool free;
+    };
+
+    size_t PageSize ();
+
+    // Addresses passed to `Reserve` must be aligned to this.
+    size_t AllocationGranularity ();
+
+    // The region of the address space containing `address`. For unused memory, this is all of
+    // the unused range around it.
+    bool Query (uintptr_t address, Region* region);
+
+    // Reserves and commits `size` bytes at exactly `address`, or returns null if that isn't free.
+    void* Reserve (uintptr_t address, size_t size, Access access);
+    void Release (void* block, size_t size);
+
+    // Changes the access of all pages in the range, and returns what the first of them had.
+    bool Protect (void* address, size_t size, Access access, Access* previous);
+    void FlushInstructionCache (const void* address, size_t size);
+
+    // Base of the PE image that `address` is inside of, or null if it's not in one. Outside of
+    // Windows, images are only ever mapped by hand, and are found by their headers.
+    const void* ModuleFromAddress (const void* address);
+
+
+    ///
+    // Thread freeze
+    ///
+
+    // Keeps every other thread of the process suspended for as long as it lives. Nothing may
+    // allocate while they are, since one of them may be holding the heap lock. On Linux threads
+    // are stopped by a signal, so ones blocking it are given up on after a while.
+    class ThreadFreeze
+    {
+        std::vector<void*> m_threads;   // Handles on Windows, where each thread stopped elsewhere
+
+        public:
+            ThreadFreeze ();
+            ThreadFreeze (const ThreadFreeze&) = delete;
+            ~ThreadFreeze ();
+
+            ThreadFreeze& operator= (const ThreadFreeze&) = delete;
+
+            // Whether any of the threads will continue executing at an address in [start, end).
+            bool IsExecuting (uintptr_t start, uintptr_t end) const;
+    };
+
+} // namespace platform
@@ -0,0 +1,222 @@
+﻿// Copyright (c) 2015, Johan Sköld
+// License: https://opensource.org/licenses/ISC
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+// What the hook engine takes from the Windows headers, for building it on other systems: the
+// structures of the PE format it parses, and the handful of MSVC intrinsics it uses.
+
+///
+// Intrinsics
+///
+
+#define TARGET(isa) __attribute__((target(isa)))
+
+// GCC's own versions of these either clash with the MSVC signatures, or need the XSAVE
+// instruction set enabled for the whole function calling them.
+#define __cpuid(info, leaf)             posix::CpuId(info, leaf, 0)
+#define __cpuidex(info, leaf, subleaf)  posix::CpuId(info, leaf, subleaf)
+#define _xgetbv(index)                  posix::XGetBv(index)
+
+namespace posix {
+
+    inline void CpuId (int info[4], int leaf, int subleaf)
+    {
+        __asm__ __volatile__ ("cpuid"
+                              : "=a" (info[0]), "=b" (info[1]), "=c" (info[2]), "=d" (info[3])
+                              : "a" (leaf), "c" (subleaf));
+    }
+
+    inline uint64_t XGetBv (uint32_t index)
+    {
+        uint32_t low, high;
+        __asm__ __volatile__ ("xgetbv" : "=a" (low), "=d" (high) : "c" (index));
+        return (uint64_t)high << 32 | low;
+    }
+
+} // namespace posix
+
+inline unsigned char _BitScanForward (unsigned long* index, unsigned long mask)
+{
+    if (!mask) {
+        return 0;
+    }
+
+    *index = (unsigned long)__builtin_ctzl(mask);
+    return 1;
+}
+
+
+///
+// PE format
+///
+
+#define IMAGE_DOS_SIGNATURE                 0x5a4d      // MZ
+#define IMAGE_NT_SIGNATURE                  0x00004550  // PE00
+#define IMAGE_NT_OPTIONAL_HDR64_MAGIC       0x20b
+
+#define IMAGE_FILE_MACHINE_AMD64            0x8664
+#define IMAGE_FILE_EXECUTABLE_IMAGE         0x0002
+#define IMAGE_FILE_LARGE_ADDRESS_AWARE      0x0020
+#define IMAGE_FILE_DLL                      0x2000
+
+#define IMAGE_NUMBEROF_DIRECTORY_ENTRIES    16
+#define IMAGE_DIRECTORY_ENTRY_EXPORT        0
+#define IMAGE_DIRECTORY_ENTRY_IMPORT        1
+#define IMAGE_DIRECTORY_ENTRY_RESOURCE      2
+#define IMAGE_DIRECTORY_ENTRY_EXCEPTION     3
+#define IMAGE_DIRECTORY_ENTRY_BASERELOC     5
+#define IMAGE_DIRECTORY_ENTRY_IAT           12
+
+#define IMAGE_SIZEOF_SHORT_NAME             8
+
+#define IMAGE_SCN_CNT_CODE                  0x00000020
+#define IMAGE_SCN_CNT_INITIALIZED_DATA      0x00000040
+#define IMAGE_SCN_CNT_UNINITIALIZED_DATA    0x00000080
+#define IMAGE_SCN_MEM_EXECUTE               0x20000000
+#define IMAGE_SCN_MEM_READ                  0x40000000
+#define IMAGE_SCN_MEM_WRITE                 0x80000000
+
+#define IMAGE_ORDINAL_FLAG64                0x8000000000000000ull
+#define IMAGE_ORDINAL64(ordinal)            ((ordinal) & 0xffff)
+#define IMAGE_SNAP_BY_ORDINAL64(ordinal)    (((ordinal) & IMAGE_ORDINAL_FLAG64) != 0)
+
+#define UNW_FLAG_NHANDLER                   0x0
+#define UNW_FLAG_EHANDLER                   0x1
+#define UNW_FLAG_UHANDLER                   0x2
+#define UNW_FLAG_CHAININFO                  0x4
+
+typedef struct _IMAGE_DOS_HEADER {
+    uint16_t e_magic;
+    uint16_t e_cblp;
+    uint16_t e_cp;
+    uint16_t e_crlc;
+    uint16_t e_cparhdr;
+    uint16_t e_minalloc;
+    uint16_t e_maxalloc;
+    uint16_t e_ss;
+    uint16_t e_sp;
+    uint16_t e_csum;
+    uint16_t e_ip;
+    uint16_t e_cs;
+    uint16_t e_lfarlc;
+    uint16_t e_ovno;
+    uint16_t e_res[4];
+    uint16_t e_oemid;
+    uint16_t e_oeminfo;
+    uint16_t e_res2[10];
+    int32_t e_lfanew;
+} IMAGE_DOS_HEADER;
+
+typedef struct _IMAGE_FILE_HEADER {
+    uint16_t Machine;
+    uint16_t NumberOfSections;
+    uint32_t TimeDateStamp;
+    uint32_t PointerToSymbolTable;
+    uint32_t NumberOfSymbols;
+    uint16_t SizeOfOptionalHeader;
+    uint16_t Characteristics;
+} IMAGE_FILE_HEADER;
+
+typedef struct _IMAGE_DATA_DIRECTORY {
+    uint32_t VirtualAddress;
+    uint32_t Size;
+} IMAGE_DATA_DIRECTORY;
+
+typedef struct _IMAGE_OPTIONAL_HEADER64 {
+    uint16_t Magic;
+    uint8_t MajorLinkerVersion;
+    uint8_t MinorLinkerVersion;
+    uint32_t SizeOfCode;
+    uint32_t SizeOfInitializedData;
+    uint32_t SizeOfUninitializedData;
+    uint32_t AddressOfEntryPoint;
+    uint32_t BaseOfCode;
+    uint64_t ImageBase;
+    uint32_t SectionAlignment;
+    uint32_t FileAlignment;
+    uint16_t MajorOperatingSystemVersion;
+    uint16_t MinorOperatingSystemVersion;
+    uint16_t MajorImageVersion;
+    uint16_t MinorImageVersion;
+    uint16_t MajorSubsystemVersion;
+    uint16_t MinorSubsystemVersion;
+    uint32_t Win32VersionValue;
+    uint32_t SizeOfImage;
+    uint32_t SizeOfHeaders;
+    uint32_t CheckSum;
+    uint16_t Subsystem;
+    uint16_t DllCharacteristics;
+    uint64_t SizeOfStackReserve;
+    uint64_t SizeOfStackCommit;
+    uint64_t SizeOfHeapReserve;
+    uint64_t SizeOfHeapCommit;
+    uint32_t LoaderFlags;
+    uint32_t NumberOfRvaAndSizes;
+    IMAGE_DATA_DIRECTORY DataDirectory[IMAGE_NUMBEROF_DIRECTORY_ENTRIES];
+} IMAGE_OPTIONAL_HEADER64;
+
+typedef struct _IMAGE_NT_HEADERS64 {
+    uint32_t Signature;
+    IMAGE_FILE_HEADER FileHeader;
+    IMAGE_OPTIONAL_HEADER64 OptionalHeader;
+} IMAGE_NT_HEADERS64, IMAGE_NT_HEADERS;
+
+typedef struct _IMAGE_SECTION_HEADER {
+    uint8_t Name[IMAGE_SIZEOF_SHORT_NAME];
+    union {
+        uint32_t PhysicalAddress;
+        uint32_t VirtualSize;
+    } Misc;
+    uint32_t VirtualAddress;
+    uint32_t SizeOfRawData;
+    uint32_t PointerToRawData;
+    uint32_t PointerToRelocations;
+    uint32_t PointerToLinenumbers;
+    uint16_t NumberOfRelocations;
+    uint16_t NumberOfLinenumbers;
+    uint32_t Characteristics;
+} IMAGE_SECTION_HEADER, *PIMAGE_SECTION_HEADER;
+
+#define IMAGE_FIRST_SECTION(ntHeaders) \
+    ((PIMAGE_SECTION_HEADER)((uintptr_t)(ntHeaders) + offsetof(IMAGE_NT_HEADERS64, OptionalHeader) + (ntHeaders)->FileHeader.SizeOfOptionalHeader))
+
+typedef struct _IMAGE_IMPORT_DESCRIPTOR {
+    union {
+        uint32_t Characteristics;
+        uint32_t OriginalFirstThunk;
+    };
+    uint32_t TimeDateStamp;
+    uint32_t ForwarderChain;
+    uint32_t Name;
+    uint32_t FirstThunk;
+} IMAGE_IMPORT_DESCRIPTOR;
+
+typedef struct _IMAGE_IMPORT_BY_NAME {
+    uint16_t Hint;
+    char Name[1];
+} IMAGE_IMPORT_BY_NAME;
+
+typedef struct _IMAGE_THUNK_DATA64 {
+    union {
+        uint64_t ForwarderString;
+        uint64_t Function;
+        uint64_t Ordinal;
+        uint64_t AddressOfData;
+    } u1;
+} IMAGE_THUNK_DATA64;
+
+typedef struct _RUNTIME_FUNCTION {
+    uint32_t BeginAddress;
+    uint32_t EndAddress;
+    uint32_t UnwindData;
+} RUNTIME_FUNCTION;
+
+static_assert(sizeof(IMAGE_DOS_HEADER) == 64, "layout must match winnt.h");
+static_assert(sizeof(IMAGE_NT_HEADERS64) == 264, "layout must match winnt.h");
+static_assert(sizeof(IMAGE_SECTION_HEADER) == 40, "layout must match winnt.h");
+static_assert(sizeof(IMAGE_IMPORT_DESCRIPTOR) == 20, "layout must match winnt.h");
+static_assert(sizeof(RUNTIME_FUNCTION) == 12, "layout must match winnt.h");
@@ -0,0 +1,127 @@
+﻿// Copyright (c) 2015, Johan Sköld
+// License: https://opensource.org/licenses/ISC
+
+#include "stdafx.h"
+#include "rtti.h"
+
+#include "pe.h"
+#include "util.h"
+
+namespace rtti {
+
+    ///
+    // Statics
+    ///
+
+    // x64 locators store RVAs rather than pointers, and identify themselves with signature 1.
+    const uint32_t COL_SIGNATURE = 1;
+
+    struct CompleteObjectLocator {
+        uint32_t signature;
+        uint32_t offset;            // Offset of this vftable within the complete class
+        uint32_t cdOffset;
+        uint32_t typeDescriptor;
+        uint32_t classDescriptor;
+        uint32_t self;
+    };
+
+    struct TypeDescriptor {
+        uint64_t vftable;           // type_info's vftable
+        uint64_t spare;
+        char name[1];
+    };
+
+    const size_t MAX_NAME_LENGTH = 0x200;
+
+
+    ///
+    // Locals
+    ///
+
+    static const char* TypeName (const pe::Image& image, uint32_t rva)
+    {
+        auto descriptor = (const TypeDescriptor*)image.FromRva(rva, sizeof(TypeDescriptor));
+        if (!descriptor) {
+            return nullptr;
+        }
+
+        // The name must be null terminated within the image, and look like a mangled class or
+        // struct name.
+        auto name = descriptor->name;
+        auto nameRva = rva + (uint32_t)offsetof(TypeDescriptor, name);
+
+        for (size_t i = 0; i < MAX_NAME_LENGTH; ++i) {
+            if (!image.FromRva(nameRva + (uint32_t)i, 1)) {
+                return nullptr;
+            }
+
+            if (!name[i]) {
+                const auto valid = i > 4 && name[0] == '.' && name[1] == '?' && name[2] == 'A' && (name[3] == 'V' || name[3] == 'U');
+                return valid ? name : nullptr;
+            }
+        }
+
+        return nullptr;
+    }
+
+
+    ///
+    // Index
+    ///
+
+    void Index::ScanSection (const pe::Image& image, const char name[])
+    {
+        const uint8_t* start;
+        const uint8_t* end;
+
+        if (!image.SectionRange(image.Section(name), &start, &end)) {
+            return;
+        }
+
+        uint32_t sectionRva;
+        if (!image.RvaFromPointer(start, &sectionRva)) {
+            return;
+        }
+
+        // Every pointer-aligned slot is checked for whether it points at a locator that points
+        // back at itself, which rules out pretty much anything that isn't one. The vftable starts
+        // in the slot after it.
+        for (auto slot = (const uint64_t*)start; (const uint8_t*)(slot + 2) <= end; ++slot) {
+            uint32_t colRva;
+            if (!image.RvaFromAddress(*slot, &colRva) || (colRva & 3)) {
+                continue;
+            }
+
+            auto col = (const CompleteObjectLocator*)image.FromRva(colRva, sizeof(CompleteObjectLocator));
+            if (!col || col->signature != COL_SIGNATURE || col->self != colRva || col->offset != 0) {
+                continue;
+            }
+
+            if (auto typeName = TypeName(image, col->typeDescriptor)) {
+                const auto vftable = sectionRva + (uint32_t)((const uint8_t*)(slot + 1) - start);
+                m_vftables.emplace(typeName, vftable);
+            }
+        }
+    }
+
+    void Index::Build (const pe::Image& image)
+    {
+        m_vftables.clear();
+
+        // MSVC puts vftables in .rdata, but keep looking in .data in case anything was merged.
+        ScanSection(image, ".rdata");
+        ScanSection(image, ".data");
+    }
+
+    size_t Index::Count () const
+    {
+        return m_vftables.size();
+    }
+
+    uint32_t Index::Find (const char name[]) const
+    {
+        auto result = m_vftables.find(name);
+        return result != m_vftables.end() ? result->second : 0;
+    }
+
+} // namespace rtti
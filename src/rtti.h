@@ -0,0 +1,32 @@
+﻿// Copyright (c) 2015, Johan Sköld
+// License: https://opensource.org/licenses/ISC
+
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+
+namespace pe { class Image; }
+
+namespace rtti {
+
+    // Maps the mangled names of polymorphic classes, such as ".?AVBSTriShape@@", to their
+    // vftables. MSVC stores a pointer to the class's CompleteObjectLocator in the slot before
+    // each vftable, so a single pass over the data sections finds all of them without any byte
+    // signatures. Only the primary vftable of each class is kept.
+    class Index
+    {
+        std::unordered_map<std::string, uint32_t> m_vftables;
+
+        void ScanSection (const pe::Image& image, const char name[]);
+
+        public:
+            void Build (const pe::Image& image);
+            size_t Count () const;
+
+            // RVA of the class's vftable, or 0 if it wasn't found.
+            uint32_t Find (const char name[]) const;
+    };
+
+} // namespace rtti
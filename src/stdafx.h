@@ -7,25 +7,55 @@
 #pragma warning(disable:4091) // 'typedef ': ignored on left of '' when no variable is declared
 #pragma warning(disable:4456) // declaration of 'identifier' hides previous local declaration
 
+#ifdef _WIN32
+
 // Windows headers
 #define WIN32_LEAN_AND_MEAN
 #define _WIN32_WINNT 0x0601
 #include <windows.h>
 #include <intrin.h>
 #include <shlobj.h>
+#include <tlhelp32.h>
+
+// MSVC allows intrinsics of any instruction set anywhere.
+#define TARGET(isa)
+
+#else
+
+// Only the hook engine is built elsewhere, for its tests and benchmarks.
+#include <cstdio>
+#include <cstdlib>
+#include <execinfo.h>
+#include <x86intrin.h>
+#include "posix.h"
+
+#endif
 
 // Standard headers
+#include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <chrono>
+#include <condition_variable>
+#include <cstdarg>
+#include <cstring>
+#include <map>
+#include <mutex>
 #include <streambuf>
-#include <varargs.h>
+#include <thread>
 #include <vector>
 
+#ifdef _WIN32
+
 // WinSDK headers
 #include <d3d11.h>
 
 // 3rdparty headers
 #include <XInput.h>
 #include <cpptoml.h>
+
+#endif
+
 #include <udis86.h>
 
 #pragma warning(pop)
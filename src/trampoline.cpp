@@ -0,0 +1,244 @@
+﻿// Copyright (c) 2015, Johan Sköld
+// License: https://opensource.org/licenses/ISC
+
+#include "stdafx.h"
+#include "trampoline.h"
+
+#include "platform.h"
+#include "util.h"
+
+namespace trampoline {
+
+    ///
+    // Statics
+    ///
+
+    // A bit short of 2 GiB, which leaves room for the length of the jumps in and out of a slot.
+    const uintptr_t REACH = 0x7fff0000;
+    const uintptr_t SLOT_ALIGNMENT = 16;
+    const size_t BLOCK_SIZE = 0x10000;
+
+
+    ///
+    // Locals
+    ///
+
+    static uintptr_t AlignDown (uintptr_t value, uintptr_t alignment)
+    {
+        return value - value % alignment;
+    }
+
+    static uintptr_t AlignUp (uintptr_t value, uintptr_t alignment)
+    {
+        return AlignDown(value + alignment - 1, alignment);
+    }
+
+
+    ///
+    // Backend
+    ///
+
+    class PlatformBackend : public Backend
+    {
+        size_t m_granularity = platform::AllocationGranularity();
+
+        public:
+            void* Reserve (uintptr_t near, uintptr_t low, uintptr_t high, size_t size) override
+            {
+                platform::Region region;
+
+                // Walk the regions below `near` first, then the ones above it, and take the end
+                // of a free region closest to it.
+                for (auto addr = near; addr >= low; addr = region.base - 1) {
+                    if (!platform::Query(addr, &region)) {
+                        break;
+                    }
+
+                    const auto base = (std::max)(AlignUp(region.base, m_granularity), low);
+                    const auto end = (std::min)(region.base + region.size, high);
+
+                    if (region.free && end >= base + size) {
+                        if (auto block = platform::Reserve(AlignDown(end - size, m_granularity), size, platform::Access::ReadWriteExecute)) {
+                            return block;
+                        }
+                    }
+
+                    if (!region.base) {
+                        break;
+                    }
+                }
+
+                for (auto addr = near; addr < high; addr = region.base + region.size) {
+                    if (!platform::Query(addr, &region)) {
+                        break;
+                    }
+
+                    const auto base = (std::max)(AlignUp(region.base, m_granularity), low);
+                    const auto end = (std::min)(region.base + region.size, high);
+
+                    if (region.free && end >= base + size) {
+                        if (auto block = platform::Reserve(base, size, platform::Access::ReadWriteExecute)) {
+                            return block;
+                        }
+                    }
+                }
+
+                return nullptr;
+            }
+
+            void Release (void* block, size_t size) override
+            {
+                platform::Release(block, size);
+            }
+
+            size_t Granularity () const override
+            {
+                return m_granularity;
+            }
+    };
+
+    Backend& SystemBackend ()
+    {
+        static PlatformBackend s_backend;
+        return s_backend;
+    }
+
+
+    ///
+    // Allocator
+    ///
+
+    Allocator::Allocator (Backend& backend)
+        : m_backend(backend) { }
+
+    Allocator::~Allocator ()
+    {
+        for (const auto& block : m_blocks) {
+            m_backend.Release((void*)block.base, block.size);
+        }
+    }
+
+    void* Allocator::Take (uintptr_t low, uintptr_t high, size_t size)
+    {
+        auto it = m_free.upper_bound(low);
+        if (it != m_free.begin()) {
+            --it;
+        }
+
+        for (; it != m_free.end() && it->first < high; ++it) {
+            const auto start = AlignUp((std::max)(it->first, low), SLOT_ALIGNMENT);
+            const auto end = (std::min)(it->second, high);
+
+            if (start >= end || end - start < size) {
+                continue;
+            }
+
+            const auto free = *it;
+            m_free.erase(it);
+
+            if (free.first < start) {
+                m_free.emplace(free.first, start);
+            }
+
+            if (start + size < free.second) {
+                m_free.emplace(start + size, free.second);
+            }
+
+            m_used.emplace(start, size);
+            return (void*)start;
+        }
+
+        return nullptr;
+    }
+
+    void Allocator::Give (uintptr_t start, uintptr_t end)
+    {
+        auto next = m_free.find(end);
+        if (next != m_free.end()) {
+            end = next->second;
+            m_free.erase(next);
+        }
+
+        auto it = m_free.lower_bound(start);
+        if (it != m_free.begin() && (--it)->second == start) {
+            it->second = end;
+            return;
+        }
+
+        m_free.emplace(start, end);
+    }
+
+    void* Allocator::Allocate (const void* target, size_t size)
+    {
+        size = AlignUp((std::max<size_t>)(size, 1), SLOT_ALIGNMENT);
+
+        const auto near = (uintptr_t)target;
+        const auto low = near > REACH ? near - REACH : 0;
+        const auto high = near < UINTPTR_MAX - REACH ? near + REACH : UINTPTR_MAX;
+
+        std::lock_guard<std::mutex> lock(m_mutex);
+
+        if (auto slot = Take(low, high, size)) {
+            return slot;
+        }
+
+        const auto granularity = (std::max)(m_backend.Granularity(), BLOCK_SIZE);
+        const auto blockSize = AlignUp(size, granularity);
+        const auto block = (uintptr_t)m_backend.Reserve(near, low, high, blockSize);
+
+        if (!block) {
+            ERR("No free memory within reach of %p", target);
+            return nullptr;
+        }
+
+        m_blocks.push_back({ block, blockSize });
+        Give(block, block + blockSize);
+        return Take(low, high, size);
+    }
+
+    void Allocator::Free (void* slot)
+    {
+        if (!slot) {
+            return;
+        }
+
+        std::lock_guard<std::mutex> lock(m_mutex);
+
+        auto it = m_used.find((uintptr_t)slot);
+        if (it == m_used.end()) {
+            ERR("%p is not an allocated slot", slot);
+            return;
+        }
+
+        Give(it->first, it->first + it->second);
+        m_used.erase(it);
+    }
+
+    size_t Allocator::BlockCount () const
+    {
+        return m_blocks.size();
+    }
+
+
+    ///
+    // Functions
+    ///
+
+    // Never destroyed, since detours may still be in place while static destructors run.
+    static Allocator& SharedAllocator ()
+    {
+        static auto s_allocator = new Allocator();
+        return *s_allocator;
+    }
+
+    void* Allocate (const void* target, size_t size)
+    {
+        return SharedAllocator().Allocate(target, size);
+    }
+
+    void Free (void* slot)
+    {
+        SharedAllocator().Free(slot);
+    }
+
+} // namespace trampoline
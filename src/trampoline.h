@@ -0,0 +1,83 @@
+﻿// Copyright (c) 2015, Johan Sköld
+// License: https://opensource.org/licenses/ISC
+
+#pragma once
+
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <vector>
+
+namespace trampoline {
+
+    ///
+    // Backend
+    ///
+
+    // Where the allocator gets its memory from. The system one is all the game ever uses, but
+    // anything that can hand out executable memory at a given range works.
+    class Backend
+    {
+        public:
+            virtual ~Backend () = default;
+
+            // Reserves and commits `size` bytes of read/write/execute memory inside [low, high),
+            // preferably as close to `near` as possible. Returns null if nothing is free there.
+            virtual void* Reserve (uintptr_t near, uintptr_t low, uintptr_t high, size_t size) = 0;
+            virtual void Release (void* block, size_t size) = 0;
+
+            // Sizes passed to `Reserve` are multiples of this.
+            virtual size_t Granularity () const = 0;
+    };
+
+    Backend& SystemBackend ();
+
+
+    ///
+    // Allocator
+    ///
+
+    // Hands out small slots for trampolines, all placed within rel32 reach of the code they are
+    // for. Memory is reserved from the backend a block at a time, and the unused parts of all
+    // blocks are kept as a map of free intervals, so most allocations never go to the backend.
+    class Allocator
+    {
+        struct Block {
+            uintptr_t base;
+            size_t size;
+        };
+
+        Backend& m_backend;
+        std::mutex m_mutex;
+        std::vector<Block> m_blocks;
+        std::map<uintptr_t, uintptr_t> m_free;      // Start -> end
+        std::map<uintptr_t, size_t> m_used;         // Start -> size
+
+        void* Take (uintptr_t low, uintptr_t high, size_t size);
+        void Give (uintptr_t start, uintptr_t end);
+
+        public:
+            Allocator (Backend& backend = SystemBackend());
+            Allocator (const Allocator&) = delete;
+            ~Allocator ();
+
+            Allocator& operator= (const Allocator&) = delete;
+
+            // Returns a 16 byte aligned slot of at least `size` bytes, every byte of which can
+            // reach and be reached from `target` with a rel32 displacement. Null on failure.
+            void* Allocate (const void* target, size_t size);
+            void Free (void* slot);
+
+            size_t BlockCount () const;
+    };
+
+
+    ///
+    // Functions
+    ///
+
+    // Shared allocator used by the hooks.
+    void* Allocate (const void* target, size_t size);
+    void Free (void* slot);
+
+} // namespace trampoline
@@ -10,6 +10,8 @@
 
 namespace logging {
 
+#ifdef _WIN32
+
     static HANDLE s_handle;
 
     // Main thread
@@ -27,11 +29,49 @@ namespace logging {
     // Main thread
     void Close ()
     {
+        // Static destructors may still log after this.
         if (s_handle) {
             CloseHandle(s_handle);
+            s_handle = nullptr;
+        }
+    }
+
+    static void WriteLine (const char line[], size_t length)
+    {
+        DWORD written;
+        WriteFile(s_handle, line, (DWORD)length, &written, nullptr);
+    }
+
+#else
+
+    static FILE* s_handle;
+
+    // Main thread
+    void Open (const wchar_t filename[])
+    {
+        char path[0x400];
+        if (wcstombs(path, filename, ArraySize(path)) < ArraySize(path)) {
+            s_handle = fopen(path, "w");
         }
     }
 
+    // Main thread
+    void Close ()
+    {
+        if (s_handle) {
+            fclose(s_handle);
+            s_handle = nullptr;
+        }
+    }
+
+    static void WriteLine (const char line[], size_t length)
+    {
+        fwrite(line, 1, length, s_handle);
+        fflush(s_handle);
+    }
+
+#endif
+
     // Random threads
     void Write (const char func[], const char str[], ...)
     {
@@ -42,10 +82,12 @@ namespace logging {
             char buffer[0x100];
             va_list args;
             va_start(args, str);
-            auto len = (DWORD)vsnprintf(buffer, ArraySize(buffer), fmt, args);
+            auto len = vsnprintf(buffer, ArraySize(buffer), fmt, args);
             va_end(args);
 
-            WriteFile(s_handle, buffer, len, &len, nullptr);
+            if (len > 0) {
+                WriteLine(buffer, (std::min)((size_t)len, ArraySize(buffer) - 1));
+            }
         }
     }
 
@@ -56,23 +98,139 @@ namespace logging {
 // Scoped timer
 ///
 
-ScopedTimer::ScopedTimer (const char func[], const char fmt[])
-    : m_func(func)
-    , m_fmt(fmt)
+static uint64_t Microseconds ()
 {
-    static_assert(sizeof(m_start) == sizeof(LARGE_INTEGER), "invalid cast");
-    QueryPerformanceCounter((LARGE_INTEGER*)&m_start);
+    const auto now = std::chrono::steady_clock::now().time_since_epoch();
+    return (uint64_t)std::chrono::duration_cast<std::chrono::microseconds>(now).count();
 }
 
+ScopedTimer::ScopedTimer (const char func[], const char fmt[])
+    : m_start(Microseconds())
+    , m_func(func)
+    , m_fmt(fmt) { }
+
 ScopedTimer::~ScopedTimer ()
 {
-    uint64_t end, freq;
-    QueryPerformanceCounter((LARGE_INTEGER*)&end);
-    QueryPerformanceFrequency((LARGE_INTEGER*)&freq);
-    auto microsec = (end - m_start) / (freq / 1000000);
+    auto microsec = Microseconds() - m_start;
     logging::Write(m_func, m_fmt, microsec / 1000, microsec % 1000);
 }
 
+
+///
+// Parallel
+///
+
+// Workers are started the first time they're needed and kept from then on, so that a run of
+// small scans doesn't pay for creating and joining threads every time. Only one loop runs on the
+// pool at a time. Any other, including one started from inside a loop, runs on the calling
+// thread. The pool is never destroyed, as its threads may be waiting in it until the process ends.
+class WorkerPool
+{
+    std::mutex m_loop;                      // Held by the thread running a loop on the pool
+    std::mutex m_mutex;
+    std::condition_variable m_wake;
+    std::condition_variable m_done;
+    std::vector<std::thread> m_threads;
+
+    const std::function<void(size_t)>* m_fn = nullptr;
+    size_t m_count = 0;
+    std::atomic<size_t> m_next;
+    size_t m_generation = 0;
+    size_t m_seats = 0;                     // Workers that may still join the current loop
+    size_t m_busy = 0;                      // Workers inside the current loop
+
+    void Work (const std::function<void(size_t)>& fn, size_t count)
+    {
+        for (auto i = m_next++; i < count; i = m_next++) {
+            fn(i);
+        }
+    }
+
+    void Worker ()
+    {
+        size_t seen = 0;
+        std::unique_lock<std::mutex> lock(m_mutex);
+
+        for (;;) {
+            m_wake.wait(lock, [&] { return m_generation != seen; });
+            seen = m_generation;
+
+            if (!m_seats) {
+                continue;
+            }
+
+            --m_seats;
+            ++m_busy;
+
+            const auto fn = m_fn;
+            const auto count = m_count;
+            lock.unlock();
+
+            Work(*fn, count);
+
+            lock.lock();
+            if (!--m_busy) {
+                m_done.notify_one();
+            }
+        }
+    }
+
+    public:
+        WorkerPool ()
+            : m_next(0) { }
+
+        void Run (size_t count, size_t threads, const std::function<void(size_t)>& fn)
+        {
+            std::unique_lock<std::mutex> loop(m_loop, std::try_to_lock);
+
+            if (!loop.owns_lock() || threads <= 1) {
+                for (size_t i = 0; i < count; ++i) {
+                    fn(i);
+                }
+
+                return;
+            }
+
+            std::unique_lock<std::mutex> lock(m_mutex);
+
+            while (m_threads.size() < threads - 1) {
+                m_threads.emplace_back([this] { Worker(); });
+            }
+
+            m_fn = &fn;
+            m_count = count;
+            m_next = 0;
+            m_seats = threads - 1;
+            ++m_generation;
+
+            lock.unlock();
+            m_wake.notify_all();
+
+            Work(fn, count);
+
+            // Workers that haven't joined by now would find nothing left to do, and `fn` is
+            // about to go away.
+            lock.lock();
+            m_seats = 0;
+            m_done.wait(lock, [&] { return m_busy == 0; });
+        }
+};
+
+void ParallelFor (size_t count, size_t threads, const std::function<void(size_t)>& fn)
+{
+    static auto s_pool = new WorkerPool();
+    s_pool->Run(count, (std::min)(threads, count), fn);
+}
+
+size_t WorkerCount ()
+{
+    // Keep the pool small; we're usually running while the game itself is busy loading.
+    const size_t maxWorkers = 8;
+    const auto hardware = (size_t)std::thread::hardware_concurrency();
+    return hardware ? (std::min)(hardware, maxWorkers) : 1;
+}
+
+
 ///
 // Misc
 ///
@@ -102,8 +260,16 @@ void LogAsm (void* addr, size_t size)
 void LogCallstack (const char func[], size_t count)
 {
     void* stack[64];
-    auto max = min(count, ArraySize(stack));
+    auto max = (std::min)(count, ArraySize(stack));
+#ifdef _WIN32
     auto size = CaptureStackBackTrace(1, (DWORD)max, stack, nullptr);
+#else
+    // Leave out this function, like the Windows version does.
+    void* frames[ArraySize(stack) + 1];
+    const auto captured = (size_t)(std::max)(backtrace(frames, (int)max + 1), 1);
+    const auto size = captured - 1;
+    memcpy(stack, frames + 1, size * sizeof(void*));
+#endif
 
     logging::Write(func, "Callstack:");
     for (size_t i = 0; i < size; ++i) {
@@ -4,6 +4,7 @@
 #pragma once
 
 #include <cstdint>
+#include <functional>
 
 ///
 // Macros
@@ -48,13 +49,15 @@ class UnsafePtr
 
         operator bool() const;
 
-        friend bool operator== (const UnsafePtr& a, const UnsafePtr& b);
-        friend bool operator!= (const UnsafePtr& a, const UnsafePtr& b);
+        template <class U>
+        friend bool operator== (const UnsafePtr<U>& a, const UnsafePtr<U>& b);
+        template <class U>
+        friend bool operator!= (const UnsafePtr<U>& a, const UnsafePtr<U>& b);
 
-        template <class T, class U>
-        friend bool operator== (const UnsafePtr<T>& a, const U* b);
-        template <class T, class U>
-        friend bool operator!= (const UnsafePtr<T>& a, const U* b);
+        template <class U, class V>
+        friend bool operator== (const UnsafePtr<U>& a, const V* b);
+        template <class U, class V>
+        friend bool operator!= (const UnsafePtr<U>& a, const V* b);
 };
 
 template <class T>
@@ -130,6 +133,18 @@ class ScopedTimer
 };
 
 
+///
+// Parallel
+///
+
+// Calls `fn` once for every index in [0, count), spread over at most `threads` threads including
+// the calling one. Indices are handed out in increasing order, but may complete out of order.
+// The other threads come from a pool that's kept between calls, and while it's busy with one
+// loop, others run on the calling thread alone.
+void ParallelFor (size_t count, size_t threads, const std::function<void(size_t)>& fn);
+size_t WorkerCount ();
+
+
 ///
 // Misc
 ///
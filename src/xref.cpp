@@ -0,0 +1,260 @@
+﻿// Copyright (c) 2015, Johan Sköld
+// License: https://opensource.org/licenses/ISC
+
+#include "stdafx.h"
+#include "xref.h"
+
+#include "pe.h"
+#include "util.h"
+
+namespace xref {
+
+    ///
+    // Statics
+    ///
+
+    // Chunks are only ever cut at function starts, so each of them starts on a known instruction.
+    const uint32_t CHUNK_SIZE = 256 * 1024;
+
+    struct Chunk {
+        uint32_t start;
+        uint32_t end;
+        size_t firstSync;           // Index of the first function start after `start`
+    };
+
+    struct ChunkResult {
+        std::vector<uint64_t> starts;   // Bitmap from `start`, rounded down to a 64 byte offset into .text
+        std::vector<Ref> refs;
+        size_t instructions = 0;
+    };
+
+
+    ///
+    // Locals
+    ///
+
+    static bool RefTarget (ud_mnemonic_code mnemonic, const ud_operand& op, uint32_t next, uint32_t* target, RefKind* kind)
+    {
+        int64_t disp;
+
+        if (op.type == UD_OP_MEM && op.base == UD_R_RIP) {
+            disp = op.lval.sdword;
+            *kind = RefKind::Data;
+        } else if (op.type == UD_OP_JIMM && mnemonic == UD_Icall) {
+            disp = op.lval.sdword;
+            *kind = RefKind::Call;
+        } else if (op.type == UD_OP_JIMM && mnemonic == UD_Ijmp) {
+            disp = op.size == 8 ? op.lval.sbyte : op.lval.sdword;
+            *kind = RefKind::Jump;
+        } else {
+            return false;
+        }
+
+        const auto result = (int64_t)next + disp;
+        if (result < 0 || result > UINT32_MAX) {
+            return false;
+        }
+
+        *target = (uint32_t)result;
+        return true;
+    }
+
+    using RefIterator = std::vector<Ref>::const_iterator;
+
+    static std::pair<RefIterator, RefIterator> RefRange (const std::vector<Ref>& refs, uint32_t target)
+    {
+        return std::equal_range(refs.begin(), refs.end(), Ref{ target, 0, RefKind::Call }, [] (const Ref& a, const Ref& b) {
+            return a.target < b.target;
+        });
+    }
+
+    static void DecodeChunk (const uint8_t*               text,
+                             uint32_t                     textRva,
+                             const Chunk&                 chunk,
+                             const std::vector<uint32_t>& syncs,
+                             ChunkResult*                 result)
+    {
+        const auto base = chunk.start - (chunk.start - textRva) % 64;
+        result->starts.assign((chunk.end - base + 63) / 64, 0);
+
+        ud_t ud;
+        ud_init(&ud);
+        ud_set_mode(&ud, 64);
+        ud_set_syntax(&ud, nullptr);
+        ud_set_input_buffer(&ud, text + (chunk.start - textRva), chunk.end - chunk.start);
+
+        auto sync = chunk.firstSync;
+        auto rva = chunk.start;
+
+        while (rva < chunk.end) {
+            while (sync < syncs.size() && syncs[sync] <= rva) {
+                ++sync;
+            }
+
+            const auto len = ud_disassemble(&ud);
+            if (!len) {
+                break;
+            }
+
+            // An instruction running into the next function means we've lost track of where the
+            // instructions start, usually by decoding padding or data placed between functions.
+            if (sync < syncs.size() && syncs[sync] < chunk.end && rva + len > syncs[sync]) {
+                rva = syncs[sync];
+                ud_set_input_buffer(&ud, text + (rva - textRva), chunk.end - rva);
+                continue;
+            }
+
+            const auto mnemonic = ud_insn_mnemonic(&ud);
+
+            if (mnemonic != UD_Iinvalid) {
+                const auto offset = rva - base;
+                result->starts[offset / 64] |= 1ull << (offset % 64);
+                result->instructions += 1;
+
+                for (unsigned i = 0; auto op = ud_insn_opr(&ud, i); ++i) {
+                    Ref ref;
+                    if (RefTarget(mnemonic, *op, rva + len, &ref.target, &ref.kind)) {
+                        ref.site = rva;
+                        result->refs.push_back(ref);
+                    }
+                }
+            }
+
+            rva += len;
+        }
+    }
+
+
+    ///
+    // Index
+    ///
+
+    void Index::Build (const pe::Image& image, size_t threads)
+    {
+        m_textRva = 0;
+        m_textSize = 0;
+        m_instructions = 0;
+        m_starts.clear();
+        m_refs.clear();
+        m_functions = pdata::Index();
+
+        const uint8_t* text;
+        const uint8_t* textEnd;
+
+        if (!image.SectionRange(image.Section(".text"), &text, &textEnd) || !image.RvaFromPointer(text, &m_textRva)) {
+            ERR("No .text section");
+            return;
+        }
+
+        m_textSize = (uint32_t)(textEnd - text);
+
+        // Cut the section into chunks at function starts, which then also serve as points for the
+        // linear sweep to get back in sync with the instructions.
+        m_functions.Build(image);
+
+        std::vector<uint32_t> syncs;
+        for (const auto& function : m_functions.Functions()) {
+            if (function.begin - m_textRva < m_textSize) {
+                syncs.push_back(function.begin);
+            }
+        }
+
+        std::vector<Chunk> chunks;
+        chunks.push_back({ m_textRva, m_textRva + m_textSize, 0 });
+
+        for (size_t i = 0; i < syncs.size(); ++i) {
+            if (syncs[i] - chunks.back().start >= CHUNK_SIZE) {
+                chunks.back().end = syncs[i];
+                chunks.push_back({ syncs[i], m_textRva + m_textSize, i });
+            }
+        }
+
+        std::vector<ChunkResult> results(chunks.size());
+
+        ParallelFor(chunks.size(), threads, [&] (size_t i) {
+            DecodeChunk(text, m_textRva, chunks[i], syncs, &results[i]);
+        });
+
+        // Chunks may share the 64-bit words at their edges, so those have to be combined.
+        m_starts.assign((m_textSize + 63) / 64, 0);
+
+        for (size_t i = 0; i < chunks.size(); ++i) {
+            const auto first = (chunks[i].start - m_textRva) / 64;
+            const auto& result = results[i];
+
+            for (size_t j = 0; j < result.starts.size() && first + j < m_starts.size(); ++j) {
+                m_starts[first + j] |= result.starts[j];
+            }
+
+            m_instructions += result.instructions;
+            m_refs.insert(m_refs.end(), result.refs.begin(), result.refs.end());
+        }
+
+        std::sort(m_refs.begin(), m_refs.end(), [] (const Ref& a, const Ref& b) {
+            return a.target != b.target ? a.target < b.target : a.site < b.site;
+        });
+    }
+
+    size_t Index::InstructionCount () const
+    {
+        return m_instructions;
+    }
+
+    size_t Index::RefCount () const
+    {
+        return m_refs.size();
+    }
+
+    const std::vector<Ref>& Index::Refs () const
+    {
+        return m_refs;
+    }
+
+    bool Index::IsInstructionStart (uint32_t rva) const
+    {
+        if (rva - m_textRva >= m_textSize) {
+            return false;
+        }
+
+        const auto offset = rva - m_textRva;
+        return (m_starts[offset / 64] & (1ull << (offset % 64))) != 0;
+    }
+
+    std::vector<uint32_t> Index::CallersOf (uint32_t target) const
+    {
+        return ReferencesTo(target, RefKind::Call);
+    }
+
+    std::vector<uint32_t> Index::ReferencesTo (uint32_t target) const
+    {
+        std::vector<uint32_t> sites;
+        auto range = RefRange(m_refs, target);
+
+        for (auto it = range.first; it != range.second; ++it) {
+            sites.push_back(it->site);
+        }
+
+        return sites;
+    }
+
+    std::vector<uint32_t> Index::ReferencesTo (uint32_t target, RefKind kind) const
+    {
+        std::vector<uint32_t> sites;
+        auto range = RefRange(m_refs, target);
+
+        for (auto it = range.first; it != range.second; ++it) {
+            if (it->kind == kind) {
+                sites.push_back(it->site);
+            }
+        }
+
+        return sites;
+    }
+
+    uint32_t Index::FunctionContaining (uint32_t rva) const
+    {
+        const auto function = m_functions.Find(rva);
+        return function ? function->primary : 0;
+    }
+
+} // namespace xref
@@ -0,0 +1,57 @@
+﻿// Copyright (c) 2015, Johan Sköld
+// License: https://opensource.org/licenses/ISC
+
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "pdata.h"
+
+namespace pe { class Image; }
+
+namespace xref {
+
+    enum class RefKind : uint8_t {
+        Call,           // call rel32
+        Jump,           // jmp rel8/rel32
+        Data,           // Any instruction with a [rip+disp32] operand
+    };
+
+    struct Ref {
+        uint32_t target;
+        uint32_t site;          // Start of the referencing instruction
+        RefKind kind;
+    };
+
+    // Disassembles all of .text once, and records where every instruction starts along with the
+    // targets of all direct calls, jumps and RIP-relative operands. Afterwards, finding everything
+    // that references an address is a binary search rather than another pass over the code.
+    // Everything is in RVAs, so the index works the same for loaded images and files on disk.
+    class Index
+    {
+        uint32_t m_textRva = 0;
+        uint32_t m_textSize = 0;
+        size_t m_instructions = 0;
+        std::vector<uint64_t> m_starts;
+        std::vector<Ref> m_refs;
+        pdata::Index m_functions;
+
+        public:
+            void Build (const pe::Image& image, size_t threads = 1);
+            size_t InstructionCount () const;
+            size_t RefCount () const;
+
+            // Every reference, sorted by target and then by site.
+            const std::vector<Ref>& Refs () const;
+
+            bool IsInstructionStart (uint32_t rva) const;
+            std::vector<uint32_t> CallersOf (uint32_t target) const;
+            std::vector<uint32_t> ReferencesTo (uint32_t target) const;
+            std::vector<uint32_t> ReferencesTo (uint32_t target, RefKind kind) const;
+
+            // Start of the function whose .pdata ranges contain `rva`, or 0 if there is none.
+            uint32_t FunctionContaining (uint32_t rva) const;
+    };
+
+} // namespace xref
@@ -0,0 +1,228 @@
+﻿// Copyright (c) 2015, Johan Sköld
+// License: https://opensource.org/licenses/ISC
+
+#include "stdafx.h"
+#include "hooks.h"
+
+#include "trampoline.h"
+#include "util.h"
+
+#include <unistd.h>
+
+// Per-call cost of each kind of hook, against a call that isn't hooked at all. Detours are also
+// compared with the jump sequences they used to be entered and left through. Results are
+// printed, and written as CSV to the path given with -o so separate runs can be compared.
+
+const size_t REPEATS = 5;
+const size_t HOOK_CALLS = 10 * 1000 * 1000;
+
+using HookFn = int(int, int);
+using HookSlot = hooks::Function<0, HookFn>;
+
+extern "C" HookFn TargetDirect;
+extern "C" HookFn TargetInject;
+extern "C" HookFn TargetDetour;
+extern "C" HookFn TargetDispatch;
+
+struct Result {
+    const char* variant;
+    double seconds;
+    uint64_t cycles;
+};
+
+static HookFn* s_prevInject;
+static HookFn* s_prevDetour;
+static HookFn* s_prevStub;
+static volatile int s_sink;
+
+static int InjectHook (int a, int b)
+{
+    return s_prevInject(a, b);
+}
+
+static int DetourHook (int a, int b)
+{
+    return s_prevDetour(a, b);
+}
+
+static int StubHook (int a, int b)
+{
+    return s_prevStub(a, b);
+}
+
+// Mirrors how dx hands calls out to every registered callback.
+using DispatchHooks = hooks::Multiplexer<HookFn, HookSlot>;
+
+static void Subscriber (void*, int result, int, int)
+{
+    s_sink = result;
+}
+
+static void CallMany (HookFn* fn)
+{
+    HookFn* volatile call = fn;
+    int sum = 0;
+
+    for (size_t i = 0; i < HOOK_CALLS; ++i) {
+        sum += call((int)i, 1);
+    }
+
+    s_sink = sum;
+}
+
+// Calls `fn` through `call` a few times and keeps the fastest run, which is the one least
+// disturbed by whatever else the machine was doing.
+static Result Measure (const char variant[], HookFn* fn)
+{
+    Result result = { variant, 0, 0 };
+
+    for (size_t i = 0; i < REPEATS; ++i) {
+        const auto start = std::chrono::steady_clock::now();
+        const auto cycles = __rdtsc();
+
+        CallMany(fn);
+
+        const auto elapsed = __rdtsc() - cycles;
+        const auto seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        if (i == 0 || seconds < result.seconds) {
+            result.seconds = seconds;
+            result.cycles = elapsed;
+        }
+    }
+
+    return result;
+}
+
+// The sequences detours used before they were entered and left through plain jumps. The stubs
+// stand in for a detoured function's patched entry and its trampoline's exit, in front of a
+// function that isn't patched, so they cost the same two jumps per call a detour does.
+enum class Stub {
+    PushRet,    // push rax; movabs rax, imm64; xchg [rsp], rax; ret
+    JmpAbs,     // jmp [rip+0]; dq imm64
+};
+
+static void EmitStub (uint8_t* code, Stub stub, const void* to)
+{
+    if (stub == Stub::PushRet) {
+        const uint8_t push[] = { 0x50, 0x48, 0xb8 };
+        const uint8_t xchgRet[] = { 0x48, 0x87, 0x04, 0x24, 0xc3 };
+
+        memcpy(code, push, sizeof(push));
+        memcpy(code + sizeof(push), &to, sizeof(to));
+        memcpy(code + sizeof(push) + sizeof(to), xchgRet, sizeof(xchgRet));
+    } else {
+        const uint8_t jmp[] = { 0xff, 0x25, 0x00, 0x00, 0x00, 0x00 };
+
+        memcpy(code, jmp, sizeof(jmp));
+        memcpy(code + sizeof(jmp), &to, sizeof(to));
+    }
+}
+
+static bool MeasureStubs (const char variant[], Stub stub, std::vector<Result>* results)
+{
+    auto entry = (uint8_t*)trampoline::Allocate((const void*)TargetDirect, 16);
+    auto leave = (uint8_t*)trampoline::Allocate((const void*)TargetDirect, 16);
+
+    if (entry && leave) {
+        EmitStub(entry, stub, (const void*)StubHook);
+        EmitStub(leave, stub, (const void*)TargetDirect);
+        s_prevStub = (HookFn*)leave;
+
+        results->push_back(Measure(variant, (HookFn*)entry));
+    } else {
+        fprintf(stderr, "Could not allocate the %s stubs\n", variant);
+    }
+
+    trampoline::Free(entry);
+    trampoline::Free(leave);
+    return entry && leave;
+}
+
+static bool Run (std::vector<Result>* results)
+{
+    results->push_back(Measure("Direct", TargetDirect));
+
+    static void* s_vftable[] = { (void*)TargetInject };
+    hooks::VfTable vftable(s_vftable);
+    vftable.Inject<HookSlot>(InjectHook, &s_prevInject);
+    results->push_back(Measure("Inject", (HookFn*)s_vftable[0]));
+    vftable.Disable<HookSlot>();
+
+    auto detour = hooks::Detour(TargetDetour, DetourHook, &s_prevDetour);
+    if (!detour.IsValid()) {
+        fprintf(stderr, "Could not detour TargetDetour\n");
+        return false;
+    }
+
+    results->push_back(Measure("Detour", TargetDetour));
+
+    // What the detour would cost with the old jump sequences.
+    if (!MeasureStubs("PushRet", Stub::PushRet, results) || !MeasureStubs("JmpAbs", Stub::JmpAbs, results)) {
+        return false;
+    }
+
+    // Once without subscribers, which is what every multiplexed function costs while nothing is
+    // registered for it, and once with four.
+    auto dispatch = DispatchHooks::Install(TargetDispatch);
+    if (!dispatch.IsValid()) {
+        fprintf(stderr, "Could not detour TargetDispatch\n");
+        return false;
+    }
+
+    results->push_back(Measure("Dispatch0", TargetDispatch));
+
+    for (intptr_t i = 0; i < 4; ++i) {
+        DispatchHooks::AddPost(Subscriber, (void*)i);
+    }
+
+    results->push_back(Measure("Dispatch4", TargetDispatch));
+
+    for (intptr_t i = 0; i < 4; ++i) {
+        DispatchHooks::RemovePost(Subscriber, (void*)i);
+    }
+
+    return true;
+}
+
+int main (int argc, char** argv)
+{
+    const char* csvPath = nullptr;
+    for (int opt; (opt = getopt(argc, argv, "o:")) != -1;) {
+        if (opt != 'o') {
+            fprintf(stderr, "Usage: %s [-o results.csv]\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+
+        csvPath = optarg;
+    }
+
+    logging::Open(L"/dev/stderr");
+
+    std::vector<Result> results;
+    if (!Run(&results)) {
+        return EXIT_FAILURE;
+    }
+
+    auto csv = csvPath ? fopen(csvPath, "w") : nullptr;
+    if (csv) {
+        fprintf(csv, "variant,calls,seconds,ns_per_call,cycles_per_call\n");
+    }
+
+    for (const auto& result : results) {
+        const auto nanoseconds = result.seconds * 1e9 / HOOK_CALLS;
+        const auto cycles = (double)result.cycles / HOOK_CALLS;
+
+        printf("%-10s %6.2f ns/call, %6.1f cycles/call\n", result.variant, nanoseconds, cycles);
+        if (csv) {
+            fprintf(csv, "%s,%zu,%.6f,%.3f,%.2f\n", result.variant, HOOK_CALLS, result.seconds, nanoseconds, cycles);
+        }
+    }
+
+    if (csv) {
+        fclose(csv);
+    }
+
+    logging::Close();
+    return EXIT_SUCCESS;
+}
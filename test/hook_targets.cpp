@@ -0,0 +1,38 @@
+﻿// Copyright (c) 2015, Johan Sköld
+// License: https://opensource.org/licenses/ISC
+
+// Like test/main.cpp's Test, these are compiled without optimizations so they're never inlined
+// and have prologues long enough to detour. Their bodies all differ, so the linker won't fold
+// them into one function either.
+
+extern "C" int TargetDirect (int a, int b)
+{
+    int numA = a;
+    int numB = b;
+    int added = numA + numB;
+    return added;
+}
+
+extern "C" int TargetInject (int a, int b)
+{
+    int numA = a;
+    int numB = b;
+    int subtracted = numA - numB;
+    return subtracted;
+}
+
+extern "C" int TargetDetour (int a, int b)
+{
+    int numA = a;
+    int numB = b;
+    int multiplied = numA * numB;
+    return multiplied;
+}
+
+extern "C" int TargetDispatch (int a, int b)
+{
+    int numA = a;
+    int numB = b;
+    int xored = numA ^ numB;
+    return xored;
+}
@@ -0,0 +1,186 @@
+﻿// Copyright (c) 2015, Johan Sköld
+// License: https://opensource.org/licenses/ISC
+
+#pragma once
+
+#include "test.h"
+
+#include <cstring>
+#include <vector>
+
+#include <unistd.h>
+
+// Builds small x64 PE images for the tests of the engine's PE parsing, either laid out as a file
+// or as the loader would map it. Sections are placed one page apart in the order they're added,
+// so the RVA of the next one is known before its contents have to be.
+
+namespace test {
+
+    class Image
+    {
+        struct Section {
+            char name[IMAGE_SIZEOF_SHORT_NAME];
+            uint32_t rva;
+            uint32_t characteristics;
+            std::vector<uint8_t> data;
+        };
+
+        static const uint32_t PAGE_SIZE = 0x1000;
+        static const uint32_t FILE_ALIGNMENT = 0x200;
+        static const uint32_t HEADERS_SIZE = 0x400;
+        static const uint32_t NT_HEADERS_OFFSET = sizeof(IMAGE_DOS_HEADER);
+
+        std::vector<Section> m_sections;
+        IMAGE_DATA_DIRECTORY m_directories[IMAGE_NUMBEROF_DIRECTORY_ENTRIES] = {};
+
+        static uint32_t Align (size_t size, uint32_t alignment)
+        {
+            return (uint32_t)((size + alignment - 1) & ~(size_t)(alignment - 1));
+        }
+
+        // Where each section's data goes in a file.
+        std::vector<uint32_t> FileOffsets () const
+        {
+            std::vector<uint32_t> offsets;
+            auto offset = HEADERS_SIZE;
+
+            for (const auto& section : m_sections) {
+                offsets.push_back(offset);
+                offset += Align(section.data.size(), FILE_ALIGNMENT);
+            }
+
+            offsets.push_back(offset);
+            return offsets;
+        }
+
+        void WriteHeaders (uint8_t* out, bool mapped) const
+        {
+            IMAGE_DOS_HEADER dosHeader = {};
+            dosHeader.e_magic = IMAGE_DOS_SIGNATURE;
+            dosHeader.e_lfanew = NT_HEADERS_OFFSET;
+            memcpy(out, &dosHeader, sizeof(dosHeader));
+
+            IMAGE_NT_HEADERS64 ntHeaders = {};
+            ntHeaders.Signature = IMAGE_NT_SIGNATURE;
+            ntHeaders.FileHeader.Machine = IMAGE_FILE_MACHINE_AMD64;
+            ntHeaders.FileHeader.NumberOfSections = (uint16_t)m_sections.size();
+            ntHeaders.FileHeader.SizeOfOptionalHeader = sizeof(IMAGE_OPTIONAL_HEADER64);
+            ntHeaders.FileHeader.Characteristics = IMAGE_FILE_EXECUTABLE_IMAGE | IMAGE_FILE_LARGE_ADDRESS_AWARE | IMAGE_FILE_DLL;
+
+            auto& optionalHeader = ntHeaders.OptionalHeader;
+            optionalHeader.Magic = IMAGE_NT_OPTIONAL_HDR64_MAGIC;
+            optionalHeader.ImageBase = 0x180000000ull;
+            optionalHeader.SectionAlignment = PAGE_SIZE;
+            optionalHeader.FileAlignment = FILE_ALIGNMENT;
+            optionalHeader.SizeOfImage = Size();
+            optionalHeader.SizeOfHeaders = HEADERS_SIZE;
+            optionalHeader.NumberOfRvaAndSizes = IMAGE_NUMBEROF_DIRECTORY_ENTRIES;
+            memcpy(optionalHeader.DataDirectory, m_directories, sizeof(m_directories));
+            memcpy(out + NT_HEADERS_OFFSET, &ntHeaders, sizeof(ntHeaders));
+
+            const auto offsets = FileOffsets();
+            auto header = (IMAGE_SECTION_HEADER*)(out + NT_HEADERS_OFFSET + sizeof(ntHeaders));
+
+            for (size_t i = 0; i < m_sections.size(); ++i, ++header) {
+                const auto& section = m_sections[i];
+                IMAGE_SECTION_HEADER sectionHeader = {};
+
+                memcpy(sectionHeader.Name, section.name, sizeof(section.name));
+                sectionHeader.Misc.VirtualSize = (uint32_t)section.data.size();
+                sectionHeader.VirtualAddress = section.rva;
+                sectionHeader.SizeOfRawData = Align(section.data.size(), FILE_ALIGNMENT);
+                sectionHeader.PointerToRawData = mapped ? section.rva : offsets[i];
+                sectionHeader.Characteristics = section.characteristics;
+                memcpy(header, &sectionHeader, sizeof(sectionHeader));
+            }
+        }
+
+        public:
+            uint32_t NextRva () const
+            {
+                return m_sections.empty() ? PAGE_SIZE : m_sections.back().rva + Align((std::max)(m_sections.back().data.size(), (size_t)1), PAGE_SIZE);
+            }
+
+            // Adds a section at NextRva(), and returns its RVA.
+            uint32_t AddSection (const char* name, uint32_t characteristics, std::vector<uint8_t> data)
+            {
+                Section section = {};
+                memcpy(section.name, name, (std::min)(strlen(name), sizeof(section.name)));
+                section.rva = NextRva();
+                section.characteristics = characteristics;
+                section.data = std::move(data);
+
+                m_sections.push_back(std::move(section));
+                return m_sections.back().rva;
+            }
+
+            void SetDirectory (size_t index, uint32_t rva, uint32_t size)
+            {
+                m_directories[index].VirtualAddress = rva;
+                m_directories[index].Size = size;
+            }
+
+            // SizeOfImage, and so the number of bytes Map() writes.
+            uint32_t Size () const
+            {
+                return NextRva();
+            }
+
+            std::vector<uint8_t> File () const
+            {
+                const auto offsets = FileOffsets();
+                std::vector<uint8_t> file(offsets.back());
+
+                WriteHeaders(file.data(), false);
+
+                for (size_t i = 0; i < m_sections.size(); ++i) {
+                    std::copy(m_sections[i].data.begin(), m_sections[i].data.end(), file.begin() + offsets[i]);
+                }
+
+                return file;
+            }
+
+            // Lays the image out at `base` like the loader would, minus relocations and imports.
+            void Map (uint8_t* base) const
+            {
+                memset(base, 0, Size());
+                WriteHeaders(base, true);
+
+                for (const auto& section : m_sections) {
+                    std::copy(section.data.begin(), section.data.end(), base + section.rva);
+                }
+            }
+    };
+
+    // Writes `file` to disk and reads it back in, like the tools that scan executables do.
+    inline std::vector<uint8_t> ReadBack (const std::vector<uint8_t>& file)
+    {
+        char path[] = "/tmp/image.XXXXXX";
+        const auto fd = mkstemp(path);
+        CHECK(fd >= 0);
+        CHECK_EQ(write(fd, file.data(), file.size()), (ssize_t)file.size());
+        close(fd);
+
+        std::vector<uint8_t> read(file.size() + 1);
+        auto stream = fopen(path, "rb");
+        CHECK(stream);
+
+        if (stream) {
+            read.resize(fread(read.data(), 1, read.size(), stream));
+            fclose(stream);
+        }
+
+        unlink(path);
+        CHECK(read == file);
+        return read;
+    }
+
+    // Appends the bytes of `value` to `out`.
+    template <class T>
+    void Append (std::vector<uint8_t>* out, const T& value)
+    {
+        const auto bytes = (const uint8_t*)&value;
+        out->insert(out->end(), bytes, bytes + sizeof(value));
+    }
+
+} // namespace test
@@ -0,0 +1,269 @@
+﻿// Copyright (c) 2015, Johan Sköld
+// License: https://opensource.org/licenses/ISC
+
+#include "stdafx.h"
+#include "imports.h"
+
+#include "hooks.h"
+#include "image.h"
+#include "pe.h"
+#include "test.h"
+
+#include <sys/mman.h>
+
+// Builds an image importing functions by name and by ordinal, and checks the slots the index
+// finds for them, both in a file read back from disk and in a mapped image, where the loader's
+// part of filling in the slots is done by hand. Import hooks then swap the slots in the mapped
+// image.
+
+using Fn = int(int);
+
+struct Import {
+    const char* name;           // nullptr to import by ordinal
+    uint16_t ordinal;           // Also the hint of named imports
+};
+
+struct Dll {
+    const char* name;
+    std::vector<Import> imports;
+    bool lookup;                // Whether it has a lookup table, which old linkers left out
+};
+
+static const std::vector<Dll> DLLS = {
+    { "KERNEL32.dll", { { "CreateFileW", 0x10 }, { "ReadFile", 0x20 } }, true },
+    { "ordinal.DLL", { { nullptr, 7 }, { "Named", 0 }, { nullptr, 9 } }, true },
+    { "legacy.dll", { { "Legacy", 0 } }, false },
+};
+
+// Where each function's address goes, in the order of DLLS.
+static std::vector<uint32_t> s_slots;
+
+static uint32_t Slot (size_t dll, size_t import)
+{
+    size_t index = import;
+    for (size_t i = 0; i < dll; ++i) {
+        index += DLLS[i].imports.size();
+    }
+
+    return s_slots[index];
+}
+
+template <class T>
+static void Put (std::vector<uint8_t>* data, size_t offset, const T& value)
+{
+    memcpy(data->data() + offset, &value, sizeof(value));
+}
+
+// The import directory, followed by the lookup and address tables of each DLL, and then the
+// names. In a file both tables hold the same thing.
+static std::vector<uint8_t> Idata (uint32_t rva)
+{
+    std::vector<uint8_t> data((DLLS.size() + 1) * sizeof(IMAGE_IMPORT_DESCRIPTOR));
+    std::vector<uint32_t> lookups;
+    std::vector<uint32_t> addresses;
+
+    for (const auto& dll : DLLS) {
+        const auto size = (dll.imports.size() + 1) * sizeof(IMAGE_THUNK_DATA64);
+
+        lookups.push_back(dll.lookup ? (uint32_t)data.size() : 0);
+        data.resize(data.size() + (dll.lookup ? size : 0));
+        addresses.push_back((uint32_t)data.size());
+        data.resize(data.size() + size);
+    }
+
+    s_slots.clear();
+
+    for (size_t i = 0; i < DLLS.size(); ++i) {
+        const auto& dll = DLLS[i];
+
+        IMAGE_IMPORT_DESCRIPTOR descriptor = {};
+        descriptor.OriginalFirstThunk = dll.lookup ? rva + lookups[i] : 0;
+        descriptor.FirstThunk = rva + addresses[i];
+        descriptor.Name = rva + (uint32_t)data.size();
+        data.insert(data.end(), dll.name, dll.name + strlen(dll.name) + 1);
+        Put(&data, i * sizeof(descriptor), descriptor);
+
+        for (size_t j = 0; j < dll.imports.size(); ++j) {
+            const auto& import = dll.imports[j];
+            IMAGE_THUNK_DATA64 thunk = {};
+
+            if (import.name) {
+                data.resize((data.size() + 1) & ~(size_t)1);
+                thunk.u1.AddressOfData = rva + data.size();
+                test::Append(&data, import.ordinal);
+                data.insert(data.end(), import.name, import.name + strlen(import.name) + 1);
+            } else {
+                thunk.u1.Ordinal = IMAGE_ORDINAL_FLAG64 | import.ordinal;
+            }
+
+            const auto offset = j * sizeof(thunk);
+            if (dll.lookup) {
+                Put(&data, lookups[i] + offset, thunk);
+            }
+
+            Put(&data, addresses[i] + offset, thunk);
+            s_slots.push_back(rva + addresses[i] + (uint32_t)offset);
+        }
+    }
+
+    return data;
+}
+
+static test::Image BuildImage ()
+{
+    test::Image image;
+    image.AddSection(".text", IMAGE_SCN_CNT_CODE | IMAGE_SCN_MEM_EXECUTE | IMAGE_SCN_MEM_READ, std::vector<uint8_t>(0x100, 0xcc));
+
+    const auto rva = image.NextRva();
+    const auto idata = Idata(rva);
+    image.AddSection(".idata", IMAGE_SCN_CNT_INITIALIZED_DATA | IMAGE_SCN_MEM_READ, idata);
+    image.SetDirectory(IMAGE_DIRECTORY_ENTRY_IMPORT, rva, (uint32_t)((DLLS.size() + 1) * sizeof(IMAGE_IMPORT_DESCRIPTOR)));
+    return image;
+}
+
+static void CheckIndex (const imports::Index& index, bool mapped)
+{
+    CHECK_EQ(index.Count(), mapped ? 5u : 6u);
+
+    CHECK_EQ(index.Find("KERNEL32.dll", "CreateFileW"), Slot(0, 0));
+    CHECK_EQ(index.Find("kernel32", "ReadFile"), Slot(0, 1));
+    CHECK_EQ(index.Find("Kernel32.DLL", "ReadFile"), Slot(0, 1));
+    CHECK_EQ(index.Find("ordinal.dll", (uint16_t)7), Slot(1, 0));
+    CHECK_EQ(index.Find("ordinal", "Named"), Slot(1, 1));
+    CHECK_EQ(index.Find("ORDINAL", (uint16_t)9), Slot(1, 2));
+
+    // Only a file still has the names in the address table.
+    CHECK_EQ(index.Find("legacy.dll", "Legacy"), mapped ? 0u : Slot(2, 0));
+
+    CHECK_EQ(index.Find("kernel32", "WriteFile"), 0u);
+    CHECK_EQ(index.Find("kernel32", (uint16_t)0x10), 0u);
+    CHECK_EQ(index.Find("ordinal", (uint16_t)8), 0u);
+    CHECK_EQ(index.Find("ordinal", "7"), 0u);
+    CHECK_EQ(index.Find("user32", "CreateFileW"), 0u);
+}
+
+static void TestFile ()
+{
+    const auto read = test::ReadBack(BuildImage().File());
+    const pe::Image image(read.data(), read.size());
+    CHECK(image.IsValid());
+
+    imports::Index index;
+    index.Build(image);
+    CheckIndex(index, false);
+}
+
+static int Imported (int a)
+{
+    return a + 1;
+}
+
+static int Replacement (int a)
+{
+    return a + 2;
+}
+
+// Indices of modules are kept for as long as the process runs, so the image never goes away.
+// Every slot is bound to `Imported`, and the image is read-only after that, as a loaded one is.
+static uint8_t* MappedImage ()
+{
+    static uint8_t* s_base;
+
+    if (!s_base) {
+        const auto image = BuildImage();
+        auto base = mmap(nullptr, image.Size(), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        CHECK(base != MAP_FAILED);
+
+        s_base = (uint8_t*)base;
+        image.Map(s_base);
+
+        for (auto slot : s_slots) {
+            *(Fn**)(s_base + slot) = Imported;
+        }
+
+        mprotect(s_base, image.Size(), PROT_READ);
+    }
+
+    return s_base;
+}
+
+static void TestMapped ()
+{
+    CheckIndex(imports::ForModule(MappedImage()), true);
+}
+
+static void CheckHook (hooks::ImportHook* hook, Fn* prev, Fn** slot)
+{
+    CHECK(hook->IsValid());
+    CHECK(hook->IsEnabled());
+    CHECK_EQ(prev, Imported);
+    CHECK_EQ(*slot, Replacement);
+
+    CHECK(hook->Disable());
+    CHECK_EQ(*slot, Imported);
+    CHECK(hook->Enable());
+    CHECK_EQ(*slot, Replacement);
+}
+
+static void TestHookByName ()
+{
+    const auto base = MappedImage();
+    const auto slot = (Fn**)(base + Slot(0, 1));
+    Fn* prev = nullptr;
+
+    {
+        auto hook = hooks::HookImport(base, "kernel32.dll", "ReadFile", Replacement, &prev);
+        CheckHook(&hook, prev, slot);
+        CHECK_EQ(*(Fn**)(base + Slot(0, 0)), Imported);
+    }
+
+    // Destroying the hook puts the original back.
+    CHECK_EQ(*slot, Imported);
+}
+
+static void TestHookByOrdinal ()
+{
+    const auto base = MappedImage();
+    const auto slot = (Fn**)(base + Slot(1, 2));
+    Fn* prev = nullptr;
+
+    {
+        auto hook = hooks::HookImport(base, "ordinal.dll", (uint16_t)9, Replacement, &prev);
+        CheckHook(&hook, prev, slot);
+
+        // A moved hook is only restored once.
+        auto moved = std::move(hook);
+        CHECK(!hook.IsValid());
+        CHECK(moved.IsEnabled());
+        CHECK_EQ(*slot, Replacement);
+    }
+
+    CHECK_EQ(*slot, Imported);
+}
+
+static void TestMissing ()
+{
+    const auto base = MappedImage();
+    Fn* prev = Imported;
+
+    auto byName = hooks::HookImport(base, "kernel32.dll", "WriteFile", Replacement, &prev);
+    CHECK(!byName.IsValid());
+    CHECK(!prev);
+
+    auto byOrdinal = hooks::HookImport(base, "ordinal.dll", (uint16_t)8, Replacement, &prev);
+    CHECK(!byOrdinal.IsValid());
+    CHECK(!prev);
+
+    auto legacy = hooks::HookImport(base, "legacy.dll", "Legacy", Replacement, &prev);
+    CHECK(!legacy.IsValid());
+}
+
+int main ()
+{
+    RUN(TestFile);
+    RUN(TestMapped);
+    RUN(TestHookByName);
+    RUN(TestHookByOrdinal);
+    RUN(TestMissing);
+    return RESULT();
+}
@@ -0,0 +1,192 @@
+﻿// Copyright (c) 2015, Johan Sköld
+// License: https://opensource.org/licenses/ISC
+
+#include "stdafx.h"
+#include "lde.h"
+
+#include "test.h"
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+// The length decoder is checked against udis86 over all the machine code mapped into this
+// process: the test itself, libstdc++, libc and the dynamic loader. That's a few megabytes of
+// real compiler output, decoded linearly from the start of each executable mapping.
+
+struct Stats {
+    size_t instructions = 0;
+    size_t skipped = 0;             // Known udis86 mistakes
+    size_t lengths = 0;             // Length disagreements
+    size_t branches = 0;            // Branch kind or displacement disagreements
+    size_t rip = 0;                 // RIP-relative operand disagreements
+};
+
+struct Range {
+    const uint8_t* start;
+    const uint8_t* end;
+};
+
+static std::vector<Range> ExecutableMappings ()
+{
+    std::vector<Range> ranges;
+
+    auto maps = fopen("/proc/self/maps", "r");
+    if (!maps) {
+        return ranges;
+    }
+
+    char line[0x200];
+    while (fgets(line, sizeof(line), maps)) {
+        unsigned long long start, end;
+        char perms[5];
+
+        // Only file backed code; anything anonymous may be written to while it's read.
+        if (sscanf(line, "%llx-%llx %4s", &start, &end, perms) == 3 && perms[0] == 'r' && perms[2] == 'x' && strchr(line, '/')) {
+            ranges.push_back({ (const uint8_t*)start, (const uint8_t*)end });
+        }
+    }
+
+    fclose(maps);
+    return ranges;
+}
+
+static lde::Branch ExpectedBranch (const ud_t& ud)
+{
+    const auto mnemonic = ud_insn_mnemonic(&ud);
+    const auto op = ud_insn_opr(&ud, 0);
+    const auto relative = op && op->type == UD_OP_JIMM;
+
+    switch (mnemonic) {
+        case UD_Ijmp:       return relative ? lde::Branch::Jump : lde::Branch::Indirect;
+        case UD_Icall:      return relative ? lde::Branch::Call : lde::Branch::Indirect;
+        case UD_Iret:
+        case UD_Iretf:      return lde::Branch::Return;
+        case UD_Iloop:
+        case UD_Iloope:
+        case UD_Iloopne:
+        case UD_Ijrcxz:
+        case UD_Ijecxz:
+        case UD_Ijcxz:      return lde::Branch::Loop;
+        default:            return mnemonic >= UD_Ija && mnemonic <= UD_Ijz ? lde::Branch::Conditional : lde::Branch::None;
+    }
+}
+
+// Where udis86 says a relative branch displacement points, relative to the next instruction.
+static int64_t RelativeTarget (const ud_operand& op)
+{
+    switch (op.size) {
+        case 8:     return op.lval.sbyte;
+        case 16:    return op.lval.sword;
+        default:    return op.lval.sdword;
+    }
+}
+
+static bool HasRipOperand (const ud_t& ud)
+{
+    for (unsigned i = 0; auto op = ud_insn_opr(&ud, i); ++i) {
+        if (op->type == UD_OP_MEM && op->base == UD_R_RIP) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// udis86 takes an operand size prefix on a relative branch to mean a rel16, even with REX.W,
+// which takes precedence. glibc's TLS calls are padded out with exactly such prefixes.
+static bool IsMisdecoded (const ud_t& ud)
+{
+    const auto op = ud_insn_opr(&ud, 0);
+    return op && op->type == UD_OP_JIMM && op->size == 16 && (ud.pfx_rex & 0x08);
+}
+
+static void Compare (const uint8_t* start, const uint8_t* end, Stats* stats)
+{
+    ud_t ud;
+    ud_init(&ud);
+    ud_set_mode(&ud, 64);
+    ud_set_syntax(&ud, nullptr);
+
+    for (auto code = start; code < end;) {
+        ud_set_input_buffer(&ud, code, (size_t)(end - code));
+        const auto expected = ud_disassemble(&ud);
+        if (!expected) {
+            break;
+        }
+
+        // Padding and data between functions; both decoders are free to disagree on it.
+        if (ud_insn_mnemonic(&ud) == UD_Iinvalid) {
+            code += expected;
+            continue;
+        }
+
+        ++stats->instructions;
+
+        lde::Instruction insn;
+        const auto length = lde::Decode(code, (size_t)(end - code), &insn);
+
+        if (IsMisdecoded(ud)) {
+            ++stats->skipped;
+            code += length ? length : expected;
+            continue;
+        }
+
+        if (length != expected) {
+            ++stats->lengths;
+            if (stats->lengths <= 10) {
+                fprintf(stderr, "%p: %s is %u bytes, decoded as %zu\n", (const void*)code, ud_insn_hex(&ud), expected, length);
+            }
+        } else {
+            const auto op = ud_insn_opr(&ud, 0);
+            const auto branch = ExpectedBranch(ud);
+
+            const auto target = op && op->type == UD_OP_JIMM ? code + length + RelativeTarget(*op) : nullptr;
+
+            if (insn.branch != branch || (target && lde::BranchTarget(code, insn) != target)) {
+                ++stats->branches;
+                if (stats->branches <= 10) {
+                    fprintf(stderr, "%p: %s branch %d, decoded as %d\n", (const void*)code, ud_insn_hex(&ud), (int)branch, (int)insn.branch);
+                }
+            }
+
+            if ((insn.ripOffset != 0) != HasRipOperand(ud)) {
+                ++stats->rip;
+                if (stats->rip <= 10) {
+                    fprintf(stderr, "%p: %s rip-relative operand decoded at %u\n", (const void*)code, ud_insn_hex(&ud), insn.ripOffset);
+                }
+            }
+        }
+
+        code += expected;
+    }
+}
+
+static void TestCorpus ()
+{
+    Stats stats;
+    size_t bytes = 0;
+
+    for (const auto& range : ExecutableMappings()) {
+        Compare(range.start, range.end, &stats);
+        bytes += (size_t)(range.end - range.start);
+    }
+
+    printf("%zu instructions in %zu KB, %zu skipped: %zu length, %zu branch and %zu rip-relative disagreements\n",
+           stats.instructions,
+           bytes / 1024,
+           stats.skipped,
+           stats.lengths,
+           stats.branches,
+           stats.rip);
+
+    CHECK(stats.instructions > 100000);
+    CHECK_EQ(stats.lengths, 0u);
+    CHECK_EQ(stats.branches, 0u);
+    CHECK_EQ(stats.rip, 0u);
+}
+
+int main ()
+{
+    RUN(TestCorpus);
+    return RESULT();
+}
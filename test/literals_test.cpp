@@ -0,0 +1,203 @@
+﻿// Copyright (c) 2015, Johan Sköld
+// License: https://opensource.org/licenses/ISC
+
+#include "stdafx.h"
+#include "literals.h"
+
+#include "image.h"
+#include "pe.h"
+#include "test.h"
+#include "xref.h"
+
+// Builds an image with strings in .rdata, some of them too short or badly terminated to count,
+// and functions in .text that load them with a lea. Whether a string leads to a function depends
+// on how many functions with .pdata entries load it.
+
+const uint32_t TEXT_RVA = 0x1000;
+const uint32_t RDATA_RVA = 0x2000;
+
+struct Literal {
+    const char* ascii;          // Either this
+    const wchar_t* wide;        // Or this
+    size_t offset;              // Into .rdata
+    const char* end;            // What follows the string, which must be a null to end it
+};
+
+// Offsets of wide strings are even, as the compiler aligns them, except where noted.
+static const Literal LITERALS[] = {
+    { "abc", nullptr, 0x00, "" },               // Shorter than MIN_LENGTH
+    { "abcd", nullptr, 0x10, "" },
+    { "Unique", nullptr, 0x20, "" },
+    { "Shared", nullptr, 0x30, "" },
+    { "Copied", nullptr, 0x40, "" },
+    { "Copied", nullptr, 0x50, "" },
+    { "Leaf", nullptr, 0x60, "" },
+    { "Unterminated", nullptr, 0x70, "\x01" },
+    { nullptr, L"abc", 0x100, "" },
+    { nullptr, L"wxyz", 0x110, "" },
+    { nullptr, L"Wide unique", 0x120, "" },
+    { nullptr, L"Misaligned", 0x141, "" },    // Odd offset
+};
+
+// Functions, and the offset of the literal each of them loads. The last one is a leaf function
+// without a .pdata entry.
+struct Function {
+    uint32_t offset;            // Into .text
+    size_t literal;
+    bool pdata;
+};
+
+static const Function FUNCTIONS[] = {
+    { 0x00, 2, true },          // Unique
+    { 0x20, 3, true },          // Shared
+    { 0x40, 3, true },          // Shared
+    { 0x60, 4, true },          // The first copy
+    { 0x80, 5, true },          // The second copy
+    { 0xa0, 10, true },         // Wide unique
+    { 0xc0, 6, false },         // Leaf
+};
+
+const uint32_t FUNCTION_SIZE = 8;
+
+static std::vector<uint8_t> Rdata ()
+{
+    std::vector<uint8_t> rdata(0x200, 0xff);
+
+    for (const auto& literal : LITERALS) {
+        auto out = rdata.begin() + (ptrdiff_t)literal.offset;
+
+        if (literal.ascii) {
+            out = std::copy(literal.ascii, literal.ascii + strlen(literal.ascii), out);
+        } else {
+            for (auto c = literal.wide; *c; ++c) {
+                *out++ = (uint8_t)*c;
+                *out++ = 0;
+            }
+        }
+
+        if (*literal.end) {
+            *out = (uint8_t)*literal.end;
+        } else {
+            *out++ = 0;
+            *out = 0;
+        }
+    }
+
+    return rdata;
+}
+
+static std::vector<uint8_t> Text ()
+{
+    std::vector<uint8_t> text(0x100, 0xcc);
+
+    for (const auto& function : FUNCTIONS) {
+        const auto target = RDATA_RVA + (uint32_t)LITERALS[function.literal].offset;
+        const auto disp = (int32_t)(target - (TEXT_RVA + function.offset + 7));
+
+        const uint8_t code[] = {
+            0x48, 0x8d, 0x05, 0, 0, 0, 0,       // lea rax, [rip+literal]
+            0xc3,                               // ret
+        };
+
+        memcpy(text.data() + function.offset, code, sizeof(code));
+        memcpy(text.data() + function.offset + 3, &disp, sizeof(disp));
+    }
+
+    return text;
+}
+
+static std::vector<uint8_t> BuildFile ()
+{
+    test::Image image;
+    CHECK_EQ(image.AddSection(".text", IMAGE_SCN_CNT_CODE | IMAGE_SCN_MEM_EXECUTE | IMAGE_SCN_MEM_READ, Text()), TEXT_RVA);
+    CHECK_EQ(image.AddSection(".rdata", IMAGE_SCN_CNT_INITIALIZED_DATA | IMAGE_SCN_MEM_READ, Rdata()), RDATA_RVA);
+
+    const std::vector<uint8_t> xdata = { 1, 0, 0, 0 };
+    const auto xdataRva = image.AddSection(".xdata", IMAGE_SCN_CNT_INITIALIZED_DATA | IMAGE_SCN_MEM_READ, xdata);
+
+    std::vector<uint8_t> pdata;
+    for (const auto& function : FUNCTIONS) {
+        if (function.pdata) {
+            const RUNTIME_FUNCTION entry = { TEXT_RVA + function.offset, TEXT_RVA + function.offset + FUNCTION_SIZE, xdataRva };
+            test::Append(&pdata, entry);
+        }
+    }
+
+    const auto pdataRva = image.AddSection(".pdata", IMAGE_SCN_CNT_INITIALIZED_DATA | IMAGE_SCN_MEM_READ, pdata);
+    image.SetDirectory(IMAGE_DIRECTORY_ENTRY_EXCEPTION, pdataRva, (uint32_t)pdata.size());
+    return image.File();
+}
+
+static uint32_t LiteralRva (size_t index)
+{
+    return RDATA_RVA + (uint32_t)LITERALS[index].offset;
+}
+
+static uint32_t FunctionRva (size_t index)
+{
+    return TEXT_RVA + FUNCTIONS[index].offset;
+}
+
+// Strings of at least MIN_LENGTH characters count, whether ASCII or UTF-16.
+static void TestStrings ()
+{
+    const auto file = BuildFile();
+    const pe::Image image(file.data(), file.size());
+
+    xref::Index code;
+    code.Build(image);
+
+    literals::Index index;
+    index.Build(image, code);
+
+    CHECK(index.Find("abc").empty());
+    CHECK(index.Find("abcd") == std::vector<uint32_t> { LiteralRva(1) });
+    CHECK(index.Find("bcd").empty());
+    CHECK(index.Find("Unique") == std::vector<uint32_t> { LiteralRva(2) });
+    CHECK(index.Find("Unterminated").empty());
+
+    auto copies = index.Find("Copied");
+    std::sort(copies.begin(), copies.end());
+    CHECK((copies == std::vector<uint32_t> { LiteralRva(4), LiteralRva(5) }));
+
+    CHECK(index.Find(L"abc").empty());
+    CHECK(index.Find(L"wxyz") == std::vector<uint32_t> { LiteralRva(9) });
+    CHECK(index.Find(L"Wide unique") == std::vector<uint32_t> { LiteralRva(10) });
+    CHECK(index.Find(L"Misaligned").empty());
+
+    // The ASCII and UTF-16 strings are kept apart.
+    CHECK(index.Find(L"Unique").empty());
+    CHECK(index.Find("Wide unique").empty());
+
+    // abcd, Unique, Shared, both copies, Leaf, wxyz and Wide unique.
+    CHECK_EQ(index.Count(), 8u);
+}
+
+// Only a string loaded by exactly one function with a .pdata entry leads to it.
+static void TestFunctions ()
+{
+    const auto file = BuildFile();
+    const pe::Image image(file.data(), file.size());
+
+    xref::Index code;
+    code.Build(image);
+
+    literals::Index index;
+    index.Build(image, code);
+
+    CHECK_EQ(index.FindFunctionReferencing("Unique"), FunctionRva(0));
+    CHECK_EQ(index.FindFunctionReferencing("Shared"), 0u);
+    CHECK_EQ(index.FindFunctionReferencing("Copied"), 0u);
+    CHECK_EQ(index.FindFunctionReferencing("Leaf"), 0u);
+    CHECK_EQ(index.FindFunctionReferencing("abcd"), 0u);
+    CHECK_EQ(index.FindFunctionReferencing("Missing"), 0u);
+    CHECK_EQ(index.FindFunctionReferencing(L"Wide unique"), FunctionRva(5));
+    CHECK_EQ(index.FindFunctionReferencing(L"wxyz"), 0u);
+}
+
+int main ()
+{
+    RUN(TestStrings);
+    RUN(TestFunctions);
+    return RESULT();
+}
@@ -0,0 +1,199 @@
+﻿// Copyright (c) 2015, Johan Sköld
+// License: https://opensource.org/licenses/ISC
+
+#include "stdafx.h"
+#include "hooks.h"
+
+#include "test.h"
+
+#include <sys/mman.h>
+
+// Hooks the middle of a hand-assembled function and runs it. The function records the registers
+// it sees after the hook point, so the changes the callback made can be checked. Code mapped
+// outside of any module has no .pdata to say whether it's a leaf function, so it can be hooked
+// anywhere. The stub calls the callback as Windows would, hence `ms_abi`.
+
+// Where the function stores what it sees after the hook point, through rsi.
+struct Observed {
+    uint64_t rax, rdx;
+    uint8_t zf, cf, pad[6];
+    uint64_t rbx, r12, r8, rsp, rdi;
+};
+
+using Fn = void(uint64_t value, Observed* observed);
+
+const size_t HOOK_OFFSET = 26;
+const size_t SHIFT_OFFSET = 3;      // Where the stack is or isn't moved by 8 on the way in
+const size_t UNSHIFT_OFFSET = 66;   // And where it's moved back
+
+const uint64_t ZF = 0x40;
+const uint64_t CF = 0x01;
+
+static hooks::Context s_seen;
+static uintptr_t s_stack;
+static size_t s_calls;
+
+__attribute__((ms_abi))
+static void Callback (hooks::Context* context)
+{
+    // The compiler counts on the stack being aligned when it places this, so a stub that calls
+    // with a misaligned stack shows in its address.
+    alignas(16) volatile uint8_t local[16];
+    s_stack = (uintptr_t)local;
+
+    s_seen = *context;
+    ++s_calls;
+
+    context->rax += 100;
+    context->r8 = 0x1234;
+    context->rflags = (context->rflags & ~ZF) | CF;
+}
+
+class Code
+{
+    uint8_t* m_page;
+
+    public:
+        Code ()
+        {
+            m_page = (uint8_t*)mmap(nullptr, 0x1000, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            memset(m_page, 0xcc, 0x1000);
+        }
+
+        ~Code ()
+        {
+            munmap(m_page, 0x1000);
+        }
+
+        // Saves rbx and r12, which it fills from `value`, and sets the flags with a compare just
+        // before the hook point. With `shift`, the stack is moved by another 8 bytes, so that the
+        // hook point is reached with either alignment.
+        Fn* Assemble (bool shift)
+        {
+            static const uint8_t code[] = {
+                0x53,                                   // push rbx
+                0x41, 0x54,                             // push r12
+                0x0f, 0x1f, 0x40, 0x00,                 // nop, or sub rsp, 8
+                0x48, 0x89, 0xfb,                       // mov rbx, rdi
+                0x49, 0x89, 0xfc,                       // mov r12, rdi
+                0x49, 0xf7, 0xd4,                       // not r12
+                0x48, 0x89, 0xf8,                       // mov rax, rdi
+                0x48, 0x89, 0x66, 0x30,                 // mov [rsi+48], rsp
+                0x48, 0x39, 0xc0,                       // cmp rax, rax
+                0x48, 0x8d, 0x14, 0x00,                 // lea rdx, [rax+rax]   <- hooked
+                0x90,                                   // nop
+                0x48, 0x89, 0x06,                       // mov [rsi], rax
+                0x48, 0x89, 0x56, 0x08,                 // mov [rsi+8], rdx
+                0x0f, 0x94, 0xc1,                       // sete cl
+                0x88, 0x4e, 0x10,                       // mov [rsi+16], cl
+                0x0f, 0x92, 0xc1,                       // setb cl
+                0x88, 0x4e, 0x11,                       // mov [rsi+17], cl
+                0x48, 0x89, 0x5e, 0x18,                 // mov [rsi+24], rbx
+                0x4c, 0x89, 0x66, 0x20,                 // mov [rsi+32], r12
+                0x4c, 0x89, 0x46, 0x28,                 // mov [rsi+40], r8
+                0x48, 0x89, 0x7e, 0x38,                 // mov [rsi+56], rdi
+                0x0f, 0x1f, 0x40, 0x00,                 // nop, or add rsp, 8
+                0x41, 0x5c,                             // pop r12
+                0x5b,                                   // pop rbx
+                0xc3,                                   // ret
+            };
+
+            memcpy(m_page, code, sizeof(code));
+
+            if (shift) {
+                static const uint8_t sub[] = { 0x48, 0x83, 0xec, 0x08 };
+                static const uint8_t add[] = { 0x48, 0x83, 0xc4, 0x08 };
+                memcpy(m_page + SHIFT_OFFSET, sub, sizeof(sub));
+                memcpy(m_page + UNSHIFT_OFFSET, add, sizeof(add));
+            }
+
+            return (Fn*)m_page;
+        }
+
+        uint8_t* At (size_t offset) const
+        {
+            return m_page + offset;
+        }
+};
+
+static void CheckHooked (Fn* fn, uint64_t value)
+{
+    Observed observed = {};
+    s_calls = 0;
+    fn(value, &observed);
+
+    CHECK_EQ(s_calls, 1u);
+
+    // What the callback saw at the hook point.
+    CHECK_EQ(s_seen.rax, value);
+    CHECK_EQ(s_seen.rbx, value);
+    CHECK_EQ(s_seen.rsp, observed.rsp);
+    CHECK((s_seen.rflags & ZF) != 0);
+    CHECK((s_seen.rflags & CF) == 0);
+    CHECK_EQ(s_stack & 15, 0u);
+
+    // What it changed, as seen by the relocated instruction and the code after it.
+    CHECK_EQ(observed.rax, value + 100);
+    CHECK_EQ(observed.rdx, 2 * (value + 100));
+    CHECK_EQ(observed.r8, 0x1234u);
+    CHECK_EQ(observed.zf, 0);
+    CHECK_EQ(observed.cf, 1);
+
+    // What it had to leave alone.
+    CHECK_EQ(observed.rbx, value);
+    CHECK_EQ(observed.r12, ~value);
+    CHECK_EQ(observed.rdi, value);
+}
+
+static void CheckUnhooked (Fn* fn, uint64_t value)
+{
+    Observed observed = {};
+    s_calls = 0;
+    fn(value, &observed);
+
+    CHECK_EQ(s_calls, 0u);
+    CHECK_EQ(observed.rax, value);
+    CHECK_EQ(observed.rdx, 2 * value);
+    CHECK_EQ(observed.zf, 1);
+    CHECK_EQ(observed.cf, 0);
+}
+
+static void TestRegisters (bool shift)
+{
+    Code code;
+    const auto fn = code.Assemble(shift);
+
+    CheckUnhooked(fn, 7);
+
+    {
+        auto hook = hooks::MidHook(code.At(HOOK_OFFSET), (hooks::MidHookFn*)Callback, hooks::Context::RBX);
+        CHECK(hook.IsValid());
+        if (!hook.IsValid()) {
+            return;
+        }
+
+        CHECK_EQ(code.At(HOOK_OFFSET)[0], 0xe9);
+        CheckHooked(fn, 7);
+        CheckHooked(fn, 0x123456789);
+    }
+
+    CheckUnhooked(fn, 7);
+}
+
+// The call into the function leaves rsp 8 bytes off alignment, and two pushes keep it that way.
+static void TestMisaligned ()
+{
+    TestRegisters(false);
+}
+
+static void TestAligned ()
+{
+    TestRegisters(true);
+}
+
+int main ()
+{
+    RUN(TestAligned);
+    RUN(TestMisaligned);
+    return RESULT();
+}
@@ -0,0 +1,132 @@
+﻿// Copyright (c) 2015, Johan Sköld
+// License: https://opensource.org/licenses/ISC
+
+#include "stdafx.h"
+#include "hooks.h"
+
+#include "test.h"
+
+#include <thread>
+
+// Calls the dispatcher directly, with the original set by hand, so nothing needs detouring.
+
+static int Target (int a)
+{
+    return a * 2;
+}
+
+struct OrderTag;
+using Ordered = hooks::Multiplexer<int(int), OrderTag>;
+
+static std::vector<int> s_calls;
+
+static void Pre (void* user, int)
+{
+    s_calls.push_back((int)(intptr_t)user);
+}
+
+static void Post (void* user, int result, int)
+{
+    s_calls.push_back((int)(intptr_t)user * 100 + result);
+}
+
+// Pre subscribers run by order before the target, and post ones after it, with its result.
+static void TestOrder ()
+{
+    *Ordered::Original() = Target;
+    CHECK(Ordered::IsEmpty());
+    CHECK_EQ(Ordered::Dispatch(1), 2);
+
+    CHECK(Ordered::AddPre(Pre, (void*)2, 1));
+    CHECK(Ordered::AddPre(Pre, (void*)1, 0));
+    CHECK(Ordered::AddPre(Pre, (void*)3, 1));
+    CHECK(Ordered::AddPost(Post, (void*)1));
+    CHECK(!Ordered::IsEmpty());
+
+    s_calls.clear();
+    CHECK_EQ(Ordered::Dispatch(2), 4);
+    CHECK((s_calls == std::vector<int> { 1, 2, 3, 104 }));
+
+    CHECK(Ordered::RemovePre(Pre, (void*)2));
+    CHECK(!Ordered::RemovePre(Pre, (void*)2));
+    CHECK(!Ordered::RemovePost(Post, (void*)2));
+
+    s_calls.clear();
+    Ordered::Notify(6, 3);
+    CHECK((s_calls == std::vector<int> { 106 }));
+
+    CHECK(Ordered::RemovePre(Pre, (void*)1));
+    CHECK(Ordered::RemovePre(Pre, (void*)3));
+    CHECK(Ordered::RemovePost(Post, (void*)1));
+    CHECK(Ordered::IsEmpty());
+
+    s_calls.clear();
+    CHECK_EQ(Ordered::Dispatch(3), 6);
+    CHECK(s_calls.empty());
+}
+
+struct ChurnTag;
+using Churned = hooks::Multiplexer<int(int), ChurnTag>;
+
+const size_t CHURN_THREADS = 4;
+const size_t CHURN_CHANGES = 20000;
+const uint32_t CHURN_MAGIC = 0x5eb5c41b;
+
+static std::atomic<size_t> s_seen;
+
+static void Counter (void* user, int)
+{
+    // A freed list would hand out garbage here, if it didn't crash first.
+    CHECK_EQ(*(const uint32_t*)user, CHURN_MAGIC);
+    s_seen.fetch_add(1, std::memory_order_relaxed);
+}
+
+// Subscribers come and go while other threads dispatch, which frees the lists they replace.
+static void TestChurn ()
+{
+    static const uint32_t s_magic = CHURN_MAGIC;
+    *Churned::Original() = Target;
+
+    std::atomic<bool> stop(false);
+    std::atomic<size_t> started(0);
+    std::vector<std::thread> threads;
+
+    for (size_t i = 0; i < CHURN_THREADS; ++i) {
+        threads.emplace_back([&stop, &started] {
+            started.fetch_add(1);
+
+            while (!stop.load(std::memory_order_relaxed)) {
+                CHECK_EQ(Churned::Dispatch(5), 10);
+            }
+        });
+    }
+
+    while (started.load() < CHURN_THREADS) {
+        std::this_thread::yield();
+    }
+
+    // Until some subscriber has been called, so the lists were really in use.
+    for (size_t i = 0; i < CHURN_CHANGES || !s_seen.load(); ++i) {
+        CHECK(Churned::AddPre(Counter, (void*)&s_magic, (int)(i % 7)));
+
+        if (i % 3 == 2) {
+            CHECK(Churned::RemovePre(Counter, (void*)&s_magic));
+        }
+    }
+
+    stop = true;
+    for (auto& thread : threads) {
+        thread.join();
+    }
+
+    // Removing takes out every entry added with the same pointers, if the last change didn't.
+    Churned::RemovePre(Counter, (void*)&s_magic);
+    CHECK(Churned::IsEmpty());
+}
+
+int main ()
+{
+    RUN(TestOrder);
+    RUN(TestChurn);
+    return RESULT();
+}
@@ -0,0 +1,76 @@
+﻿// Copyright (c) 2015, Johan Sköld
+// License: https://opensource.org/licenses/ISC
+
+#include "stdafx.h"
+#include "util.h"
+
+#include "test.h"
+
+// Every index is visited exactly once, however the loop ends up spread over the pool.
+static void CheckLoop (size_t count, size_t threads)
+{
+    std::vector<std::atomic<int>> visits(count);
+    for (auto& visit : visits) {
+        visit = 0;
+    }
+
+    ParallelFor(count, threads, [&] (size_t i) {
+        visits[i].fetch_add(1);
+    });
+
+    for (const auto& visit : visits) {
+        CHECK_EQ(visit.load(), 1);
+    }
+}
+
+static void TestLoops ()
+{
+    CheckLoop(0, 4);
+    CheckLoop(1, 4);
+    CheckLoop(1000, 1);
+
+    // Workers are kept between loops, and more are started when a loop asks for them.
+    for (size_t threads = 2; threads <= 8; ++threads) {
+        CheckLoop(1000, threads);
+        CheckLoop(3, threads);
+    }
+}
+
+// A loop started while the pool is busy runs on its calling thread alone.
+static void TestNested ()
+{
+    std::atomic<size_t> visits(0);
+
+    ParallelFor(8, 4, [&] (size_t) {
+        ParallelFor(8, 4, [&] (size_t) {
+            visits.fetch_add(1);
+        });
+    });
+
+    CHECK_EQ(visits.load(), 64u);
+}
+
+static void TestConcurrent ()
+{
+    std::vector<std::thread> threads;
+
+    for (size_t i = 0; i < 4; ++i) {
+        threads.emplace_back([] {
+            for (size_t j = 0; j < 100; ++j) {
+                CheckLoop(100, 4);
+            }
+        });
+    }
+
+    for (auto& thread : threads) {
+        thread.join();
+    }
+}
+
+int main ()
+{
+    RUN(TestLoops);
+    RUN(TestNested);
+    RUN(TestConcurrent);
+    return RESULT();
+}
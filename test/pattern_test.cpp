@@ -0,0 +1,216 @@
+﻿// Copyright (c) 2015, Johan Sköld
+// License: https://opensource.org/licenses/ISC
+
+#include "stdafx.h"
+#include "pattern.h"
+
+#include "test.h"
+
+#include <string>
+#include <sys/mman.h>
+#include <unistd.h>
+
+// Every scanner is compared against a plain byte-by-byte search, over random data that's placed
+// right before an inaccessible page so reading past the end of a range crashes the test.
+
+struct Spec {
+    std::vector<char> bytes;
+    std::string mask;
+};
+
+static uint64_t s_random = 0x9e3779b97f4a7c15ull;
+
+static uint32_t NextRandom ()
+{
+    s_random ^= s_random << 13;
+    s_random ^= s_random >> 7;
+    s_random ^= s_random << 17;
+    return (uint32_t)s_random;
+}
+
+// Bytes are drawn from a small alphabet, so short patterns match often.
+static uint8_t RandomByte ()
+{
+    return (uint8_t)(NextRandom() % 4);
+}
+
+static Spec RandomSpec (size_t size)
+{
+    Spec spec;
+    spec.bytes.resize(size);
+    spec.mask.resize(size);
+
+    for (size_t i = 0; i < size; ++i) {
+        spec.bytes[i] = (char)RandomByte();
+        spec.mask[i] = NextRandom() % 4 ? 'x' : '?';
+    }
+
+    spec.mask[NextRandom() % size] = 'x';
+    return spec;
+}
+
+static std::vector<const uint8_t*> FindNaive (const uint8_t* start, const uint8_t* end, const Spec& spec)
+{
+    std::vector<const uint8_t*> matches;
+    const auto size = spec.mask.size();
+
+    for (auto ptr = start; (size_t)(end - ptr) >= size; ++ptr) {
+        size_t i = 0;
+        while (i < size && (spec.mask[i] != 'x' || ptr[i] == (uint8_t)spec.bytes[i])) {
+            ++i;
+        }
+
+        if (i == size) {
+            matches.push_back(ptr);
+        }
+    }
+
+    return matches;
+}
+
+// Random data ending right where an inaccessible page starts.
+class GuardedBuffer
+{
+    uint8_t* m_block;
+    size_t m_blockSize;
+
+    public:
+        uint8_t* start;
+        uint8_t* end;
+
+        GuardedBuffer (size_t size)
+        {
+            const auto page = (size_t)sysconf(_SC_PAGESIZE);
+            m_blockSize = (size + page - 1) / page * page + page;
+            m_block = (uint8_t*)mmap(nullptr, m_blockSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            mprotect(m_block + m_blockSize - page, page, PROT_NONE);
+
+            end = m_block + m_blockSize - page;
+            start = end - size;
+
+            for (auto ptr = start; ptr < end; ++ptr) {
+                *ptr = RandomByte();
+            }
+        }
+
+        ~GuardedBuffer ()
+        {
+            munmap(m_block, m_blockSize);
+        }
+};
+
+static void Plant (uint8_t* start, uint8_t* end, const Spec& spec, size_t count)
+{
+    const auto size = spec.mask.size();
+    for (size_t i = 0; i < count && (size_t)(end - start) >= size; ++i) {
+        const auto offset = NextRandom() % (end - start - size + 1);
+        memcpy(start + offset, spec.bytes.data(), size);
+    }
+
+    // One more right at the end, where the vector loops hand over to the tail.
+    memcpy(end - size, spec.bytes.data(), size);
+}
+
+static void TestPattern ()
+{
+    GuardedBuffer buffer(0x40000 + 13);
+
+    for (size_t i = 0; i < 200; ++i) {
+        const auto spec = RandomSpec(1 + NextRandom() % 40);
+        Plant(buffer.start, buffer.end, spec, 8);
+
+        const hooks::Pattern pattern(spec.bytes.data(), spec.mask.c_str());
+        CHECK_EQ(pattern.Size(), spec.mask.size());
+
+        // Ranges of every alignment, including ones shorter than the pattern.
+        const auto start = buffer.start + NextRandom() % 64;
+        const auto end = buffer.end - (i % 2 ? 0 : NextRandom() % 64);
+        const auto expected = FindNaive(start, end, spec);
+
+        CHECK_EQ(pattern.Find(start, end), expected.empty() ? nullptr : expected[0]);
+        CHECK(pattern.FindAll(start, end) == expected);
+
+        CHECK_EQ(pattern.Find(start, end, 4), expected.empty() ? nullptr : expected[0]);
+        CHECK(pattern.FindAll(start, end, 4) == expected);
+
+        const auto tiny = start + spec.mask.size() / 2;
+        CHECK(pattern.FindAll(start, tiny) == FindNaive(start, tiny, spec));
+
+        for (auto match : expected) {
+            CHECK(pattern.Matches(match, end));
+        }
+
+        const auto found = hooks::FindPattern((uintptr_t)start, (uintptr_t)end, spec.bytes.data(), spec.mask.c_str());
+        CHECK_EQ(found, expected.empty() ? 0 : (uintptr_t)expected[0]);
+    }
+}
+
+static void TestSignature ()
+{
+    static constexpr auto s_signature = hooks::MakeSignature("48 8D 0D ?? ?? ?? ?? E8 ?? ?? ?? ?? 48 8B C3");
+    const char bytes[] = "\x48\x8D\x0D\0\0\0\0\xE8\0\0\0\0\x48\x8B\xC3";
+
+    GuardedBuffer buffer(0x10000);
+    const Spec spec = { std::vector<char>(bytes, bytes + 15), "xxx????x????xxx" };
+    Plant(buffer.start, buffer.end, spec, 16);
+
+    // A byte that differs within the wildcards still matches.
+    buffer.start[100] = 0x48;
+    buffer.start[101] = 0x8d;
+    buffer.start[102] = 0x0d;
+    memset(buffer.start + 103, 0xcc, 4);
+    buffer.start[107] = 0xe8;
+    memset(buffer.start + 108, 0xcc, 4);
+    memcpy(buffer.start + 112, "\x48\x8B\xC3", 3);
+
+    const hooks::Pattern pattern(s_signature);
+    const auto expected = FindNaive(buffer.start, buffer.end, spec);
+
+    CHECK(expected.size() >= 2);
+    CHECK(pattern.FindAll(buffer.start, buffer.end) == expected);
+    CHECK(hooks::Pattern(spec.bytes.data(), spec.mask.c_str()).FindAll(buffer.start, buffer.end) == expected);
+}
+
+// Batches split their range into chunks for threads, so matches near chunk boundaries must be
+// reported once, by the chunk they start in.
+static void TestBatch ()
+{
+    GuardedBuffer buffer(0x200000 + 7);
+
+    std::vector<Spec> specs;
+    hooks::PatternBatch batch;
+
+    for (size_t i = 0; i < 40; ++i) {
+        // Single concrete bytes have no pair of adjacent bytes to be keyed by.
+        specs.push_back(i < 4 ? Spec{ { (char)RandomByte(), 0, 0 }, "x??" } : RandomSpec(2 + NextRandom() % 30));
+        Plant(buffer.start, buffer.end, specs.back(), 32);
+        CHECK_EQ(batch.Add(specs.back().bytes.data(), specs.back().mask.c_str()), i);
+    }
+
+    CHECK_EQ(batch.Count(), specs.size());
+
+    for (size_t threads : { 1, 3, 8 }) {
+        const auto start = buffer.start + threads;
+        batch.Scan((uintptr_t)start, (uintptr_t)buffer.end, threads);
+
+        for (size_t i = 0; i < specs.size(); ++i) {
+            std::vector<uintptr_t> expected;
+            for (auto match : FindNaive(start, buffer.end, specs[i])) {
+                expected.push_back((uintptr_t)match);
+            }
+
+            auto matches = batch.Matches(i);
+            std::sort(matches.begin(), matches.end());
+            CHECK(matches == expected);
+            CHECK(batch.Stats(i).candidates >= expected.size());
+        }
+    }
+}
+
+int main ()
+{
+    RUN(TestPattern);
+    RUN(TestSignature);
+    RUN(TestBatch);
+    return RESULT();
+}
@@ -0,0 +1,251 @@
+﻿// Copyright (c) 2015, Johan Sköld
+// License: https://opensource.org/licenses/ISC
+
+#include "stdafx.h"
+#include "pdata.h"
+
+#include "hooks.h"
+#include "image.h"
+#include "pe.h"
+#include "test.h"
+
+#include <sys/mman.h>
+
+// Builds an image whose exception directory has split, chained and unsorted entries, and checks
+// the index built from it, both as read back from a file and as mapped. The mapped image is also
+// executable, so detours of its functions can check that they stay inside them.
+
+using Fn = int(int);
+
+const uint32_t TEXT_RVA = 0x1000;
+
+// Functions in .text, as offsets into it. The gap between B and the cold part of A is a leaf
+// function, without an entry.
+const uint32_t A_BEGIN = 0x00;
+const uint32_t A_SPLIT = 0x20;          // A continues in a second entry chained to the first
+const uint32_t A_END = 0x30;
+const uint32_t B_BEGIN = 0x40;
+const uint32_t B_END = 0x60;
+const uint32_t LEAF = 0x60;
+const uint32_t A_COLD_BEGIN = 0x80;     // Split off from A, chained through its unwind info
+const uint32_t A_COLD_END = 0x90;
+const uint32_t EMPTY = 0xa0;            // An entry without a size, which is ignored
+const uint32_t SHORT_BEGIN = 0xc0;      // A function too short to detour
+const uint32_t SHORT_END = 0xc3;
+const uint32_t NEXT_BEGIN = 0xc3;       // And the one right after it
+const uint32_t NEXT_END = 0xc7;
+const uint32_t LONG_BEGIN = 0x100;      // One that's just long enough
+const uint32_t LONG_END = 0x109;
+
+static std::vector<uint8_t> Text ()
+{
+    std::vector<uint8_t> text(0x200, 0xcc);
+
+    const uint8_t shortFn[] = { 0x89, 0xf8, 0xc3 };             // mov eax, edi; ret
+    const uint8_t nextFn[] = { 0x8d, 0x47, 0x01, 0xc3 };        // lea eax, [rdi+1]; ret
+    const uint8_t longFn[] = {
+        0x8d, 0x47, 0x02,                                       // lea eax, [rdi+2]
+        0x90, 0x90, 0x90, 0x90, 0x90,                           // nop
+        0xc3,                                                   // ret
+    };
+
+    std::copy(std::begin(shortFn), std::end(shortFn), text.begin() + SHORT_BEGIN);
+    std::copy(std::begin(nextFn), std::end(nextFn), text.begin() + NEXT_BEGIN);
+    std::copy(std::begin(longFn), std::end(longFn), text.begin() + LONG_BEGIN);
+    return text;
+}
+
+static test::Image BuildImage ()
+{
+    test::Image image;
+    image.AddSection(".text", IMAGE_SCN_CNT_CODE | IMAGE_SCN_MEM_EXECUTE | IMAGE_SCN_MEM_READ, Text());
+
+    const auto xdataRva = image.NextRva();
+    const auto pdataRva = xdataRva + 0x1000;
+
+    // The primary entry of A is the first one in .pdata.
+    const RUNTIME_FUNCTION a = { TEXT_RVA + A_BEGIN, TEXT_RVA + A_SPLIT, xdataRva };
+
+    // Plain unwind info, then unwind info with a single code, padded to two, that chains to A.
+    std::vector<uint8_t> xdata = { 1, 0, 0, 0 };
+    const auto chainedRva = xdataRva + (uint32_t)xdata.size();
+    xdata.insert(xdata.end(), { 1 | (UNW_FLAG_CHAININFO << 3), 0, 1, 0, 0, 0, 0, 0 });
+    test::Append(&xdata, a);
+    image.AddSection(".xdata", IMAGE_SCN_CNT_INITIALIZED_DATA | IMAGE_SCN_MEM_READ, xdata);
+
+    const RUNTIME_FUNCTION entries[] = {
+        a,
+        { TEXT_RVA + LONG_BEGIN, TEXT_RVA + LONG_END, xdataRva },
+        { TEXT_RVA + A_COLD_BEGIN, TEXT_RVA + A_COLD_END, chainedRva },
+        { TEXT_RVA + B_BEGIN, TEXT_RVA + B_END, xdataRva },
+        { TEXT_RVA + A_SPLIT, TEXT_RVA + A_END, pdataRva | 1 },
+        { TEXT_RVA + EMPTY, TEXT_RVA + EMPTY, xdataRva },
+        { TEXT_RVA + NEXT_BEGIN, TEXT_RVA + NEXT_END, xdataRva },
+        { TEXT_RVA + SHORT_BEGIN, TEXT_RVA + SHORT_END, xdataRva },
+    };
+
+    std::vector<uint8_t> pdata;
+    for (const auto& entry : entries) {
+        test::Append(&pdata, entry);
+    }
+
+    CHECK_EQ(image.AddSection(".pdata", IMAGE_SCN_CNT_INITIALIZED_DATA | IMAGE_SCN_MEM_READ, pdata), pdataRva);
+    image.SetDirectory(IMAGE_DIRECTORY_ENTRY_EXCEPTION, pdataRva, (uint32_t)pdata.size());
+    return image;
+}
+
+static void CheckFunction (const pdata::Index& index, uint32_t begin, uint32_t end, uint32_t primary)
+{
+    for (auto offset : { begin, (begin + end) / 2, end - 1 }) {
+        const auto function = index.Find(TEXT_RVA + offset);
+        CHECK(function);
+
+        if (function) {
+            CHECK_EQ(function->begin, TEXT_RVA + begin);
+            CHECK_EQ(function->end, TEXT_RVA + end);
+            CHECK_EQ(function->primary, TEXT_RVA + primary);
+        }
+    }
+}
+
+static void CheckIndex (const pdata::Index& index)
+{
+    CHECK_EQ(index.Count(), 6u);
+
+    CheckFunction(index, A_BEGIN, A_END, A_BEGIN);
+    CheckFunction(index, B_BEGIN, B_END, B_BEGIN);
+    CheckFunction(index, A_COLD_BEGIN, A_COLD_END, A_BEGIN);
+    CheckFunction(index, SHORT_BEGIN, SHORT_END, SHORT_BEGIN);
+    CheckFunction(index, NEXT_BEGIN, NEXT_END, NEXT_BEGIN);
+    CheckFunction(index, LONG_BEGIN, LONG_END, LONG_BEGIN);
+
+    CHECK(!index.Find(0));
+    CHECK(!index.Find(TEXT_RVA + A_END));
+    CHECK(!index.Find(TEXT_RVA + LEAF));
+    CHECK(!index.Find(TEXT_RVA + EMPTY));
+    CHECK(!index.Find(TEXT_RVA + LONG_END));
+    CHECK(!index.Find(UINT32_MAX));
+
+    const auto& functions = index.Functions();
+    CHECK(std::is_sorted(functions.begin(), functions.end(), [] (const pdata::Function& a, const pdata::Function& b) {
+        return a.begin < b.begin;
+    }));
+}
+
+static void TestFile ()
+{
+    const auto read = test::ReadBack(BuildImage().File());
+    const pe::Image image(read.data(), read.size());
+    CHECK(image.IsValid());
+    CHECK(!image.IsMapped());
+
+    pdata::Index index;
+    index.Build(image);
+    CheckIndex(index);
+
+    // Truncated in the middle of .pdata, the last section, there's no exception directory left
+    // to read.
+    const auto pdataRva = image.NtHeaders()->OptionalHeader.DataDirectory[IMAGE_DIRECTORY_ENTRY_EXCEPTION].VirtualAddress;
+    const auto pdata = image.FromRva(pdataRva);
+    CHECK(pdata);
+
+    const pe::Image truncated(read.data(), (size_t)(pdata - read.data()) + 4 * sizeof(RUNTIME_FUNCTION));
+    index.Build(truncated);
+    CHECK_EQ(index.Count(), 0u);
+}
+
+// Indices of modules are kept for as long as the process runs, so the image never goes away.
+static uint8_t* MappedImage ()
+{
+    static uint8_t* s_base;
+
+    if (!s_base) {
+        const auto image = BuildImage();
+        auto base = mmap(nullptr, image.Size(), PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        CHECK(base != MAP_FAILED);
+
+        s_base = (uint8_t*)base;
+        image.Map(s_base);
+    }
+
+    return s_base;
+}
+
+static void TestMapped ()
+{
+    const auto base = MappedImage();
+    CheckIndex(pdata::ForModule(base));
+    CHECK_EQ(&pdata::ForModule(base), &pdata::ForModule(base));
+}
+
+static Fn* s_prev;
+
+static int Hook (int a)
+{
+    return s_prev(a) + 100;
+}
+
+// A detour may only cover the function it's for, however short that is.
+static void TestDetour ()
+{
+    const auto text = MappedImage() + TEXT_RVA;
+    const auto shortFn = (Fn*)(text + SHORT_BEGIN);
+    const auto nextFn = (Fn*)(text + NEXT_BEGIN);
+    const auto longFn = (Fn*)(text + LONG_BEGIN);
+
+    {
+        std::vector<uint8_t> original(text + SHORT_BEGIN, text + NEXT_END);
+        auto detour = hooks::Detour(shortFn, Hook, &s_prev);
+
+        CHECK(!detour.IsValid());
+        CHECK(memcmp(text + SHORT_BEGIN, original.data(), original.size()) == 0);
+        CHECK_EQ(shortFn(1), 1);
+        CHECK_EQ(nextFn(1), 2);
+    }
+
+    {
+        auto detour = hooks::Detour(longFn, Hook, &s_prev);
+        CHECK(detour.IsValid());
+        CHECK_EQ(longFn(1), 103);
+        CHECK_EQ(nextFn(1), 2);
+    }
+
+    CHECK_EQ(longFn(1), 3);
+}
+
+static void MidHookCallback (hooks::Context*)
+{
+}
+
+// Mid-function hooks need to know where the function starts, to find what branches into them.
+static void TestMidHook ()
+{
+    const auto text = MappedImage() + TEXT_RVA;
+
+    {
+        std::vector<uint8_t> original(text + LEAF, text + A_COLD_BEGIN);
+        auto hook = hooks::MidHook(text + LEAF, MidHookCallback);
+
+        CHECK(!hook.IsValid());
+        CHECK(memcmp(text + LEAF, original.data(), original.size()) == 0);
+    }
+
+    // The stub calls the callback as Windows would, so it's only placed here, not run.
+    const auto nops = text + LONG_BEGIN + 3;
+    {
+        auto hook = hooks::MidHook(nops, MidHookCallback);
+        CHECK(hook.IsValid());
+        CHECK_EQ(nops[0], 0xe9);
+    }
+
+    CHECK_EQ(nops[0], 0x90);
+}
+
+int main ()
+{
+    RUN(TestFile);
+    RUN(TestMapped);
+    RUN(TestDetour);
+    RUN(TestMidHook);
+    return RESULT();
+}
@@ -0,0 +1,171 @@
+﻿// Copyright (c) 2015, Johan Sköld
+// License: https://opensource.org/licenses/ISC
+
+#include "stdafx.h"
+#include "platform.h"
+
+#include "test.h"
+
+#include <signal.h>
+#include <sys/mman.h>
+
+using platform::Access;
+
+static uint8_t* Map (size_t size, int protection)
+{
+    auto block = mmap(nullptr, size, protection, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    return block == MAP_FAILED ? nullptr : (uint8_t*)block;
+}
+
+static void TestMemory ()
+{
+    const auto page = platform::PageSize();
+    auto block = Map(page * 4, PROT_READ | PROT_WRITE);
+    CHECK(block);
+
+    platform::Region region;
+    CHECK(platform::Query((uintptr_t)block + page, &region));
+    CHECK(!region.free);
+    CHECK(region.base <= (uintptr_t)block && (uintptr_t)block + page * 4 <= region.base + region.size);
+
+    // Freeing the middle leaves a hole that can be reserved again, at exactly that address.
+    munmap(block + page, page * 2);
+    CHECK(platform::Query((uintptr_t)block + page * 2, &region));
+    CHECK(region.free);
+    CHECK_EQ(region.base, (uintptr_t)block + page);
+    CHECK_EQ(region.size, page * 2);
+
+    CHECK(!platform::Reserve((uintptr_t)block, page, Access::ReadWrite));
+    auto reserved = (uint8_t*)platform::Reserve((uintptr_t)block + page, page, Access::ReadWrite);
+    CHECK_EQ(reserved, block + page);
+
+    Access previous;
+    CHECK(platform::Protect(reserved + 16, 16, Access::Read, &previous));
+    CHECK(previous == Access::ReadWrite);
+    CHECK(platform::Protect(reserved, page, Access::ReadWriteExecute, &previous));
+    CHECK(previous == Access::Read);
+
+    platform::Release(reserved, page);
+    munmap(block, page);
+    munmap(block + page * 3, page);
+}
+
+static void TestModuleFromAddress ()
+{
+    const auto page = platform::PageSize();
+    auto block = Map(page * 4, PROT_READ | PROT_WRITE);
+    CHECK(block);
+
+    // An image that covers the first three pages, with the last one left over.
+    auto dosHeader = (IMAGE_DOS_HEADER*)block;
+    dosHeader->e_magic = IMAGE_DOS_SIGNATURE;
+    dosHeader->e_lfanew = 0x80;
+
+    auto ntHeaders = (IMAGE_NT_HEADERS64*)(block + 0x80);
+    ntHeaders->Signature = IMAGE_NT_SIGNATURE;
+    ntHeaders->OptionalHeader.SizeOfImage = (uint32_t)(page * 3);
+
+    CHECK_EQ(platform::ModuleFromAddress(block), (const void*)block);
+    CHECK_EQ(platform::ModuleFromAddress(block + page * 2 + 100), (const void*)block);
+    CHECK(!platform::ModuleFromAddress(block + page * 3));
+
+    // The walk stops at the first page that can't be read.
+    mprotect(block + page, page, PROT_NONE);
+    CHECK(!platform::ModuleFromAddress(block + page * 2));
+    CHECK(!platform::ModuleFromAddress(block + page));
+
+    ntHeaders->Signature = 0;
+    CHECK(!platform::ModuleFromAddress(block));
+
+    munmap(block, page * 4);
+}
+
+// Runs hand-written code that loops on itself until it's rewritten, so where the thread is
+// executing is known exactly.
+static void TestThreadFreeze ()
+{
+    const auto page = platform::PageSize();
+    auto code = Map(page, PROT_READ | PROT_WRITE | PROT_EXEC);
+    CHECK(code);
+
+    code[0] = 0xeb;     // jmp $
+    code[1] = 0xfe;
+    code[2] = 0xc3;     // ret
+
+    std::atomic<bool> started(false);
+    std::thread spinner([&] {
+        started = true;
+        ((void(*)())code)();
+    });
+
+    // Spin until the thread is seen inside the loop.
+    while (!started) {
+        std::this_thread::yield();
+    }
+
+    auto stopped = false;
+    for (size_t i = 0; i < 1000 && !stopped; ++i) {
+        platform::ThreadFreeze threads;
+        stopped = threads.IsExecuting((uintptr_t)code, (uintptr_t)code + 2);
+    }
+
+    CHECK(stopped);
+
+    {
+        platform::ThreadFreeze threads;
+        CHECK(threads.IsExecuting((uintptr_t)code, (uintptr_t)code + 2));
+        CHECK(!threads.IsExecuting((uintptr_t)code + 2, (uintptr_t)code + 3));
+
+        // Nothing runs while frozen, so this can't be torn by the thread executing it.
+        code[0] = 0x90;     // nop
+        code[1] = 0x90;
+    }
+
+    spinner.join();
+    munmap(code, page);
+}
+
+// A thread that blocks every signal can't be stopped, and is left running instead of hanging
+// the freeze. Later freezes aren't confused by the signal it has pending.
+static void TestThreadFreezeBlocked ()
+{
+    std::atomic<bool> started(false);
+    std::atomic<bool> done(false);
+
+    std::thread blocked([&] {
+        sigset_t all;
+        sigfillset(&all);
+        pthread_sigmask(SIG_BLOCK, &all, nullptr);
+
+        started = true;
+        while (!done) {
+            std::this_thread::yield();
+        }
+    });
+
+    while (!started) {
+        std::this_thread::yield();
+    }
+
+    {
+        platform::ThreadFreeze threads;
+        CHECK(!threads.IsExecuting(0, UINTPTR_MAX));
+    }
+
+    {
+        platform::ThreadFreeze threads;
+        CHECK(!threads.IsExecuting(0, UINTPTR_MAX));
+    }
+
+    done = true;
+    blocked.join();
+}
+
+int main ()
+{
+    RUN(TestMemory);
+    RUN(TestModuleFromAddress);
+    RUN(TestThreadFreeze);
+    RUN(TestThreadFreezeBlocked);
+    return RESULT();
+}
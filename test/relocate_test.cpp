@@ -0,0 +1,243 @@
+﻿// Copyright (c) 2015, Johan Sköld
+// License: https://opensource.org/licenses/ISC
+
+#include "stdafx.h"
+#include "hooks.h"
+
+#include "test.h"
+
+#include <sys/mman.h>
+
+// Detours hand-assembled functions whose first instructions are relative to where they are, and
+// calls the originals through their trampolines, which only works if those instructions were
+// relocated correctly. Arguments arrive in edi, as the System V ABI has it.
+
+using Fn = int(int);
+
+const size_t DATA_OFFSET = 0x800;
+const int DATA_VALUE = 1000;
+
+static Fn* s_prev;
+
+static int Hook (int a)
+{
+    return s_prev(a) + 1;
+}
+
+class Code
+{
+    uint8_t* m_page;
+
+    public:
+        Code ()
+        {
+            m_page = (uint8_t*)mmap(nullptr, 0x1000, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            memset(m_page, 0xcc, 0x1000);
+            memcpy(m_page + DATA_OFFSET, &DATA_VALUE, sizeof(DATA_VALUE));
+        }
+
+        ~Code ()
+        {
+            munmap(m_page, 0x1000);
+        }
+
+        // Places the function at the start of the page, with every rip-relative displacement
+        // marked by a zero dword pointed at the data.
+        Fn* Assemble (std::initializer_list<uint8_t> bytes, std::initializer_list<size_t> ripOffsets = {})
+        {
+            std::copy(bytes.begin(), bytes.end(), m_page);
+
+            for (auto offset : ripOffsets) {
+                const auto disp = (int32_t)(DATA_OFFSET - (offset + 4));
+                memcpy(m_page + offset, &disp, sizeof(disp));
+            }
+
+            return (Fn*)m_page;
+        }
+
+        // Where the instruction after the dword at `offset` jumps to with its rel32.
+        void SetRel32 (size_t offset, size_t target)
+        {
+            const auto disp = (int32_t)(target - (offset + 4));
+            memcpy(m_page + offset, &disp, sizeof(disp));
+        }
+
+        const uint8_t* Bytes () const
+        {
+            return m_page;
+        }
+};
+
+// Detours `fn`, and checks that it returns `expected` for `arg` with and without the detour.
+static void CheckDetour (Fn* fn, int arg, int expected)
+{
+    CHECK_EQ(fn(arg), expected);
+
+    {
+        auto detour = hooks::Detour(fn, Hook, &s_prev);
+        CHECK(detour.IsValid());
+        if (!detour.IsValid()) {
+            return;
+        }
+
+        CHECK_EQ(fn(arg), expected + 1);
+        CHECK_EQ(s_prev(arg), expected);
+    }
+
+    // The original bytes are back once the detour is gone.
+    CHECK_EQ(fn(arg), expected);
+}
+
+static void CheckRefused (Fn* fn, const uint8_t* bytes, size_t size)
+{
+    std::vector<uint8_t> original(bytes, bytes + size);
+
+    auto detour = hooks::Detour(fn, Hook, &s_prev);
+    CHECK(!detour.IsValid());
+    CHECK(!s_prev);
+    CHECK(memcmp(bytes, original.data(), size) == 0);
+}
+
+static void TestLea ()
+{
+    Code code;
+    auto fn = code.Assemble({
+        0x48, 0x8d, 0x05, 0, 0, 0, 0,   // lea rax, [rip+data]
+        0x8b, 0x00,                     // mov eax, [rax]
+        0x01, 0xf8,                     // add eax, edi
+        0xc3,                           // ret
+    }, { 3 });
+
+    CheckDetour(fn, 5, DATA_VALUE + 5);
+}
+
+static void TestMov ()
+{
+    Code code;
+    auto fn = code.Assemble({
+        0x8b, 0x05, 0, 0, 0, 0,         // mov eax, [rip+data]
+        0x29, 0xf8,                     // sub eax, edi
+        0xc3,                           // ret
+    }, { 2 });
+
+    CheckDetour(fn, 5, DATA_VALUE - 5);
+}
+
+// Instructions with an immediate after the displacement, which the displacement is relative to
+// the end of.
+static void TestImmediate ()
+{
+    Code code;
+    auto fn = code.Assemble({
+        0x83, 0x3d, 0, 0, 0, 0, 0x00,   // cmp dword [rip+data], 0
+        0x74, 0x03,                     // je +3
+        0x89, 0xf8,                     // mov eax, edi
+        0xc3,                           // ret
+        0x31, 0xc0,                     // xor eax, eax
+        0xc3,                           // ret
+    }, { 2 });
+
+    CheckDetour(fn, 7, 7);
+}
+
+// Short conditional jumps are widened, and both of their ways out still go to the same places.
+static void TestShortJcc ()
+{
+    Code code;
+    auto fn = code.Assemble({
+        0x85, 0xff,                     // test edi, edi
+        0x74, 0x06,                     // je +6
+        0x8d, 0x47, 0x01,               // lea eax, [rdi+1]
+        0xc3,                           // ret
+        0xcc, 0xcc,
+        0xb8, 0x2a, 0x00, 0x00, 0x00,   // mov eax, 42
+        0xc3,                           // ret
+    });
+
+    CheckDetour(fn, 0, 42);
+    CheckDetour(fn, 3, 4);
+}
+
+static void TestCall ()
+{
+    Code code;
+    auto fn = code.Assemble({
+        0xe8, 0, 0, 0, 0,               // call callee
+        0x01, 0xf8,                     // add eax, edi
+        0xc3,                           // ret
+        0xb8, 0x07, 0x00, 0x00, 0x00,   // callee: mov eax, 7
+        0xc3,                           // ret
+    });
+
+    code.SetRel32(1, 8);
+    CheckDetour(fn, 1, 8);
+}
+
+static void TestJmp ()
+{
+    Code code;
+    auto fn = code.Assemble({
+        0x89, 0xf8,                     // mov eax, edi
+        0xe9, 0, 0, 0, 0,               // jmp elsewhere
+        0xcc,
+        0x83, 0xc0, 0x02,               // elsewhere: add eax, 2
+        0xc3,                           // ret
+    });
+
+    code.SetRel32(3, 8);
+    CheckDetour(fn, 1, 3);
+}
+
+// loop and jrcxz have no rel32 form, and branches back into the overwritten bytes would land in
+// the middle of the jump to the detour.
+static void TestRefused ()
+{
+    {
+        Code code;
+        auto fn = code.Assemble({
+            0x31, 0xc0,                 // xor eax, eax
+            0x89, 0xf9,                 // mov ecx, edi
+            0xe3, 0x02,                 // jrcxz +2
+            0xff, 0xc0,                 // inc eax
+            0xc3,                       // ret
+        });
+
+        CheckRefused(fn, code.Bytes(), 9);
+    }
+
+    {
+        Code code;
+        auto fn = code.Assemble({
+            0x31, 0xc0,                 // xor eax, eax
+            0xff, 0xc0,                 // inc eax
+            0xe2, 0xfc,                 // loop -4
+            0xc3,                       // ret
+        });
+
+        CheckRefused(fn, code.Bytes(), 7);
+    }
+
+    {
+        Code code;
+        auto fn = code.Assemble({
+            0xff, 0xcf,                 // dec edi
+            0x75, 0xfc,                 // jne -4
+            0x89, 0xf8,                 // mov eax, edi
+            0xc3,                       // ret
+        });
+
+        CheckRefused(fn, code.Bytes(), 7);
+    }
+}
+
+int main ()
+{
+    RUN(TestLea);
+    RUN(TestMov);
+    RUN(TestImmediate);
+    RUN(TestShortJcc);
+    RUN(TestCall);
+    RUN(TestJmp);
+    RUN(TestRefused);
+    return RESULT();
+}
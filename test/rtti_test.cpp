@@ -0,0 +1,144 @@
+﻿// Copyright (c) 2015, Johan Sköld
+// License: https://opensource.org/licenses/ISC
+
+#include "stdafx.h"
+#include "rtti.h"
+
+#include "image.h"
+#include "pe.h"
+#include "test.h"
+#include "util.h"
+
+#include <sys/mman.h>
+
+// Builds an image with hand-made RTTI in .rdata: one class with a proper CompleteObjectLocator,
+// and one for each way a locator can be wrong. Only the first may end up in the index, both in
+// a file read back from disk and in a mapped image, where the slots hold actual addresses.
+
+struct CompleteObjectLocator {
+    uint32_t signature;
+    uint32_t offset;
+    uint32_t cdOffset;
+    uint32_t typeDescriptor;
+    uint32_t classDescriptor;
+    uint32_t self;
+};
+
+struct Class {
+    const char* name;
+    uint32_t signature;
+    uint32_t offset;
+    uint32_t selfDelta;             // Added to the locator's own RVA in `self`
+};
+
+static const Class CLASSES[] = {
+    { ".?AVGood@@", 1, 0, 0 },
+    { ".?AVBadSignature@@", 0, 0, 0 },
+    { ".?AVBadOffset@@", 1, 8, 0 },
+    { ".?AVBadSelf@@", 1, 0, 0x20 },
+};
+
+const uint32_t TEXT_RVA = 0x1000;
+const size_t VFTABLE_SIZE = 3;
+const size_t CLASS_SIZE = 0x100;
+
+// Where each class's vftable is, right after the slot pointing at its locator.
+static uint32_t VfTableRva (uint32_t rdata, size_t index)
+{
+    return rdata + (uint32_t)(index * CLASS_SIZE) + 0x88;
+}
+
+template <class T>
+static void Put (std::vector<uint8_t>* data, size_t offset, const T& value)
+{
+    memcpy(data->data() + offset, &value, sizeof(value));
+}
+
+// Every class takes CLASS_SIZE bytes: its type descriptor, then its locator at +0x60, and the
+// slot pointing at the locator at +0x80, followed by the vftable. Pointers are relative to
+// `imageBase`.
+static std::vector<uint8_t> Rdata (uint32_t rva, uint64_t imageBase)
+{
+    const auto count = ArraySize(CLASSES);
+    std::vector<uint8_t> data(count * CLASS_SIZE);
+
+    for (size_t i = 0; i < count; ++i) {
+        const auto& cls = CLASSES[i];
+        const auto offset = i * CLASS_SIZE;
+
+        // type_info's vftable and the spare pointer, then the name.
+        Put(&data, offset, imageBase + TEXT_RVA);
+        memcpy(data.data() + offset + 16, cls.name, strlen(cls.name) + 1);
+
+        const auto colRva = rva + (uint32_t)offset + 0x60;
+        const CompleteObjectLocator col = { cls.signature, cls.offset, 0, rva + (uint32_t)offset, 0, colRva + cls.selfDelta };
+        Put(&data, offset + 0x60, col);
+        Put(&data, offset + 0x80, imageBase + colRva);
+
+        for (size_t j = 0; j < VFTABLE_SIZE; ++j) {
+            Put(&data, offset + 0x88 + j * 8, imageBase + TEXT_RVA + j * 0x10);
+        }
+    }
+
+    return data;
+}
+
+// The RVA of .rdata is known up front, as it's the section after .text.
+static test::Image BuildImage (uint64_t imageBase)
+{
+    test::Image image;
+    image.AddSection(".text", IMAGE_SCN_CNT_CODE | IMAGE_SCN_MEM_EXECUTE | IMAGE_SCN_MEM_READ, std::vector<uint8_t>(0x100, 0xc3));
+
+    const auto rva = image.NextRva();
+    image.AddSection(".rdata", IMAGE_SCN_CNT_INITIALIZED_DATA | IMAGE_SCN_MEM_READ, Rdata(rva, imageBase));
+    return image;
+}
+
+static void CheckIndex (const rtti::Index& index)
+{
+    const auto rdata = TEXT_RVA + 0x1000;
+
+    CHECK_EQ(index.Count(), 1u);
+    CHECK_EQ(index.Find(".?AVGood@@"), VfTableRva(rdata, 0));
+
+    for (size_t i = 1; i < ArraySize(CLASSES); ++i) {
+        CHECK_EQ(index.Find(CLASSES[i].name), 0u);
+    }
+
+    CHECK_EQ(index.Find(".?AVMissing@@"), 0u);
+}
+
+static void TestFile ()
+{
+    // Files hold pointers based on the preferred image base.
+    const auto read = test::ReadBack(BuildImage(0x180000000ull).File());
+    const pe::Image image(read.data(), read.size());
+    CHECK(image.IsValid());
+    CHECK_EQ(image.ImageBase(), 0x180000000ull);
+
+    rtti::Index index;
+    index.Build(image);
+    CheckIndex(index);
+}
+
+static void TestMapped ()
+{
+    const auto size = BuildImage(0).Size();
+    auto base = (uint8_t*)mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    CHECK(base != MAP_FAILED);
+
+    BuildImage((uint64_t)base).Map(base);
+
+    rtti::Index index;
+    index.Build(pe::Image(base));
+    CheckIndex(index);
+
+    munmap(base, size);
+}
+
+int main ()
+{
+    RUN(TestFile);
+    RUN(TestMapped);
+    return RESULT();
+}
@@ -0,0 +1,439 @@
+﻿// Copyright (c) 2015, Johan Sköld
+// License: https://opensource.org/licenses/ISC
+
+#include "stdafx.h"
+#include "hooks.h"
+
+#include "pattern.h"
+#include "pe.h"
+#include "util.h"
+
+#include <unistd.h>
+
+// Times every scanner variant against a synthetic image, and an executable read from disk when
+// one is given, such as the game's. Results are printed, and written as CSV so separate runs can
+// be compared.
+namespace bench {
+
+    ///
+    // Statics
+    ///
+
+    struct Options {
+        const char* csvPath = nullptr;
+        size_t syntheticSize = 64 * 1024 * 1024;    // Size of the synthetic .text section, or 0 to skip it
+        const char* file = nullptr;                 // Executable to read from disk, or null to skip it
+        size_t maxThreads = WorkerCount();          // Every thread count up to this is measured
+    };
+
+    const size_t REPEATS = 5;
+    const size_t SECTION_LOOKUPS = 10000;
+    const uint32_t HEADERS_SIZE = 0x400;
+    const uint32_t TEXT_RVA = 0x1000;
+    const size_t MEGABYTE = 1024 * 1024;
+
+    struct Target {
+        const char* name;
+        const uint8_t* bytes;
+        const uint8_t* mask;
+        size_t size;
+        size_t perMegabyte;         // Copies planted in the synthetic image, or 0 for one at the end
+        hooks::Pattern pattern;
+    };
+
+    struct Image {
+        const char* name;
+        const void* base;           // Start of the PE headers
+        const uint8_t* start;       // Start of .text
+        const uint8_t* end;
+    };
+
+    struct Result {
+        const char* image;
+        const char* variant;
+        size_t threads;
+        size_t bytes;
+        size_t iterations;
+        size_t matches;
+        double seconds;
+        uint64_t cycles;
+    };
+
+    // A mix of sequences that are common in x64 code, which produce lots of candidates and
+    // matches, and the signatures used by the features, which only show up once. The latter are
+    // planted near the end of the synthetic image, so a first-match search has to visit all of it.
+    static constexpr auto s_prologue = hooks::MakeSignature("48 89 5C 24 ?? 57 48 83 EC ??");
+    static constexpr auto s_leaCall = hooks::MakeSignature("48 8D 0D ?? ?? ?? ?? E8 ?? ?? ?? ??");
+    static constexpr auto s_thisCall = hooks::MakeSignature("40 53 48 83 EC 20 48 8B D9 E8 ?? ?? ?? ?? 48 8B C3");
+    static constexpr auto s_movieCtor = hooks::MakeSignature("48 83 EC 20 33 ED 48 8D 05 ?? ?? ?? ?? 4C 8D 35 ?? ?? ?? ?? "
+                                                             "4C 89 31 C7 41 ?? ?? ?? ?? ?? 48 89 69 18 48 89 01");
+    static constexpr auto s_triShapeCtor = hooks::MakeSignature("E8 ?? ?? ?? ?? 48 8D 05 ?? ?? ?? ?? C6 87 58 01 00 00 03 "
+                                                                "48 89 07 33 C0 89 87 60 01 00 00 66 89 87 64 01 00 00");
+
+
+    ///
+    // Locals
+    ///
+
+    template <size_t N>
+    static Target MakeTarget (const char name[], const hooks::Signature<N>& signature, size_t perMegabyte)
+    {
+        return { name, signature.bytes, signature.mask, N, perMegabyte, hooks::Pattern(signature) };
+    }
+
+    static uint64_t NextRandom (uint64_t* state)
+    {
+        // xorshift64*
+        auto x = *state;
+        x ^= x >> 12;
+        x ^= x << 25;
+        x ^= x >> 27;
+        *state = x;
+        return x * 0x2545f4914f6cdd1dull;
+    }
+
+    // The scan we started out with: compare every signature at every offset, one byte at a time.
+    static const uint8_t* FindNaive (const uint8_t* start, const uint8_t* end, const Target& target)
+    {
+        for (auto ptr = start; (size_t)(end - ptr) >= target.size; ++ptr) {
+            size_t i = 0;
+            while (i < target.size && (!target.mask[i] || ptr[i] == target.bytes[i])) {
+                ++i;
+            }
+
+            if (i == target.size) {
+                return ptr;
+            }
+        }
+
+        return nullptr;
+    }
+
+    static bool ReadExecutable (const char path[], std::vector<uint8_t>* data)
+    {
+        auto file = fopen(path, "rb");
+        if (!file) {
+            ERR("Could not open %s (%d)", path, errno);
+            return false;
+        }
+
+        auto result = fseek(file, 0, SEEK_END) == 0;
+        const auto size = ftell(file);
+        result = result && size > 0 && fseek(file, 0, SEEK_SET) == 0;
+
+        if (result) {
+            data->resize((size_t)size);
+            result = fread(data->data(), 1, data->size(), file) == data->size();
+        }
+
+        fclose(file);
+
+        if (!result) {
+            ERR("Failed to read %s", path);
+        }
+
+        return result;
+    }
+
+    // Builds a PE file with a single .text section filled with bytes following the frequency of
+    // x64 code, and plants copies of the targets in it.
+    static std::vector<uint8_t> BuildSynthetic (size_t textSize, const std::vector<Target>& targets)
+    {
+        textSize = (textSize + 0x1ff) & ~(size_t)0x1ff;
+        std::vector<uint8_t> data(HEADERS_SIZE + textSize);
+
+        auto dosHeader = (IMAGE_DOS_HEADER*)data.data();
+        dosHeader->e_magic = IMAGE_DOS_SIGNATURE;
+        dosHeader->e_lfanew = sizeof(*dosHeader);
+
+        auto ntHeaders = (IMAGE_NT_HEADERS*)(data.data() + dosHeader->e_lfanew);
+        ntHeaders->Signature = IMAGE_NT_SIGNATURE;
+        ntHeaders->FileHeader.Machine = IMAGE_FILE_MACHINE_AMD64;
+        ntHeaders->FileHeader.NumberOfSections = 1;
+        ntHeaders->FileHeader.SizeOfOptionalHeader = sizeof(ntHeaders->OptionalHeader);
+        ntHeaders->FileHeader.Characteristics = IMAGE_FILE_EXECUTABLE_IMAGE | IMAGE_FILE_LARGE_ADDRESS_AWARE;
+        ntHeaders->OptionalHeader.Magic = IMAGE_NT_OPTIONAL_HDR64_MAGIC;
+        ntHeaders->OptionalHeader.SectionAlignment = 0x1000;
+        ntHeaders->OptionalHeader.FileAlignment = 0x200;
+        ntHeaders->OptionalHeader.SizeOfHeaders = HEADERS_SIZE;
+        ntHeaders->OptionalHeader.SizeOfImage = (uint32_t)(TEXT_RVA + ((textSize + 0xfff) & ~(size_t)0xfff));
+
+        auto text = IMAGE_FIRST_SECTION(ntHeaders);
+        memcpy(text->Name, ".text", 5);
+        text->Misc.VirtualSize = (uint32_t)textSize;
+        text->VirtualAddress = TEXT_RVA;
+        text->SizeOfRawData = (uint32_t)textSize;
+        text->PointerToRawData = HEADERS_SIZE;
+        text->Characteristics = IMAGE_SCN_CNT_CODE | IMAGE_SCN_MEM_EXECUTE | IMAGE_SCN_MEM_READ;
+
+        // Expand the byte frequencies into a table that can be sampled with 16 random bits. The
+        // frequencies are on a log scale, where 24 steps roughly doubles the likelihood.
+        std::vector<uint8_t> table;
+        table.reserve(0x10000);
+
+        uint64_t weights[256];
+        uint64_t total = 0;
+
+        for (size_t i = 0; i < 256; ++i) {
+            const auto freq = hooks::detail::BYTE_FREQUENCY[i];
+            weights[i] = (1ull << (freq / 24)) * (24 + freq % 24);
+            total += weights[i];
+        }
+
+        for (size_t i = 0; i < 256; ++i) {
+            table.resize((std::min)(table.size() + (size_t)(weights[i] * 0x10000 / total), (size_t)0x10000), (uint8_t)i);
+        }
+
+        table.resize(0x10000, 0x00);
+
+        uint64_t state = 0x9e3779b97f4a7c15ull;
+        auto code = data.data() + HEADERS_SIZE;
+
+        for (size_t i = 0; i < textSize; i += 4) {
+            const auto bits = NextRandom(&state);
+            for (size_t j = 0; j < 4 && i + j < textSize; ++j) {
+                code[i + j] = table[(bits >> (j * 16)) & 0xffff];
+            }
+        }
+
+        auto plant = [&] (const Target& target, size_t offset) {
+            if (offset <= textSize && target.size <= textSize - offset) {
+                for (size_t i = 0; i < target.size; ++i) {
+                    if (target.mask[i]) {
+                        code[offset + i] = target.bytes[i];
+                    }
+                }
+            }
+        };
+
+        for (size_t i = 0; i < targets.size(); ++i) {
+            const auto& target = targets[i];
+
+            if (!target.perMegabyte) {
+                plant(target, textSize - (std::min)((i + 1) * 0x1000, textSize));
+                continue;
+            }
+
+            const auto stride = MEGABYTE / target.perMegabyte;
+            for (auto offset = i * 64; offset < textSize; offset += stride) {
+                plant(target, offset);
+            }
+        }
+
+        return data;
+    }
+
+    // Runs `fn` a few times and keeps the fastest run, which is the one least disturbed by
+    // whatever else the machine was doing.
+    template <class F>
+    static Result Measure (const Image&  image,
+                           const char    variant[],
+                           size_t        threads,
+                           size_t        iterations,
+                           const F&      fn)
+    {
+        Result result = { image.name, variant, threads, (size_t)(image.end - image.start), iterations, 0, 0, 0 };
+
+        for (size_t i = 0; i < REPEATS; ++i) {
+            const auto start = std::chrono::steady_clock::now();
+            const auto cycles = __rdtsc();
+
+            result.matches = fn();
+
+            const auto elapsed = __rdtsc() - cycles;
+            const auto seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+            if (i == 0 || seconds < result.seconds) {
+                result.seconds = seconds;
+                result.cycles = elapsed;
+            }
+        }
+
+        return result;
+    }
+
+    static void RunImage (const Image& image, const std::vector<Target>& targets, size_t maxThreads, std::vector<Result>* results)
+    {
+        LOG("Benchmarking %s: %zu KB of .text", image.name, (size_t)(image.end - image.start) / 1024);
+
+        const auto count = targets.size();
+
+        results->push_back(Measure(image, "Naive", 1, count, [&] {
+            size_t matches = 0;
+            for (const auto& target : targets) {
+                matches += FindNaive(image.start, image.end, target) ? 1 : 0;
+            }
+            return matches;
+        }));
+
+        // Start every worker up front, so that creating them isn't part of any measurement.
+        ParallelFor(maxThreads, maxThreads, [] (size_t) { });
+
+        for (size_t threads = 1; threads <= maxThreads; ++threads) {
+            results->push_back(Measure(image, "Find", threads, count, [&] {
+                size_t matches = 0;
+                for (const auto& target : targets) {
+                    matches += target.pattern.Find(image.start, image.end, threads) ? 1 : 0;
+                }
+                return matches;
+            }));
+
+            results->push_back(Measure(image, "FindAll", threads, count, [&] {
+                size_t matches = 0;
+                for (const auto& target : targets) {
+                    matches += target.pattern.FindAll(image.start, image.end, threads).size();
+                }
+                return matches;
+            }));
+
+            hooks::PatternBatch batch;
+            for (const auto& target : targets) {
+                batch.Add(target.pattern);
+            }
+
+            results->push_back(Measure(image, "PatternBatch", threads, count, [&] {
+                batch.Scan((uintptr_t)image.start, (uintptr_t)image.end, threads);
+
+                size_t matches = 0;
+                for (size_t i = 0; i < batch.Count(); ++i) {
+                    matches += batch.Matches(i).size();
+                }
+                return matches;
+            }));
+        }
+
+        auto lookup = Measure(image, "FindSection", 1, SECTION_LOOKUPS, [&] {
+            size_t matches = 0;
+            for (size_t i = 0; i < SECTION_LOOKUPS; ++i) {
+                matches += hooks::FindSection(image.base, ".text") ? 1 : 0;
+            }
+            return matches;
+        });
+
+        lookup.bytes = 0;
+        results->push_back(lookup);
+    }
+
+    static void WriteCsv (const char path[], const std::vector<Result>& results)
+    {
+        auto file = fopen(path, "w");
+        if (!file) {
+            ERR("Could not open benchmark results for writing (%d)", errno);
+            return;
+        }
+
+        fprintf(file, "image,variant,threads,bytes,iterations,matches,seconds,mb_per_s,cycles_per_byte,cycles_per_iteration\n");
+
+        for (const auto& result : results) {
+            const auto megabytes = (double)result.bytes / MEGABYTE;
+            fprintf(file,
+                    "%s,%s,%zu,%zu,%zu,%zu,%.6f,%.1f,%.3f,%.1f\n",
+                    result.image,
+                    result.variant,
+                    result.threads,
+                    result.bytes,
+                    result.iterations,
+                    result.matches,
+                    result.seconds,
+                    result.seconds > 0 ? megabytes / result.seconds : 0.0,
+                    result.bytes ? (double)result.cycles / result.bytes : 0.0,
+                    (double)result.cycles / (std::max)(result.iterations, (size_t)1));
+        }
+
+        fclose(file);
+    }
+
+
+    ///
+    // Run
+    ///
+
+    static void Run (const Options& options)
+    {
+        ScopedTimer timer(__FUNCTION__, "Benchmark finished in %u.%u ms");
+
+        std::vector<Target> targets;
+        targets.push_back(MakeTarget("Prologue", s_prologue, 64));
+        targets.push_back(MakeTarget("LeaCall", s_leaCall, 64));
+        targets.push_back(MakeTarget("ThisCall", s_thisCall, 4));
+        targets.push_back(MakeTarget("MovieCtor", s_movieCtor, 0));
+        targets.push_back(MakeTarget("TriShapeCtor", s_triShapeCtor, 0));
+
+        std::vector<Result> results;
+
+        if (options.syntheticSize) {
+            auto data = BuildSynthetic(options.syntheticSize, targets);
+            auto text = hooks::FindSection(data.data(), ".text");
+            auto start = data.data() + text->PointerToRawData;
+            RunImage({ "Synthetic", data.data(), start, start + text->SizeOfRawData }, targets, options.maxThreads, &results);
+        }
+
+        std::vector<uint8_t> file;
+        if (options.file && ReadExecutable(options.file, &file)) {
+            // FindSection trusts the headers it's given, so they're validated by pe::Image first.
+            pe::Image image(file.data(), file.size());
+            const uint8_t* start;
+            const uint8_t* end;
+
+            if (image.IsValid() && image.SectionRange(image.Section(".text"), &start, &end)) {
+                RunImage({ "File", file.data(), start, end }, targets, options.maxThreads, &results);
+            } else {
+                ERR("%s is not an executable with a .text section", options.file);
+            }
+        }
+
+        for (const auto& result : results) {
+            printf("%-9s %-12s x%zu: %7.1f MB/s, %.2f cycles/byte, %.1f cycles/iteration, %zu matches\n",
+                result.image,
+                result.variant,
+                result.threads,
+                result.seconds > 0 ? (double)result.bytes / MEGABYTE / result.seconds : 0.0,
+                result.bytes ? (double)result.cycles / result.bytes : 0.0,
+                (double)result.cycles / (std::max)(result.iterations, (size_t)1),
+                result.matches);
+        }
+
+        if (options.csvPath) {
+            WriteCsv(options.csvPath, results);
+        }
+    }
+
+} // namespace bench
+
+int main (int argc, char** argv)
+{
+    logging::Open(L"/dev/stderr");
+
+    // Sizes are in megabytes, and capped so the synthetic image fits in a PE section.
+    const size_t maxSize = 1024;
+    const size_t maxThreads = 256;
+    bench::Options options;
+
+    for (int opt; (opt = getopt(argc, argv, "s:f:o:t:")) != -1;) {
+        switch (opt) {
+            case 's':
+                options.syntheticSize = (std::min)((size_t)strtoul(optarg, nullptr, 10), maxSize) * bench::MEGABYTE;
+                break;
+
+            case 'f':
+                options.file = optarg;
+                break;
+
+            case 'o':
+                options.csvPath = optarg;
+                break;
+
+            case 't':
+                options.maxThreads = (std::max)((std::min)((size_t)strtoul(optarg, nullptr, 10), maxThreads), (size_t)1);
+                break;
+
+            default:
+                fprintf(stderr, "Usage: %s [-s megabytes] [-f executable] [-o results.csv] [-t threads]\n", argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+
+    bench::Run(options);
+    logging::Close();
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,32 @@
+﻿// Copyright (c) 2015, Johan Sköld
+// License: https://opensource.org/licenses/ISC
+
+#pragma once
+
+#include <cstdio>
+#include <cstdlib>
+
+// Just enough to write the engine's tests with: a failed check is reported and the test carries
+// on, and `RUN` exits with the number of failures.
+
+namespace test {
+
+    inline int& Failures ()
+    {
+        static int s_failures;
+        return s_failures;
+    }
+
+} // namespace test
+
+#define CHECK(cond) \
+    ((cond) ? (void)0 : (fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond), (void)++test::Failures()))
+
+#define CHECK_EQ(a, b) \
+    CHECK((a) == (b))
+
+#define RUN(fn) \
+    (printf("%s\n", #fn), fn())
+
+#define RESULT() \
+    (test::Failures() ? (fprintf(stderr, "%d check(s) failed\n", test::Failures()), EXIT_FAILURE) : EXIT_SUCCESS)
@@ -0,0 +1,193 @@
+﻿// Copyright (c) 2015, Johan Sköld
+// License: https://opensource.org/licenses/ISC
+
+#include "stdafx.h"
+#include "trampoline.h"
+
+#include "test.h"
+
+const uintptr_t GIGABYTE = 0x40000000;
+const uintptr_t REL32_REACH = 0x80000000;
+
+// Hands out address ranges without backing them with memory, which the allocator never touches,
+// so slots can be checked for reach anywhere in the address space.
+class FakeBackend : public trampoline::Backend
+{
+    public:
+        std::vector<std::pair<uintptr_t, size_t>> blocks;
+        size_t reserves = 0;
+        bool full = false;
+
+        void* Reserve (uintptr_t near, uintptr_t low, uintptr_t high, size_t size) override
+        {
+            ++reserves;
+            CHECK_EQ(size % Granularity(), 0u);
+
+            if (full) {
+                return nullptr;
+            }
+
+            // Take the closest free spot at or below `near`.
+            for (auto base = near - near % Granularity(); base >= low && base + size <= high; base -= Granularity()) {
+                auto overlaps = false;
+                for (const auto& block : blocks) {
+                    overlaps |= base < block.first + block.second && block.first < base + size;
+                }
+
+                if (!overlaps) {
+                    blocks.emplace_back(base, size);
+                    return (void*)base;
+                }
+            }
+
+            return nullptr;
+        }
+
+        void Release (void* block, size_t size) override
+        {
+            for (auto it = blocks.begin(); it != blocks.end(); ++it) {
+                if (it->first == (uintptr_t)block) {
+                    CHECK_EQ(it->second, size);
+                    blocks.erase(it);
+                    return;
+                }
+            }
+
+            CHECK(!"released a block that wasn't reserved");
+        }
+
+        size_t Granularity () const override
+        {
+            return 0x10000;
+        }
+};
+
+static bool InReach (const void* slot, size_t size, uintptr_t target)
+{
+    const auto start = (uintptr_t)slot;
+    const auto end = start + size;
+    return start > target ? end - target < REL32_REACH : target - start < REL32_REACH;
+}
+
+static void TestSlots ()
+{
+    FakeBackend backend;
+
+    {
+        trampoline::Allocator allocator(backend);
+        const uintptr_t target = 0x7ff700000000;
+
+        std::vector<std::pair<uintptr_t, size_t>> slots;
+        for (size_t i = 0; i < 1000; ++i) {
+            const auto size = 1 + i % 60;
+            auto slot = allocator.Allocate((const void*)target, size);
+
+            CHECK(slot);
+            CHECK_EQ((uintptr_t)slot % 16, 0u);
+            CHECK(InReach(slot, size, target));
+            slots.emplace_back((uintptr_t)slot, size);
+        }
+
+        // Slots are packed into blocks, and none of them overlap.
+        CHECK(allocator.BlockCount() <= 2);
+        CHECK_EQ(backend.reserves, allocator.BlockCount());
+
+        std::sort(slots.begin(), slots.end());
+        for (size_t i = 1; i < slots.size(); ++i) {
+            CHECK(slots[i - 1].first + slots[i - 1].second <= slots[i].first);
+        }
+
+        // Once everything is freed, the free intervals merge back into whole blocks.
+        for (const auto& slot : slots) {
+            allocator.Free((void*)slot.first);
+        }
+
+        const auto blocks = allocator.BlockCount();
+        CHECK(allocator.Allocate((const void*)target, 0x10000));
+        CHECK_EQ(allocator.BlockCount(), blocks);
+    }
+
+    // The allocator gives back every block it reserved.
+    CHECK(backend.blocks.empty());
+}
+
+static void TestReach ()
+{
+    FakeBackend backend;
+    trampoline::Allocator allocator(backend);
+
+    const uintptr_t first = 0x7ff700000000;
+    const uintptr_t second = first + 3 * GIGABYTE;
+
+    auto a = allocator.Allocate((const void*)first, 32);
+    auto b = allocator.Allocate((const void*)second, 32);
+
+    // The first block is out of reach of the second target, so it needs one of its own.
+    CHECK(InReach(a, 32, first));
+    CHECK(InReach(b, 32, second));
+    CHECK_EQ(allocator.BlockCount(), 2u);
+
+    // Targets in between can use either.
+    auto c = allocator.Allocate((const void*)(first + GIGABYTE), 32);
+    CHECK(InReach(c, 32, first + GIGABYTE));
+    CHECK_EQ(allocator.BlockCount(), 2u);
+
+    // Near the bottom of the address space, the range mustn't wrap around.
+    auto d = allocator.Allocate((const void*)0x20000, 32);
+    CHECK(d && InReach(d, 32, 0x20000));
+}
+
+static void TestFailure ()
+{
+    FakeBackend backend;
+    trampoline::Allocator allocator(backend);
+
+    backend.full = true;
+    CHECK(!allocator.Allocate((const void*)0x7ff700000000, 16));
+    CHECK_EQ(allocator.BlockCount(), 0u);
+
+    // Freeing anything but a slot is ignored.
+    backend.full = false;
+    auto slot = (uint8_t*)allocator.Allocate((const void*)0x7ff700000000, 16);
+    allocator.Free(slot + 16);
+    allocator.Free(nullptr);
+    allocator.Free(slot);
+    CHECK_EQ(allocator.Allocate((const void*)0x7ff700000000, 16), (void*)slot);
+}
+
+// The system backend has to find real free memory near the code and data of the process, and
+// hand it out executable.
+static void TestSystem ()
+{
+    trampoline::Allocator allocator;
+
+    int local = 0;
+    const void* targets[] = { (const void*)&TestSystem, (const void*)&local, (const void*)&allocator };
+
+    for (auto target : targets) {
+        auto slot = (uint8_t*)allocator.Allocate(target, 16);
+        CHECK(slot);
+        if (!slot) {
+            continue;
+        }
+
+        CHECK(InReach(slot, 16, (uintptr_t)target));
+
+        const uint8_t code[] = { 0xb8, 0x2a, 0x00, 0x00, 0x00, 0xc3 };     // mov eax, 42; ret
+        memcpy(slot, code, sizeof(code));
+        CHECK_EQ(((int(*)())slot)(), 42);
+
+        allocator.Free(slot);
+    }
+
+    CHECK(allocator.BlockCount() >= 1);
+}
+
+int main ()
+{
+    RUN(TestSlots);
+    RUN(TestReach);
+    RUN(TestFailure);
+    RUN(TestSystem);
+    return RESULT();
+}
@@ -0,0 +1,110 @@
+﻿// Copyright (c) 2015, Johan Sköld
+// License: https://opensource.org/licenses/ISC
+
+#include "stdafx.h"
+#include "hooks.h"
+
+#include "platform.h"
+#include "test.h"
+#include "util.h"
+
+#include <sys/mman.h>
+
+static uint8_t* MapCode (size_t size)
+{
+    auto block = mmap(nullptr, size, PROT_READ | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    return block == MAP_FAILED ? nullptr : (uint8_t*)block;
+}
+
+// Patches spanning pages are all written, and every page gets its protection back.
+static void TestCommit ()
+{
+    const auto page = platform::PageSize();
+    auto code = MapCode(page * 2);
+    CHECK(code);
+
+    const uint64_t pointer = 0x1122334455667788ull;
+    const uint8_t bytes[] = { 1, 2, 3, 4, 5, 6, 7, 8, 9, 10 };
+
+    hooks::Transaction transaction;
+    transaction.Write(code + page - 5, bytes, sizeof(bytes));
+    transaction.Write(code + 16, &pointer, sizeof(pointer));
+    CHECK_EQ(transaction.Count(), 2u);
+    CHECK(transaction.Commit());
+    CHECK_EQ(transaction.Count(), 0u);
+
+    CHECK(memcmp(code + page - 5, bytes, sizeof(bytes)) == 0);
+    CHECK(memcmp(code + 16, &pointer, sizeof(pointer)) == 0);
+
+    platform::Access access;
+    CHECK(platform::Protect(code, 1, platform::Access::ReadExecute, &access));
+    CHECK(access == platform::Access::ReadExecute);
+    CHECK(platform::Protect(code + page, 1, platform::Access::ReadExecute, &access));
+    CHECK(access == platform::Access::ReadExecute);
+
+    munmap(code, page * 2);
+}
+
+// A thread looping inside the bytes being replaced fails the commit, whether or not the write
+// is one that could be done atomically.
+static void TestExecuting ()
+{
+    const auto page = platform::PageSize();
+    auto code = MapCode(page);
+    CHECK(code);
+
+    const uint8_t loop[] = {
+        0x90, 0x90,                 // nop; nop
+        0xeb, 0xfe,                 // jmp $
+        0xc3,                       // ret
+    };
+
+    platform::Protect(code, page, platform::Access::ReadWriteExecute, nullptr);
+    memcpy(code, loop, sizeof(loop));
+    platform::Protect(code, page, platform::Access::ReadExecute, nullptr);
+
+    std::atomic<bool> started(false);
+    std::thread spinner([&] {
+        started = true;
+        ((void(*)())code)();
+    });
+
+    while (!started) {
+        std::this_thread::yield();
+    }
+
+    // Wait until the thread has reached the loop.
+    for (auto reached = false; !reached;) {
+        platform::ThreadFreeze threads;
+        reached = threads.IsExecuting((uintptr_t)code + 2, (uintptr_t)code + 4);
+    }
+
+    const uint64_t aligned = 0xcccccccccccccccc;
+    const uint8_t unaligned[] = { 0xcc, 0xcc, 0xcc };
+
+    hooks::Transaction transaction;
+    transaction.Write(code, &aligned, sizeof(aligned));
+    CHECK(!transaction.Commit());
+
+    transaction.Write(code + 1, unaligned, sizeof(unaligned));
+    CHECK(!transaction.Commit());
+
+    CHECK(memcmp(code, loop, sizeof(loop)) == 0);
+
+    // Patches that merely start where the thread is are fine, and this one lets it out.
+    const uint8_t ret[] = { 0xc3, 0xcc };
+    transaction.Write(code + 2, ret, sizeof(ret));
+    CHECK(transaction.Commit());
+
+    spinner.join();
+    munmap(code, page);
+}
+
+int main ()
+{
+    logging::Open(L"/dev/stderr");
+
+    RUN(TestCommit);
+    RUN(TestExecuting);
+    return RESULT();
+}
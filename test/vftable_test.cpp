@@ -0,0 +1,314 @@
+﻿// Copyright (c) 2015, Johan Sköld
+// License: https://opensource.org/licenses/ISC
+
+#include "stdafx.h"
+#include "hooks.h"
+
+#include "image.h"
+#include "platform.h"
+#include "test.h"
+
+#include <atomic>
+#include <thread>
+#include <vector>
+
+#include <sys/mman.h>
+
+static int Original (int a)
+{
+    return a + 1;
+}
+
+static int Replacement (int a)
+{
+    return a + 2;
+}
+
+using Slot0 = hooks::Function<0, int(int)>;
+using Slot1 = hooks::Function<1, int(int)>;
+
+// Slots are written through read-only pages, which get their protection back.
+static void TestInject ()
+{
+    const auto page = platform::PageSize();
+    auto table = (void**)mmap(nullptr, page, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    CHECK(table != MAP_FAILED);
+
+    table[0] = (void*)Original;
+    table[1] = (void*)Original;
+    mprotect(table, page, PROT_READ);
+
+    int (*prev)(int) = nullptr;
+    hooks::VfTable vftable(table);
+
+    CHECK(vftable.Inject<Slot0>(Replacement, &prev));
+    CHECK_EQ(table[0], (void*)Replacement);
+    CHECK_EQ(table[1], (void*)Original);
+    CHECK_EQ(prev, Original);
+
+    CHECK(vftable.Disable<Slot0>());
+    CHECK_EQ(table[0], (void*)Original);
+    CHECK(vftable.Enable<Slot0>());
+    CHECK_EQ(table[0], (void*)Replacement);
+    CHECK(!vftable.Disable<Slot1>());
+
+    platform::Access access;
+    CHECK(platform::Protect(table, page, platform::Access::Read, &access));
+    CHECK(access == platform::Access::Read);
+
+    munmap(table, page);
+}
+
+// Only the pages that hold slots are unprotected, so the ones between them needn't even exist.
+static void TestSparse ()
+{
+    const auto page = platform::PageSize();
+    auto base = (uint8_t*)mmap(nullptr, page * 3, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    CHECK(base != MAP_FAILED);
+
+    const auto table = (void**)base;
+    const auto count = page * 3 / sizeof(void*);
+    const auto last = count - 1;
+
+    table[0] = (void*)Original;
+    table[last] = (void*)Original;
+    munmap(base + page, page);
+
+    int (*prev0)(int) = nullptr;
+    int (*prevLast)(int) = nullptr;
+    hooks::VfTable vftable(table);
+
+    CHECK(vftable.Inject({
+        { 0, (void*)Replacement, (void**)&prev0 },
+        { last, (void*)Replacement, (void**)&prevLast },
+    }));
+
+    CHECK_EQ(table[0], (void*)Replacement);
+    CHECK_EQ(table[last], (void*)Replacement);
+    CHECK_EQ(prev0, Original);
+    CHECK_EQ(prevLast, Original);
+
+    munmap(base, page);
+    munmap(base + page * 2, page);
+}
+
+// Objects are laid out like the game's, with the vptr first. Methods get the object first.
+struct Object {
+    void** vftable;
+};
+
+using Method0 = hooks::Function<0, int(Object&, int)>;
+using Method1 = hooks::Function<1, int(Object&, int)>;
+using Method3 = hooks::Function<3, int(Object&, int)>;
+
+static int First (Object&, int a)
+{
+    return a + 1;
+}
+
+static int Second (Object&, int a)
+{
+    return a + 10;
+}
+
+static Method0::Fn* s_prevFirst;
+
+static int ShadowedFirst (Object& object, int a)
+{
+    return s_prevFirst(object, a) + 100;
+}
+
+template <class F>
+static int CallThrough (Object& object, int a)
+{
+    return ((typename F::Fn*)object.vftable[F::INDEX])(object, a);
+}
+
+static const char s_locator[] = "locator";
+
+// Attached objects point at the copy, RTTI slot included, and only they see its replacements.
+static void TestShadowAttach ()
+{
+    void* slots[] = { (void*)s_locator, (void*)First, (void*)Second, (void*)First };
+    const auto vftable = slots + 1;
+
+    hooks::ShadowVfTable shadow(vftable, 3);
+    CHECK(shadow.IsValid());
+    CHECK_EQ(shadow.Count(), 3u);
+    CHECK_EQ(shadow.Original(), vftable);
+    CHECK(shadow.Table() != vftable);
+
+    Object attached = { vftable };
+    Object other = { vftable };
+
+    CHECK(shadow.Attach(&attached));
+    CHECK_EQ(attached.vftable, shadow.Table());
+    CHECK_EQ(attached.vftable[-1], (void*)s_locator);
+    CHECK_EQ(attached.vftable[1], (void*)Second);
+    CHECK(shadow.IsAttached(&attached));
+    CHECK(!shadow.IsAttached(&other));
+    CHECK(!shadow.Attach(&attached));
+
+    CHECK(shadow.Replace<Method0>(ShadowedFirst, &s_prevFirst));
+    CHECK_EQ(s_prevFirst, First);
+    CHECK_EQ(CallThrough<Method0>(attached, 1), 102);
+    CHECK_EQ(CallThrough<Method1>(attached, 1), 11);
+    CHECK_EQ(CallThrough<Method0>(other, 1), 2);
+    CHECK_EQ(vftable[0], (void*)First);
+
+    Method3::Fn* prev = nullptr;
+    CHECK(!shadow.Replace<Method3>(ShadowedFirst, &prev));
+
+    CHECK(shadow.Detach(&attached));
+    CHECK_EQ(attached.vftable, vftable);
+    CHECK_EQ(CallThrough<Method0>(attached, 1), 2);
+    CHECK(!shadow.Detach(&attached));
+    CHECK(!shadow.Detach(&other));
+
+    // Objects of other classes are left alone.
+    void* otherSlots[] = { nullptr, (void*)Second };
+    Object unrelated = { otherSlots + 1 };
+    CHECK(!shadow.Attach(&unrelated));
+    CHECK_EQ(unrelated.vftable, otherSlots + 1);
+}
+
+// Of the shadows trying to attach the same object at once, only one gets it, and the others
+// leave the vptr it set alone.
+static void TestShadowRace ()
+{
+    const size_t THREADS = 4;
+    const size_t OBJECTS = 10000;
+
+    void* slots[] = { (void*)s_locator, (void*)First, (void*)Second };
+    const auto vftable = slots + 1;
+
+    std::vector<hooks::ShadowVfTable> shadows;
+    for (size_t i = 0; i < THREADS; ++i) {
+        shadows.emplace_back(vftable, 2);
+    }
+
+    std::vector<Object> objects(OBJECTS, Object{ vftable });
+    std::atomic<size_t> attached(0);
+    std::atomic<bool> start(false);
+    std::vector<std::thread> threads;
+
+    for (size_t i = 0; i < THREADS; ++i) {
+        threads.emplace_back([&, i] {
+            while (!start.load()) {
+            }
+
+            for (auto& object : objects) {
+                if (shadows[i].Attach(&object)) {
+                    attached.fetch_add(1);
+                }
+            }
+        });
+    }
+
+    start.store(true);
+    for (auto& thread : threads) {
+        thread.join();
+    }
+
+    CHECK_EQ(attached.load(), OBJECTS);
+
+    size_t owned = 0;
+    for (const auto& shadow : shadows) {
+        for (auto& object : objects) {
+            owned += shadow.IsAttached(&object);
+        }
+    }
+
+    CHECK_EQ(owned, OBJECTS);
+}
+
+// Without a count, a table in a module ends at the first slot that isn't code, or at the end of
+// its section, whatever follows it.
+static void TestShadowSize ()
+{
+    const size_t RDATA_SIZE = 0x1000;
+    const size_t SLOTS = RDATA_SIZE / sizeof(void*);
+
+    test::Image image;
+    const auto textRva = image.AddSection(".text", IMAGE_SCN_CNT_CODE | IMAGE_SCN_MEM_EXECUTE | IMAGE_SCN_MEM_READ, std::vector<uint8_t>(0x100, 0xc3));
+    const auto rdataRva = image.AddSection(".rdata", IMAGE_SCN_CNT_INITIALIZED_DATA | IMAGE_SCN_MEM_READ, std::vector<uint8_t>(RDATA_SIZE));
+    const auto dataRva = image.AddSection(".data", IMAGE_SCN_CNT_INITIALIZED_DATA | IMAGE_SCN_MEM_READ | IMAGE_SCN_MEM_WRITE, std::vector<uint8_t>(0x10));
+
+    const auto size = image.Size();
+    auto base = (uint8_t*)mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    CHECK(base != MAP_FAILED);
+    image.Map(base);
+
+    const auto code = base + textRva;
+    const auto rdata = (void**)(base + rdataRva);
+
+    // Three functions, then a pointer to data, then code that belongs to something else.
+    rdata[0] = rdata;
+    rdata[1] = code;
+    rdata[2] = code + 0x10;
+    rdata[3] = code + 0x20;
+    rdata[4] = rdata;
+    rdata[5] = code;
+
+    // Two functions at the very end of the section, followed by code pointed to from .data.
+    rdata[SLOTS - 3] = rdata;
+    rdata[SLOTS - 2] = code;
+    rdata[SLOTS - 1] = code;
+    *(void**)(base + dataRva) = code;
+
+    hooks::ShadowVfTable first(rdata + 1);
+    CHECK(first.IsValid());
+    CHECK_EQ(first.Count(), 3u);
+    CHECK_EQ(first.Table()[-1], (void*)rdata);
+
+    hooks::ShadowVfTable last(rdata + SLOTS - 2);
+    CHECK(last.IsValid());
+    CHECK_EQ(last.Count(), 2u);
+
+    // Outside of any module there's nothing to tell where the table ends.
+    void* slots[] = { nullptr, (void*)First };
+    hooks::ShadowVfTable unknown(slots + 1);
+    CHECK(!unknown.IsValid());
+
+    munmap(base, size);
+}
+
+// The function is looked up again once the object has been pointed at another table, whether
+// it's the same object or not.
+static void TestBoundVirtual ()
+{
+    using Bound = hooks::BoundVirtual<Method0>;
+
+    void* slots[] = { (void*)s_locator, (void*)First, (void*)Second };
+    const auto vftable = slots + 1;
+
+    hooks::ShadowVfTable shadow(vftable, 2);
+    CHECK(shadow.Replace<Method0>(ShadowedFirst, &s_prevFirst));
+
+    Object object = { vftable };
+    CHECK_EQ(Bound::Call(object, 1), 2);
+    CHECK_EQ(Bound::Call(object, 1), 2);
+
+    CHECK(shadow.Attach(&object));
+    CHECK_EQ(Bound::Call(object, 1), 102);
+    CHECK_EQ(Bound::Call(object, 1), 102);
+
+    CHECK(shadow.Detach(&object));
+    CHECK_EQ(Bound::Call(object, 1), 2);
+
+    void* otherSlots[] = { nullptr, (void*)Second };
+    Object other = { otherSlots + 1 };
+    CHECK_EQ(Bound::Call(other, 1), 11);
+    CHECK_EQ(Bound::Call(object, 1), 2);
+}
+
+int main ()
+{
+    RUN(TestInject);
+    RUN(TestSparse);
+    RUN(TestShadowAttach);
+    RUN(TestShadowRace);
+    RUN(TestShadowSize);
+    RUN(TestBoundVirtual);
+    return RESULT();
+}
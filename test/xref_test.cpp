@@ -0,0 +1,196 @@
+﻿// Copyright (c) 2015, Johan Sköld
+// License: https://opensource.org/licenses/ISC
+
+#include "stdafx.h"
+#include "xref.h"
+
+#include "image.h"
+#include "pe.h"
+#include "test.h"
+
+// Builds an image with enough identical functions in .text that the sweep is cut into several
+// chunks, each with a call, a lea, and short and near jumps at known places. Every function is
+// followed by padding that ends in the start of an instruction running into the next one, which
+// the sweep has to get back in sync from.
+
+const uint32_t TEXT_RVA = 0x1000;
+const uint32_t FUNCTION_COUNT = 400;
+const uint32_t FUNCTION_SPACING = 0x1104;   // Chunks are cut mid-word in the bitmap with this
+const uint32_t FUNCTION_SIZE = 32;
+
+// Offsets of the instructions in each function.
+const uint32_t CALL = 1;
+const uint32_t LEA = 6;
+const uint32_t JMP8 = 13;
+const uint32_t JMP8_TARGET = 20;
+const uint32_t JMP32 = 20;
+const uint32_t JMP32_TARGET = 30;
+const uint32_t RUNAWAY = FUNCTION_SPACING - 3;
+
+static uint32_t FunctionRva (uint32_t i)
+{
+    return TEXT_RVA + i * FUNCTION_SPACING;
+}
+
+template <class T>
+static void Put (std::vector<uint8_t>* data, size_t offset, const T& value)
+{
+    memcpy(data->data() + offset, &value, sizeof(value));
+}
+
+// Every function calls the first one, and loads the address of the start of .data.
+static std::vector<uint8_t> Text (uint32_t dataRva)
+{
+    std::vector<uint8_t> text(FUNCTION_COUNT * FUNCTION_SPACING, 0xcc);
+
+    for (uint32_t i = 0; i < FUNCTION_COUNT; ++i) {
+        const auto offset = i * FUNCTION_SPACING;
+        const auto rva = FunctionRva(i);
+
+        const uint8_t code[] = {
+            0x55,                                   // push rbp
+            0xe8, 0, 0, 0, 0,                       // call first
+            0x48, 0x8d, 0x05, 0, 0, 0, 0,           // lea rax, [rip+data]
+            0xeb, JMP8_TARGET - (JMP8 + 2),         // jmp short +5
+            0x90, 0x90, 0x90, 0x90, 0x90,           // nop
+            0xe9, 0, 0, 0, 0,                       // jmp near +5
+            0xcc, 0xcc, 0xcc, 0xcc, 0xcc,           // int3
+            0x5d,                                   // pop rbp
+            0xc3,                                   // ret
+        };
+
+        static_assert(sizeof(code) == FUNCTION_SIZE, "the offsets are off");
+        memcpy(text.data() + offset, code, sizeof(code));
+
+        Put(&text, offset + CALL + 1, (int32_t)(FunctionRva(0) - (rva + CALL + 5)));
+        Put(&text, offset + LEA + 3, (int32_t)(dataRva - (rva + LEA + 7)));
+        Put(&text, offset + JMP32 + 1, (int32_t)(JMP32_TARGET - (JMP32 + 5)));
+
+        // mov rax, imm64, cut off by the next function.
+        if (i + 1 < FUNCTION_COUNT) {
+            text[offset + RUNAWAY] = 0x48;
+            text[offset + RUNAWAY + 1] = 0xb8;
+        }
+    }
+
+    return text;
+}
+
+static std::vector<uint8_t> BuildFile ()
+{
+    test::Image image;
+
+    const auto dataRva = TEXT_RVA + ((FUNCTION_COUNT * FUNCTION_SPACING + 0xfff) & ~0xfffu);
+    CHECK_EQ(image.AddSection(".text", IMAGE_SCN_CNT_CODE | IMAGE_SCN_MEM_EXECUTE | IMAGE_SCN_MEM_READ, Text(dataRva)), TEXT_RVA);
+    CHECK_EQ(image.AddSection(".data", IMAGE_SCN_CNT_INITIALIZED_DATA | IMAGE_SCN_MEM_READ | IMAGE_SCN_MEM_WRITE, std::vector<uint8_t>(0x100)), dataRva);
+
+    const std::vector<uint8_t> xdata = { 1, 0, 0, 0 };
+    const auto xdataRva = image.AddSection(".xdata", IMAGE_SCN_CNT_INITIALIZED_DATA | IMAGE_SCN_MEM_READ, xdata);
+
+    std::vector<uint8_t> pdata;
+    for (uint32_t i = 0; i < FUNCTION_COUNT; ++i) {
+        const RUNTIME_FUNCTION entry = { FunctionRva(i), FunctionRva(i) + FUNCTION_SIZE, xdataRva };
+        test::Append(&pdata, entry);
+    }
+
+    const auto pdataRva = image.AddSection(".pdata", IMAGE_SCN_CNT_INITIALIZED_DATA | IMAGE_SCN_MEM_READ, pdata);
+    image.SetDirectory(IMAGE_DIRECTORY_ENTRY_EXCEPTION, pdataRva, (uint32_t)pdata.size());
+    return image.File();
+}
+
+static void CheckIndex (const xref::Index& index)
+{
+    const auto dataRva = TEXT_RVA + ((FUNCTION_COUNT * FUNCTION_SPACING + 0xfff) & ~0xfffu);
+
+    std::vector<uint32_t> calls;
+    std::vector<uint32_t> leas;
+
+    for (uint32_t i = 0; i < FUNCTION_COUNT; ++i) {
+        const auto rva = FunctionRva(i);
+        calls.push_back(rva + CALL);
+        leas.push_back(rva + LEA);
+
+        for (auto offset : { 0u, CALL, LEA, JMP8, JMP8 + 2, JMP32, JMP32_TARGET, FUNCTION_SIZE - 1 }) {
+            CHECK(index.IsInstructionStart(rva + offset));
+        }
+
+        CHECK(!index.IsInstructionStart(rva + CALL + 1));
+        CHECK(!index.IsInstructionStart(rva + LEA + 3));
+
+        CHECK((index.ReferencesTo(rva + JMP8_TARGET, xref::RefKind::Jump) == std::vector<uint32_t> { rva + JMP8 }));
+        CHECK((index.ReferencesTo(rva + JMP32_TARGET) == std::vector<uint32_t> { rva + JMP32 }));
+        CHECK(index.ReferencesTo(rva + JMP32_TARGET, xref::RefKind::Call).empty());
+
+        CHECK_EQ(index.FunctionContaining(rva + LEA), rva);
+        CHECK_EQ(index.FunctionContaining(rva + FUNCTION_SIZE), 0u);
+
+        // The padding is decoded as well, up to the instruction running into the next function,
+        // which the sweep gave up on. That's right before where a chunk may start, in the same
+        // word of the bitmap.
+        CHECK(index.IsInstructionStart(rva + FUNCTION_SIZE));
+
+        if (i + 1 < FUNCTION_COUNT) {
+            CHECK(index.IsInstructionStart(rva + RUNAWAY - 1));
+            CHECK(!index.IsInstructionStart(rva + RUNAWAY));
+        }
+    }
+
+    CHECK(index.CallersOf(FunctionRva(0)) == calls);
+    CHECK(index.ReferencesTo(dataRva, xref::RefKind::Data) == leas);
+    CHECK(index.ReferencesTo(dataRva, xref::RefKind::Call).empty());
+    CHECK(index.CallersOf(FunctionRva(1)).empty());
+    CHECK_EQ(index.RefCount(), (size_t)FUNCTION_COUNT * 4);
+
+    CHECK(!index.IsInstructionStart(TEXT_RVA - 1));
+    CHECK(!index.IsInstructionStart(dataRva));
+}
+
+static void TestSweep ()
+{
+    const auto file = BuildFile();
+    const pe::Image image(file.data(), file.size());
+    CHECK(image.IsValid());
+
+    xref::Index index;
+    index.Build(image);
+    CheckIndex(index);
+}
+
+// Cut into chunks and swept in parallel, the result is exactly the same as in one go.
+static void TestParallel ()
+{
+    const auto file = BuildFile();
+    const pe::Image image(file.data(), file.size());
+
+    xref::Index serial;
+    serial.Build(image, 1);
+
+    for (size_t threads : { 2, 4, 7 }) {
+        xref::Index parallel;
+        parallel.Build(image, threads);
+        CheckIndex(parallel);
+
+        CHECK_EQ(parallel.InstructionCount(), serial.InstructionCount());
+        CHECK_EQ(parallel.RefCount(), serial.RefCount());
+
+        const auto& a = serial.Refs();
+        const auto& b = parallel.Refs();
+        CHECK(a.size() == b.size() && std::equal(a.begin(), a.end(), b.begin(), [] (const xref::Ref& x, const xref::Ref& y) {
+            return x.target == y.target && x.site == y.site && x.kind == y.kind;
+        }));
+
+        auto mismatches = 0;
+        for (auto rva = TEXT_RVA; rva < FunctionRva(FUNCTION_COUNT); ++rva) {
+            mismatches += serial.IsInstructionStart(rva) != parallel.IsInstructionStart(rva) ? 1 : 0;
+        }
+
+        CHECK_EQ(mismatches, 0);
+    }
+}
+
+int main ()
+{
+    RUN(TestSweep);
+    RUN(TestParallel);
+    return RESULT();
+}